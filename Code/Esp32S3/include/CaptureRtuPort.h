@@ -0,0 +1,60 @@
+/*
+ * Recording Modbus RTU Port
+ *
+ * Wraps the RtuPort of the drive link and records what passes through it
+ * into a ModbusCapture: every request frame, every chunk of received bytes
+ * (also the stale bytes flushInput() drops), baud rate changes and
+ * collisions. While no capture runs, this costs one flag check per call.
+ */
+
+#pragma once
+
+#include "RtuPort.h"
+#include "ModbusCapture.h"
+
+template <typename Capture>
+class CaptureRtuPort : public RtuPort {
+public:
+    CaptureRtuPort(RtuPort &port, Capture &capture) : _port(port), _capture(capture) {}
+
+    void setBaud(uint32_t baud) override {
+        _port.setBaud(baud);
+        _capture.recordBaud(micros(), baud);
+    }
+    int available() override { return _port.available(); }
+    size_t read(uint8_t *buffer, size_t length) override {
+        size_t n = _port.read(buffer, length);
+        if (_capture.recording()) recordRx(buffer, n);
+        return n;
+    }
+    void write(const uint8_t *frame, size_t length) override {
+        if (_capture.recording()) _capture.record(CAPTURE_TX, micros(), frame, length);
+        _port.write(frame, length);
+    }
+    void flushInput() override {
+        if (_capture.recording()) {
+            uint8_t stale[32];
+            size_t n;
+            while ((n = _port.read(stale, sizeof(stale))) > 0) recordRx(stale, n);
+        }
+        _port.flushInput();
+    }
+    void waitForData(uint32_t ms) override { _port.waitForData(ms); }
+    bool takeCollision() override {
+        bool collision = _port.takeCollision();
+        if (collision) _capture.record(CAPTURE_COLLISION, micros(), nullptr, 0);
+        return collision;
+    }
+    const char *name() const override { return _port.name(); }
+
+private:
+    void recordRx(const uint8_t *data, size_t length) {
+        uint32_t now = micros();
+        for (size_t i = 0; i < length; i += 255) {
+            _capture.record(CAPTURE_RX, now, data + i, length - i > 255 ? 255 : length - i);
+        }
+    }
+
+    RtuPort &_port;
+    Capture &_capture;
+};
@@ -0,0 +1,172 @@
+/*
+ * Register Macros
+ *
+ * A configuration sequence of the A6 drive as a table of steps: register
+ * writes (16 or 32 bit), delays, waits for a servo status and verifying reads.
+ * The drive task runs a macro without blocking. The writes between two other
+ * steps go out together as one burst, neighbouring 32-bit writes share a frame.
+ * A step may take its value from the argument the macro is started with, so
+ * one table serves e.g. any homing position.
+ *
+ * Built-in macros are constexpr tables, made from the macro...() helpers.
+ * Uploaded ones come as text, see macroParse().
+ *
+ * Plain C++ without Arduino dependencies, so it also builds on a host.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MACRO_MAX_STEPS 32
+#define MACRO_VALUE_ARG 0x01 // Step flag: the value is the macro argument
+
+enum MacroOp : uint8_t {
+    MACRO_WRITE,       // 16-bit register write
+    MACRO_WRITE32,     // 32-bit write, two registers, low word first
+    MACRO_DELAY,       // value = ms before the next step
+    MACRO_WAIT_STATUS, // Until the servo status (U41.0A) reads 'value', fails after 'timeoutMs'
+    MACRO_VERIFY,      // Reads the 16-bit register back, fails unless it holds 'value'
+    MACRO_VERIFY32
+};
+
+struct MacroStep {
+    MacroOp op;
+    uint8_t flags;
+    uint16_t reg;
+    int32_t value;
+    uint16_t timeoutMs;
+};
+
+struct DriveMacro {
+    uint8_t count;
+    MacroStep steps[MACRO_MAX_STEPS];
+};
+
+constexpr MacroStep macroWrite(uint16_t reg, int16_t value) { return { MACRO_WRITE, 0, reg, value, 0 }; }
+constexpr MacroStep macroWriteArg(uint16_t reg) { return { MACRO_WRITE, MACRO_VALUE_ARG, reg, 0, 0 }; }
+constexpr MacroStep macroWrite32(uint16_t reg, int32_t value) { return { MACRO_WRITE32, 0, reg, value, 0 }; }
+constexpr MacroStep macroWrite32Arg(uint16_t reg) { return { MACRO_WRITE32, MACRO_VALUE_ARG, reg, 0, 0 }; }
+constexpr MacroStep macroDelay(uint16_t ms) { return { MACRO_DELAY, 0, 0, ms, 0 }; }
+constexpr MacroStep macroWaitStatus(int16_t status, uint16_t timeoutMs) {
+    return { MACRO_WAIT_STATUS, 0, 0, status, timeoutMs };
+}
+constexpr MacroStep macroVerify(uint16_t reg, int16_t value) { return { MACRO_VERIFY, 0, reg, value, 0 }; }
+constexpr MacroStep macroVerify32Arg(uint16_t reg) { return { MACRO_VERIFY32, MACRO_VALUE_ARG, reg, 0, 0 }; }
+
+inline bool macroIsWrite(const MacroStep &step) {
+    return step.op == MACRO_WRITE || step.op == MACRO_WRITE32;
+}
+
+inline int32_t macroValue(const MacroStep &step, int32_t arg) {
+    return (step.flags & MACRO_VALUE_ARG) ? arg : step.value;
+}
+
+// End of the burst starting at step 'first': the index after its last write
+inline uint8_t macroBurstEnd(const MacroStep *steps, uint8_t count, uint8_t first) {
+    uint8_t end = first;
+    while (end < count && macroIsWrite(steps[end])) end++;
+    return end;
+}
+
+// Register as a number (0x0607, 1543) or in drive notation (C06.07), false if it is neither
+inline bool macroParseRegister(const char *token, uint16_t *reg) {
+    char *end;
+    long value;
+    if (token[0] == 'C' || token[0] == 'c') {
+        long group = strtol(token + 1, &end, 16);
+        if (*end != '.' || group < 0 || group > 0xFF) return false;
+        value = strtol(end + 1, &end, 16);
+        if (value < 0 || value > 0xFF) return false;
+        value |= group << 8;
+    } else {
+        value = strtol(token, &end, 0);
+    }
+    if (*end != 0 || end == token || value < 0 || value > 0xFFFF) return false;
+    *reg = (uint16_t)value;
+    return true;
+}
+
+inline bool macroParseNumber(const char *token, long long min, long long max, int32_t *value) {
+    char *end;
+    long long v = strtoll(token, &end, 0);
+    if (*end != 0 || end == token || v < min || v > max) return false;
+    *value = (int32_t)v;
+    return true;
+}
+
+// One step of the text form, tokens already split. False if it is not valid.
+inline bool macroParseStep(char **tok, uint8_t n, MacroStep *step) {
+    memset(step, 0, sizeof(*step));
+    int32_t value;
+    if (n == 3 && (strcmp(tok[0], "write") == 0 || strcmp(tok[0], "verify") == 0)) {
+        step->op = tok[0][0] == 'w' ? MACRO_WRITE : MACRO_VERIFY;
+        if (!macroParseRegister(tok[1], &step->reg) || !macroParseNumber(tok[2], -32768, 65535, &value)) return false;
+        step->value = (int16_t)value; // 0xFFFF and -1 are the same register value
+        return true;
+    }
+    if (n == 3 && (strcmp(tok[0], "write32") == 0 || strcmp(tok[0], "verify32") == 0)) {
+        step->op = tok[0][0] == 'w' ? MACRO_WRITE32 : MACRO_VERIFY32;
+        return macroParseRegister(tok[1], &step->reg) && step->reg < 0xFFFF
+            && macroParseNumber(tok[2], INT32_MIN, UINT32_MAX, &step->value);
+    }
+    if (n == 2 && strcmp(tok[0], "delay") == 0) {
+        step->op = MACRO_DELAY;
+        return macroParseNumber(tok[1], 0, 65535, &step->value);
+    }
+    if (n == 3 && strcmp(tok[0], "wait") == 0) {
+        step->op = MACRO_WAIT_STATUS;
+        if (!macroParseNumber(tok[2], 1, 65535, &value)) return false;
+        step->timeoutMs = (uint16_t)value;
+        return macroParseNumber(tok[1], 0, 0xFFFF, &step->value);
+    }
+    return false;
+}
+
+// Parses the text form of a macro, one step per line or separated by ';', '#'
+// starts a comment:
+//   write <reg> <value>      write32 <reg> <value>
+//   verify <reg> <value>     verify32 <reg> <value>
+//   delay <ms>               wait <status> <timeout ms>
+// Returns false with the line of the first error in 'errorLine'.
+inline bool macroParse(const char *text, size_t len, DriveMacro *macro, uint16_t *errorLine) {
+    macro->count = 0;
+    uint16_t line = 1;
+    size_t pos = 0;
+    while (pos < len) {
+        char buf[80];
+        size_t n = 0;
+        bool comment = false;
+        bool tooLong = false;
+        while (pos < len && text[pos] != '\n' && text[pos] != ';') {
+            if (text[pos] == '#') comment = true;
+            if (!comment) {
+                if (n < sizeof(buf) - 1) buf[n++] = (text[pos] == '\t' || text[pos] == '\r' || text[pos] == ',') ? ' ' : text[pos];
+                else tooLong = true;
+            }
+            pos++;
+        }
+        buf[n] = 0;
+        char *tok[4];
+        uint8_t tokens = 0;
+        for (char *t = buf; *t && tokens < 4; ) { // Splits at the spaces in place
+            while (*t == ' ') *t++ = 0;
+            if (*t) tok[tokens++] = t;
+            while (*t && *t != ' ') t++;
+        }
+        if (tokens > 0 || tooLong) {
+            if (tooLong || tokens == 4 || macro->count == MACRO_MAX_STEPS
+                || !macroParseStep(tok, tokens, &macro->steps[macro->count])) {
+                *errorLine = line;
+                return false;
+            }
+            macro->count++;
+        }
+        if (pos < len && text[pos] == '\n') line++;
+        pos++;
+    }
+    return true;
+}
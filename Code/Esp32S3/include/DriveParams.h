@@ -0,0 +1,132 @@
+/*
+ * Drive Parameter Image
+ *
+ * The C00..C06 parameters of one A6 drive, as raw 16-bit registers. A group
+ * C0x lives at 0x0x00, parameter C0x.yy at 0x0x00 + yy. The drive task fills
+ * an image by block reads (backup) or writes the registers of an image that
+ * differ from the drive (restore). Registers the drive refuses to read are not
+ * part of the image, and neither are the command registers (paramCommandRegister()).
+ *
+ * Blob format (files in LittleFS, /params download and upload), little endian:
+ * "A6PB", version, slave id of the drive backed up, run count (uint16), then
+ * per run of present registers: first address (uint16), register count
+ * (uint16) and the values (uint16 each).
+ *
+ * Plain C++ without Arduino dependencies, so it also builds on a host.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#define PARAM_GROUPS 7          // C00..C06
+#define PARAM_GROUP_REGS 128    // Registers scanned per group, C0x.00..C0x.7F
+#define PARAM_REGS (PARAM_GROUPS * PARAM_GROUP_REGS)
+#define PARAM_BLOB_VERSION 1
+#define PARAM_BLOB_HEADER 8
+#define PARAM_BLOB_MAX (PARAM_BLOB_HEADER + PARAM_REGS * 2 + (PARAM_REGS + 1) / 2 * 4) // Every other register present
+
+struct DriveParamImage {
+    uint16_t values[PARAM_REGS];
+    uint8_t present[PARAM_REGS / 8]; // Registers the drive answered for
+    uint8_t slaveId;
+
+    void clear() { memset(this, 0, sizeof(*this)); }
+    bool has(uint16_t i) const { return present[i / 8] & (1 << (i % 8)); }
+    void set(uint16_t i, uint16_t value) {
+        values[i] = value;
+        present[i / 8] |= 1 << (i % 8);
+    }
+    uint16_t count() const {
+        uint16_t n = 0;
+        for (uint16_t i = 0; i < PARAM_REGS; i++) n += has(i);
+        return n;
+    }
+};
+
+// Register address of image index 'i' and back, -1 outside C00..C06
+inline uint16_t paramAddress(uint16_t i) {
+    return (i / PARAM_GROUP_REGS) << 8 | (i % PARAM_GROUP_REGS);
+}
+
+inline int16_t paramIndex(uint16_t address) {
+    if ((address >> 8) >= PARAM_GROUPS || (address & 0xFF) >= PARAM_GROUP_REGS) return -1;
+    return (address >> 8) * PARAM_GROUP_REGS + (address & 0xFF);
+}
+
+// Command and run-state registers: set by the firmware while it runs, not
+// settings. Never backed up or restored, a restore could switch the servo on.
+inline bool paramCommandRegister(uint16_t address) {
+    return address == 0x0321    // C03.21 target speed
+        || address == 0x0341    // C03.41 target torque
+        || address == 0x0411;   // C04.11 servo on via Modbus
+}
+
+// Length of the run of present registers starting at 'i', within its group and 'maxRegs'
+inline uint16_t paramRunLength(const DriveParamImage &img, uint16_t i, uint16_t maxRegs) {
+    uint16_t groupEnd = (i / PARAM_GROUP_REGS + 1) * PARAM_GROUP_REGS;
+    uint16_t n = 0;
+    while (i + n < groupEnd && n < maxRegs && img.has(i + n)) n++;
+    return n;
+}
+
+// Writes the blob of 'img' to 'buf' (PARAM_BLOB_MAX fits any image). Returns its length.
+inline size_t paramBlobBuild(const DriveParamImage &img, uint8_t *buf, size_t size) {
+    if (size < PARAM_BLOB_HEADER) return 0;
+    memcpy(buf, "A6PB", 4);
+    buf[4] = PARAM_BLOB_VERSION;
+    buf[5] = img.slaveId;
+    size_t len = PARAM_BLOB_HEADER;
+    uint16_t runs = 0;
+    for (uint16_t i = 0; i < PARAM_REGS; ) {
+        uint16_t n = paramRunLength(img, i, PARAM_GROUP_REGS);
+        if (n == 0) {
+            i++;
+            continue;
+        }
+        if (len + 4 + n * 2 > size) return 0;
+        uint16_t address = paramAddress(i);
+        buf[len++] = address & 0xFF; buf[len++] = address >> 8;
+        buf[len++] = n & 0xFF;       buf[len++] = n >> 8;
+        for (uint16_t k = 0; k < n; k++) {
+            buf[len++] = img.values[i + k] & 0xFF;
+            buf[len++] = img.values[i + k] >> 8;
+        }
+        runs++;
+        i += n;
+    }
+    buf[6] = runs & 0xFF;
+    buf[7] = runs >> 8;
+    return len;
+}
+
+// Reads a blob into 'img', or only checks it with 'img' = nullptr. Returns false
+// if it is not one, or a run lies outside C00..C06. Command registers in the blob
+// are left out of 'img' and counted in 'skipped'.
+inline bool paramBlobParse(const uint8_t *buf, size_t len, DriveParamImage *img, uint16_t *skipped = nullptr) {
+    if (img) img->clear();
+    if (skipped) *skipped = 0;
+    if (len < PARAM_BLOB_HEADER || memcmp(buf, "A6PB", 4) != 0 || buf[4] != PARAM_BLOB_VERSION) return false;
+    if (img) img->slaveId = buf[5];
+    uint16_t runs = buf[6] | (buf[7] << 8);
+    size_t pos = PARAM_BLOB_HEADER;
+    for (uint16_t r = 0; r < runs; r++) {
+        if (pos + 4 > len) return false;
+        uint16_t address = buf[pos] | (buf[pos + 1] << 8);
+        uint16_t n = buf[pos + 2] | (buf[pos + 3] << 8);
+        pos += 4;
+        int16_t first = paramIndex(address);
+        if (first < 0 || n == 0 || paramIndex(address + n - 1) != first + n - 1 || pos + n * 2 > len) return false;
+        for (uint16_t k = 0; k < n; k++) {
+            if (paramCommandRegister(address + k)) {
+                if (skipped) (*skipped)++;
+            } else if (img) {
+                img->set(first + k, buf[pos + 2 * k] | (buf[pos + 2 * k + 1] << 8));
+            }
+        }
+        pos += n * 2;
+    }
+    return pos == len;
+}
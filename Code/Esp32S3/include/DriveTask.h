@@ -0,0 +1,213 @@
+/*
+ * Servo Drive Task
+ *
+ * Owns the Modbus link to the A6-RS drives. Runs in its own FreeRTOS task,
+ * pinned to the application core at a higher priority than loop(), so bus
+ * timing no longer depends on WiFi, the web server or JSON work.
+ *
+ * The rest of the firmware talks to the task only through lock-free SPSC
+ * queues: commands and setpoints in, telemetry samples, events and log
+ * lines out. appLoop() is the only producer of commands and the only
+ * consumer of everything else.
+ *
+ * Up to DRIVE_MAX_COUNT drives (one per cable stack) share one RS485 bus.
+ * Commands, samples and events carry the index of the drive they belong to.
+ * The telemetry cycles of the drives take turns on the bus, weighted by
+ * their telemetry weight once the bus is saturated. While all drives run
+ * with the same setpoint, it is broadcast to them in a single frame.
+ * The poll periods adapt to the measured bus time, so the bus stays under a
+ * utilisation target (DRIVE_CMD_BUS_TARGET) at the highest rates it allows.
+ * Configuration sequences run as register macros (DriveMacro.h), one at a
+ * time per drive, next to the telemetry.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+#include "SpscQueue.h"
+#include "ServoRegisterMap.h"
+#include "ModbusCapture.h"
+#include "ModbusLatency.h"
+#include "DriveParams.h"
+#include "DriveMacro.h"
+
+#define DRIVE_TASK_CORE 1           // Same core as loop(), WiFi and AsyncTCP run on core 0
+#define DRIVE_TASK_PRIORITY 5       // Above loop() (1), below the WiFi/LwIP tasks
+#define DRIVE_TASK_STACK_SIZE 6144
+#define DRIVE_MAX_COUNT 4           // Drives on the bus
+#define DRIVE_MAX_BATCHES (1 + DRIVE_MAX_COUNT) // Batch ids 1..4, 0 = not tracked
+#define DRIVE_LOG_MSG_LENGTH 100
+
+#ifndef MODBUS_UART_IDF
+#define MODBUS_UART_IDF 1           // 1 = ESP-IDF UART driver woken by RX timeout events, 0 = polled HardwareSerial
+#endif
+
+#ifndef MODBUS_CAPTURE
+#define MODBUS_CAPTURE 1            // 1 = traffic capture into a RAM ring (ModbusCapture.h), for Code/HostTools/mbreplay
+#endif
+#define MODBUS_CAPTURE_BYTES 32768  // About 1500 telemetry exchanges
+#define MODBUS_CAPTURE_TRIGGER_STOP_MS 500 // Traffic kept after a link loss, when the capture stops on it
+
+// --- Commands (appLoop -> drive task) ---
+enum DriveCommandType : uint8_t {
+    DRIVE_CMD_SET_TORQUE,  // value = torque setpoint (0-2000), written while the servo runs, < 0 pauses
+    DRIVE_CMD_ENABLE,
+    DRIVE_CMD_DISABLE,     // Also writes a torque of 0 and clears the setpoint
+    DRIVE_CMD_ESTOP,       // Drops all queued bus requests, then disables every drive
+    DRIVE_CMD_WRITE_REG,   // 16-bit register write
+    DRIVE_CMD_WRITE_REG32, // 32-bit register write (two registers, low word first)
+    DRIVE_CMD_RUN_MACRO,   // reg = DriveMacroId, value = its argument. Counts as one request of 'batch'
+    DRIVE_CMD_BATCH_BEGIN, // Start counting the commands tagged with 'batch'
+    DRIVE_CMD_BATCH_END,   // Report DRIVE_EVT_BATCH_DONE once all commands of 'batch' completed
+    DRIVE_CMD_POLL_PROFILE, // value = POLL_PROFILE_HOMING while homing, otherwise chosen from the servo status
+    DRIVE_CMD_RESET_LATENCY, // Clears the bus latency histograms
+    DRIVE_CMD_BUS_TARGET,  // value = bus utilisation in % the telemetry poll rates are tuned for (10-95)
+    DRIVE_CMD_PARAM_BACKUP, // Reads C00..C06 of the drive into driveParams
+    DRIVE_CMD_PARAM_RESTORE // Writes the registers of driveParams that differ in the drive
+};
+
+// Register macros the drive task runs, see DriveTask.cpp for the steps
+enum DriveMacroId : uint8_t {
+    MACRO_DRIVE_CONFIG,  // Servo off, torque mode, soft limits on (also driveApplyConfig() and reconnect)
+    MACRO_HOMING_START,  // Soft limits off, speed mode at 'value' rpm, servo on, until 'Running'
+    MACRO_HOMING_FINISH, // Servo off, torque mode, negative soft limit 'value', soft limits on
+    MACRO_HOMING_ABORT,  // Servo off, torque mode, soft limits on
+    MACRO_USER,          // driveUserMacro
+    MACRO_COUNT
+};
+
+struct DriveCommand {
+    DriveCommandType type;
+    uint8_t drive;  // Index into the drives passed to driveBegin()
+    uint8_t batch;  // 0 = not part of a batch
+    uint16_t reg;
+    int32_t value;
+};
+
+// --- Telemetry (drive task -> appLoop) ---
+// One record per telemetry cycle of a drive, or per connection state change.
+// The bus statistics are shared by all drives. 'fields' holds the latest value
+// of every field, 'freshFields' those read since the previous record: the
+// fields of the cycle plus the feedback read along with the setpoint (0x17).
+// The other fields are carried over from earlier cycles. Times are micros() of
+// the drive task, taken when the response frame holding the value arrived.
+struct DriveSample {
+    uint8_t drive;
+    uint32_t timeMs;
+    uint32_t timeUs;              // Acquisition time: arrival of the position, else of the newest fresh field
+    uint32_t acquisitionUs;       // First to last arrival of the fresh fields
+    uint32_t freshFields;         // FIELD_BIT() mask of the fields read since the previous record
+    bool modbusOk;
+    uint8_t transactions;         // Modbus frames of the cycle
+    uint32_t cycleUs;             // First request queued to last response of the cycle
+    uint16_t turnaroundUs;        // Drive response turnaround, moving average
+    uint16_t turnaroundMinUs;     // Spread = jitter of the direction switching
+    uint16_t turnaroundMaxUs;
+    uint32_t collisions;          // RS485 mode: requests that collided on the line
+    uint16_t gapUs;               // Current inter-frame gap
+    uint32_t configDirty;         // Shadowed config registers not (yet) confirmed by the drive
+    uint32_t configMismatches;    // Safety registers that read back different after a write, since start
+    uint16_t cpuUsPerTxn;         // Drive task CPU time per Modbus transaction, last second
+    uint16_t exchangeAvgUs;       // Request on the wire to completion, moving average
+    uint16_t exchangeMaxUs;
+    uint16_t wakeupsPerSec;       // Drive task loop passes, last second
+    PollProfile pollProfile;      // Telemetry poll rates in use
+    uint8_t fieldRateHz[FIELD_COUNT]; // Effective read rate per field, last second
+    uint16_t telemetryHz;         // Telemetry frames of this drive, last second
+    uint8_t telemetryShare;       // Its share of all telemetry frames on the bus in %, last second
+    uint32_t setpointLatencyUs;   // New setpoint to the write carrying it on the wire, last change
+    uint32_t setpointLatencyMaxUs;
+    uint32_t deadlineMisses;      // Modbus requests that waited longer than their class deadline
+    uint8_t busLoadPct;           // Bus utilisation, last second
+    uint16_t pollScalePct;        // Telemetry poll periods in % of the register table, tuned to the bus target
+    int32_t fields[FIELD_COUNT];  // Indexed by RegFieldId, raw drive units
+};
+
+// --- Events (drive task -> appLoop) ---
+enum DriveEventType : uint8_t {
+    DRIVE_EVT_BATCH_DONE,   // 'batch' finished, 'ok' = no write failed
+    DRIVE_EVT_DISABLE_DONE, // Servo disable write answered
+    DRIVE_EVT_RECONNECTED,  // Link recovered, differing config written. 'ok' = false: the drive restarted,
+                            // full configuration re-applied, servo disabled
+    DRIVE_EVT_PARAMS_DONE,  // Parameter backup or restore finished, driveParams is free again
+    DRIVE_EVT_MACRO_DONE    // MACRO_USER finished, 'ok' = every step succeeded, driveUserMacro is free again
+};
+
+struct DriveEvent {
+    DriveEventType type;
+    uint8_t drive;
+    uint8_t batch;
+    bool ok;
+};
+
+struct DriveLogMessage {
+    char text[DRIVE_LOG_MSG_LENGTH];
+};
+
+// --- Gateway (Modbus TCP server <-> drive task) ---
+// Modbus TCP requests from the PC tools, forwarded to the drive with the
+// matching slave id at the lowest bus priority, one at a time. The answer
+// goes back the same way, as a complete Modbus TCP frame. The requests come
+// from the AsyncTCP task, the answers are sent by appLoop().
+#define DRIVE_GATEWAY_MAX_FRAME 260 // MBAP header + largest PDU
+
+struct DriveGatewayFrame {
+    uint8_t client;     // Slot of the TCP client
+    uint8_t connection; // Connection counter of the slot, answers to a closed connection are dropped
+    uint16_t length;
+    uint32_t busUs;     // Answer only: time the request held the bus
+    uint8_t adu[DRIVE_GATEWAY_MAX_FRAME];
+};
+
+extern SpscQueue<DriveCommand, 32> driveCommands;
+extern SpscQueue<DriveSample, 16> driveSamples;
+extern SpscQueue<DriveEvent, 16> driveEvents;
+extern SpscQueue<DriveLogMessage, 24> driveLogs;
+extern SpscQueue<DriveGatewayFrame, 8> gatewayRequests;  // Modbus TCP server -> drive task
+extern SpscQueue<DriveGatewayFrame, 8> gatewayResponses; // Drive task -> appLoop
+
+// --- Traffic Capture ---
+// Recorded by the drive task. appLoop() starts and stops it, and reads it out
+// once modbusCapture.state() is CAPTURE_FROZEN. A link loss is marked in the
+// log and triggers the stop if the capture was started with a trigger delay.
+#if MODBUS_CAPTURE
+extern ModbusCapture<MODBUS_CAPTURE_BYTES> modbusCapture;
+#endif
+
+// --- Parameter Backup / Restore ---
+// The image a backup fills and a restore writes from. Between sending
+// DRIVE_CMD_PARAM_BACKUP / _RESTORE and DRIVE_EVT_PARAMS_DONE it belongs to the
+// drive task, otherwise to appLoop().
+extern DriveParamImage driveParams;
+
+// --- Register Macros ---
+// The uploaded macro. Between sending DRIVE_CMD_RUN_MACRO with MACRO_USER and
+// DRIVE_EVT_MACRO_DONE it belongs to the drive task, otherwise to appLoop().
+extern DriveMacro driveUserMacro;
+
+// --- Latency Histograms ---
+// Exchange times of all drives on the bus, written by the drive task. Readers
+// in other tasks see them without locking. DRIVE_CMD_RESET_LATENCY clears them.
+const ModbusLatencyStats &driveLatencyStats();
+
+// Setup, called from setupApp() before driveStartTask(). They run the bus
+// synchronously in the calling task. driveBegin() opens UART 'uartNum' (8N1)
+// and returns false if that failed. With 'dePin' >= 0 RTS drives the RS485
+// transceiver's DE, see IdfRtuPort.h for the collision check. 'slaveIds' and
+// 'weights' hold one entry per drive, 'weights' sets the share of the telemetry
+// frames a drive gets while the bus is saturated. 'softLimitNeg' is the negative
+// software limit (C06.08) the configuration applies, also after a reconnect.
+bool driveBegin(uint8_t uartNum, int rxPin, int txPin, int dePin, const uint8_t *slaveIds, const uint8_t *weights,
+                uint8_t driveCount, uint32_t baud, int32_t softLimitNeg);
+uint8_t driveConnect();  // Initial connection check, returns the number of drives that answered
+bool driveLinkOk(uint8_t drive);
+
+// Finds the baud rate the drives answer at (stored, then fallback, then target)
+// and asks them to move to 'targetBaud' via C0A.01. All drives share the bus,
+// so the rate only changes if every drive that answered follows. Returns the
+// working rate, 0 if no drive answered at all.
+uint32_t driveNegotiateBaud(uint32_t storedBaud, uint32_t fallbackBaud, uint32_t targetBaud);
+bool driveApplyConfig(); // Torque mode, soft limits, servo disabled, on every drive that answered
+
+// Starts the drive task. From here on only the task touches the bus.
+void driveStartTask();
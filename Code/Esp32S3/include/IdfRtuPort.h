@@ -0,0 +1,73 @@
+/*
+ * Modbus RTU Port on the ESP-IDF UART Driver - see RtuPort.h
+ *
+ * Replaces HardwareSerial for the drive link. The UART RX timeout is set to
+ * RTU_UART_RX_TIMEOUT_SYMBOLS characters, so the driver posts a UART_DATA
+ * event with timeout_flag as soon as a response frame has ended (or its RX
+ * FIFO fills up), and the drive task sleeps on the event queue in between.
+ *
+ * With a DE pin, RTS drives the transceiver's DE while a request goes out.
+ * With RTU_RS485_ECHO_CHECK (transceiver /RE tied low, so its receiver hears
+ * the line while we send) the UART runs in RS485 collision detect mode: the
+ * port asserts DE itself, releases it once the last stop bit is out
+ * (uart_wait_tx_done(), write() blocks for the frame time) and compares the
+ * echo of the request with what it sent. A difference is a collision, and
+ * the echo never reaches the master. Without it (/RE tied to DE) the UART
+ * runs in RS485 half-duplex mode, the driver switches DE and there is no
+ * echo to check: takeCollision() is always false.
+ * If every request collides, /RE is tied to DE: the response is taken for
+ * the echo. Set RTU_RS485_ECHO_CHECK to 0 for such a transceiver.
+ */
+
+#pragma once
+
+#include "RtuPort.h"
+#include "ModbusRtu.h"
+#include <driver/uart.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+
+#define RTU_UART_RX_BUFFER 512        // Driver ring buffer, must exceed the 128 byte hardware FIFO
+#define RTU_UART_EVENT_QUEUE 16
+#define RTU_UART_RX_TIMEOUT_SYMBOLS 4 // Frame end: just over t3.5 of silence
+#define RTU_TX_DONE_TIMEOUT_MS 50     // Longest request at the slowest rate is ~30 ms
+
+#ifndef RTU_RS485_ECHO_CHECK
+#define RTU_RS485_ECHO_CHECK 1 // 1 = transceiver /RE tied low, requests are read back and compared (collision check)
+#endif
+
+class IdfRtuPort : public RtuPort {
+public:
+    // 'dePin' < 0: plain UART (converter with automatic direction switching)
+    bool begin(uart_port_t port, int rxPin, int txPin, int dePin, uint32_t baud);
+
+    void setBaud(uint32_t baud) override;
+    int available() override;
+    size_t read(uint8_t *buffer, size_t length) override;
+    void write(const uint8_t *frame, size_t length) override;
+    void flushInput() override;
+    void waitForData(uint32_t ms) override;
+    bool takeCollision() override;
+    const char *name() const override {
+        return _echoCheck ? "IDF UART RS485, echo check" : _rs485 ? "IDF UART RS485" : "IDF UART";
+    }
+
+    // Event statistics
+    uint32_t frameEvents = 0;  // RX timeout events (frame ends)
+    uint32_t dataEvents = 0;   // RX FIFO threshold events
+    uint32_t overflows = 0;    // RX FIFO or ring buffer overflows, input was dropped
+    uint32_t lineErrors = 0;   // Framing, parity and break events
+    uint32_t collisions = 0;   // Echo check: requests whose echo did not match what was sent
+
+private:
+    void takeEcho(); // Reads the echo of the last request that arrived so far and compares it
+
+    uart_port_t _port = UART_NUM_2;
+    QueueHandle_t _events = nullptr;
+    bool _rs485 = false;
+    bool _echoCheck = false;
+    uint8_t _tx[MODBUS_RTU_MAX_FRAME]; // Last request, to compare its echo with
+    size_t _txLen = 0;
+    size_t _echoLen = 0;               // Echo bytes read back so far
+    bool _collision = false;
+};
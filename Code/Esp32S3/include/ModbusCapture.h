@@ -0,0 +1,192 @@
+/*
+ * Modbus Traffic Capture
+ *
+ * RAM ring of every frame exchanged with the drives, with microsecond
+ * timestamps, to reproduce field issues on a host (Code/HostTools/mbreplay).
+ * The drive task records (CaptureRtuPort.h), appLoop() starts and stops the
+ * capture and reads it out once it is frozen. A capture can freeze itself a
+ * little after a trigger (link loss), so the ring holds the traffic that led
+ * up to it. When the ring is full the oldest records are dropped.
+ *
+ * Log format, little endian: a MODBUS_CAPTURE_HEADER_LENGTH byte header
+ * ("MBCP", version, 3 reserved, baud rate at the first record, records
+ * dropped from the ring), then records of a 6 byte header (type, payload
+ * length, micros() at the time) and the payload.
+ * Plain C++ without Arduino dependencies, so it also builds on a host.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <atomic>
+
+#define MODBUS_CAPTURE_VERSION 1
+#define MODBUS_CAPTURE_HEADER_LENGTH 16
+#define MODBUS_CAPTURE_RECORD_HEADER 6
+
+enum ModbusCaptureType : uint8_t {
+    CAPTURE_TX = 1,    // Request frame as written to the port
+    CAPTURE_RX,        // Bytes as read from the port, one record per read
+    CAPTURE_BAUD,      // Payload: new baud rate, uint32
+    CAPTURE_COLLISION, // The port reported a collision on the line (RS485 mode)
+    CAPTURE_MARK       // Payload: text, e.g. "Drive 1: link down"
+};
+
+enum ModbusCaptureState : uint8_t {
+    CAPTURE_IDLE,      // Nothing recorded yet
+    CAPTURE_RECORDING,
+    CAPTURE_FROZEN     // Stopped, can be read out
+};
+
+struct ModbusCaptureRecord {
+    uint8_t type;
+    uint8_t length;
+    uint32_t timeUs;
+    const uint8_t *data;
+};
+
+// Parses the log header. Returns false if 'buf' is not a capture.
+inline bool modbusCaptureParseHeader(const uint8_t *buf, size_t len, uint32_t &baud, uint32_t &dropped) {
+    if (len < MODBUS_CAPTURE_HEADER_LENGTH || memcmp(buf, "MBCP", 4) != 0 || buf[4] != MODBUS_CAPTURE_VERSION) {
+        return false;
+    }
+    baud = buf[8] | (buf[9] << 8) | (buf[10] << 16) | ((uint32_t)buf[11] << 24);
+    dropped = buf[12] | (buf[13] << 8) | (buf[14] << 16) | ((uint32_t)buf[15] << 24);
+    return true;
+}
+
+// Parses the record at 'offset' of a log. Returns its size, 0 at the end or if it is cut off.
+inline size_t modbusCaptureParseRecord(const uint8_t *buf, size_t len, size_t offset, ModbusCaptureRecord &rec) {
+    if (offset + MODBUS_CAPTURE_RECORD_HEADER > len) return 0;
+    const uint8_t *p = buf + offset;
+    rec.type = p[0];
+    rec.length = p[1];
+    rec.timeUs = p[2] | (p[3] << 8) | (p[4] << 16) | ((uint32_t)p[5] << 24);
+    rec.data = p + MODBUS_CAPTURE_RECORD_HEADER;
+    if (offset + MODBUS_CAPTURE_RECORD_HEADER + rec.length > len) return 0;
+    return MODBUS_CAPTURE_RECORD_HEADER + rec.length;
+}
+
+template <size_t Size>
+class ModbusCapture {
+    static_assert(Size >= 2 * (MODBUS_CAPTURE_RECORD_HEADER + 255), "Capture ring must hold the largest records");
+
+public:
+    // --- appLoop() ---
+
+    // Starts a new capture, the previous one is lost. With 'triggerStopUs' > 0
+    // the capture freezes that long after trigger(). False while recording.
+    bool start(uint32_t triggerStopUs) {
+        if (_state.load(std::memory_order_acquire) == CAPTURE_RECORDING) return false;
+        _tail = 0;
+        _used = 0;
+        _dropped = 0;
+        _triggerStopUs = triggerStopUs;
+        _triggered = false;
+        _stopRequest.store(false, std::memory_order_relaxed);
+        _state.store(CAPTURE_RECORDING, std::memory_order_release);
+        return true;
+    }
+
+    // The drive task freezes the capture on its next pass (service())
+    void stop() { _stopRequest.store(true, std::memory_order_release); }
+
+    ModbusCaptureState state() const { return (ModbusCaptureState)_state.load(std::memory_order_acquire); }
+
+    // Log size and contents, only while frozen
+    size_t size() const { return MODBUS_CAPTURE_HEADER_LENGTH + _used; }
+    size_t read(uint8_t *buffer, size_t length, size_t offset) const {
+        size_t n = 0;
+        while (n < length && offset < MODBUS_CAPTURE_HEADER_LENGTH) buffer[n++] = headerByte(offset++);
+        if (offset < MODBUS_CAPTURE_HEADER_LENGTH) return n;
+        offset -= MODBUS_CAPTURE_HEADER_LENGTH;
+        while (n < length && offset < _used) buffer[n++] = _buf[(_tail + offset++) % Size];
+        return n;
+    }
+
+    // --- Drive task ---
+
+    bool recording() const { return _state.load(std::memory_order_relaxed) == CAPTURE_RECORDING; }
+
+    void record(ModbusCaptureType type, uint32_t timeUs, const uint8_t *data, uint8_t length) {
+        if (!recording()) return;
+        size_t need = MODBUS_CAPTURE_RECORD_HEADER + length;
+        while (Size - _used < need) dropOldest();
+        if (_used == 0) _firstBaud = _baud;
+        uint8_t header[MODBUS_CAPTURE_RECORD_HEADER] = {
+            type, length, (uint8_t)timeUs, (uint8_t)(timeUs >> 8), (uint8_t)(timeUs >> 16), (uint8_t)(timeUs >> 24)
+        };
+        put(header, sizeof(header));
+        put(data, length);
+    }
+
+    // Called on every baud rate change, also while not recording
+    void recordBaud(uint32_t timeUs, uint32_t baud) {
+        _baud = baud;
+        uint8_t data[4] = { (uint8_t)baud, (uint8_t)(baud >> 8), (uint8_t)(baud >> 16), (uint8_t)(baud >> 24) };
+        record(CAPTURE_BAUD, timeUs, data, sizeof(data));
+    }
+
+    void mark(uint32_t timeUs, const char *text) {
+        size_t length = strlen(text);
+        record(CAPTURE_MARK, timeUs, (const uint8_t *)text, length > 255 ? 255 : length);
+    }
+
+    // Something worth keeping happened: freeze after 'triggerStopUs', if set at start()
+    void trigger(uint32_t timeUs) {
+        if (!recording() || _triggered || _triggerStopUs == 0) return;
+        _triggered = true;
+        _triggerUs = timeUs;
+    }
+
+    // Freezes the capture once it was stopped or the trigger delay is over
+    void service(uint32_t nowUs) {
+        if (!recording()) return;
+        if (_stopRequest.load(std::memory_order_acquire) || (_triggered && nowUs - _triggerUs >= _triggerStopUs)) {
+            _state.store(CAPTURE_FROZEN, std::memory_order_release);
+        }
+    }
+
+private:
+    uint8_t byteAt(size_t offset) const { return _buf[(_tail + offset) % Size]; }
+
+    void dropOldest() {
+        uint8_t type = byteAt(0);
+        size_t length = MODBUS_CAPTURE_RECORD_HEADER + byteAt(1);
+        if (type == CAPTURE_BAUD) {
+            _firstBaud = 0;
+            for (uint8_t i = 0; i < 4; i++) _firstBaud |= (uint32_t)byteAt(MODBUS_CAPTURE_RECORD_HEADER + i) << (8 * i);
+        }
+        _tail = (_tail + length) % Size;
+        _used -= length;
+        _dropped++;
+    }
+
+    void put(const uint8_t *data, size_t length) {
+        for (size_t i = 0; i < length; i++) _buf[(_tail + _used + i) % Size] = data[i];
+        _used += length;
+    }
+
+    uint8_t headerByte(size_t offset) const {
+        static const char magic[4] = { 'M', 'B', 'C', 'P' };
+        if (offset < 4) return magic[offset];
+        if (offset == 4) return MODBUS_CAPTURE_VERSION;
+        if (offset < 8) return 0;
+        if (offset < 12) return (uint8_t)(_firstBaud >> (8 * (offset - 8)));
+        return (uint8_t)(_dropped >> (8 * (offset - 12)));
+    }
+
+    uint8_t _buf[Size];
+    size_t _tail = 0;             // Oldest record
+    size_t _used = 0;
+    uint32_t _dropped = 0;        // Records dropped from the full ring
+    uint32_t _baud = 0;           // Current baud rate
+    uint32_t _firstBaud = 0;      // Baud rate at the oldest record
+    uint32_t _triggerStopUs = 0;
+    bool _triggered = false;
+    uint32_t _triggerUs = 0;
+    std::atomic<bool> _stopRequest{false};
+    std::atomic<uint8_t> _state{CAPTURE_IDLE};
+};
@@ -0,0 +1,32 @@
+/*
+ * Modbus TCP Gateway
+ *
+ * Modbus TCP server for PC tools (drive parameter software, mbpoll, ...)
+ * while the machine runs, without unplugging the ESP32 from CN3. Requests
+ * are framed in the AsyncTCP task and handed to the drive task, which
+ * forwards them to the drive with the matching slave id at the lowest bus
+ * priority (see DriveTask.h). Unit id 0 or 255 addresses the first drive.
+ * gatewayLoop() sends the answers and counts the bus time of every client.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+#include "ModbusTcp.h"
+
+#define GATEWAY_MAX_CLIENTS 4
+#define GATEWAY_STATS_WINDOW_MS 1000
+
+struct GatewayClientStats {
+    bool connected;
+    IPAddress remoteIp;
+    uint32_t requests;     // Answered since the client connected
+    uint32_t exceptions;   // Of those, answered with an exception
+    uint32_t dropped;      // Not forwarded, the drive task queue was full
+    uint32_t busUs;        // Bus time of its requests since it connected
+    uint16_t busMsPerSec;  // Bus time of its requests in the last window
+};
+
+bool gatewayBegin(uint16_t port = MODBUS_TCP_PORT);
+void gatewayLoop(); // From appLoop(): sends the answers, frees closed connections, updates the statistics
+GatewayClientStats gatewayClient(uint8_t slot);
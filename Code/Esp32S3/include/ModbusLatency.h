@@ -0,0 +1,91 @@
+/*
+ * Latency Histograms of the Modbus Link
+ *
+ * Fixed buckets from 250 us to 200 ms plus an overflow bucket: adding a
+ * sample is a short search and an increment, and nothing is allocated. A
+ * percentile is reported as the upper bound of its bucket, capped at the
+ * largest sample, so it is never below the true value and at most one
+ * bucket step above it.
+ *
+ * ModbusLatencyStats keeps one histogram per function code and one per
+ * register group (the parameter group in the high byte of the address,
+ * 0x03xx = C03, 0x40xx = U40). The drive task writes them, other tasks may
+ * read them without locking: a sample read while it is added can be off by one.
+ *
+ * Plain C++ without Arduino dependencies, so it also builds on a host.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include "ModbusRtu.h"
+
+#define LATENCY_BUCKETS 20
+#define LATENCY_FUNCTIONS 4 // Function codes the master sends, see latencyFunctions
+#define LATENCY_GROUPS 12   // Register groups, the last one also takes the groups that did not fit
+
+// Upper bounds of the buckets in us, the last bucket takes everything above
+static const uint32_t latencyBucketUs[LATENCY_BUCKETS - 1] = {
+    250, 500, 750, 1000, 1500, 2000, 3000, 4000, 5000, 7500,
+    10000, 15000, 20000, 30000, 50000, 75000, 100000, 150000, 200000
+};
+
+static const uint8_t latencyFunctions[LATENCY_FUNCTIONS] = {
+    MB_FC_READ_HOLDING_REGISTERS, MB_FC_WRITE_SINGLE_REGISTER, MB_FC_WRITE_MULTIPLE_REGISTERS,
+    MB_FC_READ_WRITE_MULTIPLE_REGISTERS
+};
+
+struct LatencyHistogram {
+    uint32_t counts[LATENCY_BUCKETS];
+    uint32_t total;
+    uint32_t maxUs;
+
+    void add(uint32_t us) {
+        uint8_t i = 0;
+        while (i < LATENCY_BUCKETS - 1 && us > latencyBucketUs[i]) i++;
+        counts[i]++;
+        total++;
+        if (us > maxUs) maxUs = us;
+    }
+
+    // Upper bound of the bucket holding the 'pct' percentile, 0 without samples
+    uint32_t percentile(uint8_t pct) const {
+        if (total == 0) return 0;
+        uint32_t rank = ((uint64_t)total * pct + 99) / 100;
+        if (rank == 0) rank = 1;
+        uint32_t seen = 0;
+        for (uint8_t i = 0; i < LATENCY_BUCKETS - 1; i++) {
+            seen += counts[i];
+            if (seen >= rank) return latencyBucketUs[i] < maxUs ? latencyBucketUs[i] : maxUs;
+        }
+        return maxUs;
+    }
+};
+
+struct ModbusLatencyStats {
+    LatencyHistogram function[LATENCY_FUNCTIONS]; // Indexed like latencyFunctions
+    LatencyHistogram group[LATENCY_GROUPS];
+    uint8_t groupIds[LATENCY_GROUPS];             // Address high byte of each group
+    uint8_t groupCount;
+
+    void reset() { *this = ModbusLatencyStats(); }
+
+    void add(uint8_t function, uint16_t address, uint32_t us) {
+        for (uint8_t i = 0; i < LATENCY_FUNCTIONS; i++) {
+            if (latencyFunctions[i] == function) this->function[i].add(us);
+        }
+        group[groupIndex(address >> 8)].add(us);
+    }
+
+private:
+    uint8_t groupIndex(uint8_t id) {
+        for (uint8_t i = 0; i < groupCount; i++) {
+            if (groupIds[i] == id) return i;
+        }
+        if (groupCount < LATENCY_GROUPS) {
+            groupIds[groupCount] = id;
+            return groupCount++;
+        }
+        return LATENCY_GROUPS - 1;
+    }
+};
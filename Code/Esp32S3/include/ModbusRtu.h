@@ -0,0 +1,167 @@
+/*
+ * Modbus RTU Frame Helpers
+ *
+ * CRC, request builders and response checks for the function codes the
+ * A6-RS drive supports (0x03 read, 0x06 write 16 bit, 0x10 write 32 bit),
+ * plus 0x17 read/write, which the A6 manual does not list and is probed for.
+ * Plain C++ without Arduino dependencies, so it also builds on a host.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+// --- Function Codes ---
+#define MB_FC_READ_HOLDING_REGISTERS 0x03
+#define MB_FC_WRITE_SINGLE_REGISTER 0x06
+#define MB_FC_WRITE_MULTIPLE_REGISTERS 0x10
+#define MB_FC_READ_WRITE_MULTIPLE_REGISTERS 0x17 // Write first, then read, in one exchange
+
+// --- Transaction Results ---
+// 0x01..0x7F are exception codes returned by the drive, the rest match ModbusMaster.
+#define MB_RESULT_SUCCESS 0x00
+#define MB_RESULT_ILLEGAL_FUNCTION 0x01
+#define MB_RESULT_ILLEGAL_DATA_ADDRESS 0x02
+#define MB_RESULT_ILLEGAL_DATA_VALUE 0x03
+#define MB_RESULT_SLAVE_DEVICE_FAILURE 0x04
+#define MB_RESULT_INVALID_SLAVE_ID 0xE0
+#define MB_RESULT_INVALID_FUNCTION 0xE1
+#define MB_RESULT_TIMEOUT 0xE2
+#define MB_RESULT_INVALID_CRC 0xE3
+#define MB_RESULT_ABORTED 0xE4 // Dropped from the queue before it was sent
+
+#define MODBUS_RTU_MAX_FRAME 256
+#define MODBUS_BROADCAST_ID 0 // Writes to slave 0 reach every drive on the bus, none of them answers
+
+// CRC-16/MODBUS (polynomial 0xA001, init 0xFFFF), transmitted low byte first
+inline uint16_t modbusCrc16(const uint8_t *data, size_t length) {
+    uint16_t crc = 0xFFFF;
+    while (length--) {
+        crc ^= *data++;
+        for (uint8_t i = 0; i < 8; i++) {
+            crc = (crc & 0x0001) ? (crc >> 1) ^ 0xA001 : crc >> 1;
+        }
+    }
+    return crc;
+}
+
+// Appends the CRC to a frame of 'length' bytes, returns the new length
+inline size_t modbusAppendCrc(uint8_t *frame, size_t length) {
+    uint16_t crc = modbusCrc16(frame, length);
+    frame[length] = crc & 0xFF;
+    frame[length + 1] = crc >> 8;
+    return length + 2;
+}
+
+// True if the last two bytes of the frame hold a valid CRC
+inline bool modbusCrcValid(const uint8_t *frame, size_t length) {
+    if (length < 4) return false;
+    uint16_t crc = modbusCrc16(frame, length - 2);
+    return frame[length - 2] == (crc & 0xFF) && frame[length - 1] == (crc >> 8);
+}
+
+inline size_t modbusBuildReadRequest(uint8_t *frame, uint8_t slaveId, uint16_t address, uint16_t count) {
+    frame[0] = slaveId;
+    frame[1] = MB_FC_READ_HOLDING_REGISTERS;
+    frame[2] = address >> 8;
+    frame[3] = address & 0xFF;
+    frame[4] = count >> 8;
+    frame[5] = count & 0xFF;
+    return modbusAppendCrc(frame, 6);
+}
+
+inline size_t modbusBuildWriteSingleRequest(uint8_t *frame, uint8_t slaveId, uint16_t address, uint16_t value) {
+    frame[0] = slaveId;
+    frame[1] = MB_FC_WRITE_SINGLE_REGISTER;
+    frame[2] = address >> 8;
+    frame[3] = address & 0xFF;
+    frame[4] = value >> 8;
+    frame[5] = value & 0xFF;
+    return modbusAppendCrc(frame, 6);
+}
+
+inline size_t modbusBuildWriteMultipleRequest(uint8_t *frame, uint8_t slaveId, uint16_t address,
+                                              const uint16_t *values, uint16_t count) {
+    frame[0] = slaveId;
+    frame[1] = MB_FC_WRITE_MULTIPLE_REGISTERS;
+    frame[2] = address >> 8;
+    frame[3] = address & 0xFF;
+    frame[4] = count >> 8;
+    frame[5] = count & 0xFF;
+    frame[6] = count * 2;
+    size_t len = 7;
+    for (uint16_t i = 0; i < count; i++) {
+        frame[len++] = values[i] >> 8;
+        frame[len++] = values[i] & 0xFF;
+    }
+    return modbusAppendCrc(frame, len);
+}
+
+inline size_t modbusBuildReadWriteRequest(uint8_t *frame, uint8_t slaveId, uint16_t readAddress, uint16_t readCount,
+                                          uint16_t writeAddress, const uint16_t *values, uint16_t writeCount) {
+    frame[0] = slaveId;
+    frame[1] = MB_FC_READ_WRITE_MULTIPLE_REGISTERS;
+    frame[2] = readAddress >> 8;
+    frame[3] = readAddress & 0xFF;
+    frame[4] = readCount >> 8;
+    frame[5] = readCount & 0xFF;
+    frame[6] = writeAddress >> 8;
+    frame[7] = writeAddress & 0xFF;
+    frame[8] = writeCount >> 8;
+    frame[9] = writeCount & 0xFF;
+    frame[10] = writeCount * 2;
+    size_t len = 11;
+    for (uint16_t i = 0; i < writeCount; i++) {
+        frame[len++] = values[i] >> 8;
+        frame[len++] = values[i] & 0xFF;
+    }
+    return modbusAppendCrc(frame, len);
+}
+
+// Length of a normal (non-exception) response to the given request ('count' = registers read)
+inline size_t modbusExpectedResponseLength(uint8_t function, uint16_t count) {
+    switch (function) {
+        case MB_FC_READ_HOLDING_REGISTERS:
+        case MB_FC_READ_WRITE_MULTIPLE_REGISTERS: return 5 + 2 * count;
+        case MB_FC_WRITE_SINGLE_REGISTER:
+        case MB_FC_WRITE_MULTIPLE_REGISTERS: return 8;
+        default: return 0;
+    }
+}
+
+// Checks a (possibly partial) response. Returns true once the frame is complete,
+// with the transaction result in 'result'. The A6 manual documents exception
+// frames with a 4 byte error code, the standard uses 1 byte, so both are accepted.
+inline bool modbusCheckResponse(const uint8_t *rx, size_t rxLen, uint8_t slaveId, uint8_t function,
+                                uint16_t count, uint8_t &result) {
+    if (rxLen < 5) return false;
+    if (rx[0] != slaveId) { result = MB_RESULT_INVALID_SLAVE_ID; return true; }
+
+    if (rx[1] == (function | 0x80)) {
+        static const uint8_t exceptionLengths[] = { 5, 6, 8 };
+        for (uint8_t i = 0; i < sizeof(exceptionLengths); i++) {
+            size_t len = exceptionLengths[i];
+            if (rxLen >= len && modbusCrcValid(rx, len)) {
+                result = rx[len - 3]; // Lowest byte of the error code
+                return true;
+            }
+        }
+        if (rxLen >= 8) { result = MB_RESULT_INVALID_CRC; return true; }
+        return false;
+    }
+    if (rx[1] != function) { result = MB_RESULT_INVALID_FUNCTION; return true; }
+
+    size_t expected = modbusExpectedResponseLength(function, count);
+    if (rxLen < expected) return false;
+    if (!modbusCrcValid(rx, expected)) { result = MB_RESULT_INVALID_CRC; return true; }
+    if ((function == MB_FC_READ_HOLDING_REGISTERS || function == MB_FC_READ_WRITE_MULTIPLE_REGISTERS)
+        && rx[2] != count * 2) { result = MB_RESULT_INVALID_FUNCTION; return true; }
+    result = MB_RESULT_SUCCESS;
+    return true;
+}
+
+// Register 'index' of a read response (big-endian on the wire)
+inline uint16_t modbusResponseWord(const uint8_t *rx, uint16_t index) {
+    return (uint16_t)rx[3 + 2 * index] << 8 | rx[4 + 2 * index];
+}
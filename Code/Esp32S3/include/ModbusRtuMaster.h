@@ -0,0 +1,231 @@
+/*
+ * Non-blocking Modbus RTU Master
+ *
+ * Requests are queued and the UART is serviced by a small state machine in
+ * poll(), which must be called frequently from the owning task. When a response
+ * arrives (or the transaction times out) the completion callback of the
+ * request is invoked from within poll(). The bytes come from an RtuPort and are
+ * read in bulk into the frame buffer and checked there.
+ *
+ * Bus timing follows the Modbus RTU serial line spec: t3.5 is derived from
+ * the baud rate (fixed 1750 us above 19200 baud). The gap before each request
+ * starts at t3.5, grows after timeouts and shrinks back while the drive keeps
+ * answering. The gap is only as fine as the owner's poll() period: the drive
+ * task polls every 1 ms tick, so a request goes out up to a tick after the gap
+ * has passed. The inter-character limit t1.5 is not checked: the port hands
+ * over bytes in bulk at that same tick, so a pause inside a frame shorter than
+ * a tick can not be seen. A pause longer than t3.5 ends the response as
+ * truncated, sranalyze finds t1.5 violations in a logic analyzer capture.
+ *
+ * The drive's response turnaround is measured for every transaction. The
+ * response timeout (request on the wire to first response byte) follows the
+ * longest turnaround seen, so a drive that went away is noticed after about
+ * 10 ms instead of 100 ms. After a timeout the next request gets the full
+ * MODBUS_RESPONSE_TIMEOUT_MS again: a drive that answers late raises the
+ * longest turnaround and with it the timeout. The turnaround does not move
+ * the gap, that is the line silence the drives need between frames, not
+ * their processing time.
+ *
+ * Every request belongs to a priority class with its own FIFO. Between
+ * frames the highest class with a queued request goes next, so a setpoint
+ * never waits for more than the frame already on the bus. Each class has a
+ * deadline for its queueing delay: a lower class that missed it is served
+ * before a higher one that did not (except SAFETY), so slow reads can not
+ * starve. Queueing delay and deadline misses are counted per class, the
+ * exchange time (request on the wire to completion, timeouts included) goes
+ * into latency histograms per function code and register group.
+ *
+ * Several drives can share the bus: every request carries the slave id that
+ * was selected when it was queued (selectSlave()), so the drive task can
+ * interleave the requests of all drives in the same queues. Writes can go to
+ * MODBUS_BROADCAST_ID: no drive answers, the request completes once the
+ * frame is on the wire and the drives had MODBUS_BROADCAST_DELAY_US to act.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+#include "ModbusRtu.h"
+#include "ModbusLatency.h"
+#include "RtuPort.h"
+
+#define MODBUS_QUEUE_SIZE 24
+#define MODBUS_MAX_WRITE_REGS 8
+#define MODBUS_MAX_READ_REGS_PER_FRAME (MODBUS_RTU_MAX_FRAME / 2 - 3) // Read response must fit the frame buffer
+#define MODBUS_RESPONSE_TIMEOUT_MS 100 // The A6 answers within a few ms, ModbusMaster waited 2000 ms
+#define MODBUS_MIN_RESPONSE_TIMEOUT_MS 10 // Lower bound of the timeout derived from the turnaround
+#define MODBUS_TURNAROUND_MARGIN 4   // Derived timeout: longest turnaround times this, plus MODBUS_RX_LATENCY_US
+#define MODBUS_T35_FIXED_US 1750     // t3.5 above 19200 baud
+#define MODBUS_MAX_GAP_US 10000      // Upper bound of the adaptive inter-frame gap
+#define MODBUS_GAP_SHRINK_AFTER 50   // Good transactions before the gap is shrunk again
+#define MODBUS_RX_LATENCY_US 2000    // Poll period plus UART RX timeout, bytes may show up this late
+#define MODBUS_BROADCAST_DELAY_US 2000 // Bus kept idle after a broadcast while the drives process it
+
+// Priority classes, highest first
+enum ModbusPriority : uint8_t {
+    MB_PRIO_SAFETY,       // Disable / e-stop, and the command and configuration writes ordered with them
+    MB_PRIO_SETPOINT,     // Torque setpoint stream
+    MB_PRIO_FEEDBACK,     // Motion feedback reads (position, speed, torque)
+    MB_PRIO_HOUSEKEEPING, // Slow reads (temperatures, bus voltage, DI), connection check
+    MB_PRIO_GATEWAY,      // Requests forwarded from Modbus TCP clients
+    MB_PRIO_COUNT
+};
+
+// Queueing delay deadline per class, request queued to request on the wire
+#define MODBUS_DEADLINE_SAFETY_US 5000
+#define MODBUS_DEADLINE_SETPOINT_US 10000
+#define MODBUS_DEADLINE_FEEDBACK_US 50000        // One telemetry interval
+#define MODBUS_DEADLINE_HOUSEKEEPING_US 500000
+#define MODBUS_DEADLINE_GATEWAY_US 1000000
+
+struct ModbusTransaction;
+
+// Completion callback. 'words' holds the registers of a read response, or is null.
+typedef void (*ModbusCallback)(const ModbusTransaction &txn, uint8_t result, const uint16_t *words);
+
+struct ModbusTransaction {
+    uint8_t slaveId;       // Set by the master: slave selected when the request was queued
+    uint8_t function;      // MB_FC_*, or MB_FC_PAUSE
+    uint16_t address;
+    uint16_t count;        // Registers to read/write, pause length in ms for MB_FC_PAUSE
+    uint16_t writeAddress; // MB_FC_READ_WRITE_MULTIPLE_REGISTERS: 'values' go here, 'address'/'count' are read
+    uint16_t writeCount;
+    uint16_t values[MODBUS_MAX_WRITE_REGS];
+    ModbusCallback callback;
+    void *context;         // Passed through to the callback
+    uint32_t tag;          // Passed through to the callback
+    ModbusPriority priority;
+    uint32_t queuedUs;     // Set by the master: request queued
+    uint32_t startUs;      // Set by the master: request put on the wire
+};
+
+// Queueing delay of one priority class
+struct ModbusClassStats {
+    uint32_t waitUs;         // Last request
+    uint32_t waitMaxUs;
+    uint32_t deadlineMisses;
+};
+
+// Tracks a group of queued requests so a state machine can wait for all of them.
+// The owner counts requests in 'pending', completion callbacks count them down.
+struct ModbusBatch {
+    uint8_t pending;
+    bool failed;
+};
+
+inline void batchBegin(ModbusBatch &batch) { batch.pending = 0; batch.failed = false; }
+inline bool batchDone(const ModbusBatch &batch) { return batch.pending == 0; }
+
+#define MB_FC_PAUSE 0x00 // Internal: keeps the bus idle for a while, no frame is sent
+
+class ModbusRtuMaster {
+public:
+    // Result codes, named like ModbusMaster's for familiarity
+    static const uint8_t ku8MBSuccess = MB_RESULT_SUCCESS;
+    static const uint8_t ku8MBIllegalDataAddress = MB_RESULT_ILLEGAL_DATA_ADDRESS;
+    static const uint8_t ku8MBResponseTimedOut = MB_RESULT_TIMEOUT;
+    static const uint8_t ku8MBInvalidCRC = MB_RESULT_INVALID_CRC;
+    static const uint8_t ku8MBAborted = MB_RESULT_ABORTED;
+
+    void begin(RtuPort &port, uint8_t slaveId, uint32_t baud);
+
+    // Switches the port to 'baud' and recomputes the bus timing
+    void setBaud(uint32_t baud);
+
+    // Requests queued from now on go to 'slaveId' (begin() selects its 'slaveId').
+    // With MODBUS_BROADCAST_ID only writes can be queued.
+    void selectSlave(uint8_t slaveId) { _slaveId = slaveId; }
+    uint8_t selectedSlave() const { return _slaveId; }
+
+    // Queue requests. Return false if the queue of the class is full.
+    bool readHoldingRegisters(uint16_t address, uint16_t count, ModbusCallback callback,
+                              void *context = nullptr, uint32_t tag = 0, ModbusPriority priority = MB_PRIO_SAFETY);
+    bool writeSingleRegister(uint16_t address, uint16_t value, ModbusCallback callback,
+                             void *context = nullptr, uint32_t tag = 0, ModbusPriority priority = MB_PRIO_SAFETY);
+    bool writeMultipleRegisters(uint16_t address, const uint16_t *values, uint16_t count,
+                                ModbusCallback callback, void *context = nullptr, uint32_t tag = 0,
+                                ModbusPriority priority = MB_PRIO_SAFETY);
+    // 0x17: writes 'values' to 'writeAddress', then reads 'readCount' registers, in one exchange
+    bool readWriteMultipleRegisters(uint16_t readAddress, uint16_t readCount, uint16_t writeAddress,
+                                    const uint16_t *values, uint16_t writeCount, ModbusCallback callback,
+                                    void *context = nullptr, uint32_t tag = 0, ModbusPriority priority = MB_PRIO_SAFETY);
+    // Keeps the bus idle for 'ms' once the requests queued before it in its class are done
+    bool queuePause(uint16_t ms, ModbusPriority priority = MB_PRIO_SAFETY);
+
+    // Services the UART, call as often as possible
+    void poll();
+
+    // Drops all queued requests, their callbacks receive ku8MBAborted.
+    // The transaction currently on the bus is allowed to finish.
+    void abortAll();
+    // Same, for the requests queued for one slave only
+    void abortSlave(uint8_t slaveId);
+
+    bool idle() const { return _state == STATE_IDLE && _total == 0; }
+    bool waitingForResponse() const { return _state == STATE_WAIT_RESPONSE; }
+    uint8_t pending() const { return _total + (_state != STATE_IDLE ? 1 : 0); }
+
+    // Bus timing in us
+    uint32_t charUs() const { return _charUs; }
+    uint32_t t35Us() const { return _t35Us; }
+    uint32_t gapUs() const { return _gapUs; }
+    uint32_t responseTimeoutUs() const { return _responseTimeoutUs; }
+
+    // Statistics
+    uint32_t transactions = 0;
+    uint32_t failures = 0;
+    uint32_t exceptions = 0;       // Failures the drive answered with an exception, the bus itself worked
+    uint32_t timeouts = 0;
+    uint32_t truncated = 0;        // Responses that stopped before they were complete
+    uint32_t collisions = 0;       // Requests the port saw collide on the line (RS485 mode)
+    uint32_t broadcasts = 0;       // Unanswered writes to MODBUS_BROADCAST_ID, not counted in 'transactions'
+    uint32_t turnaroundUs = 0;     // End of request to first response byte, last transaction
+    uint32_t turnaroundMinUs = 0;  // Min and max show the jitter of the direction switching
+    uint32_t turnaroundMaxUs = 0;  // Since setBaud(), sets the response timeout
+    uint32_t turnaroundAvgUs = 0;  // Moving average over ~16 transactions
+    uint32_t exchangeUs = 0;       // Request on the wire to completion callback, last transaction
+    uint32_t exchangeMaxUs = 0;
+    uint32_t exchangeAvgUs = 0;    // Moving average over ~16 transactions
+    uint32_t pollBusyUs = 0;       // Total time spent in poll()
+    uint32_t busUs = 0;            // Total bus time of all frames: gap before, request, turnaround, response (wraps)
+    uint32_t lastBusUs = 0;        // Its share of the last transaction, valid in the completion callback
+    uint32_t responseUs = 0;       // Last byte of the response received, valid in the completion callback of a success
+    ModbusClassStats classStats[MB_PRIO_COUNT] = {};
+    ModbusLatencyStats latency = {}; // Exchange time histograms, broadcasts and pauses not included
+
+private:
+    enum State { STATE_IDLE, STATE_WAIT_RESPONSE, STATE_PAUSE, STATE_BROADCAST };
+
+    bool enqueue(ModbusTransaction &txn);
+    bool overdue(uint8_t prio, uint32_t now) const;
+    int8_t nextClass(uint32_t now) const;
+    void start(uint8_t prio);
+    void service(uint32_t now);
+    void complete(uint8_t result);
+    void recordTurnaround(uint32_t firstByteUs);
+    void adaptGap(uint8_t result);
+    void adaptResponseTimeout(uint8_t result);
+
+    RtuPort *_port = nullptr;
+    uint8_t _slaveId = 1;            // Selected slave, stamped on queued requests
+    uint32_t _charUs = 0;           // One character (start + 8 data + parity/stop + stop = 11 bits)
+    uint32_t _t35Us = 0;
+    uint32_t _gapUs = 0;            // Current inter-frame gap, >= t3.5
+    uint32_t _responseTimeoutUs = MODBUS_RESPONSE_TIMEOUT_MS * 1000UL; // Request on the wire to first response byte
+    uint8_t _gapGoodCount = 0;
+
+    ModbusTransaction _queue[MB_PRIO_COUNT][MODBUS_QUEUE_SIZE];
+    uint8_t _head[MB_PRIO_COUNT] = {};
+    uint8_t _count[MB_PRIO_COUNT] = {};
+    uint8_t _total = 0;
+
+    State _state = STATE_IDLE;
+    ModbusTransaction _active;
+    uint32_t _startUs = 0;        // Request sent / pause started
+    uint32_t _txTimeUs = 0;       // Time on the wire of the request
+    uint32_t _lastActivityUs = 0; // Last byte seen on the bus
+    uint32_t _lastRxUs = 0;       // Last poll() that received bytes of the response
+    uint8_t _rx[MODBUS_RTU_MAX_FRAME];
+    uint16_t _rxLen = 0;
+    uint16_t _words[MODBUS_RTU_MAX_FRAME / 2];
+};
@@ -0,0 +1,151 @@
+/*
+ * Modbus TCP Frame Helpers
+ *
+ * MBAP header framing and the PDU layer of the function codes the gateway
+ * forwards to the drives (0x03, 0x06, 0x10, 0x17). A Modbus TCP ADU is the
+ * 7 byte MBAP header (transaction id, protocol id 0, length, unit id)
+ * followed by the PDU (function code and data, no CRC).
+ * Plain C++ without Arduino dependencies, so it also builds on a host.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "ModbusRtu.h"
+
+#define MODBUS_TCP_PORT 502
+#define MODBUS_TCP_MBAP_LENGTH 7
+#define MODBUS_TCP_MAX_PDU 253
+#define MODBUS_TCP_MAX_ADU (MODBUS_TCP_MBAP_LENGTH + MODBUS_TCP_MAX_PDU)
+
+// Exception codes a gateway returns on its own
+#define MB_EX_GATEWAY_PATH_UNAVAILABLE 0x0A // Unit id not on the bus, or the request was dropped
+#define MB_EX_GATEWAY_TARGET_FAILED 0x0B    // The drive did not answer (timeout, CRC error)
+
+struct ModbusTcpHeader {
+    uint16_t transactionId;
+    uint16_t protocolId;
+    uint16_t length;        // Unit id + PDU
+    uint8_t unitId;
+};
+
+// Size of the ADU at the start of 'buf': 0 if more bytes are needed, -1 if the
+// header can not be Modbus TCP (the connection should be closed).
+inline int modbusTcpFrameLength(const uint8_t *buf, size_t len) {
+    if (len < 6) return 0;
+    uint16_t protocolId = (buf[2] << 8) | buf[3];
+    uint16_t length = (buf[4] << 8) | buf[5];
+    if (protocolId != 0 || length < 2 || length > 1 + MODBUS_TCP_MAX_PDU) return -1;
+    return (len >= 6u + length) ? 6 + length : 0;
+}
+
+inline void modbusTcpParseHeader(const uint8_t *adu, ModbusTcpHeader &header) {
+    header.transactionId = (adu[0] << 8) | adu[1];
+    header.protocolId = (adu[2] << 8) | adu[3];
+    header.length = (adu[4] << 8) | adu[5];
+    header.unitId = adu[6];
+}
+
+// Writes the MBAP header for a PDU of 'pduLen' bytes, returns the header length
+inline size_t modbusTcpBuildHeader(uint8_t *adu, uint16_t transactionId, uint8_t unitId, size_t pduLen) {
+    adu[0] = transactionId >> 8;
+    adu[1] = transactionId & 0xFF;
+    adu[2] = 0;
+    adu[3] = 0;
+    adu[4] = (pduLen + 1) >> 8;
+    adu[5] = (pduLen + 1) & 0xFF;
+    adu[6] = unitId;
+    return MODBUS_TCP_MBAP_LENGTH;
+}
+
+// --- PDU Layer ---
+
+// A decoded request PDU. 'values' are the registers to write.
+struct ModbusPduRequest {
+    uint8_t function;
+    uint16_t address;      // Read address, or write address of 0x06 / 0x10
+    uint16_t count;        // Registers to read, or to write for 0x06 / 0x10
+    uint16_t writeAddress; // 0x17 only
+    uint16_t writeCount;   // 0x17 only
+    uint16_t values[MODBUS_TCP_MAX_PDU / 2];
+};
+
+// Decodes a request PDU. Returns 0, or the exception code to answer with.
+// 'maxReadRegs' / 'maxWriteRegs' are the limits of the RTU side.
+inline uint8_t modbusParseRequestPdu(const uint8_t *pdu, size_t len, uint16_t maxReadRegs, uint16_t maxWriteRegs,
+                                     ModbusPduRequest &req) {
+    if (len < 1) return MB_RESULT_ILLEGAL_FUNCTION;
+    req.function = pdu[0];
+    req.writeCount = 0;
+    switch (req.function) {
+        case MB_FC_READ_HOLDING_REGISTERS:
+            if (len != 5) return MB_RESULT_ILLEGAL_DATA_VALUE;
+            req.address = (pdu[1] << 8) | pdu[2];
+            req.count = (pdu[3] << 8) | pdu[4];
+            if (req.count == 0 || req.count > maxReadRegs) return MB_RESULT_ILLEGAL_DATA_VALUE;
+            return 0;
+        case MB_FC_WRITE_SINGLE_REGISTER:
+            if (len != 5) return MB_RESULT_ILLEGAL_DATA_VALUE;
+            req.address = (pdu[1] << 8) | pdu[2];
+            req.count = 1;
+            req.values[0] = (pdu[3] << 8) | pdu[4];
+            return 0;
+        case MB_FC_WRITE_MULTIPLE_REGISTERS:
+            if (len < 6) return MB_RESULT_ILLEGAL_DATA_VALUE;
+            req.address = (pdu[1] << 8) | pdu[2];
+            req.count = (pdu[3] << 8) | pdu[4];
+            if (req.count == 0 || req.count > maxWriteRegs || pdu[5] != req.count * 2 || len != 6u + pdu[5]) {
+                return MB_RESULT_ILLEGAL_DATA_VALUE;
+            }
+            for (uint16_t i = 0; i < req.count; i++) req.values[i] = (pdu[6 + 2 * i] << 8) | pdu[7 + 2 * i];
+            return 0;
+        case MB_FC_READ_WRITE_MULTIPLE_REGISTERS:
+            if (len < 10) return MB_RESULT_ILLEGAL_DATA_VALUE;
+            req.address = (pdu[1] << 8) | pdu[2];
+            req.count = (pdu[3] << 8) | pdu[4];
+            req.writeAddress = (pdu[5] << 8) | pdu[6];
+            req.writeCount = (pdu[7] << 8) | pdu[8];
+            if (req.count == 0 || req.count > maxReadRegs || req.writeCount == 0 || req.writeCount > maxWriteRegs
+                || pdu[9] != req.writeCount * 2 || len != 10u + pdu[9]) {
+                return MB_RESULT_ILLEGAL_DATA_VALUE;
+            }
+            for (uint16_t i = 0; i < req.writeCount; i++) req.values[i] = (pdu[10 + 2 * i] << 8) | pdu[11 + 2 * i];
+            return 0;
+    }
+    return MB_RESULT_ILLEGAL_FUNCTION;
+}
+
+// Response PDU of a successful request, 'words' holds the registers read (0x03 / 0x17).
+// Returns the PDU length.
+inline size_t modbusBuildResponsePdu(uint8_t *pdu, const ModbusPduRequest &req, const uint16_t *words) {
+    pdu[0] = req.function;
+    switch (req.function) {
+        case MB_FC_READ_HOLDING_REGISTERS:
+        case MB_FC_READ_WRITE_MULTIPLE_REGISTERS:
+            pdu[1] = req.count * 2;
+            for (uint16_t i = 0; i < req.count; i++) {
+                pdu[2 + 2 * i] = words[i] >> 8;
+                pdu[3 + 2 * i] = words[i] & 0xFF;
+            }
+            return 2 + req.count * 2;
+        case MB_FC_WRITE_SINGLE_REGISTER:
+            pdu[1] = req.address >> 8;
+            pdu[2] = req.address & 0xFF;
+            pdu[3] = req.values[0] >> 8;
+            pdu[4] = req.values[0] & 0xFF;
+            return 5;
+        default: // MB_FC_WRITE_MULTIPLE_REGISTERS
+            pdu[1] = req.address >> 8;
+            pdu[2] = req.address & 0xFF;
+            pdu[3] = req.count >> 8;
+            pdu[4] = req.count & 0xFF;
+            return 5;
+    }
+}
+
+inline size_t modbusBuildExceptionPdu(uint8_t *pdu, uint8_t function, uint8_t code) {
+    pdu[0] = function | 0x80;
+    pdu[1] = code;
+    return 2;
+}
@@ -0,0 +1,157 @@
+/*
+ * Shadow Copy of the Drive Configuration Registers
+ *
+ * Every configuration register the firmware owns is tracked with the value we
+ * want (desired), the last value known to be in the drive and a dirty flag.
+ * planShadowFlush() turns the dirty registers into as few write frames as the
+ * drive allows: the A6 manual requires 0x06 for 16-bit and 0x10 for 32-bit
+ * parameters, so only neighbouring 32-bit parameters share a frame.
+ * planShadowReadback() does the same for reading them back, where the drive
+ * accepts any register mix in one frame. It also plans the read that verifies
+ * the safety relevant registers after a write.
+ *
+ * Plain C++ without Arduino dependencies, so it also builds on a host.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+struct ShadowReg {
+    const char *name;
+    uint16_t address;
+    uint8_t words;     // 1 = 16 bit (written with 0x06), 2 = 32 bit (written with 0x10)
+    bool verify;       // Safety relevant: read back after every write
+    int32_t desired;
+    int32_t drive;     // Last value known to be in the drive
+    bool hasDesired;   // Registers without a desired value are never written
+    bool driveKnown;
+    bool dirty;        // hasDesired and the drive value differs or is unknown
+};
+
+#define SHADOW_BIT(id) (1UL << (id))
+
+inline void shadowUpdateDirty(ShadowReg &reg) {
+    reg.dirty = reg.hasDesired && (!reg.driveKnown || reg.drive != reg.desired);
+}
+
+inline void shadowSet(ShadowReg &reg, int32_t value) {
+    reg.desired = value;
+    reg.hasDesired = true;
+    shadowUpdateDirty(reg);
+}
+
+// Value of 'reg' in the registers of a frame, 32-bit low word first (C0A.06 = 0)
+inline int32_t shadowDecode(const ShadowReg &reg, const uint16_t *words) {
+    return reg.words == 2 ? (int32_t)((uint32_t)words[1] << 16 | words[0]) : (int32_t)(int16_t)words[0];
+}
+
+// The drive confirmed 'value' (write answered or value read back)
+inline void shadowConfirm(ShadowReg &reg, int32_t value) {
+    reg.drive = value;
+    reg.driveKnown = true;
+    shadowUpdateDirty(reg);
+}
+
+// The drive value is no longer known (failed write, drive restarted)
+inline void shadowInvalidate(ShadowReg &reg) {
+    reg.driveKnown = false;
+    shadowUpdateDirty(reg);
+}
+
+// Index of the register at 'address', -1 if it is not shadowed
+inline int8_t shadowFind(const ShadowReg *regs, uint8_t count, uint16_t address) {
+    for (uint8_t i = 0; i < count; i++) {
+        if (regs[i].address == address) return i;
+    }
+    return -1;
+}
+
+inline uint32_t shadowDirtyMask(const ShadowReg *regs, uint8_t count) {
+    uint32_t mask = 0;
+    for (uint8_t i = 0; i < count; i++) {
+        if (regs[i].dirty) mask |= SHADOW_BIT(i);
+    }
+    return mask;
+}
+
+// One write frame covering the registers first .. first + regCount - 1 of the table
+struct ShadowWrite {
+    uint16_t address;
+    uint8_t words;
+    uint8_t first;
+    uint8_t regCount;
+};
+
+// Plans the writes for the dirty registers in 'mask', in table order. A 32-bit
+// register joins the previous frame if that frame holds 32-bit registers, ends
+// right before it and stays within 'maxWords'. Returns the number of frames.
+inline uint8_t planShadowFlush(const ShadowReg *regs, uint8_t count, uint32_t mask,
+                               uint8_t maxWords, ShadowWrite *writes, uint8_t maxWrites) {
+    uint8_t n = 0;
+    ShadowWrite *cur = nullptr;
+    for (uint8_t i = 0; i < count; i++) {
+        const ShadowReg &reg = regs[i];
+        if (!(mask & SHADOW_BIT(i)) || !reg.dirty) {
+            cur = nullptr; // Frames only cover neighbours in the table
+            continue;
+        }
+        if (cur && reg.words == 2 && regs[cur->first].words == 2
+            && cur->address + cur->words == reg.address && cur->words + reg.words <= maxWords) {
+            cur->words += reg.words;
+            cur->regCount++;
+            continue;
+        }
+        if (n >= maxWrites) break;
+        cur = &writes[n++];
+        cur->address = reg.address;
+        cur->words = reg.words;
+        cur->first = i;
+        cur->regCount = 1;
+    }
+    return n;
+}
+
+// One read frame, 'regMask' holds the SHADOW_BIT()s of the registers it covers
+struct ShadowRead {
+    uint16_t address;
+    uint8_t words;
+    uint32_t regMask;
+};
+
+// Plans the reads for the registers in 'mask', in address order (the table is in
+// flush order). A register joins the previous frame if at most 'maxGapRegs'
+// unused registers lie in between and the frame stays within 'maxWords'.
+// Returns the number of frames.
+inline uint8_t planShadowReadback(const ShadowReg *regs, uint8_t count, uint32_t mask, uint8_t maxGapRegs,
+                                  uint8_t maxWords, ShadowRead *reads, uint8_t maxReads) {
+    uint8_t order[32];
+    uint8_t n = 0;
+    for (uint8_t i = 0; i < count && i < 32; i++) {
+        if (!(mask & SHADOW_BIT(i))) continue;
+        uint8_t k = n++;
+        while (k > 0 && regs[order[k - 1]].address > regs[i].address) {
+            order[k] = order[k - 1];
+            k--;
+        }
+        order[k] = i;
+    }
+
+    uint8_t frames = 0;
+    ShadowRead *cur = nullptr;
+    for (uint8_t k = 0; k < n; k++) {
+        const ShadowReg &reg = regs[order[k]];
+        uint16_t end = reg.address + reg.words;
+        if (cur && reg.address <= cur->address + cur->words + maxGapRegs && end - cur->address <= maxWords) {
+            if (end - cur->address > cur->words) cur->words = end - cur->address;
+            cur->regMask |= SHADOW_BIT(order[k]);
+            continue;
+        }
+        if (frames >= maxReads) break;
+        cur = &reads[frames++];
+        cur->address = reg.address;
+        cur->words = reg.words;
+        cur->regMask = SHADOW_BIT(order[k]);
+    }
+    return frames;
+}
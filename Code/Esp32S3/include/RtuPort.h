@@ -0,0 +1,50 @@
+/*
+ * Modbus RTU Serial Port
+ *
+ * The byte transport under ModbusRtuMaster. Two implementations:
+ *  - SerialRtuPort wraps an Arduino HardwareSerial. The owning task has to
+ *    poll it, waitForData() just sleeps.
+ *  - IdfRtuPort (IdfRtuPort.h) drives the ESP-IDF UART driver directly. The
+ *    UART raises an RX timeout event when the line goes quiet after a frame,
+ *    and waitForData() blocks on the driver's event queue, so a finished
+ *    response wakes the drive task right away.
+ * Received bytes are read in bulk straight into the master's frame buffer.
+ */
+
+#pragma once
+
+#include <Arduino.h>
+
+class RtuPort {
+public:
+    virtual ~RtuPort() {}
+    virtual void setBaud(uint32_t baud) = 0;
+    virtual int available() = 0;
+    virtual size_t read(uint8_t *buffer, size_t length) = 0; // Up to 'length' buffered bytes, never blocks
+    virtual void write(const uint8_t *frame, size_t length) = 0;
+    virtual void flushInput() = 0;                           // Drops stale bytes before a request
+    virtual void waitForData(uint32_t ms) = 0;               // Returns on received data or after 'ms'
+    virtual bool takeCollision() { return false; }           // The echo of a request since the last call did not match, IdfRtuPort only
+    virtual const char *name() const = 0;
+};
+
+class SerialRtuPort : public RtuPort {
+public:
+    explicit SerialRtuPort(HardwareSerial &serial, bool rs485 = false) : _serial(serial), _rs485(rs485) {}
+
+    void setBaud(uint32_t baud) override { _serial.updateBaudRate(baud); }
+    int available() override { return _serial.available(); }
+    size_t read(uint8_t *buffer, size_t length) override {
+        size_t n = 0;
+        while (n < length && _serial.available()) buffer[n++] = _serial.read();
+        return n;
+    }
+    void write(const uint8_t *frame, size_t length) override { _serial.write(frame, length); }
+    void flushInput() override { while (_serial.available()) _serial.read(); }
+    void waitForData(uint32_t ms) override { delay(ms); }
+    const char *name() const override { return _rs485 ? "HardwareSerial RS485" : "HardwareSerial"; }
+
+private:
+    HardwareSerial &_serial;
+    bool _rs485;
+};
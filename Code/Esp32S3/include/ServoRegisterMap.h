@@ -0,0 +1,216 @@
+/*
+ * A6-RS Servo Register Map and Modbus Read Planner
+ *
+ * Declarative description of the drive registers used by the firmware.
+ * The telemetry table lists every value we poll (address, width, signedness,
+ * scale, poll class, poll period per profile). planReads() turns a set of wanted fields into the
+ * smallest number of readHoldingRegisters() spans, respecting the maximum
+ * frame size and registers the drive refuses to read.
+ *
+ * Plain C++ without Arduino dependencies, so it also builds on a host.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+// --- Configuration Register Addresses (Hex) ---
+// Modbus address = parameter group in the high byte, offset in the low byte (C06.08 -> 0x0608)
+#define REG_CONTROL_MODE 0x0000        // C00.00
+#define REG_TARGET_SPEED 0x0321        // C03.21
+#define REG_TORQUE_REF_SRC 0x0340      // C03.40
+#define REG_TARGET_TORQUE 0x0341       // C03.41
+#define REG_MODBUS_SERVO_ON 0x0411     // Servo Enable/Disable (Write)
+#define REG_DI5_FUNCTION 0x0410        // C04.10
+#define REG_SOFT_LIMIT_ENABLE 0x0607   // C06.07 (1=Enable +/- Limits)
+#define REG_SOFT_LIMIT_NEG 0x0608      // C06.08 (32-bit Negative Limit) - Alias for clarity
+#define REG_C06_08 REG_SOFT_LIMIT_NEG  // Keep old name for compatibility
+#define REG_OUT_OF_CONTROL_PROT 0x0620 // C06.20 (Out of Control Protection Mode)
+#define REG_MODBUS_BAUD 0x0A01         // C0A.01 (Baud rate code, applied after re-power-on)
+
+// C0A.01 code for a baud rate, 0 if the drive does not support it
+inline uint16_t a6BaudCode(uint32_t baud) {
+    static const uint32_t rates[] = { 2400, 4800, 9600, 19200, 38400, 57600, 115200 };
+    for (uint8_t i = 0; i < sizeof(rates) / sizeof(rates[0]); i++) {
+        if (rates[i] == baud) return i + 1;
+    }
+    return 0;
+}
+
+// Largest read per frame. Kept at the old ModbusMaster buffer size, which is known to work with the A6.
+#define MODBUS_MAX_READ_REGS 64
+
+// --- Telemetry Fields ---
+enum RegFieldId : uint8_t {
+    FIELD_SERVO_STATUS,    // U41.0A
+    FIELD_DI_STATUS,       // C04.04 according to doc, but seems U40.04 in practice? Using 0x0404 for now.
+    FIELD_SPEED,           // U40.01
+    FIELD_TORQUE,          // U40.03
+    FIELD_BUS_VOLTAGE,     // U40.06
+    FIELD_LOAD_RATIO,      // U40.07
+    FIELD_RMS_CURRENT,     // U40.0C
+    FIELD_FOLLOWING_ERROR, // U40.10
+    FIELD_POSITION,        // U40.16
+    FIELD_TEMP_IGBT,       // U40.30
+    FIELD_TEMP_MOTOR,      // U40.31
+    FIELD_COUNT
+};
+
+enum RegPollClass : uint8_t {
+    POLL_FAST, // Motion feedback, read at feedback priority
+    POLL_SLOW  // Housekeeping, read at housekeeping priority
+};
+
+// Poll rate set, chosen by the drive task from the servo and homing state
+enum PollProfile : uint8_t {
+    POLL_PROFILE_IDLE,    // Servo disabled
+    POLL_PROFILE_RUNNING, // Servo running in torque mode
+    POLL_PROFILE_HOMING,  // Stall detection needs torque and position at full rate
+    POLL_PROFILE_COUNT
+};
+
+struct RegField {
+    const char *name;
+    uint16_t address;
+    uint8_t words;     // 1 = 16 bit, 2 = 32 bit (low word first, C0A.06 = 0)
+    bool isSigned;
+    float scale;       // Raw value * scale = engineering unit
+    RegPollClass pollClass;
+    uint16_t periodMs[POLL_PROFILE_COUNT]; // Poll period per PollProfile
+};
+
+// Indexed by RegFieldId. Periods are multiples of the telemetry tick (POLL_TICK_MS).
+static const RegField regFields[FIELD_COUNT] = {
+    //                                                         idle  run  homing
+    { "servoStatus", 0x410A, 1, false, 1.0f,  POLL_FAST, {  100,  20,   20 } }, // 0=NR,1=RD,2=RUN,3=FLT
+    { "diStatus",    0x0404, 1, false, 1.0f,  POLL_SLOW, {  500, 500,  500 } },
+    { "spd",         0x4001, 1, true,  1.0f,  POLL_FAST, {  200,  20,   20 } }, // rpm
+    { "trq",         0x4003, 1, true,  0.1f,  POLL_FAST, {  200,  20,   20 } }, // %
+    { "vbus",        0x4006, 1, false, 0.1f,  POLL_SLOW, { 1000, 1000, 1000 } }, // V
+    { "load",        0x4007, 1, false, 0.1f,  POLL_SLOW, { 1000, 500,  500 } }, // %
+    { "cur",         0x400C, 1, true,  0.1f,  POLL_SLOW, { 1000, 200,  200 } }, // A
+    { "posErr",      0x4010, 2, true,  1.0f,  POLL_FAST, {  500,  50,   20 } }, // encoder pulses
+    { "pos",         0x4016, 2, true,  1.0f,  POLL_FAST, {  200,  20,   20 } }, // reference units
+    { "igbtTemp",    0x4030, 1, true,  0.1f,  POLL_SLOW, { 2000, 2000, 2000 } }, // degC
+    { "motorTemp",   0x4031, 1, true,  0.1f,  POLL_SLOW, { 2000, 2000, 2000 } }, // degC
+};
+
+#define FIELD_BIT(id) (1UL << (id))
+
+// Bit mask of all fields in a poll class
+inline uint32_t regFieldMask(RegPollClass pollClass) {
+    uint32_t mask = 0;
+    for (uint8_t i = 0; i < FIELD_COUNT; i++) {
+        if (regFields[i].pollClass == pollClass) mask |= FIELD_BIT(i);
+    }
+    return mask;
+}
+
+// Decodes a field from the register words starting at the field's address
+inline int32_t regFieldDecode(const RegField &field, const uint16_t *words) {
+    if (field.words == 2) {
+        return (int32_t)((uint32_t)words[1] << 16 | words[0]);
+    }
+    return field.isSigned ? (int32_t)(int16_t)words[0] : (int32_t)words[0];
+}
+
+// --- Read Planner ---
+
+// Inclusive register range the drive refuses to read (exception 0x02 / 0x20)
+struct RegRange {
+    uint16_t first;
+    uint16_t last;
+};
+
+struct ReadSpan {
+    uint16_t start;
+    uint16_t count;
+    uint32_t fieldMask; // Fields decoded from this span
+};
+
+struct ReadPlan {
+    ReadSpan spans[FIELD_COUNT];
+    uint8_t spanCount;
+    uint16_t totalRegs; // Registers transferred per cycle
+};
+
+struct ReadPlannerConfig {
+    uint16_t maxRegsPerFrame; // Upper bound for a single readHoldingRegisters()
+    uint16_t maxGapRegs;      // Unused registers worth reading to save a round trip
+    const RegRange *forbidden;
+    uint8_t forbiddenCount;
+    uint32_t isolatedMask;    // Fields that must be read in a span of their own
+};
+
+// Default gap: a separate transaction costs ~8 request + 5 response bytes, two 3.5
+// character silent intervals and the drive response time (C0A.03, 1 ms), i.e. roughly
+// the time of 12 extra registers at 57600 baud.
+#define READ_PLANNER_DEFAULT_GAP_REGS 12
+
+inline bool regRangeIsForbidden(const ReadPlannerConfig &cfg, uint16_t first, uint16_t last) {
+    for (uint8_t i = 0; i < cfg.forbiddenCount; i++) {
+        if (cfg.forbidden[i].first <= last && cfg.forbidden[i].last >= first) return true;
+    }
+    return false;
+}
+
+// Builds the read plan for all fields in 'wantedMask'. Fields are visited in
+// address order and greedily merged into the current span while the span stays
+// within the frame limit, the gap stays small and no refused register is covered.
+// Greedy merging in address order yields the minimum number of spans for these
+// constraints. Returns false if a wanted field can not be read at all.
+inline bool planReads(const RegField *fields, uint8_t fieldCount, uint32_t wantedMask,
+                      const ReadPlannerConfig &cfg, ReadPlan &plan) {
+    plan.spanCount = 0;
+    plan.totalRegs = 0;
+
+    // Sort wanted field indices by address (insertion sort, the table is tiny)
+    uint8_t order[32];
+    uint8_t n = 0;
+    for (uint8_t i = 0; i < fieldCount && i < 32; i++) {
+        if (!(wantedMask & FIELD_BIT(i))) continue;
+        uint8_t j = n++;
+        while (j > 0 && fields[order[j - 1]].address > fields[i].address) {
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = i;
+    }
+
+    bool ok = true;
+    ReadSpan *cur = nullptr;
+    bool curIsolated = false;
+    for (uint8_t k = 0; k < n; k++) {
+        const RegField &f = fields[order[k]];
+        uint16_t fLast = f.address + f.words - 1;
+        bool isolated = (cfg.isolatedMask & FIELD_BIT(order[k])) != 0;
+
+        if (f.words > cfg.maxRegsPerFrame || regRangeIsForbidden(cfg, f.address, fLast)) {
+            ok = false; // Field itself can not be read
+            continue;
+        }
+
+        if (cur && !isolated && !curIsolated) {
+            uint16_t curLast = cur->start + cur->count - 1;
+            uint16_t gapFirst = curLast + 1;
+            bool gapOk = f.address <= gapFirst
+                || (f.address - gapFirst <= cfg.maxGapRegs && !regRangeIsForbidden(cfg, gapFirst, f.address - 1));
+            uint16_t newLast = fLast > curLast ? fLast : curLast;
+            if (gapOk && (uint32_t)(newLast - cur->start + 1) <= cfg.maxRegsPerFrame) {
+                cur->count = newLast - cur->start + 1;
+                cur->fieldMask |= FIELD_BIT(order[k]);
+                continue;
+            }
+        }
+
+        // Start a new span
+        cur = &plan.spans[plan.spanCount++];
+        cur->start = f.address;
+        cur->count = f.words;
+        cur->fieldMask = FIELD_BIT(order[k]);
+        curIsolated = isolated;
+    }
+
+    for (uint8_t i = 0; i < plan.spanCount; i++) plan.totalRegs += plan.spans[i].count;
+    return ok;
+}
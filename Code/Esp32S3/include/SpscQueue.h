@@ -0,0 +1,60 @@
+/*
+ * Lock-free Single-Producer / Single-Consumer Queue
+ *
+ * Fixed-size ring buffer for passing items between exactly two tasks
+ * (one pushes, one pops) without locks. One slot is kept free to tell
+ * full from empty, so a queue of size N holds N - 1 items.
+ * Counts its high-water mark and the pushes rejected because it was full.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+
+template <typename T, uint16_t N>
+class SpscQueue {
+public:
+    static const uint16_t capacity = N - 1;
+
+    // Producer side. Returns false (and counts an overflow) if the queue is full.
+    bool push(const T &item) {
+        uint16_t head = _head.load(std::memory_order_relaxed);
+        uint16_t next = (head + 1) % N;
+        if (next == _tail.load(std::memory_order_acquire)) {
+            _overflows.store(_overflows.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            return false;
+        }
+        _items[head] = item;
+        _head.store(next, std::memory_order_release);
+
+        uint16_t d = depth();
+        if (d > _highWater.load(std::memory_order_relaxed)) _highWater.store(d, std::memory_order_relaxed);
+        return true;
+    }
+
+    // Consumer side. Returns false if the queue is empty.
+    bool pop(T &item) {
+        uint16_t tail = _tail.load(std::memory_order_relaxed);
+        if (tail == _head.load(std::memory_order_acquire)) return false;
+        item = _items[tail];
+        _tail.store((tail + 1) % N, std::memory_order_release);
+        return true;
+    }
+
+    // Statistics, safe to read from any task
+    uint16_t depth() const {
+        uint16_t head = _head.load(std::memory_order_acquire);
+        uint16_t tail = _tail.load(std::memory_order_acquire);
+        return (head + N - tail) % N;
+    }
+    uint16_t highWater() const { return _highWater.load(std::memory_order_relaxed); }
+    uint32_t overflows() const { return _overflows.load(std::memory_order_relaxed); }
+
+private:
+    T _items[N];
+    std::atomic<uint16_t> _head{0}; // Written by the producer only
+    std::atomic<uint16_t> _tail{0}; // Written by the consumer only
+    std::atomic<uint16_t> _highWater{0};
+    std::atomic<uint32_t> _overflows{0};
+};
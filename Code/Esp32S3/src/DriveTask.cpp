@@ -0,0 +1,2221 @@
+/*
+ * Servo Drive Task - see DriveTask.h
+ *
+ * Everything in this file runs in the drive task (or in setupApp() before the
+ * task is started). All drive I/O goes through the non-blocking ModbusRtuMaster
+ * queue, results arrive in the completion callbacks below. The callbacks find
+ * the drive a transaction belongs to by its slave id.
+ */
+
+#include "DriveTask.h"
+#include "ModbusRtuMaster.h"
+#include "RegisterShadow.h"
+#include "ModbusTcp.h"
+#if MODBUS_CAPTURE
+#include "CaptureRtuPort.h"
+#endif
+#if MODBUS_UART_IDF
+#include "IdfRtuPort.h"
+#else
+#include <driver/uart.h> // UART_MODE_RS485_HALF_DUPLEX
+#endif
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+SpscQueue<DriveCommand, 32> driveCommands;
+SpscQueue<DriveSample, 16> driveSamples;
+SpscQueue<DriveEvent, 16> driveEvents;
+SpscQueue<DriveLogMessage, 24> driveLogs;
+SpscQueue<DriveGatewayFrame, 8> gatewayRequests;
+SpscQueue<DriveGatewayFrame, 8> gatewayResponses;
+#if MODBUS_CAPTURE
+ModbusCapture<MODBUS_CAPTURE_BYTES> modbusCapture;
+#endif
+
+// --- Bus State (owned by the drive task) ---
+static ModbusRtuMaster modbus;
+static const int MAX_MODBUS_ERRORS = 5;    // Number of errors before connection is considered bad
+
+// Timing control
+static const long modbusReadInterval = 50; // Sample interval while the link is down
+static const long modbusCheckInterval = 2000;
+
+// Cost of the bus handling, measured over BUS_STATS_WINDOW_MS
+#define BUS_STATS_WINDOW_MS 1000
+static uint32_t serviceBusyUs = 0;     // Time spent in driveService() in the current window
+static uint32_t serviceWakeups = 0;
+static uint32_t statsTransactions = 0; // modbus.transactions at the start of the window
+static unsigned long statsWindowStart = 0;
+static uint16_t cpuUsPerTxn = 0;
+static uint16_t wakeupsPerSec = 0;
+
+// Telemetry rate governor
+// The poll periods of the register table are scaled at runtime, so the bus
+// runs just under busTargetPct whatever the baud rate, wiring and drive
+// firmware allow. Every RATE_WINDOW_MS the bus time of the telemetry (cycle
+// reads and the 0x17 feedback reads) is compared to what the target leaves
+// after everything else (setpoint writes, commands, gateway). The telemetry
+// load goes with 1 / scale, so the next scale follows from their ratio. The
+// periods shrink by at most a quarter per window, but grow at once. A window
+// with more than POLL_ERROR_PCT failed transactions doubles the periods and
+// holds them for POLL_ERROR_HOLD windows. Homing keeps the table periods.
+#define BUS_TARGET_PCT 80      // Default utilisation target, DRIVE_CMD_BUS_TARGET changes it
+#define POLL_SCALE_ONE 64      // pollScale of the table periods
+#define POLL_SCALE_MIN 32      // Half the table periods: the fastest fields (20 ms) reach POLL_TICK_MS
+#define POLL_SCALE_MAX 1024    // 16 times the table periods
+#define POLL_ERROR_PCT 5
+#define POLL_ERROR_HOLD 5
+
+static uint8_t busTargetPct = BUS_TARGET_PCT;
+static uint16_t pollScale = POLL_SCALE_ONE;
+static uint8_t pollHoldWindows = 0;
+static uint32_t telemetryBusUs = 0;   // Bus time of the telemetry in the current window
+static uint32_t windowBusUs = 0;      // modbus.busUs at the start of the window
+static uint32_t windowTransactions = 0;
+static uint32_t windowFailures = 0;   // Bus errors, exceptions from the drive not counted
+static uint8_t busLoadPct = 0;        // Bus utilisation in the last window
+
+// Configuration shadow: every configuration register we own. Writes to them only
+// go out if the drive does not already hold the value. Table order is the flush
+// order: the limit is written before the limits are enabled. Each drive has a copy.
+// The C06 protection registers are verified by reading them back after a write.
+static const ShadowReg shadowTemplate[] = {
+    { "controlMode",      REG_CONTROL_MODE,        1, false, 0, 0, false, false, false },
+    { "targetSpeed",      REG_TARGET_SPEED,        1, false, 0, 0, false, false, false },
+    { "torqueRefSrc",     REG_TORQUE_REF_SRC,      1, false, 0, 0, false, false, false },
+    { "di5Function",      REG_DI5_FUNCTION,        1, false, 0, 0, false, false, false },
+    { "softLimitNeg",     REG_SOFT_LIMIT_NEG,      2, true,  0, 0, false, false, false },
+    { "softLimitEnable",  REG_SOFT_LIMIT_ENABLE,   1, true,  0, 0, false, false, false },
+    { "outOfControlProt", REG_OUT_OF_CONTROL_PROT, 1, true,  0, 0, false, false, false },
+};
+#define SHADOW_COUNT (sizeof(shadowTemplate) / sizeof(shadowTemplate[0]))
+#define SHADOW_READBACK_GAP_REGS 32 // Unused registers a readback frame may span, until the drive rejects one
+#define SHADOW_VERIFY_RETRIES 2     // Rewrites of a register that read back different
+#define SHADOW_VERIFY_ATTEMPT_SHIFT 24 // Verify reads: attempt in the tag bits above the register mask
+#define MB_EXCEPTION_READ_DISABLED 0x20 // A6 specific "reading disabled" error code
+
+#define MAX_UNREADABLE_RANGES 8
+
+// A register macro in progress on one drive, see serviceMacro()
+struct MacroRun {
+    const MacroStep *steps = nullptr;     // nullptr = none running
+    uint8_t count = 0;
+    uint8_t step = 0;                     // First step of the one in progress
+    uint8_t next = 0;                     // Step after it
+    DriveMacroId id = MACRO_DRIVE_CONFIG;
+    int32_t arg = 0;
+    ModbusBatch io = { 0, false };        // Frames of the step in progress
+    ModbusBatch *batch = nullptr;         // Caller's batch, counts the macro as one request
+    bool burst = false;                   // Writes in flight, their duration is measured
+    bool waiting = false;                 // Delay or status wait in progress
+    unsigned long waitStart = 0;
+    uint32_t stepStartUs = 0;
+    uint32_t startUs = 0;
+    uint32_t longestBurstUs = 0;          // First frame queued to last answer, longest burst
+    uint8_t frames = 0;
+    uint8_t bursts = 0;
+    uint8_t inPlace = 0;                  // Shadowed registers the drive already held
+};
+
+// --- Drive State (owned by the drive task) ---
+// One entry per drive on the bus
+struct Drive {
+    uint8_t index = 0;
+    uint8_t slaveId = 1;
+    uint8_t weight = 1;                   // Telemetry weight while the bus is saturated
+    bool modbusOk = false;
+    int modbusConsecutiveErrors = 0;      // Counter for Modbus errors
+    int32_t fieldValues[FIELD_COUNT] = {}; // Latest telemetry, indexed by RegFieldId
+    uint32_t fieldTimeUs[FIELD_COUNT] = {}; // Arrival of the response each value came from
+    uint32_t freshFields = 0;             // Fields read since the last published sample
+    uint32_t sampleTimeUs = 0;            // Acquisition time of the last published sample
+    uint32_t acquisitionUs = 0;           // Its spread of arrival times
+    bool servoRunning = false;            // Servo status 2 in the last good cycle
+    int16_t torqueSetpoint = -1;          // Streamed while the servo runs, < 0 = paused
+    PollProfile pollProfile = POLL_PROFILE_IDLE; // Telemetry poll rates in use
+    bool pollHomingRequested = false;     // DRIVE_CMD_POLL_PROFILE from appLoop()
+    uint8_t fieldRateHz[FIELD_COUNT] = {}; // Good reads per field in the last rate window
+    uint16_t fieldReadCount[FIELD_COUNT] = {}; // Good reads in the current rate window
+    uint16_t telemetryFrames = 0;         // Good telemetry frames in the current rate window
+    uint16_t telemetryHz = 0;
+    uint8_t telemetryShare = 0;           // % of all telemetry frames in the last rate window
+    int16_t credit = 0;                   // Telemetry scheduler, see scheduleTelemetry()
+
+    // Setpoint latency: a new setpoint received while running, until the write carrying it is on the wire
+    bool setpointChangePending = false;   // Changed, but no write with the new value queued yet
+    uint32_t setpointChangeUs = 0;
+    bool torqueWriteCarriesChange = false;
+    uint32_t torqueWriteChangeUs = 0;
+    uint32_t setpointLatencyUs = 0;
+    uint32_t setpointLatencyMaxUs = 0;
+
+    // Setpoint stream
+    bool torqueWritePending = false;      // Torque setpoint write queued but not yet answered
+    int16_t torqueWritten = -1;           // Value of the last queued setpoint write
+    unsigned long lastTorqueWriteTime = 0;
+
+    // Connection check
+    unsigned long lastModbusCheckTime = 0;
+    unsigned long lastSampleTime = 0;
+    bool connectionCheckPending = false;
+    bool reconnectApplyPending = false;   // Set when a connection check recovered the link
+    bool runningAtLinkLoss = false;       // Servo status 'Running' when the link went down
+
+    // Reconnect readback: the owned configuration is compared before anything is written
+    uint8_t readbackPending = 0;          // Readback frames in flight
+    uint8_t readbackLost = 0;             // Registers that no longer hold the value they had confirmed
+    bool readbackFailed = false;          // A readback frame got no answer, drive values unknown
+    bool servoDropped = false;            // Was running at the link loss, no longer is
+    bool readbackSeparate = false;        // Drive rejected a readback spanning unused registers
+    uint32_t verifyMismatches = 0;        // Verified registers that read back different from the write
+
+    MacroRun macro;
+
+    ShadowReg shadowRegs[SHADOW_COUNT];
+
+    // Telemetry
+    RegRange unreadableRegs[MAX_UNREADABLE_RANGES]; // Learned from rejected block reads
+    uint8_t unreadableRegCount = 0;
+    uint32_t isolatedFields = 0;          // Fields the drive only returns in a frame of their own
+    uint32_t unavailableFields = 0;       // Fields the drive refuses entirely
+    ReadPlannerConfig plannerConfig;
+    ReadSpan combinedSpan = { 0, 0, 0 };  // Feedback read along with the setpoint (0x17), count 0 = none
+    bool combinedSupported = false;       // Drive answered the 0x17 probe
+    unsigned long fieldLastPollMs[FIELD_COUNT] = {};
+    unsigned long lastCycleTime = 0;      // Start of the last telemetry cycle
+    uint8_t cycleTransactions = 0;
+    uint8_t telemetryPending = 0;         // Spans of the current cycle still in flight
+    bool telemetryCycleOk = true;
+    int32_t telemetryCycleStartStatus = 0;
+    uint32_t cycleStartUs = 0;
+    uint32_t cycleUs = 0;                 // Duration of the last telemetry cycle
+};
+
+static Drive drives[DRIVE_MAX_COUNT];
+static uint8_t driveCount = 0;
+
+// Selects the drive's slave for the requests queued next
+static ModbusRtuMaster &bus(const Drive &d) {
+    modbus.selectSlave(d.slaveId);
+    return modbus;
+}
+
+// The drive a transaction was queued for
+static Drive &driveOf(const ModbusTransaction &txn) {
+    for (uint8_t i = 0; i < driveCount; i++) {
+        if (drives[i].slaveId == txn.slaveId) return drives[i];
+    }
+    return drives[0]; // Requests are only queued for configured drives
+}
+
+// Commands of a batch in flight, reported with DRIVE_EVT_BATCH_DONE
+struct DriveBatch {
+    ModbusBatch io;
+    bool reportPending; // DRIVE_CMD_BATCH_END seen
+};
+static DriveBatch batches[DRIVE_MAX_BATCHES];
+
+// Log lines go to appLoop(), which forwards them to Serial and the browser
+static void driveLog(const char *format, ...) {
+    DriveLogMessage msg;
+    va_list args;
+    va_start(args, format);
+    vsnprintf(msg.text, sizeof(msg.text), format, args);
+    va_end(args);
+    driveLogs.push(msg); // Dropped (and counted) if appLoop() falls behind
+}
+
+// Log line about one drive, prefixed with its number once there is more than one
+static void driveLog(const Drive &d, const char *format, ...) {
+    DriveLogMessage msg;
+    int prefix = (driveCount > 1) ? snprintf(msg.text, sizeof(msg.text), "Drive %d: ", d.index + 1) : 0;
+    va_list args;
+    va_start(args, format);
+    vsnprintf(msg.text + prefix, sizeof(msg.text) - prefix, format, args);
+    va_end(args);
+    driveLogs.push(msg);
+}
+
+// Annotates the traffic capture, e.g. with a link loss
+static void captureMark(const Drive &d, const char *text, bool trigger = false) {
+#if MODBUS_CAPTURE
+    if (!modbusCapture.recording()) return;
+    char mark[48];
+    snprintf(mark, sizeof(mark), "Drive %d (slave %d): %s", d.index + 1, d.slaveId, text);
+    uint32_t now = micros();
+    modbusCapture.mark(now, mark);
+    if (trigger) modbusCapture.trigger(now);
+#endif
+}
+
+static void pushEvent(DriveEventType type, uint8_t drive, uint8_t batch, bool ok) {
+    DriveEvent evt = { type, drive, batch, ok };
+    driveEvents.push(evt);
+}
+
+// Acquisition time of the fields read since the last sample. The position
+// times the sample, the motion feedback shares its frame wherever the drive allows.
+static void stampSample(Drive &d) {
+    uint32_t first = 0, last = 0;
+    bool any = false;
+    for (uint8_t id = 0; id < FIELD_COUNT; id++) {
+        if (!(d.freshFields & FIELD_BIT(id))) continue;
+        uint32_t t = d.fieldTimeUs[id];
+        if (!any || (int32_t)(t - first) < 0) first = t;
+        if (!any || (int32_t)(t - last) > 0) last = t;
+        any = true;
+    }
+    d.sampleTimeUs = (d.freshFields & FIELD_BIT(FIELD_POSITION)) ? d.fieldTimeUs[FIELD_POSITION] : last;
+    d.acquisitionUs = last - first;
+}
+
+// Hands the current telemetry and link state of a drive to appLoop()
+static void publishSample(Drive &d, uint8_t transactions) {
+    DriveSample sample;
+    sample.drive = d.index;
+    sample.timeMs = millis();
+    d.lastSampleTime = sample.timeMs;
+    if (d.freshFields) stampSample(d); // Otherwise nothing new, the values keep their time
+    sample.timeUs = d.sampleTimeUs;
+    sample.acquisitionUs = d.acquisitionUs;
+    sample.freshFields = d.freshFields;
+    d.freshFields = 0;
+    sample.modbusOk = d.modbusOk;
+    sample.transactions = transactions;
+    sample.cycleUs = d.cycleUs;
+    sample.turnaroundUs = min(modbus.turnaroundAvgUs, (uint32_t)UINT16_MAX);
+    sample.turnaroundMinUs = min(modbus.turnaroundMinUs, (uint32_t)UINT16_MAX);
+    sample.turnaroundMaxUs = min(modbus.turnaroundMaxUs, (uint32_t)UINT16_MAX);
+    sample.collisions = modbus.collisions;
+    sample.gapUs = min(modbus.gapUs(), (uint32_t)UINT16_MAX);
+    sample.configDirty = shadowDirtyMask(d.shadowRegs, SHADOW_COUNT);
+    sample.configMismatches = d.verifyMismatches;
+    sample.cpuUsPerTxn = cpuUsPerTxn;
+    sample.exchangeAvgUs = min(modbus.exchangeAvgUs, (uint32_t)UINT16_MAX);
+    sample.exchangeMaxUs = min(modbus.exchangeMaxUs, (uint32_t)UINT16_MAX);
+    sample.wakeupsPerSec = wakeupsPerSec;
+    sample.pollProfile = d.pollProfile;
+    memcpy(sample.fieldRateHz, d.fieldRateHz, sizeof(sample.fieldRateHz));
+    sample.telemetryHz = d.telemetryHz;
+    sample.telemetryShare = d.telemetryShare;
+    sample.setpointLatencyUs = d.setpointLatencyUs;
+    sample.setpointLatencyMaxUs = d.setpointLatencyMaxUs;
+    sample.busLoadPct = busLoadPct;
+    sample.pollScalePct = pollScale * 100 / POLL_SCALE_ONE;
+    sample.deadlineMisses = 0;
+    for (uint8_t p = 0; p < MB_PRIO_COUNT; p++) sample.deadlineMisses += modbus.classStats[p].deadlineMisses;
+    memcpy(sample.fields, d.fieldValues, sizeof(sample.fields));
+    driveSamples.push(sample);
+}
+
+// Marks the connection to a drive as lost
+static void setLinkDown(Drive &d) {
+    if (d.modbusOk) {
+        captureMark(d, "link down", true);
+        d.runningAtLinkLoss = d.servoRunning;
+    }
+    d.modbusOk = false;
+    d.modbusConsecutiveErrors = MAX_MODBUS_ERRORS;
+    d.fieldValues[FIELD_SERVO_STATUS] = 0;
+    d.servoRunning = false;
+}
+
+// --- Register Writes ---
+
+// Completion of queueWrite()/queueWrite32()
+static void onWriteDone(const ModbusTransaction &txn, uint8_t result, const uint16_t *words) {
+    ModbusBatch *batch = (ModbusBatch *)txn.context;
+    if (batch) {
+        if (batch->pending > 0) batch->pending--;
+        if (result != modbus.ku8MBSuccess) batch->failed = true;
+    }
+    if (result == modbus.ku8MBAborted) return;
+    Drive &d = driveOf(txn);
+    if (result != modbus.ku8MBSuccess) {
+        if (txn.function == MB_FC_WRITE_MULTIPLE_REGISTERS) {
+            int32_t value = (int32_t)((uint32_t)txn.values[1] << 16 | txn.values[0]);
+            driveLog(d, "MB Write32 FAIL: Reg=0x%04X, Val=%ld, Code=0x%X", txn.address, (long)value, result);
+        } else {
+            uint16_t reg = (txn.function == MB_FC_READ_WRITE_MULTIPLE_REGISTERS) ? txn.writeAddress : txn.address;
+            driveLog(d, "MB Write FAIL: Reg=0x%04X, Val=%d, Code=0x%X", reg, (int16_t)txn.values[0], result);
+        }
+        if (d.modbusOk) {
+            setLinkDown(d);
+            modbus.abortSlave(d.slaveId); // Do not continue a sequence after one of its writes failed
+            publishSample(d, 0);
+        }
+        return;
+    }
+    d.modbusConsecutiveErrors = 0;
+}
+
+// Writes are dropped while the link is down, except during startup
+static bool writesAllowed(const Drive &d) {
+    return d.modbusOk || millis() <= 5000;
+}
+
+// Queues a write of a 16-bit register. Optionally counts it in 'batch'.
+static bool queueWrite(Drive &d, uint16_t reg, int16_t value, ModbusBatch *batch = nullptr,
+                       ModbusCallback callback = onWriteDone, ModbusPriority priority = MB_PRIO_SAFETY) {
+    if (!writesAllowed(d)) {
+        if (batch) batch->failed = true;
+        return false;
+    }
+    if (!bus(d).writeSingleRegister(reg, value, callback, batch, 0, priority)) {
+        driveLog(d, "MB queue full, dropped write: Reg=0x%04X, Val=%d", reg, value);
+        if (batch) batch->failed = true;
+        return false;
+    }
+    if (batch) batch->pending++;
+    return true;
+}
+
+// Queues a write of a 32-bit value (int32_t) into two consecutive 16-bit Modbus registers.
+static bool queueWrite32(Drive &d, uint16_t reg, int32_t value, ModbusBatch *batch = nullptr) {
+    if (!writesAllowed(d)) {
+        if (batch) batch->failed = true;
+        return false;
+    }
+
+    uint16_t words[2];
+    words[0] = (uint16_t)(value & 0xFFFF); // Low word first (C0A.06 = 0)
+    words[1] = (uint16_t)(value >> 16);
+
+    if (!bus(d).writeMultipleRegisters(reg, words, 2, onWriteDone, batch)) { // Writes 2 registers starting from address 'reg'
+        driveLog(d, "MB queue full, dropped write: Reg=0x%04X, Val=%ld", reg, (long)value);
+        if (batch) batch->failed = true;
+        return false;
+    }
+    if (batch) batch->pending++;
+    return true;
+}
+
+// Runs the Modbus queue until it is empty. Only for the setup path.
+static void modbusFlush() {
+    while (!modbus.idle()) {
+        modbus.poll();
+        yield();
+    }
+}
+
+static void onEnableDone(const ModbusTransaction &txn, uint8_t result, const uint16_t *words) {
+    onWriteDone(txn, result, words);
+    if (result == modbus.ku8MBSuccess) driveLog(driveOf(txn), "-> Modbus enable command sent successfully.");
+    else if (result != modbus.ku8MBAborted) driveLog(driveOf(txn), "-> Modbus enable command FAILED.");
+}
+
+// Enables servo via Modbus
+static bool queueEnable(Drive &d, ModbusBatch *batch) {
+    driveLog(d, "Attempting to enable Servo via Modbus (0x0411 = 1)...");
+    return queueWrite(d, REG_MODBUS_SERVO_ON, 1, batch, onEnableDone);
+}
+
+static void onDisableDone(const ModbusTransaction &txn, uint8_t result, const uint16_t *words) {
+    Drive &d = driveOf(txn);
+    bool wasOk = d.modbusOk;
+    onWriteDone(txn, result, words);
+    if (result == modbus.ku8MBSuccess) driveLog(d, "-> Modbus disable command sent successfully.");
+    else if (result != modbus.ku8MBAborted && wasOk) driveLog(d, "-> Modbus disable command FAILED.");
+    if (result != modbus.ku8MBSuccess) d.servoRunning = false;
+    pushEvent(DRIVE_EVT_DISABLE_DONE, d.index, 0, result == modbus.ku8MBSuccess);
+}
+
+static void onDisableTorqueDone(const ModbusTransaction &txn, uint8_t result, const uint16_t *words) {
+    Drive &d = driveOf(txn);
+    bool wasOk = d.modbusOk;
+    onWriteDone(txn, result, words);
+    if (result == modbus.ku8MBSuccess) driveLog(d, "-> Set target torque to 0 after disable.");
+    else if (result != modbus.ku8MBAborted && wasOk) driveLog(d, "MB: Failed to explicitly set torque to 0 after disable.");
+}
+
+// Disables servo via Modbus
+static bool queueDisable(Drive &d, ModbusBatch *batch) {
+    driveLog(d, "Attempting to disable Servo via Modbus (0x0411 = 0)...");
+    bool success = queueWrite(d, REG_MODBUS_SERVO_ON, 0, batch, onDisableDone);
+
+    // Always set target torque to 0 on disable, regardless of slider position.
+    // Even if the write fails, the setpoint is 0, preventing accidental torque on re-enable.
+    queueWrite(d, REG_TARGET_TORQUE, 0, batch, onDisableTorqueDone);
+    d.torqueSetpoint = 0;
+
+    if (!success) {
+        d.servoRunning = false;
+        pushEvent(DRIVE_EVT_DISABLE_DONE, d.index, 0, false);
+    }
+    return success;
+}
+
+// --- Configuration Shadow ---
+
+static void setShadowValue(Drive &d, uint16_t reg, int32_t value) {
+    int8_t id = shadowFind(d.shadowRegs, SHADOW_COUNT, reg);
+    if (id >= 0) shadowSet(d.shadowRegs[id], value);
+}
+
+// Completion of a shadow write, 'tag' holds the index of the first register in the frame
+static void onShadowWriteDone(const ModbusTransaction &txn, uint8_t result, const uint16_t *words) {
+    Drive &d = driveOf(txn);
+    uint8_t w = 0;
+    for (uint8_t i = txn.tag; i < SHADOW_COUNT && w < txn.count; i++) {
+        ShadowReg &reg = d.shadowRegs[i];
+        if (result == modbus.ku8MBSuccess) {
+            shadowConfirm(reg, shadowDecode(reg, &txn.values[w]));
+        } else if (result != modbus.ku8MBAborted) {
+            shadowInvalidate(reg); // Aborted writes never reached the drive
+        }
+        w += reg.words;
+    }
+    onWriteDone(txn, result, words);
+}
+
+static uint8_t flushShadow(Drive &d, uint32_t mask, ModbusBatch *batch, uint8_t attempt = 0);
+static void queueShadowVerify(Drive &d, uint32_t mask, ModbusBatch *batch, uint8_t attempt);
+
+// Completion of a verify read, 'tag' holds the shadow registers it covers and the attempt.
+// Registers that read back different are written again, and verified again.
+static void onShadowVerifyDone(const ModbusTransaction &txn, uint8_t result, const uint16_t *words) {
+    ModbusBatch *batch = (ModbusBatch *)txn.context;
+    Drive &d = driveOf(txn);
+    uint32_t regMask = txn.tag & (SHADOW_BIT(SHADOW_VERIFY_ATTEMPT_SHIFT) - 1);
+    uint8_t attempt = txn.tag >> SHADOW_VERIFY_ATTEMPT_SHIFT;
+    bool failed = false;
+    uint32_t mismatch = 0;
+    if (result == modbus.ku8MBSuccess) {
+        for (uint8_t i = 0; i < SHADOW_COUNT; i++) {
+            if (!(regMask & SHADOW_BIT(i))) continue;
+            ShadowReg &reg = d.shadowRegs[i];
+            int32_t value = shadowDecode(reg, &words[reg.address - txn.address]);
+            shadowConfirm(reg, value);
+            if (!reg.dirty) continue;
+            driveLog(d, "Config verify: %s reads %ld, written %ld.", reg.name, (long)value, (long)reg.desired);
+            mismatch |= SHADOW_BIT(i);
+            d.verifyMismatches++;
+        }
+    } else if ((result == modbus.ku8MBIllegalDataAddress || result == MB_EXCEPTION_READ_DISABLED) && !d.readbackSeparate) {
+        driveLog(d, "Config verify of 0x%04X (+%d) rejected, reading registers separately.", txn.address, txn.count);
+        d.readbackSeparate = true;
+        queueShadowVerify(d, regMask, batch, attempt);
+    } else if (result != modbus.ku8MBAborted) {
+        driveLog(d, "Config verify of 0x%04X (+%d) FAILED, Code=0x%X.", txn.address, txn.count, result);
+        for (uint8_t i = 0; i < SHADOW_COUNT; i++) {
+            if (regMask & SHADOW_BIT(i)) shadowInvalidate(d.shadowRegs[i]); // Written again with the next flush
+        }
+        failed = true;
+    }
+    if (mismatch && attempt < SHADOW_VERIFY_RETRIES) {
+        flushShadow(d, mismatch, batch, attempt + 1); // Only the registers that differ
+    } else if (mismatch) {
+        driveLog(d, "Config verify FAILED: %d registers still differ after %d writes.", __builtin_popcount(mismatch),
+                 attempt + 1);
+        failed = true;
+    }
+    if (batch) {
+        if (batch->pending > 0) batch->pending--;
+        if (failed || result == modbus.ku8MBAborted) batch->failed = true;
+    }
+}
+
+// Queues the reads verifying the registers in 'mask': one frame for all of them, unless
+// the drive rejected a frame spanning unused registers before
+static void queueShadowVerify(Drive &d, uint32_t mask, ModbusBatch *batch, uint8_t attempt) {
+    ShadowRead reads[SHADOW_COUNT];
+    uint8_t n = planShadowReadback(d.shadowRegs, SHADOW_COUNT, mask, d.readbackSeparate ? 0 : SHADOW_READBACK_GAP_REGS,
+                                   MODBUS_MAX_READ_REGS, reads, SHADOW_COUNT);
+    for (uint8_t k = 0; k < n; k++) {
+        uint32_t tag = reads[k].regMask | (uint32_t)attempt << SHADOW_VERIFY_ATTEMPT_SHIFT;
+        if (bus(d).readHoldingRegisters(reads[k].address, reads[k].words, onShadowVerifyDone, batch, tag)) {
+            if (batch) batch->pending++;
+        } else {
+            driveLog(d, "MB queue full, dropped config verify: Reg=0x%04X", reads[k].address);
+            if (batch) batch->failed = true;
+        }
+    }
+}
+
+// Writes the dirty registers in 'mask', neighbouring 32-bit registers share a frame.
+// The verified ones among them are read back behind the writes, at the same
+// priority. Returns the number of write frames queued.
+static uint8_t flushShadow(Drive &d, uint32_t mask, ModbusBatch *batch, uint8_t attempt) {
+    ShadowWrite writes[SHADOW_COUNT];
+    uint8_t n = planShadowFlush(d.shadowRegs, SHADOW_COUNT, mask, MODBUS_MAX_WRITE_REGS, writes, SHADOW_COUNT);
+    if (n == 0) return 0;
+    if (!writesAllowed(d)) {
+        if (batch) batch->failed = true;
+        return 0;
+    }
+
+    uint8_t queued = 0;
+    uint32_t verifyMask = 0;
+    for (uint8_t k = 0; k < n; k++) {
+        const ShadowWrite &wr = writes[k];
+        uint16_t values[MODBUS_MAX_WRITE_REGS];
+        uint8_t w = 0;
+        uint32_t frameVerify = 0;
+        for (uint8_t i = wr.first; i < wr.first + wr.regCount; i++) {
+            int32_t value = d.shadowRegs[i].desired;
+            values[w++] = (uint16_t)(value & 0xFFFF); // Low word first (C0A.06 = 0)
+            if (d.shadowRegs[i].words == 2) values[w++] = (uint16_t)(value >> 16);
+            if (d.shadowRegs[i].verify) frameVerify |= SHADOW_BIT(i);
+        }
+        bool ok = (d.shadowRegs[wr.first].words == 1)
+            ? bus(d).writeSingleRegister(wr.address, values[0], onShadowWriteDone, batch, wr.first)
+            : bus(d).writeMultipleRegisters(wr.address, values, wr.words, onShadowWriteDone, batch, wr.first);
+        if (!ok) {
+            driveLog(d, "MB queue full, dropped write: Reg=0x%04X", wr.address);
+            if (batch) batch->failed = true;
+            continue;
+        }
+        if (batch) batch->pending++;
+        verifyMask |= frameVerify;
+        queued++;
+    }
+    queueShadowVerify(d, verifyMask, batch, attempt);
+    return queued;
+}
+
+// Register write from appLoop(). Shadowed registers are only written if they differ.
+static bool queueRegisterWrite(Drive &d, uint16_t reg, int32_t value, bool is32bit, ModbusBatch *batch) {
+    int8_t id = shadowFind(d.shadowRegs, SHADOW_COUNT, reg);
+    if (id < 0) return is32bit ? queueWrite32(d, reg, value, batch) : queueWrite(d, reg, value, batch);
+    shadowSet(d.shadowRegs[id], value);
+    flushShadow(d, SHADOW_BIT(id), batch);
+    return true;
+}
+
+// --- Register Macros ---
+// Configuration sequences run step by step next to the telemetry, one macro at a
+// time per drive. The writes between two other steps are queued at once as a
+// burst, without waiting for each other:
+//  - Shadowed registers get their desired value and are flushed together with
+//    any other dirty shadow register, in table order and only if they differ.
+//    A write to a register that is not shadowed keeps its place in the burst.
+//  - 32-bit writes to neighbouring registers share one 0x10 frame.
+//  - Writes to C04.11 (servo on) go through queueEnable()/queueDisable().
+// A delay keeps the macro waiting, not the bus. The durations of the bursts are
+// measured and logged with the result.
+
+#define MACRO_RUNNING_TIMEOUT_MS 2000 // Homing: servo on until status 'Running'
+
+static constexpr MacroStep macroDriveConfig[] = {
+    macroWrite(REG_MODBUS_SERVO_ON, 0),     // Ensure servo starts disabled, also writes a target torque of 0
+    macroDelay(100),
+    macroWrite(REG_CONTROL_MODE, 2),        // Torque mode
+    macroWrite(REG_TORQUE_REF_SRC, 0),
+    macroWrite(REG_SOFT_LIMIT_ENABLE, 1),   // Value 1 enables +/- Limits
+    macroWrite(REG_OUT_OF_CONTROL_PROT, 0),
+};
+
+static constexpr MacroStep macroHomingStart[] = { // Argument: homing speed in rpm
+    macroWrite(REG_SOFT_LIMIT_ENABLE, 0),
+    macroDelay(50),
+    macroWrite(REG_CONTROL_MODE, 1),        // Speed mode
+    macroWriteArg(REG_TARGET_SPEED),
+    macroWrite(REG_MODBUS_SERVO_ON, 1),
+    macroWaitStatus(2, MACRO_RUNNING_TIMEOUT_MS), // Status 2 means 'Running'
+};
+
+static constexpr MacroStep macroHomingFinish[] = { // Argument: homing position, the new negative soft limit
+    macroWrite(REG_MODBUS_SERVO_ON, 0),
+    macroDelay(50),
+    macroWrite(REG_CONTROL_MODE, 2),
+    macroWrite(REG_TARGET_SPEED, 0),
+    macroWrite32Arg(REG_SOFT_LIMIT_NEG),    // Also re-applied after a reconnect
+    macroDelay(50),
+    macroWrite(REG_SOFT_LIMIT_ENABLE, 1),
+};
+
+static constexpr MacroStep macroHomingAbort[] = {
+    macroWrite(REG_MODBUS_SERVO_ON, 0),
+    macroWrite(REG_CONTROL_MODE, 2),
+    macroWrite(REG_SOFT_LIMIT_ENABLE, 1),
+};
+
+struct MacroTable {
+    const char *name;
+    const MacroStep *steps;
+    uint8_t count;
+};
+
+#define MACRO_TABLE(name, steps) { name, steps, sizeof(steps) / sizeof(steps[0]) }
+
+DriveMacro driveUserMacro;
+
+static const MacroTable macroTables[MACRO_COUNT] = {
+    MACRO_TABLE("drive config", macroDriveConfig),
+    MACRO_TABLE("homing start", macroHomingStart),
+    MACRO_TABLE("homing finish", macroHomingFinish),
+    MACRO_TABLE("homing abort", macroHomingAbort),
+    { "uploaded", driveUserMacro.steps, 0 }, // Count taken from driveUserMacro
+};
+
+static void finishMacro(Drive &d, bool ok, const char *reason = nullptr) {
+    MacroRun &m = d.macro;
+    if (!m.steps) return;
+    unsigned long ms = (micros() - m.startUs) / 1000;
+    if (ok) {
+        driveLog(d, "Macro '%s': %lu ms, %d frames in %d bursts (longest %lu us), %d regs already set.",
+                 macroTables[m.id].name, ms, m.frames, m.bursts, (unsigned long)m.longestBurstUs, m.inPlace);
+    } else {
+        driveLog(d, "Macro '%s' FAILED at step %d of %d after %lu ms: %s.", macroTables[m.id].name, m.step + 1, m.count,
+                 ms, reason);
+    }
+    if (m.batch) {
+        if (m.batch->pending > 0) m.batch->pending--;
+        if (!ok) m.batch->failed = true;
+    }
+    if (m.id == MACRO_USER) pushEvent(DRIVE_EVT_MACRO_DONE, d.index, 0, ok);
+    m.steps = nullptr;
+}
+
+// Completion of a verify step, 'tag' holds the step index
+static void onMacroVerifyDone(const ModbusTransaction &txn, uint8_t result, const uint16_t *words) {
+    ModbusBatch *io = (ModbusBatch *)txn.context;
+    if (io->pending > 0) io->pending--;
+    if (result != modbus.ku8MBSuccess) {
+        io->failed = true;
+        return;
+    }
+    Drive &d = driveOf(txn);
+    int32_t value = txn.count == 2 ? (int32_t)((uint32_t)words[1] << 16 | words[0]) : (int32_t)(int16_t)words[0];
+    int8_t id = shadowFind(d.shadowRegs, SHADOW_COUNT, txn.address);
+    if (id >= 0 && d.shadowRegs[id].words == txn.count) shadowConfirm(d.shadowRegs[id], value);
+    if (!d.macro.steps) return;
+    int32_t expected = macroValue(d.macro.steps[txn.tag], d.macro.arg);
+    if (value != expected) {
+        driveLog(d, "Macro verify: 0x%04X holds %ld, expected %ld.", txn.address, (long)value, (long)expected);
+        io->failed = true;
+    }
+}
+
+// Sets the shadowed registers of a burst collected in 'mask' and flushes every dirty one
+static void flushMacroShadow(Drive &d, uint32_t mask) {
+    if (mask == 0) return;
+    MacroRun &m = d.macro;
+    uint32_t dirty = shadowDirtyMask(d.shadowRegs, SHADOW_COUNT);
+    m.inPlace += __builtin_popcount(mask & ~dirty);
+    flushShadow(d, dirty, &m.io);
+}
+
+// Queues the writes of steps m.step .. m.next - 1 as one burst
+static void queueMacroBurst(Drive &d) {
+    MacroRun &m = d.macro;
+    uint32_t shadowMask = 0;
+    for (uint8_t i = m.step; i < m.next; ) {
+        const MacroStep &s = m.steps[i];
+        int32_t value = macroValue(s, m.arg);
+        int8_t id = shadowFind(d.shadowRegs, SHADOW_COUNT, s.reg);
+        if (id >= 0 && d.shadowRegs[id].words == (s.op == MACRO_WRITE32 ? 2 : 1)) {
+            shadowSet(d.shadowRegs[id], value);
+            shadowMask |= SHADOW_BIT(id);
+            i++;
+            continue;
+        }
+        flushMacroShadow(d, shadowMask); // Before the write that follows them in the macro
+        shadowMask = 0;
+        if (s.op == MACRO_WRITE && s.reg == REG_MODBUS_SERVO_ON) {
+            if (value) queueEnable(d, &m.io);
+            else queueDisable(d, &m.io);
+            i++;
+        } else if (s.op == MACRO_WRITE) {
+            queueWrite(d, s.reg, value, &m.io);
+            i++;
+        } else {
+            // Neighbouring 32-bit writes share a frame, low word first (C0A.06 = 0)
+            uint16_t words[MODBUS_MAX_WRITE_REGS];
+            uint8_t n = 0;
+            while (i < m.next && m.steps[i].op == MACRO_WRITE32 && m.steps[i].reg == s.reg + n
+                   && n + 2 <= MODBUS_MAX_WRITE_REGS && shadowFind(d.shadowRegs, SHADOW_COUNT, m.steps[i].reg) < 0) {
+                int32_t v = macroValue(m.steps[i], m.arg);
+                words[n++] = (uint16_t)(v & 0xFFFF);
+                words[n++] = (uint16_t)(v >> 16);
+                i++;
+            }
+            if (n == 0) { // 32-bit write to a 16-bit shadowed register, not merged
+                words[n++] = (uint16_t)(value & 0xFFFF);
+                words[n++] = (uint16_t)(value >> 16);
+                i++;
+            }
+            if (bus(d).writeMultipleRegisters(s.reg, words, n, onWriteDone, &m.io)) {
+                m.io.pending++;
+            } else {
+                driveLog(d, "MB queue full, dropped write: Reg=0x%04X", s.reg);
+                m.io.failed = true;
+            }
+        }
+    }
+    flushMacroShadow(d, shadowMask);
+}
+
+// Starts step m.next, a burst takes all the writes that follow it
+static void startMacroStep(Drive &d) {
+    MacroRun &m = d.macro;
+    const MacroStep &s = m.steps[m.next];
+    m.step = m.next;
+    m.stepStartUs = micros();
+    switch (s.op) {
+        case MACRO_WRITE:
+        case MACRO_WRITE32:
+            m.next = macroBurstEnd(m.steps, m.count, m.step);
+            queueMacroBurst(d);
+            m.burst = m.io.pending > 0;
+            m.bursts += m.burst;
+            m.frames += m.io.pending;
+            break;
+        case MACRO_DELAY:
+        case MACRO_WAIT_STATUS:
+            m.next++;
+            m.waiting = true;
+            m.waitStart = millis();
+            break;
+        case MACRO_VERIFY:
+        case MACRO_VERIFY32:
+            m.next++;
+            if (bus(d).readHoldingRegisters(s.reg, s.op == MACRO_VERIFY32 ? 2 : 1, onMacroVerifyDone, &m.io, m.step)) {
+                m.io.pending++;
+                m.frames++;
+            } else {
+                m.io.failed = true;
+            }
+            break;
+    }
+}
+
+// True once the delay or status wait of step m.step is over, fails the macro on a timeout
+static bool macroWaitDone(Drive &d) {
+    MacroRun &m = d.macro;
+    const MacroStep &s = m.steps[m.step];
+    if (s.op == MACRO_DELAY) return millis() - m.waitStart >= (uint32_t)s.value;
+
+    // A status read after the step started, and already published, so appLoop()
+    // has seen it by the time the macro reports
+    bool fresh = (int32_t)(d.fieldTimeUs[FIELD_SERVO_STATUS] - m.stepStartUs) > 0
+              && !(d.freshFields & FIELD_BIT(FIELD_SERVO_STATUS));
+    int32_t status = d.fieldValues[FIELD_SERVO_STATUS];
+    if (fresh && status == s.value) return true;
+    if (fresh && status == 3) {
+        finishMacro(d, false, "servo faulted"); // Status 3 means 'Fault'
+    } else if (millis() - m.waitStart >= s.timeoutMs) {
+        driveLog(d, "Macro wait: servo status %ld after %d ms, waiting for %ld.", (long)status, s.timeoutMs,
+                 (long)s.value);
+        finishMacro(d, false, "timeout");
+    }
+    return false;
+}
+
+// Advances the macro of the drive as far as it can without waiting
+static void serviceMacro(Drive &d) {
+    MacroRun &m = d.macro;
+    while (m.steps) {
+        if (!d.modbusOk) {
+            finishMacro(d, false, "link lost");
+            return;
+        }
+        if (!batchDone(m.io)) return; // Frames of the step in flight
+        if (m.io.failed) {
+            finishMacro(d, false, "write or verify failed");
+            return;
+        }
+        if (m.burst) {
+            m.burst = false;
+            uint32_t burstUs = micros() - m.stepStartUs;
+            if (burstUs > m.longestBurstUs) m.longestBurstUs = burstUs;
+        }
+        if (m.waiting) {
+            if (!macroWaitDone(d)) return;
+            m.waiting = false;
+        }
+        if (m.next >= m.count) {
+            finishMacro(d, true);
+            return;
+        }
+        startMacroStep(d);
+    }
+}
+
+// Starts macro 'id' on the drive, counted in 'batch' until it finished.
+// Refused while the drive runs another one.
+static bool startMacro(Drive &d, DriveMacroId id, int32_t arg, ModbusBatch *batch) {
+    MacroRun &m = d.macro;
+    const MacroTable &table = macroTables[id];
+    if (m.steps || !writesAllowed(d)) {
+        driveLog(d, "Macro '%s' refused: %s.", table.name, m.steps ? "another macro is running" : "link down");
+        if (batch) batch->failed = true;
+        if (id == MACRO_USER) pushEvent(DRIVE_EVT_MACRO_DONE, d.index, 0, false);
+        return false;
+    }
+    m = MacroRun();
+    m.steps = table.steps;
+    m.count = (id == MACRO_USER) ? min(driveUserMacro.count, (uint8_t)MACRO_MAX_STEPS) : table.count;
+    m.id = id;
+    m.arg = arg;
+    m.batch = batch;
+    m.startUs = micros();
+    if (batch) batch->pending++;
+    serviceMacro(d); // The first burst goes out right away
+    return true;
+}
+
+// Queues the drive configuration: servo off, torque mode, software limits on,
+// out of control protection off. Only registers that differ are written.
+static void queueDriveConfig(Drive &d, ModbusBatch *batch) {
+    startMacro(d, MACRO_DRIVE_CONFIG, 0, batch);
+}
+
+#define TORQUE_REFRESH_MS 100 // An unchanged setpoint is re-written at this interval
+
+// The setpoint is streamed while the servo runs in torque mode
+static bool torqueStreaming(const Drive &d) {
+    return d.modbusOk && d.servoRunning && d.torqueSetpoint >= 0;
+}
+
+// A setpoint write for the drive was queued
+static void setpointQueued(Drive &d, unsigned long now) {
+    d.torqueWritePending = true;
+    d.torqueWritten = d.torqueSetpoint;
+    d.lastTorqueWriteTime = now;
+    if (d.setpointChangePending) {
+        d.setpointChangePending = false;
+        d.torqueWriteCarriesChange = true;
+        d.torqueWriteChangeUs = d.setpointChangeUs;
+    }
+}
+
+// A setpoint write for the drive completed, 'txn' carried its setpoint
+static void setpointWritten(Drive &d, const ModbusTransaction &txn) {
+    d.torqueWritePending = false;
+    if (d.torqueWriteCarriesChange && txn.startUs != 0) {
+        d.setpointLatencyUs = txn.startUs - d.torqueWriteChangeUs;
+        if (d.setpointLatencyUs > d.setpointLatencyMaxUs) d.setpointLatencyMaxUs = d.setpointLatencyUs;
+    }
+    d.torqueWriteCarriesChange = false;
+}
+
+static void onTorqueWriteDone(const ModbusTransaction &txn, uint8_t result, const uint16_t *words) {
+    setpointWritten(driveOf(txn), txn);
+    onWriteDone(txn, result, words);
+}
+
+// --- Connection Check ---
+
+// Compares a shadowed register read back from the drive with what it confirmed before
+static void readbackRegister(Drive &d, uint8_t id, int32_t value) {
+    ShadowReg &reg = d.shadowRegs[id];
+    if (reg.driveKnown && reg.drive != value) {
+        driveLog(d, "Config: %s is %ld, was %ld.", reg.name, (long)value, (long)reg.drive);
+        d.readbackLost++;
+    }
+    shadowConfirm(reg, value);
+}
+
+static void onConnectionCheckDone(const ModbusTransaction &txn, uint8_t result, const uint16_t *words) {
+    Drive &d = driveOf(txn);
+    d.connectionCheckPending = false;
+    if (result == modbus.ku8MBSuccess) {
+        if (!d.modbusOk) {
+            d.readbackLost = 0;
+            readbackRegister(d, shadowFind(d.shadowRegs, SHADOW_COUNT, REG_CONTROL_MODE), (int16_t)words[0]);
+            driveLog(d, "MB Connection Check OK (Read 0x0000 successful).");
+            d.reconnectApplyPending = true;
+        }
+        d.modbusOk = true;
+        d.modbusConsecutiveErrors = 0; // Reset error counter
+    } else if (result != modbus.ku8MBAborted) {
+        // Log only if status changed or during startup
+        if (d.modbusOk || millis() < 6000) {
+            driveLog(d, "MB Connection Check FAIL reading 0x0000! Code: 0x%X", result);
+        }
+        setLinkDown(d); // Assume max errors if check fails
+        publishSample(d, 0);
+    }
+}
+
+// Checks Modbus connection (called less frequently)
+static bool checkModbusConnection(Drive &d) {
+    if (d.connectionCheckPending) return true;
+    d.connectionCheckPending = bus(d).readHoldingRegisters(REG_CONTROL_MODE, 1, onConnectionCheckDone,
+                                                           nullptr, 0, MB_PRIO_HOUSEKEEPING);
+    return d.connectionCheckPending;
+}
+
+// --- Reconnect ---
+// A recovered link does not mean the drive restarted. The owned configuration
+// is read back (the connection check already brought C00.00) together with the
+// servo status. If the drive still holds every value it had confirmed and the
+// servo did not drop out of 'Running', it only lost the bus: the registers that
+// differ are written, nothing else. Otherwise it was power cycled (or stopped on
+// its own) and gets the full configuration, servo disable included.
+
+static void finishReconnect(Drive &d) {
+    if (!d.modbusOk) return; // Lost again, the next connection check starts over
+    bool restarted = d.readbackLost > 0 || d.servoDropped || d.readbackFailed;
+    if (restarted) {
+        driveLog(d, "Drive %s during the outage, re-applying its configuration.",
+                 d.readbackFailed ? "state unknown" : d.readbackLost ? "lost its configuration" : "left 'Running'");
+        queueDriveConfig(d, nullptr);
+    } else {
+        uint32_t dirty = shadowDirtyMask(d.shadowRegs, SHADOW_COUNT);
+        uint8_t frames = flushShadow(d, dirty, nullptr);
+        driveLog(d, "Drive kept its state: %d of %d registers differ, written in %d frames.",
+                 __builtin_popcount(dirty), (int)SHADOW_COUNT, frames);
+    }
+    pushEvent(DRIVE_EVT_RECONNECTED, d.index, 0, !restarted);
+}
+
+static void readbackDone(Drive &d) {
+    if (d.readbackPending > 0 && --d.readbackPending == 0) finishReconnect(d);
+}
+
+// Completion of a readback frame, 'tag' holds the shadow registers it covers
+static void onReadbackDone(const ModbusTransaction &txn, uint8_t result, const uint16_t *words) {
+    Drive &d = driveOf(txn);
+    for (uint8_t i = 0; i < SHADOW_COUNT; i++) {
+        if (!(txn.tag & SHADOW_BIT(i))) continue;
+        if (result == modbus.ku8MBSuccess) {
+            readbackRegister(d, i, shadowDecode(d.shadowRegs[i], &words[d.shadowRegs[i].address - txn.address]));
+        } else {
+            shadowInvalidate(d.shadowRegs[i]); // Written as if the drive had restarted
+        }
+    }
+    if (result == modbus.ku8MBIllegalDataAddress || result == MB_EXCEPTION_READ_DISABLED) {
+        if (!d.readbackSeparate) driveLog(d, "Config readback of 0x%04X (+%d) rejected, reading registers separately.",
+                                          txn.address, txn.count);
+        d.readbackSeparate = true; // Affected registers are written this time
+    } else if (result != modbus.ku8MBSuccess) {
+        d.readbackFailed = true;
+    }
+    readbackDone(d);
+}
+
+static void onReadbackStatusDone(const ModbusTransaction &txn, uint8_t result, const uint16_t *words) {
+    Drive &d = driveOf(txn);
+    if (result == modbus.ku8MBSuccess) {
+        d.servoDropped = d.runningAtLinkLoss && words[0] != 2; // Status 2 means 'Running'
+    } else {
+        d.readbackFailed = true;
+    }
+    readbackDone(d);
+}
+
+// Queues the readback of the owned configuration and the servo status
+static void startReconnect(Drive &d) {
+    driveLog(d, "Reconnected to Modbus. Checking the drive configuration...");
+    captureMark(d, "reconnected");
+    d.readbackFailed = false;
+    d.servoDropped = false;
+    uint32_t mask = 0;
+    for (uint8_t i = 0; i < SHADOW_COUNT; i++) {
+        const ShadowReg &reg = d.shadowRegs[i];
+        if ((reg.hasDesired || reg.driveKnown) && reg.address != REG_CONTROL_MODE) mask |= SHADOW_BIT(i);
+    }
+    ShadowRead reads[SHADOW_COUNT];
+    uint8_t n = planShadowReadback(d.shadowRegs, SHADOW_COUNT, mask, d.readbackSeparate ? 0 : SHADOW_READBACK_GAP_REGS,
+                                   MODBUS_MAX_READ_REGS, reads, SHADOW_COUNT);
+    d.readbackPending = 1; // Held until everything is queued
+    for (uint8_t k = 0; k < n; k++) {
+        if (bus(d).readHoldingRegisters(reads[k].address, reads[k].words, onReadbackDone, nullptr, reads[k].regMask,
+                                        MB_PRIO_HOUSEKEEPING)) {
+            d.readbackPending++;
+        } else {
+            for (uint8_t i = 0; i < SHADOW_COUNT; i++) {
+                if (reads[k].regMask & SHADOW_BIT(i)) shadowInvalidate(d.shadowRegs[i]);
+            }
+            d.readbackFailed = true;
+        }
+    }
+    if (bus(d).readHoldingRegisters(regFields[FIELD_SERVO_STATUS].address, 1, onReadbackStatusDone, nullptr, 0,
+                                    MB_PRIO_HOUSEKEEPING)) {
+        d.readbackPending++;
+    } else {
+        d.readbackFailed = true;
+    }
+    readbackDone(d);
+}
+
+// --- Telemetry ---
+
+// Block-read mode: let the planner merge neighbouring fields into multi-register
+// reads. Set to 0 to read every field in a frame of its own.
+#define MODBUS_BLOCK_READ 1
+// Combined mode: if the drive accepts 0x17, every setpoint write also reads the
+// motion feedback block. Set to 0 to always use separate transactions.
+#define MODBUS_COMBINED_RW 1
+#define CONTROL_FEEDBACK_FIELDS (FIELD_BIT(FIELD_SPEED) | FIELD_BIT(FIELD_TORQUE) | \
+                                 FIELD_BIT(FIELD_FOLLOWING_ERROR) | FIELD_BIT(FIELD_POSITION))
+#define POLL_TICK_MS 10 // Telemetry tick, every field whose period elapsed is read in the same cycle
+#define RATE_WINDOW_MS 1000
+
+static ReadPlan cycleReadPlan; // Fields due in the cycle being queued
+static unsigned long rateWindowStart = 0;
+
+// --- Telemetry Rate Governor ---
+
+// Poll period of a field in the drive's profile
+static uint32_t pollPeriodMs(const Drive &d, uint8_t id) {
+    uint16_t scale = (d.pollProfile == POLL_PROFILE_HOMING) ? POLL_SCALE_ONE : pollScale;
+    uint32_t period = (uint32_t)regFields[id].periodMs[d.pollProfile] * scale / POLL_SCALE_ONE;
+    return max(period, (uint32_t)POLL_TICK_MS);
+}
+
+// Counts the bus time of a telemetry transaction, from its completion callback
+static void telemetryBusTime(uint8_t result) {
+    if (result != modbus.ku8MBAborted) telemetryBusUs += modbus.lastBusUs;
+}
+
+// Sets the poll scale for the next window from the bus time of the last one
+static void updatePollScale(unsigned long elapsedMs) {
+    uint32_t windowUs = elapsedMs * 1000UL;
+    uint32_t busUs = modbus.busUs - windowBusUs;
+    uint32_t transactions = modbus.transactions - windowTransactions;
+    uint32_t failures = (modbus.failures - modbus.exceptions) - windowFailures; // Exceptions are answers
+    uint32_t telemetryUs = min(telemetryBusUs, busUs);
+    windowBusUs = modbus.busUs;
+    windowTransactions = modbus.transactions;
+    windowFailures = modbus.failures - modbus.exceptions;
+    telemetryBusUs = 0;
+    busLoadPct = min((uint64_t)busUs * 100 / windowUs, (uint64_t)100);
+
+    for (uint8_t i = 0; i < driveCount; i++) {
+        if (drives[i].pollProfile == POLL_PROFILE_HOMING) return; // Not scaled, would mislead the estimate
+    }
+    if (pollHoldWindows > 0) pollHoldWindows--;
+    if (failures >= 2 && failures * 100 > transactions * POLL_ERROR_PCT) {
+        uint16_t scale = min(pollScale * 2, POLL_SCALE_MAX);
+        if (scale != pollScale) {
+            driveLog("Bus errors (%lu of %lu frames), telemetry periods raised to %d%%.", (unsigned long)failures,
+                     (unsigned long)transactions, scale * 100 / POLL_SCALE_ONE);
+        }
+        pollScale = scale;
+        pollHoldWindows = POLL_ERROR_HOLD;
+        return;
+    }
+    if (telemetryUs == 0) return; // No telemetry, nothing to scale
+    int64_t budgetUs = (int64_t)windowUs * busTargetPct / 100 - (int64_t)(busUs - telemetryUs);
+    uint32_t scale = budgetUs > 0 ? (uint64_t)pollScale * telemetryUs / budgetUs : POLL_SCALE_MAX;
+    if (scale < pollScale) scale = pollHoldWindows > 0 ? pollScale : max(scale, (uint32_t)pollScale * 3 / 4);
+    pollScale = constrain(scale, (uint32_t)POLL_SCALE_MIN, (uint32_t)POLL_SCALE_MAX);
+}
+
+// Recomputes the read planner limits from what the drive refused so far.
+// The plan itself is made per cycle from the fields that are due.
+static void rebuildReadPlans(Drive &d) {
+    ReadPlannerConfig &cfg = d.plannerConfig;
+    cfg.maxRegsPerFrame = MODBUS_BLOCK_READ ? MODBUS_MAX_READ_REGS : 2;
+    cfg.maxGapRegs = MODBUS_BLOCK_READ ? READ_PLANNER_DEFAULT_GAP_REGS : 0;
+    cfg.forbidden = d.unreadableRegs;
+    cfg.forbiddenCount = d.unreadableRegCount;
+    cfg.isolatedMask = MODBUS_BLOCK_READ ? d.isolatedFields : 0xFFFFFFFFUL;
+
+    ReadPlan fullPlan;
+    planReads(regFields, FIELD_COUNT, ((1UL << FIELD_COUNT) - 1) & ~d.unavailableFields, cfg, fullPlan);
+    driveLog(d, "Read plan: all fields in %d frames / %d regs", fullPlan.spanCount, fullPlan.totalRegs);
+
+    // The combined transaction reads one span only
+    ReadPlan feedbackPlan;
+    planReads(regFields, FIELD_COUNT, CONTROL_FEEDBACK_FIELDS & ~d.unavailableFields, cfg, feedbackPlan);
+    if (feedbackPlan.spanCount == 1) {
+        d.combinedSpan = feedbackPlan.spans[0];
+    } else {
+        d.combinedSpan.count = 0;
+        d.combinedSupported = false;
+    }
+}
+
+static bool setpointBroadcastReady();
+
+// The setpoint stream reads the motion feedback (0x17). Not while the setpoint is broadcast.
+static bool combinedReadActive(const Drive &d) {
+    return d.combinedSupported && d.combinedSpan.count > 0 && torqueStreaming(d) && !setpointBroadcastReady();
+}
+
+static void markFieldsPolled(Drive &d, uint32_t fieldMask, unsigned long timeMs) {
+    for (uint8_t id = 0; id < FIELD_COUNT; id++) {
+        if (fieldMask & FIELD_BIT(id)) d.fieldLastPollMs[id] = timeMs;
+    }
+}
+
+// Decodes the fields in 'fieldMask' from registers read starting at 'start',
+// stamped with the arrival of the response. Only from a completion callback.
+static void storeSpanFields(Drive &d, uint32_t fieldMask, uint16_t start, const uint16_t *words) {
+    for (uint8_t id = 0; id < FIELD_COUNT; id++) {
+        if (fieldMask & FIELD_BIT(id)) {
+            d.fieldValues[id] = regFieldDecode(regFields[id], &words[regFields[id].address - start]);
+            d.fieldTimeUs[id] = modbus.responseUs;
+            d.fieldReadCount[id]++;
+        }
+    }
+    d.freshFields |= fieldMask;
+    d.telemetryFrames++;
+}
+
+// Picks the poll profile. Homing is requested by appLoop(), running comes from the drive status.
+static void updatePollProfile(Drive &d) {
+    PollProfile profile = d.pollHomingRequested ? POLL_PROFILE_HOMING
+                        : d.servoRunning ? POLL_PROFILE_RUNNING : POLL_PROFILE_IDLE;
+    if (profile == d.pollProfile) return;
+    static const char *const names[POLL_PROFILE_COUNT] = { "idle", "running", "homing" };
+    driveLog(d, "Telemetry poll profile: %s", names[profile]);
+    d.pollProfile = profile;
+}
+
+// Fields whose poll period in the current profile has elapsed. Half a tick of
+// slack keeps fields with the same period in the same cycle.
+static uint32_t dueFields(const Drive &d, unsigned long now) {
+    uint32_t mask = 0;
+    for (uint8_t id = 0; id < FIELD_COUNT; id++) {
+        if (now - d.fieldLastPollMs[id] + POLL_TICK_MS / 2 >= pollPeriodMs(d, id)) {
+            mask |= FIELD_BIT(id);
+        }
+    }
+    return mask & ~d.unavailableFields;
+}
+
+// Effective read rate per field, and how the telemetry frames divided between
+// the drives, over the last window
+static void updateFieldRates(unsigned long now) {
+    unsigned long elapsed = now - rateWindowStart;
+    if (elapsed < RATE_WINDOW_MS) return;
+    uint32_t totalFrames = 0;
+    for (uint8_t i = 0; i < driveCount; i++) totalFrames += drives[i].telemetryFrames;
+    for (uint8_t i = 0; i < driveCount; i++) {
+        Drive &d = drives[i];
+        for (uint8_t id = 0; id < FIELD_COUNT; id++) {
+            d.fieldRateHz[id] = min((d.fieldReadCount[id] * 1000UL + elapsed / 2) / elapsed, 255UL);
+            d.fieldReadCount[id] = 0;
+        }
+        d.telemetryHz = min((d.telemetryFrames * 1000UL + elapsed / 2) / elapsed, (unsigned long)UINT16_MAX);
+        d.telemetryShare = totalFrames ? (d.telemetryFrames * 100UL + totalFrames / 2) / totalFrames : 0;
+        d.telemetryFrames = 0;
+    }
+    updatePollScale(elapsed);
+    rateWindowStart = now;
+}
+
+// Called when the drive rejects a span. Narrows the plan step by step: exclude the
+// unused registers between fields, then read the fields separately, finally drop them.
+static void handleRejectedSpan(Drive &d, ReadSpan span) {
+    uint64_t covered = 0;
+    for (uint8_t id = 0; id < FIELD_COUNT; id++) {
+        if (!(span.fieldMask & FIELD_BIT(id))) continue;
+        for (uint8_t w = 0; w < regFields[id].words; w++) {
+            covered |= 1ULL << (regFields[id].address + w - span.start);
+        }
+    }
+
+    bool hadGap = false;
+    for (uint16_t i = 0; i < span.count; i++) {
+        if (covered & (1ULL << i)) continue;
+        uint16_t first = i;
+        while (i + 1 < span.count && !(covered & (1ULL << (i + 1)))) i++;
+        if (d.unreadableRegCount < MAX_UNREADABLE_RANGES) {
+            d.unreadableRegs[d.unreadableRegCount].first = span.start + first;
+            d.unreadableRegs[d.unreadableRegCount].last = span.start + i;
+            d.unreadableRegCount++;
+            hadGap = true;
+        }
+    }
+
+    if (hadGap) {
+        driveLog(d, "MB read of 0x%04X (+%d) rejected, excluding unused registers from block reads.", span.start, span.count);
+    } else if (span.fieldMask & (span.fieldMask - 1)) {
+        driveLog(d, "MB read of 0x%04X (+%d) rejected, reading its fields separately.", span.start, span.count);
+        d.isolatedFields |= span.fieldMask;
+    } else {
+        driveLog(d, "MB read of 0x%04X rejected, field no longer polled.", span.start);
+        d.unavailableFields |= span.fieldMask;
+    }
+    rebuildReadPlans(d);
+}
+
+static void scheduleTelemetry(unsigned long now);
+
+// Evaluates a finished telemetry cycle, publishes it and starts the next one
+static void finishTelemetryCycle(Drive &d) {
+    if (!d.telemetryCycleOk) {
+        d.modbusConsecutiveErrors++;
+        if (d.modbusConsecutiveErrors == 1) captureMark(d, "read cycle failed");
+        // Log reduced to avoid flooding
+        if (d.modbusConsecutiveErrors == 1 || d.modbusConsecutiveErrors == MAX_MODBUS_ERRORS) {
+             driveLog(d, "Modbus read cycle failed (%d consecutive)", d.modbusConsecutiveErrors);
+        }
+        if (d.modbusConsecutiveErrors >= MAX_MODBUS_ERRORS) {
+            if (d.modbusOk) {
+                driveLog(d, ">>> Too many consecutive Modbus read errors, setting status to FAIL <<<");
+            }
+            setLinkDown(d);
+            // Reset Temps on failure
+            d.fieldValues[FIELD_TEMP_IGBT] = 0; d.fieldValues[FIELD_TEMP_MOTOR] = 0;
+        }
+    } else {
+        if (!d.modbusOk) { // Log only when status changes
+             driveLog(d, ">>> Modbus communication OK <<<");
+        }
+        d.modbusConsecutiveErrors = 0;
+        d.modbusOk = true;
+        d.servoRunning = (d.fieldValues[FIELD_SERVO_STATUS] == 2); // Status 2 means 'Running'
+        if (d.telemetryCycleStartStatus != d.fieldValues[FIELD_SERVO_STATUS]) {
+            driveLog(d, "Servo Status Changed (0x410A) = %ld (0=NR,1=RD,2=RUN,3=FLT)", (long)d.fieldValues[FIELD_SERVO_STATUS]);
+        }
+    }
+    d.cycleUs = micros() - d.cycleStartUs;
+    publishSample(d, d.cycleTransactions);
+    scheduleTelemetry(millis());
+}
+
+// Completion of one telemetry span, 'tag' holds the fields decoded from it
+static void onTelemetrySpanDone(const ModbusTransaction &txn, uint8_t result, const uint16_t *words) {
+    Drive &d = driveOf(txn);
+    uint32_t fieldMask = txn.tag;
+    telemetryBusTime(result);
+    if (result == modbus.ku8MBSuccess) {
+        storeSpanFields(d, fieldMask, txn.address, words);
+    } else {
+        d.telemetryCycleOk = false;
+        if (result == modbus.ku8MBIllegalDataAddress || result == MB_EXCEPTION_READ_DISABLED) {
+            ReadSpan span = { txn.address, txn.count, fieldMask };
+            handleRejectedSpan(d, span); // Changes the plan for the next cycle
+        }
+    }
+    if (d.telemetryPending > 0 && --d.telemetryPending == 0) finishTelemetryCycle(d);
+}
+
+// Telemetry is read while the link is up, or still being established
+static bool telemetryAllowed(const Drive &d) {
+    return d.modbusOk || d.modbusConsecutiveErrors < MAX_MODBUS_ERRORS;
+}
+
+// Fields a new telemetry cycle of the drive would read now, 0 = no cycle due.
+// One cycle per drive is in flight, and at most one starts per POLL_TICK_MS.
+static uint32_t telemetryDue(const Drive &d, unsigned long now) {
+    if (!telemetryAllowed(d) || d.telemetryPending > 0 || now - d.lastCycleTime < POLL_TICK_MS) return 0;
+    uint32_t due = dueFields(d, now);
+    if (combinedReadActive(d)) due &= ~d.combinedSpan.fieldMask; // Read by the setpoint stream
+    return due;
+}
+
+// Queues one telemetry cycle: the fields in 'due', one frame per planned span
+static void startTelemetryCycle(Drive &d, uint32_t due, unsigned long now) {
+    d.lastCycleTime = now;
+    markFieldsPolled(d, due, now);
+    planReads(regFields, FIELD_COUNT, due, d.plannerConfig, cycleReadPlan);
+    const ReadPlan &plan = cycleReadPlan;
+    d.telemetryCycleOk = true;
+    d.telemetryCycleStartStatus = d.fieldValues[FIELD_SERVO_STATUS];
+    d.cycleTransactions = 0;
+    d.cycleStartUs = micros();
+    uint32_t feedbackMask = regFieldMask(POLL_FAST);
+    for (uint8_t s = 0; s < plan.spanCount; s++) {
+        const ReadSpan &span = plan.spans[s];
+        // A span holding any motion feedback field is read at feedback priority
+        ModbusPriority priority = (span.fieldMask & feedbackMask) ? MB_PRIO_FEEDBACK : MB_PRIO_HOUSEKEEPING;
+        if (bus(d).readHoldingRegisters(span.start, span.count, onTelemetrySpanDone, nullptr, span.fieldMask, priority)) {
+            d.telemetryPending++;
+            d.cycleTransactions++;
+        } else {
+            d.telemetryCycleOk = false;
+        }
+    }
+    if (d.telemetryPending == 0) finishTelemetryCycle(d);
+}
+
+// --- Telemetry Scheduler ---
+// The telemetry cycles of all drives share the bus, one cycle is in flight at a
+// time. A cycle of one drive must not be overtaken by the next cycle of another:
+// its feedback spans would go ahead of the housekeeping spans still queued, and
+// the slower drive would only finish a cycle at the housekeeping deadline.
+// When the bus is free, one of the drives with a cycle due is picked by smooth
+// weighted round robin: every waiting drive earns its weight in credit, the one
+// with the most credit starts its cycle and pays the weights of all waiting
+// drives. The next cycle is queued right from the completion of the previous
+// one, so the bus does not idle in between. While the bus keeps up, every drive
+// reads at its full poll rates. Once it saturates, the telemetry frames divide
+// between the drives in proportion to their weights, at the cost of lower poll
+// rates for all of them (see telemetryHz / telemetryShare).
+static void scheduleTelemetry(unsigned long now) {
+    Drive *next = nullptr;
+    uint32_t nextDue = 0;
+    int16_t waitingWeight = 0;
+    for (uint8_t i = 0; i < driveCount; i++) {
+        if (drives[i].telemetryPending > 0) return; // Bus busy with a cycle
+    }
+    for (uint8_t i = 0; i < driveCount; i++) {
+        Drive &d = drives[i];
+        uint32_t due = telemetryDue(d, now);
+        if (!due) continue;
+        d.credit += d.weight;
+        waitingWeight += d.weight;
+        if (!next || d.credit > next->credit) {
+            next = &d;
+            nextDue = due;
+        }
+    }
+    if (!next) return;
+    next->credit -= waitingWeight;
+    startTelemetryCycle(*next, nextDue, now);
+}
+
+// --- Combined Setpoint / Feedback Transaction ---
+
+// Completion of the 0x17 exchange: setpoint written and motion feedback read, 'tag' holds the fields
+static void onCombinedDone(const ModbusTransaction &txn, uint8_t result, const uint16_t *words) {
+    Drive &d = driveOf(txn);
+    if (result == MB_RESULT_ILLEGAL_FUNCTION) {
+        driveLog(d, "Drive rejected 0x17, writing the setpoint and reading feedback separately.");
+        d.combinedSupported = false;
+        d.torqueWritePending = false;
+        d.torqueWritten = -1; // Not written, send it again
+        markFieldsPolled(d, txn.tag, millis() - 1000); // Read by the next telemetry cycle
+        return;
+    }
+    telemetryBusTime(result); // The setpoint write is counted with it, it rides along for free
+    if (result == modbus.ku8MBSuccess) storeSpanFields(d, txn.tag, txn.address, words);
+    onTorqueWriteDone(txn, result, words);
+}
+
+static void onCombinedProbeDone(const ModbusTransaction &txn, uint8_t result, const uint16_t *words) {
+    Drive &d = driveOf(txn);
+    d.combinedSupported = (result == modbus.ku8MBSuccess);
+    if (d.combinedSupported) {
+        storeSpanFields(d, txn.tag, txn.address, words);
+        driveLog(d, "Drive supports 0x17: setpoint write and feedback read (0x%04X +%d) share one frame.",
+                 txn.address, txn.count);
+    } else {
+        driveLog(d, "Drive does not support 0x17 (Code=0x%X), using separate transactions.", result);
+    }
+}
+
+// Capability probe. Writes a torque target of 0, so only call it with the servo disabled.
+static void probeCombinedReadWrite(Drive &d) {
+    d.combinedSupported = false;
+    if (!MODBUS_COMBINED_RW || d.combinedSpan.count == 0) return;
+    uint16_t value = 0;
+    if (bus(d).readWriteMultipleRegisters(d.combinedSpan.start, d.combinedSpan.count, REG_TARGET_TORQUE, &value, 1,
+                                          onCombinedProbeDone, nullptr, d.combinedSpan.fieldMask)) {
+        modbusFlush();
+    }
+}
+
+// Streams the setpoint while running: a change goes out right away, an unchanged
+// value every TORQUE_REFRESH_MS. One write is in flight, the next one carries the
+// latest value. Between writes the bus is free for the telemetry reads.
+// With 0x17 the write also reads the motion feedback, and is sent whenever that is due.
+static void serviceTorqueSetpoint(Drive &d) {
+    if (!torqueStreaming(d)) {
+        d.setpointChangePending = false; // Not streamed, nothing to measure
+        d.torqueWritten = -1;
+        return;
+    }
+    if (d.torqueWritePending) return;
+    unsigned long now = millis();
+    bool combined = combinedReadActive(d);
+    if (d.torqueSetpoint == d.torqueWritten && now - d.lastTorqueWriteTime < TORQUE_REFRESH_MS
+        && !(combined && (dueFields(d, now) & d.combinedSpan.fieldMask))) return;
+
+    if (combined) {
+        uint16_t value = d.torqueSetpoint;
+        d.torqueWritePending = bus(d).readWriteMultipleRegisters(d.combinedSpan.start, d.combinedSpan.count,
+                                                                 REG_TARGET_TORQUE, &value, 1, onCombinedDone, nullptr,
+                                                                 d.combinedSpan.fieldMask, MB_PRIO_SETPOINT);
+        if (d.torqueWritePending) markFieldsPolled(d, d.combinedSpan.fieldMask, now);
+    } else {
+        d.torqueWritePending = queueWrite(d, REG_TARGET_TORQUE, d.torqueSetpoint, nullptr, onTorqueWriteDone,
+                                          MB_PRIO_SETPOINT);
+    }
+    if (d.torqueWritePending) setpointQueued(d, now);
+}
+
+// --- Setpoint Broadcast ---
+// Written one by one, the setpoints of N drives take effect a transaction time
+// apart. While every drive streams the same setpoint (the usual case: both
+// handles on the same slider), one write to the broadcast address updates all
+// of them with the same frame, and costs one frame instead of N exchanges.
+// The A6 has no register to stage a value and apply it later, so drives with
+// different setpoints are still written one by one, in consecutive frames.
+// A broadcast reaches every drive on the bus: a drive that is disabled, not
+// answering or holds another value rules it out. Set to 0 to always write the
+// drives one by one.
+#define MODBUS_BROADCAST_SETPOINT 1
+
+static bool setpointBroadcasting = false; // Last state, for the log
+
+static bool setpointBroadcastReady() {
+    if (!MODBUS_BROADCAST_SETPOINT || driveCount < 2) return false;
+    for (uint8_t i = 0; i < driveCount; i++) {
+        if (!torqueStreaming(drives[i]) || drives[i].torqueSetpoint != drives[0].torqueSetpoint) return false;
+    }
+    return true;
+}
+
+static void onBroadcastTorqueDone(const ModbusTransaction &txn, uint8_t result, const uint16_t *words) {
+    for (uint8_t i = 0; i < driveCount; i++) {
+        Drive &d = drives[i];
+        setpointWritten(d, txn);
+        if (result != modbus.ku8MBSuccess) d.torqueWritten = -1; // Aborted or collided, send it again
+    }
+}
+
+// Same timing as serviceTorqueSetpoint(), for all drives at once. Returns false
+// if the drives have to be written one by one.
+static bool serviceSetpointBroadcast() {
+    bool ready = setpointBroadcastReady();
+    if (ready != setpointBroadcasting) {
+        setpointBroadcasting = ready;
+        driveLog(ready ? "Setpoint broadcast to all drives." : "Setpoints written per drive.");
+    }
+    if (!ready) return false;
+
+    unsigned long now = millis();
+    bool due = false;
+    for (uint8_t i = 0; i < driveCount; i++) {
+        const Drive &d = drives[i];
+        if (d.torqueWritePending) return true; // Wait for the write in flight
+        if (d.torqueSetpoint != d.torqueWritten || now - d.lastTorqueWriteTime >= TORQUE_REFRESH_MS) due = true;
+    }
+    if (!due) return true;
+
+    modbus.selectSlave(MODBUS_BROADCAST_ID);
+    if (!modbus.writeSingleRegister(REG_TARGET_TORQUE, drives[0].torqueSetpoint, onBroadcastTorqueDone,
+                                    nullptr, 0, MB_PRIO_SETPOINT)) {
+        driveLog("MB queue full, dropped setpoint broadcast.");
+        return true;
+    }
+    for (uint8_t i = 0; i < driveCount; i++) setpointQueued(drives[i], now);
+    return true;
+}
+
+// --- Parameter Backup / Restore ---
+// One job at a time with one frame in flight, at housekeeping priority, so the
+// telemetry and the setpoint stream keep their bus time. A backup reads each
+// group in blocks of MODBUS_MAX_READ_REGS. The drive rejects a block holding a
+// register it does not have: such a block is split in halves down to single
+// registers, which are left out of the image. A restore reads the runs of the
+// image back the same way, then writes the registers that differ. Registers the
+// firmware owns (configuration shadow) are left to it.
+
+#define PARAM_JOB_RETRIES 3  // Attempts per frame after a bus error
+#define PARAM_SPAN_STACK 16  // Halves of rejected blocks waiting to be read
+
+DriveParamImage driveParams;
+
+enum ParamJobState : uint8_t {
+    PARAM_JOB_IDLE,
+    PARAM_JOB_BACKUP,
+    PARAM_JOB_RESTORE_READ,
+    PARAM_JOB_RESTORE_WRITE
+};
+
+// 32-bit parameters take a 0x10 write of both words, a 0x06 write of one word is refused
+enum ParamWriteMode : uint8_t {
+    PARAM_WRITE_SINGLE, // 0x06 of the register
+    PARAM_WRITE_LOW,    // 0x10 of the register and the next, it is the low word
+    PARAM_WRITE_HIGH    // 0x10 of the previous register and this one
+};
+
+struct ParamSpan {
+    uint16_t first; // Image index
+    uint16_t count;
+};
+
+struct ParamJob {
+    ParamJobState state = PARAM_JOB_IDLE;
+    Drive *drive = nullptr;
+    uint16_t next = 0;                 // Image index the next block or write starts from
+    ParamSpan stack[PARAM_SPAN_STACK]; // Halves of rejected blocks
+    uint8_t stackDepth = 0;
+    ParamSpan current = { 0, 0 };      // Block in flight, read again after a bus error
+    ParamWriteMode writeMode = PARAM_WRITE_SINGLE;
+    bool pending = false;              // Frame in flight
+    uint8_t retries = 0;
+    uint8_t differs[PARAM_REGS / 8];   // Restore: registers the drive holds another value of
+    uint16_t frames = 0;
+    uint16_t written = 0;
+    uint16_t refused = 0;              // Registers the drive did not let us read or write
+    uint16_t skipped = 0;              // Owned by the firmware or command registers
+    unsigned long startMs = 0;
+};
+static ParamJob paramJob;
+
+static bool paramDiffers(uint16_t i) { return paramJob.differs[i / 8] & (1 << (i % 8)); }
+static void paramSetDiffers(uint16_t i, bool on) {
+    if (on) paramJob.differs[i / 8] |= 1 << (i % 8);
+    else paramJob.differs[i / 8] &= ~(1 << (i % 8));
+}
+
+// Exception from the drive, as opposed to a bus error or an aborted request
+static bool driveRefused(uint8_t result) {
+    return result != MB_RESULT_SUCCESS && result < MB_RESULT_INVALID_SLAVE_ID;
+}
+
+static void finishParamJob(bool ok) {
+    ParamJob &job = paramJob;
+    Drive &d = *job.drive;
+    unsigned long ms = millis() - job.startMs;
+    if (!ok) {
+        driveLog(d, "Parameter %s aborted after %d frames.", job.state == PARAM_JOB_BACKUP ? "backup" : "restore",
+                 job.frames);
+    } else if (job.state == PARAM_JOB_BACKUP) {
+        driveLog(d, "Parameter backup: %d registers in %d frames, %lu ms, %d command registers skipped.",
+                 driveParams.count(), job.frames, ms, job.skipped);
+    } else {
+        // Skipped: owned by the firmware or command registers
+        driveLog(d, "Parameter restore: %d written, %d refused, %d skipped, %d frames, %lu ms.", job.written,
+                 job.refused, job.skipped, job.frames, ms);
+    }
+    job.state = PARAM_JOB_IDLE;
+    pushEvent(DRIVE_EVT_PARAMS_DONE, d.index, 0, ok);
+}
+
+// Counts a bus error of the frame in flight, aborts the job after PARAM_JOB_RETRIES
+static bool paramRetry() {
+    if (++paramJob.retries < PARAM_JOB_RETRIES && paramJob.drive->modbusOk) return true;
+    finishParamJob(false);
+    return false;
+}
+
+static void serviceParamJob();
+
+static void onParamReadDone(const ModbusTransaction &txn, uint8_t result, const uint16_t *words) {
+    ParamJob &job = paramJob;
+    job.pending = false;
+    if (job.state == PARAM_JOB_IDLE) return;
+    if (result == modbus.ku8MBAborted) {
+        finishParamJob(false);
+        return;
+    }
+    const ParamSpan span = job.current;
+    if (result == modbus.ku8MBSuccess) {
+        for (uint16_t k = 0; k < span.count; k++) {
+            if (job.state != PARAM_JOB_BACKUP) paramSetDiffers(span.first + k, words[k] != driveParams.values[span.first + k]);
+            else if (paramCommandRegister(paramAddress(span.first + k))) job.skipped++;
+            else driveParams.set(span.first + k, words[k]);
+        }
+    } else if (driveRefused(result)) {
+        if (span.count > 1 && job.stackDepth + 2 <= PARAM_SPAN_STACK) {
+            uint16_t half = span.count / 2;
+            job.stack[job.stackDepth++] = { (uint16_t)(span.first + half), (uint16_t)(span.count - half) };
+            job.stack[job.stackDepth++] = { span.first, half }; // Read next
+        } else if (job.state == PARAM_JOB_RESTORE_READ) {
+            job.refused += span.count; // In the image, but this drive does not have it
+        }
+    } else if (!paramRetry()) {
+        return;
+    } else {
+        job.stack[job.stackDepth++] = span;
+        serviceParamJob();
+        return;
+    }
+    job.retries = 0;
+    serviceParamJob(); // Next frame right away, the bus does not idle in between
+}
+
+static void onParamWriteDone(const ModbusTransaction &txn, uint8_t result, const uint16_t *words) {
+    ParamJob &job = paramJob;
+    job.pending = false;
+    if (job.state == PARAM_JOB_IDLE) return;
+    if (result == modbus.ku8MBAborted) {
+        finishParamJob(false);
+        return;
+    }
+    uint16_t i = paramIndex(txn.address);
+    if (result == modbus.ku8MBSuccess) {
+        for (uint16_t k = 0; k < txn.count; k++) paramSetDiffers(i + k, false);
+        job.written += txn.count;
+    } else if (driveRefused(result)) {
+        // Try it as part of a 32-bit parameter, then give up on the register
+        uint16_t reg = (job.writeMode == PARAM_WRITE_HIGH) ? i + 1 : i;
+        job.writeMode = (ParamWriteMode)(job.writeMode + 1);
+        job.next = reg;
+        if (job.writeMode <= PARAM_WRITE_HIGH) {
+            serviceParamJob();
+            return;
+        }
+        driveLog(*job.drive, "Parameter restore: C%02X.%02X refused (0x%X).", paramAddress(reg) >> 8,
+                 paramAddress(reg) & 0xFF, result);
+        paramSetDiffers(reg, false);
+        job.refused++;
+    } else if (!paramRetry()) {
+        return;
+    } else {
+        job.next = (job.writeMode == PARAM_WRITE_HIGH) ? i + 1 : i;
+        serviceParamJob();
+        return;
+    }
+    job.writeMode = PARAM_WRITE_SINGLE;
+    job.retries = 0;
+    serviceParamJob();
+}
+
+// The next block to read: a half of a rejected block, else the next block of a
+// group (backup) or the next run of the image (restore). False when done.
+static bool nextParamSpan(ParamSpan &span) {
+    ParamJob &job = paramJob;
+    if (job.stackDepth > 0) {
+        span = job.stack[--job.stackDepth];
+        return true;
+    }
+    while (job.next < PARAM_REGS) {
+        uint16_t groupEnd = (job.next / PARAM_GROUP_REGS + 1) * PARAM_GROUP_REGS;
+        uint16_t count = (job.state == PARAM_JOB_BACKUP)
+            ? min((uint16_t)(groupEnd - job.next), (uint16_t)MODBUS_MAX_READ_REGS)
+            : paramRunLength(driveParams, job.next, MODBUS_MAX_READ_REGS);
+        if (count == 0) {
+            job.next++;
+            continue;
+        }
+        span = { job.next, count };
+        job.next += count;
+        return true;
+    }
+    return false;
+}
+
+// Whether the firmware owns any word of the register at image index 'i', or it is a command register
+static bool paramOwned(const Drive &d, uint16_t i) {
+    uint16_t address = paramAddress(i);
+    if (paramCommandRegister(address)) return true;
+    for (uint8_t s = 0; s < SHADOW_COUNT; s++) {
+        const ShadowReg &reg = d.shadowRegs[s];
+        if (address >= reg.address && address < reg.address + reg.words) return true;
+    }
+    return false;
+}
+
+// Queues the next write of a restore. False when nothing differs any more.
+static bool queueParamWrite(Drive &d) {
+    ParamJob &job = paramJob;
+    while (job.next < PARAM_REGS && (!paramDiffers(job.next) || paramOwned(d, job.next))) {
+        if (paramDiffers(job.next)) {
+            paramSetDiffers(job.next, false);
+            job.skipped++;
+        }
+        job.next++;
+    }
+    if (job.next >= PARAM_REGS) return false;
+    uint16_t i = job.next;
+    // A pair needs both words in the image and in the same group
+    bool pairOk = (job.writeMode == PARAM_WRITE_LOW) ? paramIndex(paramAddress(i) + 1) == i + 1 && driveParams.has(i + 1)
+                : (job.writeMode == PARAM_WRITE_HIGH) ? i > 0 && paramIndex(paramAddress(i) - 1) == i - 1 && driveParams.has(i - 1)
+                : true;
+    if (!pairOk) {
+        job.writeMode = (ParamWriteMode)(job.writeMode + 1);
+        if (job.writeMode > PARAM_WRITE_HIGH) {
+            driveLog(d, "Parameter restore: C%02X.%02X refused.", paramAddress(i) >> 8, paramAddress(i) & 0xFF);
+            paramSetDiffers(i, false);
+            job.refused++;
+            job.writeMode = PARAM_WRITE_SINGLE;
+        }
+        return true; // Try again on the next pass
+    }
+    if (job.writeMode == PARAM_WRITE_SINGLE) {
+        job.pending = bus(d).writeSingleRegister(paramAddress(i), driveParams.values[i], onParamWriteDone, nullptr, 0,
+                                                 MB_PRIO_HOUSEKEEPING);
+    } else {
+        uint16_t first = (job.writeMode == PARAM_WRITE_LOW) ? i : i - 1;
+        job.pending = bus(d).writeMultipleRegisters(paramAddress(first), &driveParams.values[first], 2, onParamWriteDone,
+                                                    nullptr, 0, MB_PRIO_HOUSEKEEPING);
+    }
+    if (job.pending) job.frames++;
+    return true;
+}
+
+static void startParamJob(Drive &d, ParamJobState state) {
+    ParamJob &job = paramJob;
+    if (job.state != PARAM_JOB_IDLE) {
+        driveLog(d, "Parameter backup/restore already running.");
+        pushEvent(DRIVE_EVT_PARAMS_DONE, d.index, 0, false);
+        return;
+    }
+    if (!d.modbusOk || (state != PARAM_JOB_BACKUP && d.servoRunning)) {
+        driveLog(d, "Parameter %s needs the drive %s.", state == PARAM_JOB_BACKUP ? "backup" : "restore",
+                 d.modbusOk ? "disabled" : "connected");
+        pushEvent(DRIVE_EVT_PARAMS_DONE, d.index, 0, false);
+        return;
+    }
+    job = ParamJob();
+    job.state = state;
+    job.drive = &d;
+    job.startMs = millis();
+    memset(job.differs, 0, sizeof(job.differs));
+    if (state == PARAM_JOB_BACKUP) {
+        driveParams.clear();
+        driveParams.slaveId = d.slaveId;
+    }
+}
+
+// Issues the next frame of a running job
+static void serviceParamJob() {
+    ParamJob &job = paramJob;
+    if (job.state == PARAM_JOB_IDLE || job.pending) return;
+    Drive &d = *job.drive;
+    if (!d.modbusOk || (job.state != PARAM_JOB_BACKUP && d.servoRunning)) {
+        finishParamJob(false);
+        return;
+    }
+    if (job.state == PARAM_JOB_RESTORE_WRITE) {
+        if (!writesAllowed(d)) {
+            finishParamJob(false);
+        } else if (!queueParamWrite(d)) {
+            finishParamJob(true);
+        }
+        return;
+    }
+    ParamSpan span;
+    if (!nextParamSpan(span)) {
+        if (job.state == PARAM_JOB_BACKUP) {
+            finishParamJob(true);
+        } else {
+            job.state = PARAM_JOB_RESTORE_WRITE;
+            job.next = 0;
+        }
+        return;
+    }
+    job.current = span;
+    job.pending = bus(d).readHoldingRegisters(paramAddress(span.first), span.count, onParamReadDone, nullptr, 0,
+                                              MB_PRIO_HOUSEKEEPING);
+    if (job.pending) job.frames++;
+    else job.stack[job.stackDepth++] = span; // Queue full, again on the next pass
+}
+
+// --- Command Handling ---
+
+static void handleCommand(const DriveCommand &cmd) {
+    ModbusBatch *batch = (cmd.batch > 0 && cmd.batch < DRIVE_MAX_BATCHES) ? &batches[cmd.batch].io : nullptr;
+    if (cmd.drive >= driveCount) {
+        driveLog("Command %d for unknown drive %d dropped.", cmd.type, cmd.drive + 1);
+        if (batch) batch->failed = true;
+        return;
+    }
+    Drive &d = drives[cmd.drive];
+
+    switch (cmd.type) {
+        case DRIVE_CMD_SET_TORQUE:
+            if (cmd.value != d.torqueSetpoint && cmd.value >= 0 && d.servoRunning && !d.setpointChangePending) {
+                d.setpointChangePending = true;
+                d.setpointChangeUs = micros();
+            }
+            d.torqueSetpoint = cmd.value;
+            break;
+        case DRIVE_CMD_ENABLE:
+            queueEnable(d, batch);
+            break;
+        case DRIVE_CMD_ESTOP:
+            modbus.abortAll(); // Disables go out right after the frame on the bus
+            for (uint8_t i = 0; i < driveCount; i++) finishMacro(drives[i], false, "emergency stop");
+            for (uint8_t i = 0; i < driveCount; i++) queueDisable(drives[i], batch);
+            break;
+        case DRIVE_CMD_DISABLE:
+            queueDisable(d, batch);
+            break;
+        case DRIVE_CMD_WRITE_REG:
+            queueRegisterWrite(d, cmd.reg, (int16_t)cmd.value, false, batch);
+            break;
+        case DRIVE_CMD_WRITE_REG32:
+            queueRegisterWrite(d, cmd.reg, cmd.value, true, batch);
+            break;
+        case DRIVE_CMD_RUN_MACRO:
+            if (cmd.reg < MACRO_COUNT) startMacro(d, (DriveMacroId)cmd.reg, cmd.value, batch);
+            else if (batch) batch->failed = true;
+            break;
+        case DRIVE_CMD_POLL_PROFILE:
+            d.pollHomingRequested = (cmd.value == POLL_PROFILE_HOMING);
+            break;
+        case DRIVE_CMD_RESET_LATENCY:
+            modbus.latency.reset();
+            break;
+        case DRIVE_CMD_BUS_TARGET:
+            busTargetPct = constrain(cmd.value, 10, 95);
+            driveLog("Telemetry tuned for %d%% bus utilisation.", busTargetPct);
+            break;
+        case DRIVE_CMD_PARAM_BACKUP:
+            startParamJob(d, PARAM_JOB_BACKUP);
+            break;
+        case DRIVE_CMD_PARAM_RESTORE:
+            startParamJob(d, PARAM_JOB_RESTORE_READ);
+            break;
+        case DRIVE_CMD_BATCH_BEGIN:
+            if (batch) {
+                batchBegin(*batch);
+                batches[cmd.batch].reportPending = false;
+            }
+            break;
+        case DRIVE_CMD_BATCH_END:
+            if (batch) batches[cmd.batch].reportPending = true;
+            else pushEvent(DRIVE_EVT_BATCH_DONE, cmd.drive, cmd.batch, false);
+            break;
+    }
+}
+
+// --- Modbus TCP Gateway ---
+// Requests of the PC tools go out at the lowest priority, one at a time, so they
+// only get the bus time the control loop leaves. Their results do not count
+// towards the link state: a tool reading a register the drive refuses must not
+// take the drive offline.
+
+#define MB_EX_SLAVE_DEVICE_BUSY 0x06 // Bus queue full, the tool may retry
+
+static DriveGatewayFrame gatewayFrame; // Request in flight, the answer is built in its place
+static ModbusTcpHeader gatewayHeader;
+static ModbusPduRequest gatewayRequest;
+static bool gatewayPending = false;
+
+// Sends the PDU at gatewayFrame.adu + MBAP header back to the client
+static void gatewayAnswer(size_t pduLen, uint32_t busUs) {
+    gatewayFrame.length = modbusTcpBuildHeader(gatewayFrame.adu, gatewayHeader.transactionId,
+                                               gatewayHeader.unitId, pduLen) + pduLen;
+    gatewayFrame.busUs = busUs;
+    gatewayResponses.push(gatewayFrame); // Dropped (and counted) if appLoop() falls behind, the tool times out
+    gatewayPending = false;
+}
+
+static void gatewayException(uint8_t code, uint32_t busUs = 0) {
+    gatewayAnswer(modbusBuildExceptionPdu(gatewayFrame.adu + MODBUS_TCP_MBAP_LENGTH, gatewayRequest.function, code),
+                  busUs);
+}
+
+// The drive a unit id addresses. 0 and 255 ("this device") address the first one.
+static Drive *gatewayDrive(uint8_t unitId) {
+    if (unitId == 0 || unitId == 0xFF) return &drives[0];
+    for (uint8_t i = 0; i < driveCount; i++) {
+        if (drives[i].slaveId == unitId) return &drives[i];
+    }
+    return nullptr;
+}
+
+// A tool wrote registers the firmware owns: track what the drive holds now.
+// The difference shows up in configDirty until the configuration is applied again.
+static void gatewayWroteShadowed(Drive &d, uint16_t address, const uint16_t *values, uint16_t count) {
+    for (uint8_t i = 0; i < SHADOW_COUNT; i++) {
+        ShadowReg &reg = d.shadowRegs[i];
+        if (reg.address + reg.words <= address || reg.address >= address + count) continue;
+        if (reg.address >= address && reg.address + reg.words <= address + count) {
+            const uint16_t *w = &values[reg.address - address];
+            shadowConfirm(reg, reg.words == 2 ? (int32_t)((uint32_t)w[1] << 16 | w[0]) : (int32_t)(int16_t)w[0]);
+        } else {
+            shadowInvalidate(reg); // Only one word of a 32-bit register
+        }
+        if (reg.dirty) driveLog(d, "Gateway: %s (0x%04X) now differs from the firmware configuration.", reg.name, reg.address);
+    }
+}
+
+static void onGatewayDone(const ModbusTransaction &txn, uint8_t result, const uint16_t *words) {
+    uint32_t busUs = (result == modbus.ku8MBAborted) ? 0 : modbus.exchangeUs;
+    const ModbusPduRequest &r = gatewayRequest;
+    if (result == modbus.ku8MBSuccess) {
+        if (r.function == MB_FC_READ_WRITE_MULTIPLE_REGISTERS) {
+            gatewayWroteShadowed(driveOf(txn), r.writeAddress, r.values, r.writeCount);
+        } else if (r.function != MB_FC_READ_HOLDING_REGISTERS) {
+            gatewayWroteShadowed(driveOf(txn), r.address, r.values, r.count);
+        }
+        gatewayAnswer(modbusBuildResponsePdu(gatewayFrame.adu + MODBUS_TCP_MBAP_LENGTH, r, words), busUs);
+    } else if (result <= 0x7F) {
+        gatewayException(result, busUs); // Exception from the drive, passed through
+    } else {
+        gatewayException(result == modbus.ku8MBAborted ? MB_EX_GATEWAY_PATH_UNAVAILABLE : MB_EX_GATEWAY_TARGET_FAILED,
+                         busUs);
+    }
+}
+
+// Takes the next request from the Modbus TCP server once the previous one is answered
+static void serviceGateway() {
+    if (gatewayPending || !gatewayRequests.pop(gatewayFrame)) return;
+    gatewayPending = true;
+    modbusTcpParseHeader(gatewayFrame.adu, gatewayHeader);
+    ModbusPduRequest &r = gatewayRequest;
+    uint8_t error = modbusParseRequestPdu(gatewayFrame.adu + MODBUS_TCP_MBAP_LENGTH,
+                                          gatewayFrame.length - MODBUS_TCP_MBAP_LENGTH,
+                                          MODBUS_MAX_READ_REGS_PER_FRAME, MODBUS_MAX_WRITE_REGS, r);
+    if (error) {
+        gatewayException(error);
+        return;
+    }
+    Drive *d = gatewayDrive(gatewayHeader.unitId);
+    if (!d) {
+        gatewayException(MB_EX_GATEWAY_PATH_UNAVAILABLE);
+        return;
+    }
+    if (!d->modbusOk) {
+        gatewayException(MB_EX_GATEWAY_TARGET_FAILED);
+        return;
+    }
+
+    bool queued = false;
+    switch (r.function) {
+        case MB_FC_READ_HOLDING_REGISTERS:
+            queued = bus(*d).readHoldingRegisters(r.address, r.count, onGatewayDone, nullptr, 0, MB_PRIO_GATEWAY);
+            break;
+        case MB_FC_WRITE_SINGLE_REGISTER:
+            queued = bus(*d).writeSingleRegister(r.address, r.values[0], onGatewayDone, nullptr, 0, MB_PRIO_GATEWAY);
+            break;
+        case MB_FC_WRITE_MULTIPLE_REGISTERS:
+            queued = bus(*d).writeMultipleRegisters(r.address, r.values, r.count, onGatewayDone, nullptr, 0,
+                                                    MB_PRIO_GATEWAY);
+            break;
+        case MB_FC_READ_WRITE_MULTIPLE_REGISTERS:
+            queued = bus(*d).readWriteMultipleRegisters(r.address, r.count, r.writeAddress, r.values, r.writeCount,
+                                                        onGatewayDone, nullptr, 0, MB_PRIO_GATEWAY);
+            break;
+    }
+    if (!queued) gatewayException(MB_EX_SLAVE_DEVICE_BUSY);
+}
+
+// --- Service Loop ---
+
+static void reportFinishedBatches() {
+    for (uint8_t b = 1; b < DRIVE_MAX_BATCHES; b++) {
+        if (batches[b].reportPending && batchDone(batches[b].io)) {
+            batches[b].reportPending = false;
+            pushEvent(DRIVE_EVT_BATCH_DONE, 0, b, !batches[b].io.failed);
+        }
+    }
+}
+
+// Connection check and reconnect of one drive
+static void serviceConnection(Drive &d, unsigned long currentTime) {
+    if (!d.modbusOk && (currentTime - d.lastModbusCheckTime >= modbusCheckInterval)) {
+        d.lastModbusCheckTime = currentTime;
+        checkModbusConnection(d);
+    }
+    if (d.reconnectApplyPending && d.modbusOk && d.readbackPending == 0) {
+        d.reconnectApplyPending = false;
+        startReconnect(d);
+    }
+}
+
+// One pass of the drive task
+static void driveService() {
+    unsigned long currentTime = millis();
+
+    // 1. Commands from appLoop(), in order
+    DriveCommand cmd;
+    while (driveCommands.pop(cmd)) handleCommand(cmd);
+
+    // 2. Check Modbus connection (if not ok and interval elapsed), continue the register macros
+    for (uint8_t i = 0; i < driveCount; i++) {
+        serviceConnection(drives[i], currentTime);
+        serviceMacro(drives[i]);
+    }
+
+    // 3. Read the telemetry fields that are due, the drives take turns on the bus.
+    //    While a link is down appLoop() still gets a sample of that drive.
+    for (uint8_t i = 0; i < driveCount; i++) {
+        Drive &d = drives[i];
+        updatePollProfile(d);
+        if (!telemetryAllowed(d) && d.telemetryPending == 0 && currentTime - d.lastSampleTime >= modbusReadInterval) {
+            publishSample(d, 0);
+        }
+    }
+    scheduleTelemetry(currentTime);
+    updateFieldRates(currentTime);
+
+    // 4. Torque setpoints, only while running. Queued at setpoint priority, ahead of all reads.
+    //    One broadcast for all drives while they share the setpoint.
+    if (!serviceSetpointBroadcast()) {
+        for (uint8_t i = 0; i < driveCount; i++) serviceTorqueSetpoint(drives[i]);
+    }
+
+    // 5. Requests of Modbus TCP clients and parameter backup/restore, below everything else
+    serviceGateway();
+    serviceParamJob();
+
+    // 6. Service the bus, completion callbacks update the state above
+    modbus.poll();
+    reportFinishedBatches();
+#if MODBUS_CAPTURE
+    modbusCapture.service(micros());
+#endif
+}
+
+// CPU time of the drive task per Modbus transaction, and task wakeups per second
+static void updateBusStats(unsigned long now) {
+    unsigned long elapsed = now - statsWindowStart;
+    if (elapsed < BUS_STATS_WINDOW_MS) return;
+    uint32_t transactions = modbus.transactions - statsTransactions;
+    cpuUsPerTxn = transactions ? min(serviceBusyUs / transactions, (uint32_t)UINT16_MAX) : 0;
+    wakeupsPerSec = min(serviceWakeups * 1000UL / elapsed, (unsigned long)UINT16_MAX);
+    serviceBusyUs = 0;
+    serviceWakeups = 0;
+    statsTransactions = modbus.transactions;
+    statsWindowStart = now;
+}
+
+static RtuPort *drivePort = nullptr;
+
+static void driveTaskMain(void *arg) {
+    for (;;) {
+        uint32_t startUs = micros();
+        driveService();
+        serviceBusyUs += micros() - startUs;
+        serviceWakeups++;
+        updateBusStats(millis());
+        // While a response is due, sleep until the port reports data (the IDF port
+        // wakes up at the frame end). Otherwise one tick (1 ms), lets loop() run on the same core.
+        // This tick is the resolution of the inter-frame gap, see ModbusRtuMaster.h.
+        if (modbus.waitingForResponse()) drivePort->waitForData(1);
+        else vTaskDelay(1);
+    }
+}
+
+// --- Setup ---
+
+bool driveBegin(uint8_t uartNum, int rxPin, int txPin, int dePin, const uint8_t *slaveIds, const uint8_t *weights,
+                uint8_t count, uint32_t baud, int32_t softLimitNeg) {
+    if (count == 0 || count > DRIVE_MAX_COUNT) return false;
+#if MODBUS_UART_IDF
+    static IdfRtuPort idfPort;
+    if (!idfPort.begin((uart_port_t)uartNum, rxPin, txPin, dePin, baud)) return false;
+    drivePort = &idfPort;
+#else
+    static HardwareSerial serial(uartNum);
+    serial.begin(baud, SERIAL_8N1, rxPin, txPin);
+    if (!serial) return false;
+    if (dePin >= 0) {
+        if (!serial.setPins(-1, -1, -1, dePin) || !serial.setMode(UART_MODE_RS485_HALF_DUPLEX)) return false;
+    }
+    static SerialRtuPort serialPort(serial, dePin >= 0);
+    drivePort = &serialPort;
+#endif
+#if MODBUS_CAPTURE
+    static CaptureRtuPort<ModbusCapture<MODBUS_CAPTURE_BYTES>> capturePort(*drivePort, modbusCapture);
+    drivePort = &capturePort;
+#endif
+    driveLog("Modbus port: %s", drivePort->name());
+    modbus.begin(*drivePort, slaveIds[0], baud);
+
+    driveCount = count;
+    for (uint8_t i = 0; i < driveCount; i++) {
+        Drive &d = drives[i];
+        d.index = i;
+        d.slaveId = slaveIds[i];
+        d.weight = max(weights[i], (uint8_t)1);
+        memcpy(d.shadowRegs, shadowTemplate, sizeof(shadowTemplate));
+        setShadowValue(d, REG_SOFT_LIMIT_NEG, softLimitNeg);
+        if (driveCount > 1) driveLog(d, "Slave ID %d, telemetry weight %d", d.slaveId, d.weight);
+        rebuildReadPlans(d);
+    }
+    return true;
+}
+
+uint8_t driveConnect() {
+    for (uint8_t i = 0; i < driveCount; i++) checkModbusConnection(drives[i]);
+    modbusFlush();
+    uint8_t connected = 0;
+    for (uint8_t i = 0; i < driveCount; i++) {
+        drives[i].reconnectApplyPending = false; // Configuration is applied by driveApplyConfig()
+        if (drives[i].modbusOk) connected++;
+    }
+    return connected;
+}
+
+bool driveLinkOk(uint8_t drive) {
+    return drive < driveCount && drives[drive].modbusOk;
+}
+
+const ModbusLatencyStats &driveLatencyStats() {
+    return modbus.latency;
+}
+
+// Switches the UART and the bus timing to 'baud'
+static void setLinkBaud(uint32_t baud) {
+    modbus.setBaud(baud);
+}
+
+// Connection check at 'baud', returns the number of drives that answered
+static uint8_t probeBaud(uint32_t baud) {
+    setLinkBaud(baud);
+    delay(20); // Let the line settle after the switch
+    driveLog("Probing drives at %lu baud...", (unsigned long)baud);
+    return driveConnect();
+}
+
+static int32_t baudCodeReadback = -1;
+
+static void onBaudCodeRead(const ModbusTransaction &txn, uint8_t result, const uint16_t *words) {
+    baudCodeReadback = (result == modbus.ku8MBSuccess) ? words[0] : -1;
+}
+
+uint32_t driveNegotiateBaud(uint32_t storedBaud, uint32_t fallbackBaud, uint32_t targetBaud) {
+    // 1. Find the rate the drives talk at. C0A.01 only applies after re-power-on,
+    //    so a drive may have changed its rate since the last boot.
+    const uint32_t candidates[] = { storedBaud, fallbackBaud, targetBaud };
+    const uint8_t candidateCount = sizeof(candidates) / sizeof(candidates[0]);
+    uint32_t baud = 0;
+    uint8_t answered = 0;
+    for (uint8_t i = 0; i < candidateCount && baud == 0; i++) {
+        bool tried = false;
+        for (uint8_t j = 0; j < i; j++) tried |= (candidates[j] == candidates[i]);
+        if (tried) continue;
+        answered = probeBaud(candidates[i]);
+        if (answered > 0) baud = candidates[i];
+    }
+    if (baud == 0) {
+        setLinkBaud(storedBaud); // The drive task keeps checking at the last known rate
+        return 0;
+    }
+    if (answered < driveCount) {
+        driveLog("%d of %d drives answer at %lu baud.", answered, driveCount, (unsigned long)baud);
+    }
+    if (baud == targetBaud) return baud;
+
+    // 2. Ask the drives for the target rate (the servos are still off, C0A.01 is set "at stop")
+    uint16_t code = a6BaudCode(targetBaud);
+    if (code == 0) {
+        driveLog("Drive does not support %lu baud, staying at %lu baud.", (unsigned long)targetBaud, (unsigned long)baud);
+        return baud;
+    }
+    for (uint8_t i = 0; i < driveCount; i++) {
+        Drive &d = drives[i];
+        if (!d.modbusOk) continue;
+        baudCodeReadback = -1;
+        bus(d).readHoldingRegisters(REG_MODBUS_BAUD, 1, onBaudCodeRead);
+        modbusFlush();
+        if (baudCodeReadback == code) continue;
+        driveLog(d, "Setting drive baud rate C0A.01 = %d (%lu baud)...", code, (unsigned long)targetBaud);
+        ModbusBatch baudBatch;
+        batchBegin(baudBatch);
+        queueWrite(d, REG_MODBUS_BAUD, code, &baudBatch);
+        modbusFlush();
+        if (baudBatch.failed) {
+            driveLog(d, "FAILED to write C0A.01, staying at %lu baud.", (unsigned long)baud);
+            return probeBaud(baud) ? baud : 0;
+        }
+    }
+
+    // 3. Verify the new rate with a test read. The A6 switches only after a power
+    //    cycle, until then this fails and we fall back to the working rate. The bus
+    //    only moves if every drive that answered before answers at the new rate.
+    if (probeBaud(targetBaud) >= answered) {
+        driveLog("Drives answer at %lu baud.", (unsigned long)targetBaud);
+        return targetBaud;
+    }
+    driveLog("Drives not answering at %lu baud yet (C0A.01 applies after re-power-on), falling back to %lu baud.",
+             (unsigned long)targetBaud, (unsigned long)baud);
+    return probeBaud(baud) ? baud : 0;
+}
+
+bool driveApplyConfig() {
+    bool ok = true;
+    for (uint8_t i = 0; i < driveCount; i++) {
+        Drive &d = drives[i];
+        if (!d.modbusOk) continue;
+        ModbusBatch configBatch;
+        batchBegin(configBatch);
+        queueDriveConfig(d, &configBatch);
+        while (!batchDone(configBatch)) { // Failed writes are logged by their callbacks
+            serviceMacro(d);
+            modbus.poll();
+            yield();
+        }
+        modbusFlush();
+        if (!configBatch.failed) probeCombinedReadWrite(d); // Servo is disabled now
+        else ok = false;
+    }
+    return ok;
+}
+
+void driveStartTask() {
+    for (uint8_t i = 0; i < driveCount; i++) {
+        drives[i].lastCycleTime = millis(); drives[i].lastModbusCheckTime = millis();
+    }
+    rateWindowStart = millis();
+    xTaskCreatePinnedToCore(driveTaskMain, "drive", DRIVE_TASK_STACK_SIZE, nullptr,
+                            DRIVE_TASK_PRIORITY, nullptr, DRIVE_TASK_CORE);
+}
@@ -0,0 +1,110 @@
+/*
+ * Modbus RTU Port on the ESP-IDF UART Driver - see IdfRtuPort.h
+ */
+
+#include "IdfRtuPort.h"
+
+bool IdfRtuPort::begin(uart_port_t port, int rxPin, int txPin, int dePin, uint32_t baud) {
+    _port = port;
+    _rs485 = (dePin >= 0);
+    _echoCheck = _rs485 && RTU_RS485_ECHO_CHECK;
+    uart_config_t config = {};
+    config.baud_rate = baud;
+    config.data_bits = UART_DATA_8_BITS;
+    config.parity = UART_PARITY_DISABLE;
+    config.stop_bits = UART_STOP_BITS_1;
+    config.flow_ctrl = UART_HW_FLOWCTRL_DISABLE;
+    config.source_clk = UART_SCLK_DEFAULT;
+
+    // No TX ring buffer: requests are short and go straight into the 128 byte TX FIFO
+    if (uart_driver_install(_port, RTU_UART_RX_BUFFER, 0, RTU_UART_EVENT_QUEUE, &_events, 0) != ESP_OK) return false;
+    if (uart_param_config(_port, &config) != ESP_OK) return false;
+    if (uart_set_pin(_port, txPin, rxPin, _rs485 ? dePin : UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE) != ESP_OK) return false;
+    if (_echoCheck) {
+        // The receiver stays on while we send, DE is switched in write()
+        if (uart_set_mode(_port, UART_MODE_RS485_COLLISION_DETECT) != ESP_OK || uart_set_rts(_port, 1) != ESP_OK) return false;
+    } else if (_rs485 && uart_set_mode(_port, UART_MODE_RS485_HALF_DUPLEX) != ESP_OK) {
+        return false;
+    }
+    return uart_set_rx_timeout(_port, RTU_UART_RX_TIMEOUT_SYMBOLS) == ESP_OK;
+}
+
+void IdfRtuPort::setBaud(uint32_t baud) {
+    uart_set_baudrate(_port, baud);
+}
+
+int IdfRtuPort::available() {
+    takeEcho();
+    size_t length = 0;
+    uart_get_buffered_data_len(_port, &length);
+    return (int)length;
+}
+
+size_t IdfRtuPort::read(uint8_t *buffer, size_t length) {
+    takeEcho();
+    int n = uart_read_bytes(_port, buffer, length, 0);
+    return n > 0 ? n : 0;
+}
+
+void IdfRtuPort::write(const uint8_t *frame, size_t length) {
+    if (!_echoCheck) {
+        uart_write_bytes(_port, frame, length);
+        return;
+    }
+    _txLen = min(length, sizeof(_tx));
+    memcpy(_tx, frame, _txLen);
+    _echoLen = 0;
+    uart_set_rts(_port, 0); // DE on (RTS output high)
+    uart_write_bytes(_port, frame, length);
+    uart_wait_tx_done(_port, pdMS_TO_TICKS(RTU_TX_DONE_TIMEOUT_MS)); // Last stop bit out, well before the drive answers
+    uart_set_rts(_port, 1); // DE off
+}
+
+void IdfRtuPort::takeEcho() {
+    while (_echoLen < _txLen) {
+        size_t buffered = 0;
+        uart_get_buffered_data_len(_port, &buffered);
+        if (buffered == 0) return;
+        uint8_t echo[32];
+        int n = uart_read_bytes(_port, echo, min(min(buffered, _txLen - _echoLen), sizeof(echo)), 0);
+        if (n <= 0) return;
+        if (memcmp(echo, _tx + _echoLen, n) != 0) _collision = true;
+        _echoLen += n;
+    }
+}
+
+void IdfRtuPort::flushInput() {
+    uart_flush_input(_port);
+    _echoLen = _txLen; // An echo still pending is gone with the rest
+}
+
+// A broadcast gets no response, so its echo may not have been read yet
+bool IdfRtuPort::takeCollision() {
+    if (!_echoCheck) return false;
+    takeEcho();
+    bool collision = _collision;
+    _collision = false;
+    if (collision) collisions++;
+    return collision;
+}
+
+void IdfRtuPort::waitForData(uint32_t ms) {
+    uart_event_t event;
+    if (xQueueReceive(_events, &event, pdMS_TO_TICKS(ms)) != pdTRUE) return;
+    switch (event.type) {
+        case UART_DATA:
+            if (event.timeout_flag) frameEvents++;
+            else dataEvents++;
+            break;
+        case UART_FIFO_OVF:
+        case UART_BUFFER_FULL:
+            // The frame in progress is lost either way, the master sees it as truncated
+            overflows++;
+            uart_flush_input(_port);
+            xQueueReset(_events);
+            break;
+        default:
+            lineErrors++;
+            break;
+    }
+}
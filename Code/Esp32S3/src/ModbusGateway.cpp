@@ -0,0 +1,162 @@
+/*
+ * Modbus TCP Gateway - see ModbusGateway.h
+ *
+ * A client slot is claimed and closed by the AsyncTCP task and freed by
+ * appLoop(), which also owns the statistics. Answers carry the connection
+ * counter of their slot, so an answer to a closed connection is dropped
+ * instead of going to the next client in that slot.
+ */
+
+#include "ModbusGateway.h"
+#include <AsyncTCP.h>
+#include <atomic>
+#include "DriveTask.h"
+
+static_assert(DRIVE_GATEWAY_MAX_FRAME >= MODBUS_TCP_MAX_ADU, "Gateway frames must hold the largest Modbus TCP ADU");
+
+enum GatewaySlotState : uint8_t {
+    SLOT_FREE,   // Claimed by the AsyncTCP task
+    SLOT_ACTIVE,
+    SLOT_CLOSED  // Disconnected, freed by gatewayLoop()
+};
+
+struct GatewaySlot {
+    std::atomic<uint8_t> state{SLOT_FREE};
+    AsyncClient *client = nullptr;
+    uint8_t connection = 0;
+    IPAddress remoteIp;
+
+    // AsyncTCP task
+    uint8_t rx[MODBUS_TCP_MAX_ADU]; // Partial frame
+    uint16_t rxLen = 0;
+    std::atomic<uint32_t> dropped{0};
+
+    // appLoop()
+    GatewayClientStats stats = {};
+    uint32_t windowBusUs = 0;
+};
+
+static GatewaySlot slots[GATEWAY_MAX_CLIENTS];
+static AsyncServer *gatewayServer = nullptr;
+static unsigned long statsWindowStart = 0;
+
+// --- AsyncTCP Task ---
+
+static void queueRequest(uint8_t index, const uint8_t *adu, uint16_t length) {
+    GatewaySlot &slot = slots[index];
+    DriveGatewayFrame frame;
+    frame.client = index;
+    frame.connection = slot.connection;
+    frame.length = length;
+    frame.busUs = 0;
+    memcpy(frame.adu, adu, length);
+    if (!gatewayRequests.push(frame)) slot.dropped.fetch_add(1, std::memory_order_relaxed);
+}
+
+// Splits the TCP stream into Modbus TCP frames
+static void onGatewayData(void *arg, AsyncClient *client, void *data, size_t len) {
+    uint8_t index = (uintptr_t)arg;
+    GatewaySlot &slot = slots[index];
+    const uint8_t *bytes = (const uint8_t *)data;
+    while (len > 0) {
+        size_t n = min(len, sizeof(slot.rx) - slot.rxLen);
+        memcpy(slot.rx + slot.rxLen, bytes, n);
+        slot.rxLen += n;
+        bytes += n;
+        len -= n;
+        for (;;) {
+            int frameLen = modbusTcpFrameLength(slot.rx, slot.rxLen);
+            if (frameLen < 0) { // Not Modbus TCP
+                client->close(true);
+                return;
+            }
+            if (frameLen == 0) break;
+            queueRequest(index, slot.rx, frameLen);
+            slot.rxLen -= frameLen;
+            memmove(slot.rx, slot.rx + frameLen, slot.rxLen);
+        }
+    }
+}
+
+static void onGatewayDisconnect(void *arg, AsyncClient *client) {
+    slots[(uintptr_t)arg].state.store(SLOT_CLOSED, std::memory_order_release);
+}
+
+static void onGatewayClient(void *arg, AsyncClient *client) {
+    for (uint8_t i = 0; i < GATEWAY_MAX_CLIENTS; i++) {
+        GatewaySlot &slot = slots[i];
+        if (slot.state.load(std::memory_order_acquire) != SLOT_FREE) continue;
+        slot.client = client;
+        slot.connection++;
+        slot.remoteIp = client->remoteIP();
+        slot.rxLen = 0;
+        slot.dropped.store(0, std::memory_order_relaxed);
+        client->setNoDelay(true);
+        client->onData(onGatewayData, (void *)(uintptr_t)i);
+        client->onDisconnect(onGatewayDisconnect, (void *)(uintptr_t)i);
+        slot.state.store(SLOT_ACTIVE, std::memory_order_release);
+        return;
+    }
+    // All slots taken
+    client->onDisconnect([](void *, AsyncClient *c) { delete c; });
+    client->close(true);
+}
+
+// --- appLoop() ---
+
+bool gatewayBegin(uint16_t port) {
+    if (gatewayServer) return true;
+    gatewayServer = new AsyncServer(port);
+    if (!gatewayServer) return false;
+    gatewayServer->setNoDelay(true);
+    gatewayServer->onClient(onGatewayClient, nullptr);
+    gatewayServer->begin();
+    statsWindowStart = millis();
+    return true;
+}
+
+void gatewayLoop() {
+    static DriveGatewayFrame frame;
+    while (gatewayResponses.pop(frame)) {
+        if (frame.client >= GATEWAY_MAX_CLIENTS) continue;
+        GatewaySlot &slot = slots[frame.client];
+        if (slot.state.load(std::memory_order_acquire) != SLOT_ACTIVE || slot.connection != frame.connection) continue;
+        slot.client->write((const char *)frame.adu, frame.length);
+        slot.stats.requests++;
+        if (frame.adu[MODBUS_TCP_MBAP_LENGTH] & 0x80) slot.stats.exceptions++;
+        slot.stats.busUs += frame.busUs;
+        slot.windowBusUs += frame.busUs;
+    }
+
+    for (uint8_t i = 0; i < GATEWAY_MAX_CLIENTS; i++) {
+        GatewaySlot &slot = slots[i];
+        if (slot.state.load(std::memory_order_acquire) != SLOT_CLOSED) continue;
+        delete slot.client;
+        slot.client = nullptr;
+        slot.stats = {};
+        slot.windowBusUs = 0;
+        slot.state.store(SLOT_FREE, std::memory_order_release);
+    }
+
+    unsigned long now = millis();
+    unsigned long elapsed = now - statsWindowStart;
+    if (elapsed < GATEWAY_STATS_WINDOW_MS) return;
+    for (uint8_t i = 0; i < GATEWAY_MAX_CLIENTS; i++) {
+        GatewaySlot &slot = slots[i];
+        slot.stats.busMsPerSec = min(slot.windowBusUs / elapsed, (unsigned long)UINT16_MAX); // us per ms = ms per s
+        slot.windowBusUs = 0;
+    }
+    statsWindowStart = now;
+}
+
+GatewayClientStats gatewayClient(uint8_t index) {
+    GatewayClientStats stats = {};
+    if (index >= GATEWAY_MAX_CLIENTS) return stats;
+    const GatewaySlot &slot = slots[index];
+    if (slot.state.load(std::memory_order_acquire) != SLOT_ACTIVE) return stats;
+    stats = slot.stats;
+    stats.connected = true;
+    stats.remoteIp = slot.remoteIp;
+    stats.dropped = slot.dropped.load(std::memory_order_relaxed);
+    return stats;
+}
@@ -0,0 +1,347 @@
+/*
+ * Non-blocking Modbus RTU Master - see ModbusRtuMaster.h
+ */
+
+#include "ModbusRtuMaster.h"
+
+static const uint32_t classDeadlineUs[MB_PRIO_COUNT] = {
+    MODBUS_DEADLINE_SAFETY_US, MODBUS_DEADLINE_SETPOINT_US, MODBUS_DEADLINE_FEEDBACK_US, MODBUS_DEADLINE_HOUSEKEEPING_US,
+    MODBUS_DEADLINE_GATEWAY_US
+};
+
+void ModbusRtuMaster::begin(RtuPort &port, uint8_t slaveId, uint32_t baud) {
+    _port = &port;
+    _slaveId = slaveId;
+    setBaud(baud);
+    for (uint8_t p = 0; p < MB_PRIO_COUNT; p++) {
+        _head[p] = 0;
+        _count[p] = 0;
+    }
+    _total = 0;
+    _state = STATE_IDLE;
+    _lastActivityUs = micros();
+}
+
+void ModbusRtuMaster::setBaud(uint32_t baud) {
+    if (_port) _port->setBaud(baud);
+    _charUs = (11UL * 1000000UL + baud - 1) / baud; // 11 bit character, rounded up
+    _t35Us = baud > 19200 ? MODBUS_T35_FIXED_US : (7 * _charUs + 1) / 2;
+    _gapUs = _t35Us;
+    _responseTimeoutUs = MODBUS_RESPONSE_TIMEOUT_MS * 1000UL;
+    _gapGoodCount = 0;
+    turnaroundMinUs = 0;
+    turnaroundMaxUs = 0;
+    turnaroundAvgUs = 0;
+}
+
+bool ModbusRtuMaster::enqueue(ModbusTransaction &txn) {
+    uint8_t p = txn.priority < MB_PRIO_COUNT ? txn.priority : MB_PRIO_GATEWAY;
+    if (_count[p] >= MODBUS_QUEUE_SIZE) return false;
+    if (_slaveId == MODBUS_BROADCAST_ID && (txn.function == MB_FC_READ_HOLDING_REGISTERS
+                                            || txn.function == MB_FC_READ_WRITE_MULTIPLE_REGISTERS)) {
+        return false; // Nobody would answer
+    }
+    txn.slaveId = _slaveId;
+    txn.queuedUs = micros();
+    txn.startUs = 0;
+    _queue[p][(_head[p] + _count[p]) % MODBUS_QUEUE_SIZE] = txn;
+    _count[p]++;
+    _total++;
+    return true;
+}
+
+bool ModbusRtuMaster::readHoldingRegisters(uint16_t address, uint16_t count, ModbusCallback callback,
+                                           void *context, uint32_t tag, ModbusPriority priority) {
+    if (count == 0 || count > MODBUS_MAX_READ_REGS_PER_FRAME) return false;
+    ModbusTransaction txn;
+    txn.function = MB_FC_READ_HOLDING_REGISTERS;
+    txn.address = address;
+    txn.count = count;
+    txn.callback = callback;
+    txn.context = context;
+    txn.tag = tag;
+    txn.priority = priority;
+    return enqueue(txn);
+}
+
+bool ModbusRtuMaster::writeSingleRegister(uint16_t address, uint16_t value, ModbusCallback callback,
+                                          void *context, uint32_t tag, ModbusPriority priority) {
+    ModbusTransaction txn;
+    txn.function = MB_FC_WRITE_SINGLE_REGISTER;
+    txn.address = address;
+    txn.count = 1;
+    txn.values[0] = value;
+    txn.callback = callback;
+    txn.context = context;
+    txn.tag = tag;
+    txn.priority = priority;
+    return enqueue(txn);
+}
+
+bool ModbusRtuMaster::writeMultipleRegisters(uint16_t address, const uint16_t *values, uint16_t count,
+                                             ModbusCallback callback, void *context, uint32_t tag,
+                                             ModbusPriority priority) {
+    if (count == 0 || count > MODBUS_MAX_WRITE_REGS) return false;
+    ModbusTransaction txn;
+    txn.function = MB_FC_WRITE_MULTIPLE_REGISTERS;
+    txn.address = address;
+    txn.count = count;
+    for (uint16_t i = 0; i < count; i++) txn.values[i] = values[i];
+    txn.callback = callback;
+    txn.context = context;
+    txn.tag = tag;
+    txn.priority = priority;
+    return enqueue(txn);
+}
+
+bool ModbusRtuMaster::readWriteMultipleRegisters(uint16_t readAddress, uint16_t readCount, uint16_t writeAddress,
+                                                 const uint16_t *values, uint16_t writeCount, ModbusCallback callback,
+                                                 void *context, uint32_t tag, ModbusPriority priority) {
+    if (readCount == 0 || readCount > MODBUS_MAX_READ_REGS_PER_FRAME) return false;
+    if (writeCount == 0 || writeCount > MODBUS_MAX_WRITE_REGS) return false;
+    ModbusTransaction txn;
+    txn.function = MB_FC_READ_WRITE_MULTIPLE_REGISTERS;
+    txn.address = readAddress;
+    txn.count = readCount;
+    txn.writeAddress = writeAddress;
+    txn.writeCount = writeCount;
+    for (uint16_t i = 0; i < writeCount; i++) txn.values[i] = values[i];
+    txn.callback = callback;
+    txn.context = context;
+    txn.tag = tag;
+    txn.priority = priority;
+    return enqueue(txn);
+}
+
+bool ModbusRtuMaster::queuePause(uint16_t ms, ModbusPriority priority) {
+    ModbusTransaction txn;
+    txn.function = MB_FC_PAUSE;
+    txn.address = 0;
+    txn.count = ms;
+    txn.callback = nullptr;
+    txn.context = nullptr;
+    txn.tag = 0;
+    txn.priority = priority;
+    return enqueue(txn);
+}
+
+void ModbusRtuMaster::abortAll() {
+    // Only drop what is queued now, callbacks may queue new requests
+    for (uint8_t p = 0; p < MB_PRIO_COUNT; p++) {
+        uint8_t n = _count[p];
+        while (n-- > 0 && _count[p] > 0) {
+            ModbusTransaction txn = _queue[p][_head[p]];
+            _head[p] = (_head[p] + 1) % MODBUS_QUEUE_SIZE;
+            _count[p]--;
+            _total--;
+            if (txn.callback) txn.callback(txn, ku8MBAborted, nullptr);
+        }
+    }
+}
+
+void ModbusRtuMaster::abortSlave(uint8_t slaveId) {
+    for (uint8_t p = 0; p < MB_PRIO_COUNT; p++) {
+        // Keep the requests of the other slaves in order, report the dropped ones afterwards
+        ModbusTransaction dropped[MODBUS_QUEUE_SIZE];
+        uint8_t droppedCount = 0;
+        uint8_t kept = 0;
+        for (uint8_t i = 0; i < _count[p]; i++) {
+            const ModbusTransaction &txn = _queue[p][(_head[p] + i) % MODBUS_QUEUE_SIZE];
+            if (txn.slaveId == slaveId) dropped[droppedCount++] = txn;
+            else _queue[p][(_head[p] + kept++) % MODBUS_QUEUE_SIZE] = txn;
+        }
+        _count[p] = kept;
+        _total -= droppedCount;
+        for (uint8_t i = 0; i < droppedCount; i++) {
+            if (dropped[i].callback) dropped[i].callback(dropped[i], ku8MBAborted, nullptr);
+        }
+    }
+}
+
+// True if the oldest request of class 'prio' waited longer than its deadline
+bool ModbusRtuMaster::overdue(uint8_t prio, uint32_t now) const {
+    return now - _queue[prio][_head[prio]].queuedUs > classDeadlineUs[prio];
+}
+
+// Class of the next request: the highest class with a request, unless a lower
+// class missed its deadline and the higher one did not. SAFETY always goes first.
+int8_t ModbusRtuMaster::nextClass(uint32_t now) const {
+    int8_t best = -1;
+    for (uint8_t p = 0; p < MB_PRIO_COUNT; p++) {
+        if (_count[p] == 0) continue;
+        if (best < 0) {
+            if (p == MB_PRIO_SAFETY) return p;
+            best = p;
+        } else if (overdue(p, now) && !overdue(best, now)) {
+            best = p;
+        }
+    }
+    return best;
+}
+
+// Pops the next request of class 'prio' and puts it on the bus
+void ModbusRtuMaster::start(uint8_t prio) {
+    _active = _queue[prio][_head[prio]];
+    _head[prio] = (_head[prio] + 1) % MODBUS_QUEUE_SIZE;
+    _count[prio]--;
+    _total--;
+    _startUs = micros();
+    _active.startUs = _startUs;
+
+    ModbusClassStats &stats = classStats[prio];
+    stats.waitUs = _startUs - _active.queuedUs;
+    if (stats.waitUs > stats.waitMaxUs) stats.waitMaxUs = stats.waitUs;
+    if (stats.waitUs > classDeadlineUs[prio]) stats.deadlineMisses++;
+
+    if (_active.function == MB_FC_PAUSE) {
+        _state = STATE_PAUSE;
+        return;
+    }
+
+    uint8_t frame[MODBUS_RTU_MAX_FRAME];
+    size_t len = 0;
+    switch (_active.function) {
+        case MB_FC_READ_HOLDING_REGISTERS:
+            len = modbusBuildReadRequest(frame, _active.slaveId, _active.address, _active.count);
+            break;
+        case MB_FC_WRITE_SINGLE_REGISTER:
+            len = modbusBuildWriteSingleRequest(frame, _active.slaveId, _active.address, _active.values[0]);
+            break;
+        case MB_FC_WRITE_MULTIPLE_REGISTERS:
+            len = modbusBuildWriteMultipleRequest(frame, _active.slaveId, _active.address, _active.values, _active.count);
+            break;
+        case MB_FC_READ_WRITE_MULTIPLE_REGISTERS:
+            len = modbusBuildReadWriteRequest(frame, _active.slaveId, _active.address, _active.count,
+                                              _active.writeAddress, _active.values, _active.writeCount);
+            break;
+    }
+
+    _port->flushInput(); // Drop stale bytes from a previous frame
+    _rxLen = 0;
+    _txTimeUs = len * _charUs;
+    _port->write(frame, len);
+    _state = (_active.slaveId == MODBUS_BROADCAST_ID) ? STATE_BROADCAST : STATE_WAIT_RESPONSE;
+}
+
+// Finishes the active request and reports the result
+void ModbusRtuMaster::complete(uint8_t result) {
+    ModbusTransaction txn = _active; // The callback may queue new requests
+    _state = STATE_IDLE;
+    _lastActivityUs = micros();
+
+    const uint16_t *words = nullptr;
+    if (txn.function != MB_FC_PAUSE) {
+        lastBusUs = _gapUs + (_lastActivityUs - _startUs);
+        busUs += lastBusUs;
+    }
+    if (txn.slaveId == MODBUS_BROADCAST_ID && txn.function != MB_FC_PAUSE) {
+        broadcasts++;
+        if (_port->takeCollision()) {
+            collisions++;
+            result = ku8MBInvalidCRC; // Can not trust what the drives received
+        }
+    } else if (txn.function != MB_FC_PAUSE) {
+        responseUs = _lastRxUs;
+        exchangeUs = _lastActivityUs - _startUs;
+        if (exchangeUs > exchangeMaxUs) exchangeMaxUs = exchangeUs;
+        exchangeAvgUs = exchangeAvgUs ? exchangeAvgUs + ((int32_t)exchangeUs - (int32_t)exchangeAvgUs) / 16 : exchangeUs;
+        if (_port->takeCollision()) {
+            collisions++;
+            if (result == ku8MBSuccess) result = ku8MBInvalidCRC; // Can not trust what the drive received
+        }
+        adaptGap(result);
+        adaptResponseTimeout(result);
+        latency.add(txn.function, txn.address, exchangeUs);
+        transactions++;
+        if (result != ku8MBSuccess) failures++;
+        if (result != ku8MBSuccess && result < MB_RESULT_INVALID_SLAVE_ID) exceptions++;
+        if (result == ku8MBResponseTimedOut) timeouts++;
+        if (result == ku8MBSuccess && (txn.function == MB_FC_READ_HOLDING_REGISTERS
+                                       || txn.function == MB_FC_READ_WRITE_MULTIPLE_REGISTERS)) {
+            for (uint16_t i = 0; i < txn.count; i++) _words[i] = modbusResponseWord(_rx, i);
+            words = _words;
+        }
+    }
+    if (txn.callback) txn.callback(txn, result, words);
+}
+
+// 'firstByteUs' is the estimated arrival of the first response byte
+void ModbusRtuMaster::recordTurnaround(uint32_t firstByteUs) {
+    int32_t t = (int32_t)(firstByteUs - (_startUs + _txTimeUs));
+    turnaroundUs = t > 0 ? t : 0;
+    if (turnaroundUs > turnaroundMaxUs) turnaroundMaxUs = turnaroundUs;
+    if (turnaroundUs < turnaroundMinUs || turnaroundMinUs == 0) turnaroundMinUs = turnaroundUs;
+    turnaroundAvgUs = turnaroundAvgUs ? turnaroundAvgUs + ((int32_t)turnaroundUs - (int32_t)turnaroundAvgUs) / 16 : turnaroundUs;
+}
+
+// A timeout may mean the drive did not see the end of the previous frame: back off.
+// After a run of answered requests, move back towards t3.5.
+void ModbusRtuMaster::adaptGap(uint8_t result) {
+    if (result == ku8MBResponseTimedOut) {
+        _gapUs = min(_gapUs * 2, (uint32_t)MODBUS_MAX_GAP_US);
+        _gapGoodCount = 0;
+    } else if (result != ku8MBAborted && ++_gapGoodCount >= MODBUS_GAP_SHRINK_AFTER) {
+        _gapGoodCount = 0;
+        _gapUs = max(_gapUs - _gapUs / 8, _t35Us);
+    }
+}
+
+// Answered: follow the longest turnaround. Timed out: the full timeout for the next
+// request, in case the drive is just slower than anything seen so far.
+void ModbusRtuMaster::adaptResponseTimeout(uint8_t result) {
+    if (result == ku8MBResponseTimedOut) {
+        _responseTimeoutUs = MODBUS_RESPONSE_TIMEOUT_MS * 1000UL;
+    } else if (_rxLen > 0 && turnaroundMaxUs > 0) {
+        uint32_t derived = turnaroundMaxUs * MODBUS_TURNAROUND_MARGIN + MODBUS_RX_LATENCY_US;
+        derived = max(derived, (uint32_t)MODBUS_MIN_RESPONSE_TIMEOUT_MS * 1000);
+        _responseTimeoutUs = min(derived, (uint32_t)MODBUS_RESPONSE_TIMEOUT_MS * 1000);
+    }
+}
+
+void ModbusRtuMaster::poll() {
+    if (!_port) return;
+    uint32_t now = micros();
+    service(now);
+    pollBusyUs += micros() - now;
+}
+
+void ModbusRtuMaster::service(uint32_t now) {
+
+    switch (_state) {
+        case STATE_IDLE:
+            if (_total > 0 && now - _lastActivityUs >= _gapUs) start(nextClass(now));
+            break;
+
+        case STATE_PAUSE:
+            if (now - _startUs >= (uint32_t)_active.count * 1000UL) complete(ku8MBSuccess);
+            break;
+
+        case STATE_BROADCAST:
+            // No response, the drives get the turnaround delay to act on the frame
+            if (now - _startUs >= _txTimeUs + MODBUS_BROADCAST_DELAY_US) complete(ku8MBSuccess);
+            break;
+
+        case STATE_WAIT_RESPONSE: {
+            // Drain first, so a late poll() still sees a response that arrived in time
+            int avail = _port->available();
+            if (avail > 0) {
+                // The first byte arrived at least 'avail' characters ago
+                if (_rxLen == 0) recordTurnaround(now - avail * _charUs);
+                _lastRxUs = now;
+                _rxLen += _port->read(_rx + _rxLen, sizeof(_rx) - _rxLen);
+            }
+            uint8_t result;
+            if (modbusCheckResponse(_rx, _rxLen, _active.slaveId, _active.function, _active.count, result)) {
+                complete(result);
+            } else if (_rxLen > 0 && now - _lastRxUs > _t35Us + MODBUS_RX_LATENCY_US) {
+                // The line went silent for more than t3.5 inside the response: the frame ended incomplete
+                truncated++;
+                complete(ku8MBInvalidCRC);
+            } else if (_rxLen == 0 && now - _startUs > _txTimeUs + _responseTimeoutUs) {
+                complete(ku8MBResponseTimedOut);
+            } else if (now - _startUs > _txTimeUs + MODBUS_RESPONSE_TIMEOUT_MS * 1000UL) {
+                complete(ku8MBResponseTimedOut); // Kept trickling in without ever completing
+            }
+        } break;
+    }
+}
@@ -14,14 +14,18 @@
 #include "esp_wifi.h"
 #include <ESPAsyncWebServer.h>
 #include <AsyncTCP.h>
-#include <ModbusMaster.h>
 #include <HardwareSerial.h>
 #include <ArduinoJson.h>
 #include <Preferences.h>
+#include <LittleFS.h>
+#include "ServoRegisterMap.h"
+#include "DriveTask.h"
+#include "ModbusGateway.h"
 
 // --- Pin Definitions (ESP32-S3) ---
 #define RXD2_PIN 6 // Modbus Serial2 RX
 #define TXD2_PIN 4 // Modbus Serial2 TX
+#define RS485_DE_PIN -1 // DE of an RS485 transceiver (UART RTS), -1 = TTL converter with auto direction. /RE low for the collision check (IdfRtuPort.h)
 
 // --- WiFi Configuration ---
 Preferences preferences;
@@ -30,81 +34,163 @@ String savedPassword = "";
 const char *apSSID = "ServoSetup";
 
 // --- Modbus Configuration ---
-#define SERVO_DRIVE_SLAVE_ID 1
-ModbusMaster node;
-HardwareSerial ModbusSerial(2);
-
-// --- Modbus Register Addresses (Hex) ---
-#define REG_CONTROL_MODE 0x0000        // C00.00
-#define REG_TARGET_SPEED 0x0321        // C03.21
-#define REG_TORQUE_REF_SRC 0x0340      // C03.40
-#define REG_TARGET_TORQUE 0x0341       // C03.41
-#define REG_MODBUS_SERVO_ON 0x0411     // Servo Enable/Disable (Write)
-#define REG_DI5_FUNCTION 0x0410        // C04.10
-#define REG_SOFT_LIMIT_ENABLE 0x0607   // C06.07 (1=Enable +/- Limits)
-#define REG_SOFT_LIMIT_NEG 0x0608      // C06.08 (32-bit Negative Limit) - Alias for clarity
-#define REG_C06_08 REG_SOFT_LIMIT_NEG  // Keep old name for compatibility
-#define REG_OUT_OF_CONTROL_PROT 0x0620 // C06.20 (Out of Control Protection Mode)
-#define REG_SPEED_FEEDBACK 0x4001      // U40.01
-#define REG_TORQUE_FEEDBACK 0x4003     // U40.03
-#define REG_DI_STATUS 0x0404           // C04.04 according to doc, but seems U40.04 in practice? Using 0x4004 for now.
-#define REG_BUS_VOLTAGE 0x4006         // U40.06
-#define REG_RMS_CURRENT 0x400C         // U40.0C
-#define REG_POSITION_FEEDBACK_L 0x4016 // U40.16 (Low)
-#define REG_POSITION_FEEDBACK_H 0x4017 // U40.16 (High)
-#define REG_TEMP_IGBT 0x4030           // U40.30 (IGBT Temperature in 0.1 C)
-#define REG_TEMP_MOTOR 0x4031          // U40.31 (Motor Temperature in 0.1 C)
-#define REG_SERVO_STATUS 0x410A        // U41.0A
+// Drives on the RS485 bus, one per cable stack, e.g. { 1, 2 } for a left and a right
+// stack. While the bus is saturated the telemetry frames divide between the drives
+// in proportion to their weights.
+const uint8_t driveSlaveIds[] = { 1 };
+const uint8_t driveTelemetryWeights[] = { 1 };
+#define DRIVE_COUNT ((uint8_t)(sizeof(driveSlaveIds) / sizeof(driveSlaveIds[0])))
+static_assert(DRIVE_COUNT <= DRIVE_MAX_COUNT, "More drives than the drive task supports");
+static_assert(sizeof(driveTelemetryWeights) == sizeof(driveSlaveIds), "One telemetry weight per drive");
+#define MODBUS_BAUD 57600         // Fallback rate, known to work
+#define MODBUS_TARGET_BAUD 115200 // Fastest rate of the A6 (C0A.01 = 7)
+#define MODBUS_UART_NUM 2         // Opened by the drive task (IDF UART driver or HardwareSerial)
+#define BUS_TARGET_DEFAULT_PCT 80 // Bus utilisation the telemetry poll rates are tuned for
+uint32_t modbusBaud = MODBUS_BAUD; // Rate in use, stored in Preferences
+
+// --- Modbus Register Addresses ---
+// Register addresses and the telemetry field table live in ServoRegisterMap.h
 
 // --- Webserver & WebSocket ---
 AsyncWebServer server(80);
 AsyncWebSocket ws("/ws");
-StaticJsonDocument<350> wsJsonTx; // Slightly increased size for temp values
-StaticJsonDocument<128> wsJsonRx;
+StaticJsonDocument<6144> wsJsonTx; // Status record incl. all drives, the drive queue statistics and latency percentiles. appLoop() only.
+StaticJsonDocument<128> wsJsonRx;  // WebSocket handler only
 #define MAX_LOG_MSG_LENGTH 150
 
+// Replies to one WebSocket client. The handler runs in the AsyncTCP task, so
+// it queues them and appLoop() builds them in wsJsonTx.
+enum WsReplyType : uint8_t {
+    WS_REPLY_CONNECTED,       // "Client connected" and the status record
+    WS_REPLY_STATUS,          // getStatus
+    WS_REPLY_HOMING_REJECTED  // startHoming while the drive can not home
+};
+
+struct WsReply {
+    uint32_t clientId;
+    WsReplyType type;
+    uint8_t drive;
+};
+
+SpscQueue<WsReply, 8> wsReplies; // Dropped if full, the client asks again with getStatus
+
 // --- Global State Variables ---
-bool servoIsEnabledTarget = false;
-bool servoIsEnabledActual = false;
-bool modbusOk = false;
-int16_t currentTargetTorque = 0; // Represents the MAX torque (0-2000) sent to servo
-int16_t actualSpeed = 0;
-int16_t actualTorque = 0;
-uint16_t busVoltage = 0;
-int16_t rmsCurrent = 0;
-int32_t actualPosition = 0;
-int16_t igbtTemp = 0;
-int16_t motorTemp = 0;
-uint16_t actualServoStatus = 0;
-uint16_t diStatus = 0;
-int modbusConsecutiveErrors = 0; // Counter for Modbus errors
-const int MAX_MODBUS_ERRORS = 5; // Number of errors before connection is considered bad
-bool enableCmdSent = false;      // Track if enable command was sent
+volatile bool eStopRequested = false; // Set by the WebSocket handler, served by appLoop()
+volatile bool latencyResetRequested = false; // Same, clears the bus latency histograms
+volatile int8_t busTargetRequested = -1;     // Same, new bus utilisation target in %
+
+// --- Modbus Traffic Capture ---
+// Started and stopped over the WebSocket, downloaded from /capture (RAM, once stopped)
+// or /capture?flash=1 (last capture saved to LittleFS). Replayed with Code/HostTools/mbreplay.
+#define CAPTURE_FILE "/modbus.cap"
+enum CaptureRequest : uint8_t {
+    CAPTURE_REQ_NONE,
+    CAPTURE_REQ_START,
+    CAPTURE_REQ_START_TRIGGERED, // Stops itself after a link loss and saves to flash
+    CAPTURE_REQ_STOP,
+    CAPTURE_REQ_SAVE
+};
+volatile CaptureRequest captureRequest = CAPTURE_REQ_NONE; // Set by the WebSocket handler, served by appLoop()
+std::atomic<uint8_t> captureDownloads{0}; // /capture responses reading the ring, a new capture waits for them
+bool captureSaveWhenFrozen = false;
+bool captureWasRecording = false;
+bool flashOk = false;
+
+// --- Drive Parameter Backup ---
+// C00..C06 of a drive, read by the drive task and saved to LittleFS, one file
+// per drive. Backup and restore are started over the WebSocket (paramBackup,
+// paramRestore), the file is downloaded from and uploaded to /params?drive=N.
+// Drives count from 0 in the URLs, like the "drive" of the WebSocket commands.
+// A restore writes only the registers that differ from the file.
+#define PARAMS_FILE "/params%d.bin" // Drive number 1..DRIVE_COUNT
+enum ParamRequest : uint8_t {
+    PARAM_REQ_NONE,
+    PARAM_REQ_BACKUP,
+    PARAM_REQ_RESTORE
+};
+volatile ParamRequest paramRequest = PARAM_REQ_NONE; // Set by the WebSocket handler, served by appLoop()
+volatile uint8_t paramRequestDrive = 0;
+ParamRequest paramJob = PARAM_REQ_NONE;  // Running in the drive task, driveParams belongs to it
+uint8_t paramJobDrive = 0;
+bool paramJobDone = false;               // DRIVE_EVT_PARAMS_DONE seen
+bool paramJobOk = false;
+uint8_t paramBlob[PARAM_BLOB_MAX];       // File contents, appLoop() only
+uint8_t paramUpload[PARAM_BLOB_MAX];     // Body of a POST /params, AsyncTCP task until handed over
+size_t paramUploadLength = 0;
+AsyncWebServerRequest *paramUploadRequest = nullptr; // Upload being received, one at a time
+std::atomic<uint8_t> paramUploadDrive{0}; // Drive number of a received upload waiting for appLoop(), 0 = none
+
+// --- Register Macros ---
+// A macro in text form (DriveMacro.h) posted to /macro?drive=N runs on that
+// drive, one at a time. The result is logged by the drive task.
+#define MACRO_TEXT_MAX 2048
+char macroText[MACRO_TEXT_MAX];          // Body of a POST /macro, AsyncTCP task
+size_t macroTextLength = 0;
+AsyncWebServerRequest *macroUploadRequest = nullptr; // Upload being received, one at a time
+DriveMacro macroUpload;                  // Parsed, AsyncTCP task until handed over
+std::atomic<uint8_t> macroUploadDrive{0}; // Drive number of a parsed macro waiting for appLoop(), 0 = none
+bool userMacroRunning = false;           // Running in the drive task, driveUserMacro belongs to it
 
 // --- Homing State ---
 enum HomingState {
     HOMING_IDLE,
     HOMING_START,
-    HOMING_WAIT_FOR_RUNNING,
+    HOMING_START_PENDING,    // Waiting for the homing start macro: speed mode, enable, 'Running'
     HOMING_MOVING_SLOW,
-    HOMING_DONE
+    HOMING_DONE,
+    HOMING_FINISHING         // Waiting for the homing finish macro: torque mode, soft limits
 };
-volatile HomingState homingState = HOMING_IDLE;
-int32_t homingPosition = 0; // Loaded from Preferences or set by Homing
 const int16_t HOMING_SPEED_RPM = 120; // Homing speed 120 RPM
 const int16_t HOMING_TORQUE_THRESHOLD = 200; // 20.0% Torque (as "current" threshold)
 
-// Timer variables for Homing
-unsigned long homingStartTime = 0;
-const long HOMING_START_TIMEOUT = 2000; // 2 seconds wait for "Running"
+// --- Per-Drive State ---
+// One entry per drive on the bus. Telemetry comes from the drive task's samples,
+// enable/disable and homing run per drive.
+struct DriveState {
+    bool servoIsEnabledTarget = false;
+    bool servoIsEnabledActual = false;
+    bool modbusOk = false;
+    int16_t currentTargetTorque = 0; // Represents the MAX torque (0-2000) sent to servo
+    int16_t actualSpeed = 0;
+    int16_t actualTorque = 0;
+    uint16_t busVoltage = 0;
+    int16_t rmsCurrent = 0;
+    int32_t actualPosition = 0;
+    int32_t followingError = 0;
+    uint16_t loadRatio = 0;
+    int16_t igbtTemp = 0;
+    int16_t motorTemp = 0;
+    uint16_t actualServoStatus = 0;
+    uint16_t diStatus = 0;
+    bool enableCmdSent = false;      // Track if enable command was sent
+    bool disableCmdPending = false;  // Disable command sent but not yet answered
+    int16_t sentTorqueSetpoint = -1; // Last setpoint sent to the drive task, -1 = paused
+    bool sentPollHoming = false;     // Homing poll profile requested from the drive task
+    volatile int16_t pendingDI5Func = -1; // DI5 function requested via WebSocket, -1 = none
+
+    // Homing
+    volatile HomingState homingState = HOMING_IDLE;
+    int32_t homingPosition = 0; // Loaded from Preferences or set by Homing
+
+    // Telemetry statistics
+    uint8_t lastCycleTransactions = 0;
+    uint32_t lastCycleUs = 0;      // Duration of the last telemetry cycle
+    uint32_t sampleTimeUs = 0;     // Acquisition time of the telemetry, drive task micros()
+    uint32_t acquisitionUs = 0;    // Spread of the arrival times of the fields read for it
+    uint32_t configDirtyMask = 0;  // Drive config registers that differ from what we want
+    uint32_t configMismatches = 0; // Verified config writes that read back different
+    PollProfile pollProfile = POLL_PROFILE_IDLE;
+    uint8_t fieldRateHz[FIELD_COUNT] = {}; // Effective telemetry read rate per field
+    uint16_t telemetryHz = 0;      // Telemetry frames per second
+    uint8_t telemetryShare = 0;    // Share of all telemetry frames on the bus, %
+    uint32_t setpointLatencyUs = 0;
+    uint32_t setpointLatencyMaxUs = 0;
+};
+DriveState drives[DRIVE_COUNT];
 
 // Timing control
-unsigned long lastModbusReadTime = 0;
-unsigned long lastModbusCheckTime = 0;
 unsigned long lastWsSendTime = 0;
-const long modbusReadInterval = 50;
-const long modbusCheckInterval = 2000;
-const long wsSendInterval = 100;
+const long wsSendInterval = 100; // Modbus timing lives in the drive task
 unsigned long wifiReconnectTimer = 0;
 
 // Flag if we are in AP mode
@@ -119,11 +205,10 @@ void logToBrowser(const char* format, ...) {
     va_end(args);
     Serial.println(msgBuffer); // Always to Serial
     if (!isInAPMode && ws.count() > 0 && WiFi.status() == WL_CONNECTED) {
-        bool likely_in_ws_callback = false; // Simplified assumption
-        if (!likely_in_ws_callback) {
-             wsJsonTx.clear(); wsJsonTx["type"] = "log"; wsJsonTx["message"] = msgBuffer;
-             String jsonString; serializeJson(wsJsonTx, jsonString); ws.textAll(jsonString);
-        }
+        // Own document: also called from the WebSocket handler, while appLoop() may be using wsJsonTx
+        StaticJsonDocument<JSON_OBJECT_SIZE(2)> doc;
+        doc["type"] = "log"; doc["message"] = (const char *)msgBuffer; // Stored as a pointer, not copied
+        String jsonString; serializeJson(doc, jsonString); ws.textAll(jsonString);
     }
 }
 
@@ -175,6 +260,10 @@ const char index_html[] PROGMEM = R"rawliteral(
 <body>
   <div class="container">
     <h2>A6-RS Servo Control</h2>
+    <div class="control-group" id="driveGroup" style="display: none;">
+      <label for="driveSelect">Drive:</label>
+      <select id="driveSelect"></select>
+    </div>
     <div class="control-group">
       <!-- *** LABEL, RANGE, STEP, VALUE changed *** -->
       <label for="weightSlider">Target Weight (kg):</label> 
@@ -191,12 +280,26 @@ const char index_html[] PROGMEM = R"rawliteral(
     </div>
     <div class="status">
       <h4>Status</h4>
-      <p>Modbus: <span id="modbusStatus" class="status-badge status-modbus-fail">Checking...</span></p>
+      <p>Modbus: <span id="modbusStatus" class="status-badge status-modbus-fail">Checking...</span> (<span id="mbTx">0</span> frames/cycle)</p>
+      <p>Read Cycle: <strong id="mbCycle">0.0</strong> ms, sample acquired within <span id="acqSpan">0.0</span> ms at <span id="mbBaud">0</span> baud (turnaround <span id="mbTurn">0</span> us [<span id="mbTurnRange">0-0</span>], <span id="mbColl">0</span> collisions, gap <span id="mbGap">0</span> us)</p>
+      <p>Bus Cost: <span id="mbCpu">0</span> us CPU/frame, exchange <span id="mbExch">0</span> us (max <span id="mbExchMax">0</span> us), <span id="drvWake">0</span> wakeups/s</p>
+      <p>Bus Load: <strong id="mbLoad">0</strong> % of <input type="number" id="mbTarget" min="10" max="95" style="width:4em"> % target, poll periods at <span id="pollPct">100</span> % of the table</p>
+      <p>Exchange Latency (p50/p90/p99/max us): <span id="latStats">-</span> <button id="latResetBtn">Reset</button></p>
+      <p>Latency by Register Group: <span id="latGroups">-</span> (details at <a href="/latency">/latency</a>)</p>
+      <p>Setpoint Latency: <strong id="spLat">0.0</strong> ms (max <span id="spLatMax">0.0</span> ms, <span id="mbMiss">0</span> late frames)</p>
+      <p>Drive Parameters (C00..C06): <button id="paramBackupBtn">Backup</button> <a id="paramDownload" href="/params?drive=0">Download</a>
+         <input type="file" id="paramFile"> <button id="paramRestoreBtn">Restore</button></p>
+      <p>Drive Queues (depth/max/overflows): <span id="queueStats">-</span></p>
+      <p>Poll Rates (<span id="pollProfile">idle</span>, Hz): <span id="rateStats">-</span></p>
+      <p>Telemetry (frames/s per drive, share): <span id="telStats">-</span> of <span id="telTotal">0</span> frames/s</p>
+      <p>Modbus TCP (port 502, requests/exceptions, bus ms/s): <span id="gwStats">no clients</span></p>
       <p>Servo: <span id="servoStatus" class="status-badge status-off">Unknown</span> (<span id="servoStatusCode">?</span>)</p>
       <p>Position: <strong id="actualPosition">0</strong></p>
       <p>Speed: <strong id="actualSpeed">0</strong> rpm</p>
       <p>Actual Torque: <strong id="actualTorque">0.0</strong> %</p>
       <p>Current: <strong id="rmsCurrent">0.0</strong> A</p>
+      <p>Load Ratio: <strong id="loadRatio">0.0</strong> %</p>
+      <p>Following Error: <strong id="followingError">0</strong></p>
       <p>Bus Voltage: <strong id="busVoltage">0.0</strong> V</p>
       <p>IGBT Temp: <strong id="igbtTemp">0.0</strong> &deg;C</p>
       <p>Motor Temp: <strong id="motorTemp">0.0</strong> &deg;C</p>
@@ -226,6 +329,9 @@ const char index_html[] PROGMEM = R"rawliteral(
   var websocket;
   // var targetTorque = 0; // No longer directly used by slider
   var servoTargetState = false; 
+  var selectedDrive = 0;  // Index of the drive shown and controlled, see driveSelect
+  var driveCount = 0;
+  var lastDrives = [];
   var logTextArea = null;
   const MAX_LOG_LINES = 100;
 
@@ -236,6 +342,8 @@ const char index_html[] PROGMEM = R"rawliteral(
   var posChartData = { labels: commonLabels, datasets: [{ label: 'Position (Steps)', data: [], borderColor: 'rgb(75, 192, 192)', backgroundColor: 'rgba(75, 192, 192, 0.5)', tension: 0.1 }] };
   var voltChartData = { labels: commonLabels, datasets: [{ label: 'Bus Voltage (V)', data: [], borderColor: 'rgb(255, 99, 132)', backgroundColor: 'rgba(255, 99, 132, 0.5)', tension: 0.1 }] };
   const TIME_WINDOW_MS = 20000; // 20 seconds
+  var deviceClock = null;  // Drive task time (tUs) and the browser time it maps to, for the charts
+  var lastChartUs = null;  // Acquisition time of the last charted sample
 
   // *** NEW: Conversion factor ***
   const KG_TO_MODBUS_FACTOR = 169.8; // Approx (9.81 * 0.022 / 1.27) * 100 * 10
@@ -256,6 +364,11 @@ const char index_html[] PROGMEM = R"rawliteral(
     document.getElementById('disableBtn').addEventListener('click', onDisableClick);
     document.getElementById('homeBtn').addEventListener('click', onHomeClick);
     document.getElementById('estopBtn').addEventListener('click', onEstopClick); 
+    document.getElementById('driveSelect').addEventListener('change', onDriveChange);
+    document.getElementById('latResetBtn').addEventListener('click', onLatencyResetClick);
+    document.getElementById('paramBackupBtn').addEventListener('click', onParamBackupClick);
+    document.getElementById('paramRestoreBtn').addEventListener('click', onParamRestoreClick);
+    document.getElementById('mbTarget').addEventListener('change', onBusTargetChange);
     updateButtonStates(false, false); 
   }
 
@@ -271,6 +384,18 @@ const char index_html[] PROGMEM = R"rawliteral(
     });
   }
 
+  // Browser time in ms of a sample acquired at 'tUs' on the device. Follows the
+  // 32-bit device clock step by step, so it survives the wrap after 71 minutes,
+  // and starts over from the browser clock when the two drift apart (reboot, reconnect).
+  function deviceTimeMs(tUs) {
+    if (deviceClock) {
+      deviceClock.ms += ((tUs - deviceClock.us) | 0) / 1000.0;
+      deviceClock.us = tUs;
+    }
+    if (!deviceClock || Math.abs(deviceClock.ms - Date.now()) > 2000) deviceClock = { us: tUs, ms: Date.now() };
+    return deviceClock.ms;
+  }
+
   // Adds data to BOTH charts and enforces time window (unchanged)
   function addDataToCharts(timestamp, position, voltage) {
     if (!posChart || !voltChart) return;
@@ -335,8 +460,8 @@ const char index_html[] PROGMEM = R"rawliteral(
       }
       
       if (data.type === 'homingStatus') {
-        logToConsole('Homing Status: ' + data.message);
-        if (data.status === 'finished' || data.status === 'failed') {
+        logToConsole('Homing Status (drive ' + (data.drive + 1) + '): ' + data.message);
+        if (data.drive === selectedDrive && (data.status === 'finished' || data.status === 'failed')) {
             document.getElementById('homeBtn').disabled = false;
             document.getElementById('homeBtn').classList.remove('btn-disabled');
         }
@@ -344,43 +469,94 @@ const char index_html[] PROGMEM = R"rawliteral(
       }
 
       if (data.type === 'status') {
-        // Update status indicators (as before)
-        document.getElementById('actualPosition').textContent = data.pos;
-        document.getElementById('actualSpeed').textContent = data.spd;
-        document.getElementById('actualTorque').textContent = (data.trq / 10.0).toFixed(1);
-        document.getElementById('rmsCurrent').textContent = (data.cur / 10.0).toFixed(1);
-        document.getElementById('busVoltage').textContent = (data.vbus / 10.0).toFixed(1);
-        document.getElementById('igbtTemp').textContent = (data.igbtTemp / 10.0).toFixed(1); 
-        document.getElementById('motorTemp').textContent = (data.motorTemp / 10.0).toFixed(1); 
-
-        document.getElementById('modbusStatus').textContent = data.modbusOk ? 'OK' : 'FAIL';
-        document.getElementById('modbusStatus').className = data.modbusOk ? 'status-badge status-modbus-ok' : 'status-badge status-modbus-fail';
+        lastDrives = data.drives || [];
+        updateDriveSelect(lastDrives.length);
+        var d = lastDrives[selectedDrive];
+        if (!d) return;
+        document.getElementById('telStats').textContent =
+            lastDrives.map((x, i) => (i + 1) + ': ' + x.telHz + ' (' + x.telShare + '%)').join(', ');
+        document.getElementById('telTotal').textContent = data.telHz;
+        if (data.lat) {
+            // [samples, p50, p90, p99, max] per function code and register group
+            const fmt = (h, prefix) => Object.keys(h).map(k => prefix + k + ' ' + h[k].slice(1).join('/') + ' (' + h[k][0] + ')').join(', ') || '-';
+            document.getElementById('latStats').textContent = fmt(data.lat.fc, 'fc');
+            document.getElementById('latGroups').textContent = fmt(data.lat.grp, '');
+        }
+        if (data.gw) {
+            document.getElementById('gwStats').textContent = data.gw.length == 0 ? 'no clients' :
+                data.gw.map(c => c.ip + ' ' + c.req + '/' + c.exc + ', ' + c.busMs + ' ms/s').join('; ');
+        }
+
+        // Update status indicators of the selected drive
+        document.getElementById('actualPosition').textContent = d.pos;
+        document.getElementById('actualSpeed').textContent = d.spd;
+        document.getElementById('actualTorque').textContent = (d.trq / 10.0).toFixed(1);
+        document.getElementById('rmsCurrent').textContent = (d.cur / 10.0).toFixed(1);
+        document.getElementById('busVoltage').textContent = (d.vbus / 10.0).toFixed(1);
+        document.getElementById('igbtTemp').textContent = (d.igbtTemp / 10.0).toFixed(1); 
+        document.getElementById('motorTemp').textContent = (d.motorTemp / 10.0).toFixed(1); 
+        document.getElementById('loadRatio').textContent = (d.load / 10.0).toFixed(1);
+        document.getElementById('followingError').textContent = d.posErr;
+
+        document.getElementById('modbusStatus').textContent = d.modbusOk ? 'OK' : 'FAIL';
+        document.getElementById('mbTx').textContent = d.mbTx;
+        document.getElementById('mbCycle').textContent = (d.mbCycleUs / 1000.0).toFixed(1);
+        document.getElementById('acqSpan').textContent = (d.acqUs / 1000.0).toFixed(1);
+        document.getElementById('mbTurn').textContent = data.mbTurnUs;
+        document.getElementById('mbTurnRange').textContent = data.mbTurnMinUs + '-' + data.mbTurnMaxUs;
+        document.getElementById('mbColl').textContent = data.mbColl;
+        document.getElementById('mbBaud').textContent = data.mbBaud;
+        document.getElementById('mbGap').textContent = data.mbGapUs;
+        document.getElementById('mbCpu').textContent = data.mbCpuUs;
+        document.getElementById('mbExch').textContent = data.mbExchUs;
+        document.getElementById('mbExchMax').textContent = data.mbExchMaxUs;
+        document.getElementById('drvWake').textContent = data.drvWake;
+        document.getElementById('spLat').textContent = (d.spLatUs / 1000.0).toFixed(1);
+        document.getElementById('spLatMax').textContent = (d.spLatMaxUs / 1000.0).toFixed(1);
+        document.getElementById('mbMiss').textContent = data.mbMiss;
+        document.getElementById('mbLoad').textContent = data.mbLoad;
+        document.getElementById('pollPct').textContent = data.pollPct;
+        let target = document.getElementById('mbTarget');
+        if (document.activeElement !== target) target.value = data.mbTarget;
+        if (d.rateHz) {
+            document.getElementById('pollProfile').textContent = ['idle', 'running', 'homing'][d.pollProfile] || '?';
+            document.getElementById('rateStats').textContent =
+                Object.keys(d.rateHz).map(k => k + ' ' + d.rateHz[k]).join(', ');
+        }
+        if (data.queues) {
+            document.getElementById('queueStats').textContent =
+                Object.keys(data.queues).map(k => k + ' ' + data.queues[k].join('/')).join(', ');
+        }
+        document.getElementById('modbusStatus').className = d.modbusOk ? 'status-badge status-modbus-ok' : 'status-badge status-modbus-fail';
 
         let statusText = 'Unknown'; let statusClass = 'status-badge status-nr';
-        switch(data.servoStatus) {
+        switch(d.servoStatus) {
             case 0: statusText = 'Not Ready'; statusClass = 'status-badge status-nr'; break;
             case 1: statusText = 'Ready'; statusClass = 'status-badge status-ready'; break;
             case 2: statusText = 'Running'; statusClass = 'status-badge status-run'; break;
             case 3: statusText = 'Fault'; statusClass = 'status-badge status-fault'; break;
-            default: statusText = 'Invalid (' + data.servoStatus + ')'; statusClass = 'status-badge status-fault'; break;
+            default: statusText = 'Invalid (' + d.servoStatus + ')'; statusClass = 'status-badge status-fault'; break;
         }
         document.getElementById('servoStatus').textContent = statusText;
         document.getElementById('servoStatus').className = statusClass;
-        document.getElementById('servoStatusCode').textContent = data.servoStatus;
+        document.getElementById('servoStatusCode').textContent = d.servoStatus;
 
-        let isActuallyEnabled = (data.servoStatus === 2);
-        let homingInProgress = data.homingInProgress || false;
+        let isActuallyEnabled = (d.servoStatus === 2);
+        let homingInProgress = d.homingInProgress || false;
         updateButtonStates(isActuallyEnabled, homingInProgress);
 
-        let diVal = data.diStatus;
+        let diVal = d.diStatus;
         document.getElementById('diValueHex').textContent = '0x' + diVal.toString(16).padStart(2, '0');
         for (let i = 1; i <= 8; i++) {
             let indicator = document.getElementById('di' + i);
             indicator.className = ((diVal >> (i - 1)) & 1) ? 'di-indicator di-on' : 'di-indicator di-off';
         }
 
-        // Update charts with new data
-        addDataToCharts(Date.now(), data.pos, data.vbus / 10.0);
+        // Update charts with new data, timed by the drive task. A sample is charted once.
+        if (d.tUs !== lastChartUs) {
+          lastChartUs = d.tUs;
+          addDataToCharts(deviceTimeMs(d.tUs), d.pos, d.vbus / 10.0);
+        }
 
       }
     } catch (e) {
@@ -389,6 +565,33 @@ const char index_html[] PROGMEM = R"rawliteral(
     }
   }
 
+  // Fills the drive selector, it is only shown with more than one drive
+  function updateDriveSelect(count) {
+    if (count === driveCount) return;
+    driveCount = count;
+    let select = document.getElementById('driveSelect');
+    select.innerHTML = '';
+    for (let i = 0; i < count; i++) select.add(new Option('Drive ' + (i + 1), i));
+    if (selectedDrive >= count) selectedDrive = 0;
+    select.value = selectedDrive;
+    document.getElementById('driveGroup').style.display = count > 1 ? '' : 'none';
+  }
+
+  // Shows another drive: the slider takes its target, the charts start over
+  function onDriveChange(event) {
+    selectedDrive = parseInt(event.target.value);
+    let d = lastDrives[selectedDrive];
+    let targetWeightKg = d ? Math.round(d.target / KG_TO_MODBUS_FACTOR * 10) / 10.0 : 0;
+    document.getElementById('weightSlider').value = Math.round(targetWeightKg * 10);
+    document.getElementById('weightValue').textContent = targetWeightKg.toFixed(1) + ' kg';
+    commonLabels.length = 0;
+    lastChartUs = null;
+    document.getElementById('paramDownload').href = '/params?drive=' + selectedDrive;
+    posChartData.datasets[0].data.length = 0;
+    voltChartData.datasets[0].data.length = 0;
+    logToConsole('Showing drive ' + (selectedDrive + 1));
+  }
+
   // *** UPDATED: Slider controls weight ***
   function onSliderInput(event) {
     let sliderValue = parseInt(event.target.value); // 0-120
@@ -407,30 +610,30 @@ const char index_html[] PROGMEM = R"rawliteral(
     modbusTorqueValue = Math.max(0, Math.min(2000, modbusTorqueValue)); // Constrain to 0-2000
 
     logToConsole("Slider Change - Target Weight: " + targetWeightKg.toFixed(1) + " kg -> Sending Modbus Torque: " + modbusTorqueValue); 
-    websocket.send(JSON.stringify({command: 'setTorque', value: modbusTorqueValue}));
+    websocket.send(JSON.stringify({command: 'setTorque', drive: selectedDrive, value: modbusTorqueValue}));
  }
 
   function onEnableClick(event) {
     logToConsole("Enable Button Clicked - Requesting Servo Enable");
     servoTargetState = true;
-    websocket.send(JSON.stringify({command: 'enableServo'}));
+    websocket.send(JSON.stringify({command: 'enableServo', drive: selectedDrive}));
   }
 
   function onDisableClick(event) {
     logToConsole("Disable Button Clicked - Requesting Servo Disable");
     servoTargetState = false;
-    websocket.send(JSON.stringify({command: 'disableServo'}));
+    websocket.send(JSON.stringify({command: 'disableServo', drive: selectedDrive}));
     // Reset slider and send 0 torque (which corresponds to 0 kg)
     document.getElementById('weightSlider').value = 0;
     document.getElementById('weightValue').textContent = '0.0 kg';
-    websocket.send(JSON.stringify({command: 'setTorque', value: 0}));
+    websocket.send(JSON.stringify({command: 'setTorque', drive: selectedDrive, value: 0}));
   }
   
   function onHomeClick(event) {
     logToConsole("Homing Button Clicked - Requesting Homing Start");
     document.getElementById('homeBtn').disabled = true;
     document.getElementById('homeBtn').classList.add('btn-disabled');
-    websocket.send(JSON.stringify({command: 'startHoming'}));
+    websocket.send(JSON.stringify({command: 'startHoming', drive: selectedDrive}));
   }
 
   function onEstopClick(event) {
@@ -439,7 +642,30 @@ const char index_html[] PROGMEM = R"rawliteral(
     // Reset slider and send 0 torque
     document.getElementById('weightSlider').value = 0;
     document.getElementById('weightValue').textContent = '0.0 kg';
-    websocket.send(JSON.stringify({command: 'eStop'})); // eStop command handles sending 0 torque
+    websocket.send(JSON.stringify({command: 'eStop'})); // eStop command stops all drives and handles sending 0 torque
+  }
+
+  function onBusTargetChange(event) {
+    websocket.send(JSON.stringify({command: 'setBusTarget', value: parseInt(event.target.value)}));
+  }
+
+  function onLatencyResetClick(event) {
+    websocket.send(JSON.stringify({command: 'latencyReset'}));
+  }
+
+  function onParamBackupClick(event) {
+    websocket.send(JSON.stringify({command: 'paramBackup', drive: selectedDrive}));
+  }
+
+  // Restores the drive from its saved backup, or from the chosen file after uploading it
+  function onParamRestoreClick(event) {
+    let file = document.getElementById('paramFile').files[0];
+    if (!confirm('Write the parameters that differ ' + (file ? 'in ' + file.name : 'in the saved backup') + ' to drive ' + (selectedDrive + 1) + '?')) return;
+    let restore = () => websocket.send(JSON.stringify({command: 'paramRestore', drive: selectedDrive}));
+    if (!file) { restore(); return; }
+    fetch('/params?drive=' + selectedDrive, { method: 'POST', body: file })
+      .then(r => r.text().then(text => { logToConsole('Upload: ' + text); if (r.ok) restore(); }))
+      .catch(e => logToConsole('Upload failed: ' + e));
   }
 
   function updateButtonStates(isServoActuallyEnabled, homingInProgress) {
@@ -468,229 +694,351 @@ const char ap_mode_html[] PROGMEM = R"rawliteral(
 )rawliteral";
 
 
-// --- Modbus Functions ---
+// --- Drive Commands ---
+// All drive I/O runs in the drive task (DriveTask.cpp). The functions below only
+// push commands to its queue. Results come back as samples and events, which
+// serviceDriveQueues() applies to the drive states above.
 
-// Writes a 16-bit register
-bool writeRegister(uint16_t reg, int16_t value) {
-    if (!modbusOk && millis() > 5000) { return false; }
-    uint8_t result;
-    result = node.writeSingleRegister(reg, value);
-    delay(2); // wait some time before continuing to prevent further transmission
-    if (result != node.ku8MBSuccess) {
-        logToBrowser("MB Write FAIL: Reg=0x%04X, Val=%d, Code=0x%X", reg, value, result);
-        modbusOk = false;
-        actualServoStatus = 0; servoIsEnabledTarget = false; servoIsEnabledActual = false;
-        modbusConsecutiveErrors = MAX_MODBUS_ERRORS;
-        return false;
-    }
-    modbusConsecutiveErrors = 0;
-    return true;
-}
+#define HOMING_BATCH 1 // Drive batch id of the homing writes of drive 0, drive n uses HOMING_BATCH + n
 
-/**
- * @brief Writes a 32-bit value (int32_t) into two consecutive 16-bit Modbus registers.
- */
-bool writeRegister32bit(uint16_t reg, int32_t value) {
-    if (!modbusOk && millis() > 5000) { return false; }
+struct DriveBatchState {
+    bool pending; // Waiting for DRIVE_EVT_BATCH_DONE
+    bool failed;
+};
+DriveBatchState driveBatches[DRIVE_MAX_BATCHES];
+
+bool sendDriveCommand(uint8_t drive, DriveCommandType type, uint16_t reg = 0, int32_t value = 0, uint8_t batch = 0) {
+    DriveCommand cmd = { type, drive, batch, reg, value };
+    if (driveCommands.push(cmd)) return true;
+    logToBrowser("Drive command queue full, dropped command %d for drive %d (Reg=0x%04X)", type, drive + 1, reg);
+    if (batch) driveBatches[batch].failed = true;
+    return false;
+}
 
-    uint16_t lowWord = (uint16_t)(value & 0xFFFF);
-    uint16_t highWord = (uint16_t)(value >> 16);
+void driveBatchBegin(uint8_t batch) {
+    driveBatches[batch].pending = true;
+    driveBatches[batch].failed = false;
+    sendDriveCommand(0, DRIVE_CMD_BATCH_BEGIN, 0, 0, batch);
+}
 
-    node.setTransmitBuffer(0, lowWord);
-    node.setTransmitBuffer(1, highWord);
+void driveBatchEnd(uint8_t batch) {
+    if (!sendDriveCommand(0, DRIVE_CMD_BATCH_END, 0, 0, batch)) driveBatches[batch].pending = false; // Already marked failed
+}
 
-    uint8_t result;
-    result = node.writeMultipleRegisters(reg, 2); // Writes 2 registers starting from address 'reg'
+bool driveBatchDone(uint8_t batch) { return !driveBatches[batch].pending; }
 
-    if (result != node.ku8MBSuccess) {
-        logToBrowser("MB Write32 FAIL: Reg=0x%04X, Val=%ld, Code=0x%X", reg, value, result);
-        modbusOk = false;
-        actualServoStatus = 0; servoIsEnabledTarget = false; servoIsEnabledActual = false;
-        modbusConsecutiveErrors = MAX_MODBUS_ERRORS;
-        return false;
-    }
+bool writeRegister(uint8_t drive, uint16_t reg, int16_t value, uint8_t batch = 0) {
+    return sendDriveCommand(drive, DRIVE_CMD_WRITE_REG, reg, value, batch);
+}
 
-    modbusConsecutiveErrors = 0;
-    return true;
+// Writes a 32-bit value (int32_t) into two consecutive 16-bit Modbus registers
+bool writeRegister32bit(uint8_t drive, uint16_t reg, int32_t value, uint8_t batch = 0) {
+    return sendDriveCommand(drive, DRIVE_CMD_WRITE_REG32, reg, value, batch);
 }
 
+// Runs a register macro of the drive task, counted as one request of 'batch'
+bool runDriveMacro(uint8_t drive, DriveMacroId id, int32_t arg = 0, uint8_t batch = 0) {
+    return sendDriveCommand(drive, DRIVE_CMD_RUN_MACRO, id, arg, batch);
+}
 
 // Enables servo via Modbus
-bool enableServoModbus() {
-    logToBrowser("Attempting to enable Servo via Modbus (0x0411 = 1)...");
-    if (writeRegister(REG_MODBUS_SERVO_ON, 1)) {
-        logToBrowser("-> Modbus enable command sent successfully.");
-        delay(50); // Optional: Short pause after enable
-        return true;
-    } else {
-        logToBrowser("-> Modbus enable command FAILED.");
-        delay(50); // Optional: Short pause after failure
-        return false;
-    }
+bool enableServoModbus(uint8_t drive, uint8_t batch = 0) {
+    return sendDriveCommand(drive, DRIVE_CMD_ENABLE, REG_MODBUS_SERVO_ON, 1, batch);
 }
 
 // Disables servo via Modbus
-bool disableServoModbus() {
-    logToBrowser("Attempting to disable Servo via Modbus (0x0411 = 0)...");
-    bool success = writeRegister(REG_MODBUS_SERVO_ON, 0); 
-    if (!success && modbusOk) { logToBrowser("-> Modbus disable command FAILED."); }
-    else if (success) { logToBrowser("-> Modbus disable command sent successfully."); }
-
-    // Always set target torque to 0 on disable, regardless of slider position
-    if(writeRegister(REG_TARGET_TORQUE, 0)) { 
-        currentTargetTorque = 0; // Reset internal value
-        logToBrowser("-> Set target torque to 0 after disable.");
-    } else if (modbusOk) { 
-        logToBrowser("MB: Failed to explicitly set torque to 0 after disable."); 
-        // Even if write fails, internal target is 0, preventing accidental torque on re-enable
-        currentTargetTorque = 0;
-    } else {
-        currentTargetTorque = 0; // Ensure internal target is 0 if Modbus fails
+bool disableServoModbus(uint8_t drive, uint8_t batch = 0) {
+    // The drive task always sets target torque to 0 on disable, regardless of slider position.
+    // Even if the write fails, the internal target is 0, preventing accidental torque on re-enable.
+    drives[drive].currentTargetTorque = 0;
+    bool success = sendDriveCommand(drive, DRIVE_CMD_DISABLE, REG_MODBUS_SERVO_ON, 0, batch);
+    if (success) drives[drive].disableCmdPending = true;
+    return success;
+}
+
+// Emergency stop: the drive task drops everything queued, then disables every drive
+bool eStopAllDrives() {
+    for (uint8_t i = 0; i < DRIVE_COUNT; i++) drives[i].currentTargetTorque = 0;
+    bool success = sendDriveCommand(0, DRIVE_CMD_ESTOP, REG_MODBUS_SERVO_ON, 0);
+    if (success) {
+        for (uint8_t i = 0; i < DRIVE_COUNT; i++) drives[i].disableCmdPending = true;
     }
+    return success;
+}
+
+// The drive task writes the setpoint while the servo runs. Only changes are sent.
+void updateTorqueSetpoint(uint8_t drive, int16_t setpoint) {
+    DriveState &d = drives[drive];
+    if (setpoint == d.sentTorqueSetpoint) return;
+    if (sendDriveCommand(drive, DRIVE_CMD_SET_TORQUE, REG_TARGET_TORQUE, setpoint)) d.sentTorqueSetpoint = setpoint;
+}
 
+// Homing needs torque and position at full rate, even before the servo reports 'Running'
+void updatePollProfile(uint8_t drive, bool homing) {
+    DriveState &d = drives[drive];
+    if (homing == d.sentPollHoming) return;
+    if (sendDriveCommand(drive, DRIVE_CMD_POLL_PROFILE, 0, homing ? POLL_PROFILE_HOMING : POLL_PROFILE_IDLE)) {
+        d.sentPollHoming = homing;
+    }
+}
 
-    if (!success || !modbusOk) {
-        actualServoStatus = (actualServoStatus == 3) ? 3 : 0; // Fault or Not Ready
-        servoIsEnabledActual = false;
+// Bus statistics, shared by all drives
+uint16_t modbusTurnaroundUs = 0;
+uint16_t modbusTurnaroundMinUs = 0;
+uint16_t modbusTurnaroundMaxUs = 0;
+uint32_t modbusCollisions = 0;
+uint16_t modbusGapUs = 0;
+uint16_t busCpuUsPerTxn = 0;    // Drive task CPU time per Modbus frame
+uint16_t busExchangeAvgUs = 0;  // Request sent to response handled
+uint16_t busExchangeMaxUs = 0;
+uint16_t driveWakeupsPerSec = 0;
+uint32_t modbusDeadlineMisses = 0;
+uint8_t busLoadPct = 0;         // Bus utilisation, last second
+uint16_t pollScalePct = 100;    // Telemetry poll periods in % of the register table
+uint8_t busTargetPct = BUS_TARGET_DEFAULT_PCT; // Utilisation the poll rates are tuned for, stored in Preferences
+
+// Stores a decoded telemetry value in its drive state
+void storeTelemetryField(DriveState &d, uint8_t id, int32_t value) {
+    switch (id) {
+        case FIELD_SERVO_STATUS:    d.actualServoStatus = value; break;
+        case FIELD_DI_STATUS:       d.diStatus = value; break;
+        case FIELD_SPEED:           d.actualSpeed = value; break;
+        case FIELD_TORQUE:          d.actualTorque = value; break;
+        case FIELD_BUS_VOLTAGE:     d.busVoltage = value; break;
+        case FIELD_LOAD_RATIO:      d.loadRatio = value; break;
+        case FIELD_RMS_CURRENT:     d.rmsCurrent = value; break;
+        case FIELD_FOLLOWING_ERROR: d.followingError = value; break;
+        case FIELD_POSITION:        d.actualPosition = value; break;
+        case FIELD_TEMP_IGBT:       d.igbtTemp = value; break;
+        case FIELD_TEMP_MOTOR:      d.motorTemp = value; break;
+        default: break;
     }
-    return success;
 }
 
-// Checks Modbus connection (called less frequently)
-bool checkModbusConnection() {
-    uint8_t result;
-    result = node.readHoldingRegisters(REG_CONTROL_MODE, 1);
-    if (result == node.ku8MBSuccess) {
-        if (!modbusOk) logToBrowser("MB Connection Check OK (Read 0x0000 successful).");
-        modbusOk = true;
-        modbusConsecutiveErrors = 0; // Reset error counter
-        return true;
+void applyDriveSample(const DriveSample &sample) {
+    if (sample.drive >= DRIVE_COUNT) return;
+    DriveState &d = drives[sample.drive];
+    d.modbusOk = sample.modbusOk;
+    d.lastCycleTransactions = sample.transactions;
+    d.lastCycleUs = sample.cycleUs;
+    d.sampleTimeUs = sample.timeUs;
+    d.acquisitionUs = sample.acquisitionUs;
+    modbusTurnaroundUs = sample.turnaroundUs;
+    modbusTurnaroundMinUs = sample.turnaroundMinUs;
+    modbusTurnaroundMaxUs = sample.turnaroundMaxUs;
+    modbusCollisions = sample.collisions;
+    modbusGapUs = sample.gapUs;
+    busCpuUsPerTxn = sample.cpuUsPerTxn;
+    busExchangeAvgUs = sample.exchangeAvgUs;
+    busExchangeMaxUs = sample.exchangeMaxUs;
+    driveWakeupsPerSec = sample.wakeupsPerSec;
+    d.configDirtyMask = sample.configDirty;
+    d.configMismatches = sample.configMismatches;
+    d.pollProfile = sample.pollProfile;
+    memcpy(d.fieldRateHz, sample.fieldRateHz, sizeof(d.fieldRateHz));
+    d.telemetryHz = sample.telemetryHz;
+    d.telemetryShare = sample.telemetryShare;
+    d.setpointLatencyUs = sample.setpointLatencyUs;
+    d.setpointLatencyMaxUs = sample.setpointLatencyMaxUs;
+    modbusDeadlineMisses = sample.deadlineMisses;
+    busLoadPct = sample.busLoadPct;
+    pollScalePct = sample.pollScalePct;
+    for (uint8_t id = 0; id < FIELD_COUNT; id++) storeTelemetryField(d, id, sample.fields[id]);
+    if (d.modbusOk) {
+        d.servoIsEnabledActual = (d.actualServoStatus == 2); // Status 2 means 'Running'
     } else {
-        // Log only if status changed or during startup
-        if (modbusOk || millis() < 6000) {
-            logToBrowser("MB Connection Check FAIL reading 0x0000! Code: 0x%X", result);
+        d.actualServoStatus = 0; d.servoIsEnabledTarget = false; d.servoIsEnabledActual = false;
+    }
+}
+
+// Drains the queues filled by the drive task
+void serviceDriveQueues() {
+    DriveLogMessage msg;
+    while (driveLogs.pop(msg)) logToBrowser("%s", msg.text);
+
+    DriveEvent evt;
+    while (driveEvents.pop(evt)) {
+        if (evt.drive >= DRIVE_COUNT) continue;
+        DriveState &d = drives[evt.drive];
+        switch (evt.type) {
+            case DRIVE_EVT_BATCH_DONE:
+                if (evt.batch < DRIVE_MAX_BATCHES) {
+                    driveBatches[evt.batch].pending = false;
+                    if (!evt.ok) driveBatches[evt.batch].failed = true;
+                }
+                break;
+            case DRIVE_EVT_DISABLE_DONE:
+                d.disableCmdPending = false;
+                if (!evt.ok) {
+                    d.actualServoStatus = (d.actualServoStatus == 3) ? 3 : 0; // Fault or Not Ready
+                    d.servoIsEnabledActual = false;
+                }
+                break;
+            case DRIVE_EVT_RECONNECTED:
+                d.enableCmdSent = false;
+                d.currentTargetTorque = 0; // The link loss cleared the target, a restarted drive is disabled
+                break;
+            case DRIVE_EVT_PARAMS_DONE:
+                paramJobDone = true; // Saved by serviceParams()
+                paramJobOk = evt.ok;
+                break;
+            case DRIVE_EVT_MACRO_DONE:
+                userMacroRunning = false;
+                break;
         }
-        modbusOk = false;
-        actualServoStatus = 0; servoIsEnabledTarget = false; servoIsEnabledActual = false;
-        modbusConsecutiveErrors = MAX_MODBUS_ERRORS; // Assume max errors if check fails
-        return false;
     }
+
+    DriveSample sample;
+    while (driveSamples.pop(sample)) applyDriveSample(sample);
 }
 
-#define WAIT_TIME_BEFORE_TRANSMITTING_NEXT_DATA_IN_MS 2
-// Reads servo status data via Modbus
-bool readServoData() {
-    if (!modbusOk && modbusConsecutiveErrors >= MAX_MODBUS_ERRORS) {
-        return false;
+bool anyDriveOk() {
+    for (uint8_t i = 0; i < DRIVE_COUNT; i++) {
+        if (drives[i].modbusOk) return true;
     }
+    return false;
+}
 
-    uint8_t result;
-    bool readSuccessCurrentCycle = true;
-    uint16_t tempStatus = actualServoStatus; 
-
-    // --- Read Sequence ---
-    result = node.readHoldingRegisters(REG_SERVO_STATUS, 1);
-    if (result == node.ku8MBSuccess) actualServoStatus = node.getResponseBuffer(0);
-    else { readSuccessCurrentCycle = false; } 
-    delay(WAIT_TIME_BEFORE_TRANSMITTING_NEXT_DATA_IN_MS); 
-
-    result = node.readHoldingRegisters(REG_DI_STATUS, 1);
-     if (result == node.ku8MBSuccess) diStatus = node.getResponseBuffer(0);
-     else { readSuccessCurrentCycle = false; }
-     delay(WAIT_TIME_BEFORE_TRANSMITTING_NEXT_DATA_IN_MS); 
-
-    result = node.readHoldingRegisters(REG_SPEED_FEEDBACK, 1);
-    if (result == node.ku8MBSuccess) actualSpeed = node.getResponseBuffer(0);
-    else { readSuccessCurrentCycle = false; }
-    delay(WAIT_TIME_BEFORE_TRANSMITTING_NEXT_DATA_IN_MS); 
-
-    result = node.readHoldingRegisters(REG_TORQUE_FEEDBACK, 1);
-    if (result == node.ku8MBSuccess) actualTorque = node.getResponseBuffer(0);
-    else { readSuccessCurrentCycle = false; }
-    delay(WAIT_TIME_BEFORE_TRANSMITTING_NEXT_DATA_IN_MS); 
-
-    result = node.readHoldingRegisters(REG_BUS_VOLTAGE, 1);
-    if (result == node.ku8MBSuccess) busVoltage = node.getResponseBuffer(0);
-    else { readSuccessCurrentCycle = false; }
-    delay(WAIT_TIME_BEFORE_TRANSMITTING_NEXT_DATA_IN_MS); 
-
-    result = node.readHoldingRegisters(REG_RMS_CURRENT, 1);
-    if (result == node.ku8MBSuccess) rmsCurrent = node.getResponseBuffer(0);
-    else { readSuccessCurrentCycle = false; }
-    delay(WAIT_TIME_BEFORE_TRANSMITTING_NEXT_DATA_IN_MS); 
-
-    result = node.readHoldingRegisters(REG_POSITION_FEEDBACK_L, 2);
-    if (result == node.ku8MBSuccess) {
-        actualPosition = (int32_t)((uint32_t)node.getResponseBuffer(1) << 16 | node.getResponseBuffer(0));
-    } else {
-        readSuccessCurrentCycle = false;
+bool anyServoEnabled() {
+    for (uint8_t i = 0; i < DRIVE_COUNT; i++) {
+        if (drives[i].servoIsEnabledActual) return true;
     }
-    delay(WAIT_TIME_BEFORE_TRANSMITTING_NEXT_DATA_IN_MS); 
-    
-    // Read Temperatures
-    result = node.readHoldingRegisters(REG_TEMP_IGBT, 1);
-    if (result == node.ku8MBSuccess) igbtTemp = node.getResponseBuffer(0);
-    else { readSuccessCurrentCycle = false; }
-    delay(WAIT_TIME_BEFORE_TRANSMITTING_NEXT_DATA_IN_MS); 
-    
-    result = node.readHoldingRegisters(REG_TEMP_MOTOR, 1);
-    if (result == node.ku8MBSuccess) motorTemp = node.getResponseBuffer(0);
-    else { readSuccessCurrentCycle = false; }
-    // No delay needed after the last read
-    // --- End Read Sequence ---
-
-    if (!readSuccessCurrentCycle) {
-        modbusConsecutiveErrors++;
-        // Log reduced to avoid flooding
-        if (modbusConsecutiveErrors == 1 || modbusConsecutiveErrors == MAX_MODBUS_ERRORS) {
-             logToBrowser("Modbus read cycle failed (%d consecutive)", modbusConsecutiveErrors);
-        }
-        if (modbusConsecutiveErrors >= MAX_MODBUS_ERRORS) {
-            if (modbusOk) { 
-                logToBrowser(">>> Too many consecutive Modbus read errors, setting status to FAIL <<<");
-            }
-            modbusOk = false;
-            actualServoStatus = 0; servoIsEnabledTarget = false; servoIsEnabledActual = false;
-            // Reset Temps on failure
-            igbtTemp = 0; motorTemp = 0;
-        }
-        return false; 
-    } else {
-        if (!modbusOk) { // Log only when status changes
-             logToBrowser(">>> Modbus communication OK <<<");
-        }
-        modbusConsecutiveErrors = 0; 
-        modbusOk = true;
-        servoIsEnabledActual = (actualServoStatus == 2); // Status 2 means 'Running'
-        if(tempStatus != actualServoStatus) logToBrowser("Servo Status Changed (0x410A) = %d (0=NR,1=RD,2=RUN,3=FLT)", actualServoStatus);
-        return true; 
+    return false;
+}
+
+// Adds [depth, high-water mark, overflows] of a queue to the status record
+template <typename Queue>
+void addQueueStats(JsonObject obj, const char *name, const Queue &queue) {
+    JsonArray stats = obj.createNestedArray(name);
+    stats.add(queue.depth());
+    stats.add(queue.highWater());
+    stats.add(queue.overflows());
+}
+
+// Adds the state of one drive to the status record
+void addDriveStatus(JsonArray list, const DriveState &d) {
+    JsonObject obj = list.createNestedObject();
+    obj["modbusOk"] = d.modbusOk;
+    obj["servoEnabled"] = d.servoIsEnabledActual;
+    obj["servoStatus"] = d.actualServoStatus;
+    obj["diStatus"] = d.diStatus;
+    obj["pos"] = d.actualPosition;
+    obj["spd"] = d.actualSpeed;
+    obj["trq"] = d.actualTorque;
+    obj["cur"] = d.rmsCurrent;
+    obj["vbus"] = d.busVoltage;
+    obj["igbtTemp"] = d.igbtTemp;
+    obj["motorTemp"] = d.motorTemp;
+    obj["load"] = d.loadRatio;
+    obj["posErr"] = d.followingError;
+    obj["target"] = d.currentTargetTorque;
+    obj["mbTx"] = d.lastCycleTransactions; // Modbus frames in the last telemetry cycle
+    obj["mbCycleUs"] = d.lastCycleUs;
+    obj["tUs"] = d.sampleTimeUs;        // Acquisition time of the telemetry, device clock
+    obj["acqUs"] = d.acquisitionUs;     // Its fields arrived within this span
+    obj["cfgDirty"] = d.configDirtyMask;
+    obj["cfgMismatch"] = d.configMismatches;
+    obj["spLatUs"] = d.setpointLatencyUs;
+    obj["spLatMaxUs"] = d.setpointLatencyMaxUs;
+    obj["telHz"] = d.telemetryHz;       // Telemetry frames per second
+    obj["telShare"] = d.telemetryShare; // Share of all telemetry frames on the bus, %
+    obj["pollProfile"] = d.pollProfile;
+    JsonObject rates = obj.createNestedObject("rateHz"); // Effective read rate per telemetry field
+    for (uint8_t id = 0; id < FIELD_COUNT; id++) rates[regFields[id].name] = d.fieldRateHz[id];
+    obj["homingInProgress"] = (d.homingState != HOMING_IDLE);
+}
+
+// A6 parameter group of an address high byte: C00..C0F configuration, U40/U41 monitoring
+void latencyGroupName(char *name, size_t size, uint8_t id) {
+    snprintf(name, size, "%c%02X", id >= 0x40 ? 'U' : 'C', id);
+}
+
+// Adds [samples, p50, p90, p99, max] of a latency histogram in us, if it has samples
+void addLatencyPercentiles(JsonObject obj, char *name, const LatencyHistogram &h) {
+    if (h.total == 0) return;
+    JsonArray stats = obj.createNestedArray(name);
+    stats.add(h.total);
+    stats.add(h.percentile(50));
+    stats.add(h.percentile(90));
+    stats.add(h.percentile(99));
+    stats.add(h.maxUs);
+}
+
+// Adds the latency histograms, 'add' writes one of them under its name
+template <typename AddFn>
+void addLatencyStats(JsonObject obj, AddFn add) {
+    const ModbusLatencyStats &stats = driveLatencyStats();
+    char name[8];
+    JsonObject functions = obj.createNestedObject("fc");
+    for (uint8_t i = 0; i < LATENCY_FUNCTIONS; i++) {
+        snprintf(name, sizeof(name), "%02X", latencyFunctions[i]);
+        add(functions, name, stats.function[i]);
+    }
+    JsonObject groups = obj.createNestedObject("grp");
+    uint8_t groupCount = min(stats.groupCount, (uint8_t)LATENCY_GROUPS);
+    for (uint8_t i = 0; i < groupCount; i++) {
+        latencyGroupName(name, sizeof(name), stats.groupIds[i]);
+        add(groups, name, stats.group[i]);
     }
 }
 
+// Fills wsJsonTx with the current status record
+void fillStatusJson() {
+    wsJsonTx.clear();
+    wsJsonTx["type"] = "status";
+    wsJsonTx["mbBaud"] = modbusBaud;
+    wsJsonTx["mbTurnUs"] = modbusTurnaroundUs;
+    wsJsonTx["mbTurnMinUs"] = modbusTurnaroundMinUs;
+    wsJsonTx["mbTurnMaxUs"] = modbusTurnaroundMaxUs;
+    wsJsonTx["mbColl"] = modbusCollisions;
+    wsJsonTx["mbGapUs"] = modbusGapUs;
+    wsJsonTx["mbCpuUs"] = busCpuUsPerTxn;
+    wsJsonTx["mbExchUs"] = busExchangeAvgUs;
+    wsJsonTx["mbExchMaxUs"] = busExchangeMaxUs;
+    wsJsonTx["drvWake"] = driveWakeupsPerSec;
+    wsJsonTx["mbMiss"] = modbusDeadlineMisses;
+    wsJsonTx["mbLoad"] = busLoadPct;
+    wsJsonTx["mbTarget"] = busTargetPct;
+    wsJsonTx["pollPct"] = pollScalePct;
+    addLatencyStats(wsJsonTx.createNestedObject("lat"), addLatencyPercentiles);
+#if MODBUS_CAPTURE
+    wsJsonTx["capState"] = modbusCapture.state(); // 0 = none, 1 = recording, 2 = stopped
+    wsJsonTx["capBytes"] = modbusCapture.size();
+#endif
+    JsonArray list = wsJsonTx.createNestedArray("drives");
+    uint32_t telemetryHz = 0;
+    for (uint8_t i = 0; i < DRIVE_COUNT; i++) {
+        addDriveStatus(list, drives[i]);
+        telemetryHz += drives[i].telemetryHz;
+    }
+    wsJsonTx["telHz"] = telemetryHz; // Telemetry frames per second of all drives
+    JsonObject queues = wsJsonTx.createNestedObject("queues"); // Drive task queues
+    addQueueStats(queues, "cmd", driveCommands);
+    addQueueStats(queues, "tel", driveSamples);
+    addQueueStats(queues, "evt", driveEvents);
+    addQueueStats(queues, "log", driveLogs);
+    addQueueStats(queues, "gwReq", gatewayRequests);
+    addQueueStats(queues, "gwRsp", gatewayResponses);
+    JsonArray gateway = wsJsonTx.createNestedArray("gw"); // Modbus TCP clients
+    for (uint8_t i = 0; i < GATEWAY_MAX_CLIENTS; i++) {
+        GatewayClientStats c = gatewayClient(i);
+        if (!c.connected) continue;
+        JsonObject obj = gateway.createNestedObject();
+        obj["ip"] = c.remoteIp.toString();
+        obj["req"] = c.requests;
+        obj["exc"] = c.exceptions;
+        obj["drop"] = c.dropped;
+        obj["busMs"] = c.busMsPerSec; // Bus time per second used by the client
+        obj["busTotalMs"] = c.busUs / 1000;
+    }
+}
 
 // --- WebSocket Event Handler ---
 void onWsEvent(AsyncWebSocket *server, AsyncWebSocketClient *client, AwsEventType type, void *arg, uint8_t *data, size_t len) {
     switch (type) {
         case WS_EVT_CONNECT:
             Serial.printf("WS Client #%u connected from %s\n", client->id(), client->remoteIP().toString().c_str());
-            wsJsonTx.clear(); wsJsonTx["type"] = "log"; wsJsonTx["message"] = "Client connected";
-            { String jsonString; serializeJson(wsJsonTx, jsonString); client->text(jsonString); }
-            // Send initial status
-            wsJsonTx.clear(); 
-            wsJsonTx["type"] = "status"; 
-            wsJsonTx["modbusOk"] = modbusOk; 
-            wsJsonTx["servoEnabled"] = servoIsEnabledActual;
-            wsJsonTx["servoStatus"] = actualServoStatus; 
-            wsJsonTx["diStatus"] = diStatus; 
-            wsJsonTx["pos"] = actualPosition;
-            wsJsonTx["spd"] = actualSpeed; 
-            wsJsonTx["trq"] = actualTorque; 
-            wsJsonTx["cur"] = rmsCurrent; 
-            wsJsonTx["vbus"] = busVoltage;
-            wsJsonTx["igbtTemp"] = igbtTemp;     
-            wsJsonTx["motorTemp"] = motorTemp;   
-            wsJsonTx["homingInProgress"] = (homingState != HOMING_IDLE); 
-            { String jsonString; serializeJson(wsJsonTx, jsonString); client->text(jsonString); }
+            wsReplies.push({ client->id(), WS_REPLY_CONNECTED, 0 }); // Initial status, sent by appLoop()
             break;
         case WS_EVT_DISCONNECT:
             Serial.printf("WS Client #%u disconnected\n", client->id());
@@ -704,6 +1052,10 @@ void onWsEvent(AsyncWebSocket *server, AsyncWebSocketClient *client, AwsEventTyp
                 if (error) { Serial.printf("deserializeJson() failed: %s\n", error.c_str()); return; }
 
                 const char* command = wsJsonRx["command"];
+                uint8_t drive = 0; // Drive index, commands without one go to the first drive
+                if (wsJsonRx.containsKey("drive")) drive = wsJsonRx["drive"];
+                if (drive >= DRIVE_COUNT) { Serial.printf("WS: Unknown drive %d\n", drive); return; }
+                DriveState &d = drives[drive];
                 if (command) {
                     if (strcmp(command, "setTorque") == 0) {
                         // This command now receives the calculated Modbus Torque value (0-2000) from JS
@@ -711,61 +1063,64 @@ void onWsEvent(AsyncWebSocket *server, AsyncWebSocketClient *client, AwsEventTyp
                             int16_t reqModbusTorque = wsJsonRx["value"]; 
                             reqModbusTorque = constrain(reqModbusTorque, 0, 2000); 
                             
-                            if(currentTargetTorque != reqModbusTorque) {
-                                currentTargetTorque = reqModbusTorque; // Store the target Modbus torque value
+                            if(d.currentTargetTorque != reqModbusTorque) {
+                                d.currentTargetTorque = reqModbusTorque; // Store the target Modbus torque value
                                 // Log the received Modbus value, not the calculated weight
-                                logToBrowser("WS: Set Target Modbus Torque: %d (corresponds to %.1f %%)\n", currentTargetTorque, currentTargetTorque/10.0);
+                                logToBrowser("WS: Drive %d: Set Target Modbus Torque: %d (corresponds to %.1f %%)\n", drive + 1, d.currentTargetTorque, d.currentTargetTorque/10.0);
                             }
                         }
                     } else if (strcmp(command, "enableServo") == 0) {
-                        Serial.println("WS: Received enableServo command.");
-                        servoIsEnabledTarget = true;
+                        Serial.printf("WS: Received enableServo command for drive %d.\n", drive + 1);
+                        d.servoIsEnabledTarget = true;
                     } else if (strcmp(command, "disableServo") == 0) {
-                        Serial.println("WS: Received disableServo command.");
-                        servoIsEnabledTarget = false;
-                        currentTargetTorque = 0; // Reset internal torque target on disable command
+                        Serial.printf("WS: Received disableServo command for drive %d.\n", drive + 1);
+                        d.servoIsEnabledTarget = false;
+                        d.currentTargetTorque = 0; // Reset internal torque target on disable command
                     } else if (strcmp(command, "getStatus") == 0) {
                         Serial.println("WS: Received getStatus command.");
-                         wsJsonTx.clear(); 
-                         wsJsonTx["type"] = "status"; 
-                         wsJsonTx["modbusOk"] = modbusOk; 
-                         wsJsonTx["servoEnabled"] = servoIsEnabledActual;
-                         wsJsonTx["servoStatus"] = actualServoStatus; 
-                         wsJsonTx["diStatus"] = diStatus; 
-                         wsJsonTx["pos"] = actualPosition;
-                         wsJsonTx["spd"] = actualSpeed; 
-                         wsJsonTx["trq"] = actualTorque; 
-                         wsJsonTx["cur"] = rmsCurrent; 
-                         wsJsonTx["vbus"] = busVoltage;
-                         wsJsonTx["igbtTemp"] = igbtTemp;     
-                         wsJsonTx["motorTemp"] = motorTemp;   
-                         wsJsonTx["homingInProgress"] = (homingState != HOMING_IDLE); 
-                         { String jsonString; serializeJson(wsJsonTx, jsonString); client->text(jsonString); }
+                         wsReplies.push({ client->id(), WS_REPLY_STATUS, 0 });
                     } else if (strcmp(command, "setDI5Func") == 0) {
                          if (wsJsonRx.containsKey("value")) {
                             int16_t func = wsJsonRx["value"];
-                            Serial.printf("WS: Received setDI5Func command: %d\n", func);
-                            if (modbusOk) { writeRegister(REG_DI5_FUNCTION, func); }
+                            Serial.printf("WS: Received setDI5Func command for drive %d: %d\n", drive + 1, func);
+                            if (d.modbusOk) { d.pendingDI5Func = func; } // Written by appLoop()
                          }
                      } else if (strcmp(command, "startHoming") == 0) {
-                         Serial.println("WS: Received startHoming command.");
-                         if (modbusOk && !servoIsEnabledActual && homingState == HOMING_IDLE) {
-                             homingState = HOMING_START;
-                             logToBrowser("Homing sequence initiated...");
+                         Serial.printf("WS: Received startHoming command for drive %d.\n", drive + 1);
+                         if (d.modbusOk && !d.servoIsEnabledActual && d.homingState == HOMING_IDLE) {
+                             d.homingState = HOMING_START;
+                             logToBrowser("Drive %d: Homing sequence initiated...", drive + 1);
                          } else {
-                             logToBrowser("Cannot start homing: Servo is enabled, Modbus is offline, or homing already in progress.");
-                             wsJsonTx.clear(); wsJsonTx["type"] = "homingStatus"; wsJsonTx["status"] = "failed"; wsJsonTx["message"] = "Homing rejected.";
-                             String jsonString; serializeJson(wsJsonTx, jsonString); client->text(jsonString);
+                             logToBrowser("Cannot start homing of drive %d: Servo is enabled, Modbus is offline, or homing already in progress.", drive + 1);
+                             wsReplies.push({ client->id(), WS_REPLY_HOMING_REJECTED, drive });
                          }
+                     } else if (strcmp(command, "captureStart") == 0) {
+                         captureRequest = wsJsonRx["trigger"].as<bool>() ? CAPTURE_REQ_START_TRIGGERED : CAPTURE_REQ_START;
+                     } else if (strcmp(command, "captureStop") == 0) {
+                         captureRequest = CAPTURE_REQ_STOP;
+                     } else if (strcmp(command, "captureSave") == 0) {
+                         captureRequest = CAPTURE_REQ_SAVE;
+                     } else if (strcmp(command, "paramBackup") == 0) {
+                         paramRequestDrive = drive;
+                         paramRequest = PARAM_REQ_BACKUP;
+                     } else if (strcmp(command, "paramRestore") == 0) {
+                         paramRequestDrive = drive;
+                         paramRequest = PARAM_REQ_RESTORE;
+                     } else if (strcmp(command, "latencyReset") == 0) {
+                         latencyResetRequested = true;
+                     } else if (strcmp(command, "setBusTarget") == 0) {
+                         if (wsJsonRx.containsKey("value")) busTargetRequested = constrain(wsJsonRx["value"].as<int>(), 10, 95);
                      } else if (strcmp(command, "eStop") == 0) {
                          Serial.println("WS: Received EMERGENCY STOP command!");
                          logToBrowser("!!! EMERGENCY STOP Received !!!");
                          
-                         servoIsEnabledTarget = false;
-                         currentTargetTorque = 0; 
-                         homingState = HOMING_IDLE; // Immediately abort homing
+                         for (uint8_t i = 0; i < DRIVE_COUNT; i++) { // Stops every drive
+                             drives[i].servoIsEnabledTarget = false;
+                             drives[i].currentTargetTorque = 0; 
+                             drives[i].homingState = HOMING_IDLE; // Immediately abort homing
+                         }
                          
-                         disableServoModbus(); // Send disable command immediately
+                         eStopRequested = true; // appLoop() sends the disable command ahead of everything else
                      }
                 }
             }
@@ -776,6 +1131,278 @@ void onWsEvent(AsyncWebSocket *server, AsyncWebSocketClient *client, AwsEventTyp
     }
 }
 
+// --- Modbus Traffic Capture ---
+#if MODBUS_CAPTURE
+// Writes the stopped capture to LittleFS, replacing the previous one
+void saveCapture() {
+    if (!flashOk || modbusCapture.state() != CAPTURE_FROZEN) {
+        logToBrowser("Modbus capture: nothing to save (stop the capture first).");
+        return;
+    }
+    File file = LittleFS.open(CAPTURE_FILE, "w");
+    if (!file) {
+        logToBrowser("Modbus capture: could not open %s.", CAPTURE_FILE);
+        return;
+    }
+    uint8_t chunk[512];
+    size_t offset = 0;
+    size_t n;
+    while ((n = modbusCapture.read(chunk, sizeof(chunk), offset)) > 0) {
+        if (file.write(chunk, n) != n) break;
+        offset += n;
+    }
+    file.close();
+    logToBrowser("Modbus capture: %u bytes saved to %s.", (unsigned)offset, CAPTURE_FILE);
+}
+
+// Serves /capture: the stopped capture from RAM, or the saved one with ?flash=1
+void onCaptureDownload(AsyncWebServerRequest *request) {
+    if (request->hasParam("flash")) {
+        if (flashOk && LittleFS.exists(CAPTURE_FILE)) request->send(LittleFS, CAPTURE_FILE, "application/octet-stream", true);
+        else request->send(404, "text/plain", "No saved capture");
+        return;
+    }
+    if (modbusCapture.state() != CAPTURE_FROZEN) {
+        request->send(409, "text/plain", "No stopped capture");
+        return;
+    }
+    captureDownloads++;
+    request->onDisconnect([]() { captureDownloads--; });
+    AsyncWebServerResponse *response = request->beginResponse("application/octet-stream", modbusCapture.size(),
+        [](uint8_t *buffer, size_t maxLen, size_t index) -> size_t { return modbusCapture.read(buffer, maxLen, index); });
+    response->addHeader("Content-Disposition", "attachment; filename=modbus.cap");
+    request->send(response);
+}
+#endif
+
+// Capture requests from the WebSocket handler. The drive task records and freezes the capture.
+void serviceCapture() {
+#if MODBUS_CAPTURE
+    CaptureRequest request = captureRequest;
+    switch (request) {
+        case CAPTURE_REQ_START:
+        case CAPTURE_REQ_START_TRIGGERED: {
+            if (captureDownloads > 0) return; // Still being read, the request stays pending
+            bool triggered = (request == CAPTURE_REQ_START_TRIGGERED);
+            if (modbusCapture.start(triggered ? MODBUS_CAPTURE_TRIGGER_STOP_MS * 1000UL : 0)) {
+                captureSaveWhenFrozen = triggered;
+                logToBrowser("Modbus capture started%s.", triggered ? ", stops and saves after a link loss" : "");
+            } else {
+                logToBrowser("Modbus capture already running.");
+            }
+        } break;
+        case CAPTURE_REQ_STOP:
+            modbusCapture.stop();
+            captureSaveWhenFrozen = false;
+            break;
+        case CAPTURE_REQ_SAVE:
+            saveCapture();
+            break;
+        case CAPTURE_REQ_NONE:
+            break;
+    }
+    captureRequest = CAPTURE_REQ_NONE;
+
+    bool recording = (modbusCapture.state() == CAPTURE_RECORDING);
+    if (captureWasRecording && !recording) {
+        logToBrowser("Modbus capture stopped, %u bytes. Download from /capture.", (unsigned)modbusCapture.size());
+        if (captureSaveWhenFrozen) saveCapture();
+    }
+    captureWasRecording = recording;
+#endif
+}
+
+// --- Drive Parameter Backup ---
+
+// Drive index from the 'drive' query parameter (0..DRIVE_COUNT-1, default 0), -1 if out of range
+int paramRequestedDrive(AsyncWebServerRequest *request) {
+    if (!request->hasParam("drive")) return 0;
+    const String &value = request->getParam("drive")->value();
+    int drive = value.toInt();
+    return (drive >= 0 && drive < DRIVE_COUNT && (drive > 0 || value == "0")) ? drive : -1;
+}
+
+// Serves GET /params?drive=N: the saved parameter file of the drive
+void onParamDownload(AsyncWebServerRequest *request) {
+    int drive = paramRequestedDrive(request);
+    char path[24];
+    snprintf(path, sizeof(path), PARAMS_FILE, drive + 1);
+    if (drive < 0) request->send(400, "text/plain", "Unknown drive");
+    else if (flashOk && LittleFS.exists(path)) request->send(LittleFS, path, "application/octet-stream", true);
+    else request->send(404, "text/plain", "No parameter backup of this drive");
+}
+
+// Body of POST /params, collected in paramUpload. appLoop() saves it once complete.
+void onParamUploadBody(AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total) {
+    if (index == 0) {
+        if (paramUploadRequest || paramUploadDrive != 0 || total > sizeof(paramUpload)) return;
+        paramUploadRequest = request;
+        paramUploadLength = 0;
+        request->onDisconnect([request]() { if (paramUploadRequest == request) paramUploadRequest = nullptr; });
+    }
+    if (request != paramUploadRequest || index + len > sizeof(paramUpload)) return;
+    memcpy(paramUpload + index, data, len);
+    paramUploadLength = index + len;
+}
+
+// Serves POST /params?drive=N once its body is in
+void onParamUpload(AsyncWebServerRequest *request) {
+    if (request != paramUploadRequest) {
+        request->send(409, "text/plain", "Another upload is in progress, or the file is too large");
+        return;
+    }
+    paramUploadRequest = nullptr;
+    int drive = paramRequestedDrive(request);
+    if (drive < 0) {
+        request->send(400, "text/plain", "Unknown drive");
+    } else if (!flashOk) {
+        request->send(503, "text/plain", "LittleFS not available");
+    } else if (!paramBlobParse(paramUpload, paramUploadLength, nullptr)) {
+        request->send(400, "text/plain", "Not a parameter backup");
+    } else {
+        paramUploadDrive = drive + 1;
+        request->send(200, "text/plain", "Accepted, restore it with the Restore button");
+    }
+}
+
+// Replaces the parameter file of 'drive'
+bool writeParamFile(uint8_t drive, const uint8_t *data, size_t len) {
+    char path[24];
+    snprintf(path, sizeof(path), PARAMS_FILE, drive + 1);
+    File file = flashOk ? LittleFS.open(path, "w") : File();
+    if (!file) {
+        logToBrowser("Drive %d: could not write %s.", drive + 1, path);
+        return false;
+    }
+    bool ok = file.write(data, len) == len;
+    file.close();
+    if (ok) logToBrowser("Drive %d: %u bytes of parameters saved to %s.", drive + 1, (unsigned)len, path);
+    else logToBrowser("Drive %d: writing %s failed.", drive + 1, path);
+    return ok;
+}
+
+// Loads the parameter file of 'drive' into driveParams
+bool readParamFile(uint8_t drive) {
+    char path[24];
+    snprintf(path, sizeof(path), PARAMS_FILE, drive + 1);
+    File file = flashOk ? LittleFS.open(path, "r") : File();
+    if (!file) {
+        logToBrowser("Drive %d: no parameter backup (%s) to restore.", drive + 1, path);
+        return false;
+    }
+    size_t len = file.read(paramBlob, sizeof(paramBlob));
+    file.close();
+    uint16_t skipped;
+    if (!paramBlobParse(paramBlob, len, &driveParams, &skipped)) {
+        logToBrowser("Drive %d: %s is not a parameter backup.", drive + 1, path);
+        return false;
+    }
+    if (skipped) logToBrowser("Drive %d: %d command registers in %s skipped.", drive + 1, skipped, path);
+    logToBrowser("Drive %d: restoring %d registers from %s (backup of slave %d)...", drive + 1, driveParams.count(),
+                 path, driveParams.slaveId);
+    return true;
+}
+
+// Parameter requests from the WebSocket and uploads, and the results of the drive task
+void serviceParams() {
+    uint8_t upload = paramUploadDrive;
+    if (upload) {
+        writeParamFile(upload - 1, paramUpload, paramUploadLength);
+        paramUploadDrive = 0;
+    }
+
+    if (paramJobDone) {
+        paramJobDone = false;
+        if (paramJob == PARAM_REQ_BACKUP && paramJobOk) {
+            size_t len = paramBlobBuild(driveParams, paramBlob, sizeof(paramBlob));
+            if (len) writeParamFile(paramJobDrive, paramBlob, len);
+        }
+        paramJob = PARAM_REQ_NONE;
+    }
+
+    ParamRequest request = paramRequest;
+    if (request == PARAM_REQ_NONE || paramJob != PARAM_REQ_NONE) return; // One at a time, the request waits
+    paramRequest = PARAM_REQ_NONE;
+    uint8_t drive = paramRequestDrive;
+    if (request == PARAM_REQ_RESTORE && !readParamFile(drive)) return;
+    if (sendDriveCommand(drive, request == PARAM_REQ_BACKUP ? DRIVE_CMD_PARAM_BACKUP : DRIVE_CMD_PARAM_RESTORE)) {
+        paramJob = request;
+        paramJobDrive = drive;
+    }
+}
+
+// --- Register Macros ---
+
+// Body of POST /macro, collected in macroText
+void onMacroUploadBody(AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total) {
+    if (index == 0) {
+        if (macroUploadRequest || macroUploadDrive != 0 || total > sizeof(macroText)) return;
+        macroUploadRequest = request;
+        macroTextLength = 0;
+        request->onDisconnect([request]() { if (macroUploadRequest == request) macroUploadRequest = nullptr; });
+    }
+    if (request != macroUploadRequest || index + len > sizeof(macroText)) return;
+    memcpy(macroText + index, data, len);
+    macroTextLength = index + len;
+}
+
+// Serves POST /macro?drive=N once its body is in: parses it and hands it to appLoop()
+void onMacroUpload(AsyncWebServerRequest *request) {
+    if (request != macroUploadRequest) {
+        request->send(409, "text/plain", "Another macro is waiting to run, or the macro is too large");
+        return;
+    }
+    macroUploadRequest = nullptr;
+    int drive = paramRequestedDrive(request);
+    uint16_t errorLine = 0;
+    if (drive < 0) {
+        request->send(400, "text/plain", "Unknown drive");
+    } else if (!macroParse(macroText, macroTextLength, &macroUpload, &errorLine)) {
+        char msg[48];
+        snprintf(msg, sizeof(msg), "Invalid macro step in line %d", errorLine);
+        request->send(400, "text/plain", msg);
+    } else {
+        macroUploadDrive = drive + 1;
+        request->send(202, "text/plain", "Queued, the result is logged");
+    }
+}
+
+// Starts a parsed macro once the drive task is done with the previous one
+void serviceMacros() {
+    uint8_t upload = macroUploadDrive;
+    if (!upload || userMacroRunning) return;
+    driveUserMacro = macroUpload;
+    macroUploadDrive = 0;
+    logToBrowser("Drive %d: running uploaded macro, %d steps...", upload, driveUserMacro.count);
+    if (runDriveMacro(upload - 1, MACRO_USER)) userMacroRunning = true;
+}
+
+// --- Modbus Latency ---
+
+// Adds a latency histogram with its bucket counts, if it has samples
+void addLatencyHistogram(JsonObject obj, char *name, const LatencyHistogram &h) {
+    if (h.total == 0) return;
+    JsonObject hist = obj.createNestedObject(name);
+    hist["n"] = h.total;
+    hist["p50"] = h.percentile(50);
+    hist["p90"] = h.percentile(90);
+    hist["p99"] = h.percentile(99);
+    hist["max"] = h.maxUs;
+    JsonArray counts = hist.createNestedArray("counts");
+    for (uint8_t i = 0; i < LATENCY_BUCKETS; i++) counts.add(h.counts[i]);
+}
+
+// Serves /latency: the exchange time histograms of the bus, in us
+void onLatencyRequest(AsyncWebServerRequest *request) {
+    DynamicJsonDocument doc(12288);
+    JsonArray bounds = doc.createNestedArray("bucketsUs"); // Upper bounds, the last bucket takes the rest
+    for (uint8_t i = 0; i < LATENCY_BUCKETS - 1; i++) bounds.add(latencyBucketUs[i]);
+    addLatencyStats(doc.as<JsonObject>(), addLatencyHistogram);
+    AsyncResponseStream *response = request->beginResponseStream("application/json");
+    serializeJson(doc, *response);
+    request->send(response);
+}
+
 // --- Setup for AP Mode (unchanged) ---
 void setupAPMode() {
     isInAPMode = true;
@@ -810,7 +1437,7 @@ void setupApp() {
     logToBrowser("\nStarting Application Setup (STA Mode)...");
 
     // set large homing position to prevent false alarms
-    homingPosition = 999999;
+    for (uint8_t i = 0; i < DRIVE_COUNT; i++) drives[i].homingPosition = 999999;
     
     // Load saved homing position
     // preferences.begin("servo", true); // read-only
@@ -818,59 +1445,82 @@ void setupApp() {
     // preferences.end();
     // logToBrowser("Loaded homing position: %d", homingPosition);
 
-    // Modbus Setup
-    ModbusSerial.begin(57600, SERIAL_8N1, RXD2_PIN, TXD2_PIN);
-    if (!ModbusSerial) { logToBrowser("!!! Failed to start Modbus Serial Port in STA Mode !!!"); delay(5000); ESP.restart(); }
+    // Modbus Setup, starting at the last rate that worked
+    preferences.begin("modbus", true); // read-only
+    modbusBaud = preferences.getULong("baud", MODBUS_BAUD);
+    busTargetPct = preferences.getUChar("busTarget", BUS_TARGET_DEFAULT_PCT);
+    preferences.end();
+    if (!driveBegin(MODBUS_UART_NUM, RXD2_PIN, TXD2_PIN, RS485_DE_PIN, driveSlaveIds, driveTelemetryWeights, DRIVE_COUNT,
+                    modbusBaud, drives[0].homingPosition)) {
+        logToBrowser("!!! Failed to start Modbus Serial Port in STA Mode !!!"); delay(5000); ESP.restart();
+    }
     else { logToBrowser("Modbus Serial Port OK."); }
-    node.begin(SERVO_DRIVE_SLAVE_ID, ModbusSerial);
 
     logToBrowser("Checking initial Modbus connection...");
     delay(500);
-    checkModbusConnection();
+    uint32_t negotiatedBaud = driveNegotiateBaud(modbusBaud, MODBUS_BAUD, MODBUS_TARGET_BAUD);
+    uint8_t drivesOk = 0;
+    for (uint8_t i = 0; i < DRIVE_COUNT; i++) {
+        drives[i].modbusOk = driveLinkOk(i);
+        if (drives[i].modbusOk) drivesOk++;
+    }
+    bool modbusOk = (negotiatedBaud != 0);
+    serviceDriveQueues();
+    if (modbusOk && negotiatedBaud != modbusBaud) {
+        modbusBaud = negotiatedBaud;
+        preferences.begin("modbus", false); // read-write
+        preferences.putULong("baud", modbusBaud);
+        preferences.end();
+        logToBrowser("Modbus baud rate %lu saved to flash.", (unsigned long)modbusBaud);
+    }
     if (!modbusOk) logToBrowser("WARNING: Initial Modbus check failed!");
     else {
-        logToBrowser("Configuring Drive for Torque Mode with Software Limits...");
-        disableServoModbus(); // Ensure servo starts disabled
-        delay(100);
-        
-        // Basic configuration for Torque Mode
-        if (!writeRegister(REG_CONTROL_MODE, 2)) logToBrowser("Failed to set Control Mode (2)!");
-        if (!writeRegister(REG_TORQUE_REF_SRC, 0)) logToBrowser("Failed to set Torque Ref Source (0)!");
-        if (!writeRegister(REG_TARGET_TORQUE, 0)) logToBrowser("Failed to set initial Torque to 0!");
-
-        // Set Software Limits
-        logToBrowser("Setting Negative Software Limit (C06.08) to %d...", homingPosition);
-        if (!writeRegister32bit(REG_SOFT_LIMIT_NEG, homingPosition)) {
-             logToBrowser("FAILED to write Negative Software Limit!");
-        }
-        logToBrowser("Enabling Software Limits (C06.07 = 1)...");
-        if (!writeRegister(REG_SOFT_LIMIT_ENABLE, 1)) { // Value 1 enables +/- Limits
-            logToBrowser("FAILED to enable Software Limits!");
-        } else {
-             logToBrowser("Software Limits enabled (Positive=0, Negative=%d)", homingPosition);
-        }
+        logToBrowser("Modbus link at %lu baud, %d of %d drives answering.", (unsigned long)modbusBaud, drivesOk, DRIVE_COUNT);
 
-        // Disable Out of Control Protection
+        // Torque Mode, Software Limits, Out of Control Protection disabled, servo disabled
+        logToBrowser("Configuring Drive for Torque Mode with Software Limits...");
+        logToBrowser("Setting Negative Software Limit (C06.08) to %d, enabling Software Limits (C06.07 = 1)...", drives[0].homingPosition);
         logToBrowser("Disabling Out of Control Protection (C06.20 = 0)...");
-        if (!writeRegister(REG_OUT_OF_CONTROL_PROT, 0)) {
-            logToBrowser("FAILED to disable Out of Control Protection!");
+        bool configOk = driveApplyConfig();
+        serviceDriveQueues(); // Failed writes are logged by the drive task
+        if (!configOk) {
+            logToBrowser("FAILED to apply the drive configuration!");
         } else {
-             logToBrowser("Out of Control Protection disabled.");
+            logToBrowser("Software Limits enabled (Positive=0, Negative=%d), Out of Control Protection disabled.", drives[0].homingPosition);
         }
-        
     }
 
+    flashOk = LittleFS.begin(true);
+    if (!flashOk) logToBrowser("LittleFS not available, Modbus captures stay in RAM.");
+
     // Webserver & WebSocket Setup
     ws.onEvent(onWsEvent); server.addHandler(&ws);
     server.on("/", HTTP_GET, [](AsyncWebServerRequest *request){ request->send_P(200, "text/html", index_html); });
+    server.on("/latency", HTTP_GET, onLatencyRequest);
+    server.on("/params", HTTP_GET, onParamDownload);
+    server.on("/params", HTTP_POST, onParamUpload, nullptr, onParamUploadBody);
+    server.on("/macro", HTTP_POST, onMacroUpload, nullptr, onMacroUploadBody);
+#if MODBUS_CAPTURE
+    server.on("/capture", HTTP_GET, onCaptureDownload);
+#endif
     server.onNotFound([](AsyncWebServerRequest *request){ request->send(404, "text/plain", "Not found"); });
     server.begin();
     logToBrowser("HTTP server started. Open browser to http://%s", WiFi.localIP().toString().c_str());
+    if (gatewayBegin()) logToBrowser("Modbus TCP gateway on port %d.", MODBUS_TCP_PORT);
+    else logToBrowser("Failed to start the Modbus TCP gateway.");
 
     // Initialize timers and states
-    lastModbusReadTime = millis(); lastModbusCheckTime = millis(); lastWsSendTime = millis();
-    servoIsEnabledTarget = false; servoIsEnabledActual = false; currentTargetTorque = 0; actualServoStatus = 0; modbusConsecutiveErrors = 0;
-    homingState = HOMING_IDLE; 
+    lastWsSendTime = millis();
+    for (uint8_t i = 0; i < DRIVE_COUNT; i++) {
+        DriveState &d = drives[i];
+        d.servoIsEnabledTarget = false; d.servoIsEnabledActual = false; d.currentTargetTorque = 0; d.actualServoStatus = 0;
+        d.homingState = HOMING_IDLE; 
+    }
+
+    // From here on only the drive task touches the Modbus port
+    sendDriveCommand(0, DRIVE_CMD_BUS_TARGET, 0, busTargetPct); // Served once the task runs
+    driveStartTask();
+    logToBrowser("Drive task started on core %d.", DRIVE_TASK_CORE);
 }
 
 // --- Main Setup ---
@@ -901,221 +1551,232 @@ void setup() {
     if (!connected) { setupAPMode(); }
 }
 
-// --- Main App Loop ---
-void appLoop() {
-    unsigned long currentTime = millis();
+// Sends a homing status record of 'drive' to all WebSocket clients
+void sendHomingStatus(uint8_t drive, const char *status, const String &message) {
+    wsJsonTx.clear(); wsJsonTx["type"] = "homingStatus"; wsJsonTx["drive"] = drive; wsJsonTx["status"] = status;
+    wsJsonTx["message"] = message;
+    { String jsonString; serializeJson(wsJsonTx, jsonString); ws.textAll(jsonString); }
+}
 
-    // 1. Check Modbus connection (if not ok and interval elapsed)
-    if (!modbusOk && (currentTime - lastModbusCheckTime >= modbusCheckInterval)) {
-        lastModbusCheckTime = currentTime;
-        checkModbusConnection(); 
-        if (modbusOk) {
-            logToBrowser("Reconnected to Modbus. Re-applying settings...");
-            disableServoModbus();
-            enableCmdSent = false;
-            writeRegister(REG_CONTROL_MODE, 2);
-            writeRegister(REG_TORQUE_REF_SRC, 0);
-            writeRegister32bit(REG_SOFT_LIMIT_NEG, homingPosition);
-            writeRegister(REG_SOFT_LIMIT_ENABLE, 1);
-            writeRegister(REG_OUT_OF_CONTROL_PROT, 0); // Re-apply this setting too
+// Sends the replies the WebSocket handler queued, each to its client
+void serviceWsReplies() {
+    WsReply reply;
+    while (wsReplies.pop(reply)) {
+        String jsonString;
+        if (reply.type == WS_REPLY_HOMING_REJECTED) {
+            wsJsonTx.clear(); wsJsonTx["type"] = "homingStatus"; wsJsonTx["drive"] = reply.drive; wsJsonTx["status"] = "failed";
+            wsJsonTx["message"] = "Homing rejected.";
+            serializeJson(wsJsonTx, jsonString); ws.text(reply.clientId, jsonString);
+            continue;
         }
-    }
-
-    // 2. Read Modbus data (frequently), only if connection OK (or error counter < Max)
-    if (modbusOk || modbusConsecutiveErrors < MAX_MODBUS_ERRORS) {
-        if (currentTime - lastModbusReadTime >= modbusReadInterval) {
-            lastModbusReadTime = currentTime;
-            readServoData(); 
+        if (reply.type == WS_REPLY_CONNECTED) {
+            wsJsonTx.clear(); wsJsonTx["type"] = "log"; wsJsonTx["message"] = "Client connected";
+            serializeJson(wsJsonTx, jsonString); ws.text(reply.clientId, jsonString);
+            jsonString = "";
         }
+        fillStatusJson();
+        serializeJson(wsJsonTx, jsonString); ws.text(reply.clientId, jsonString);
     }
+}
 
-    // 3. Homing State Machine (has priority)
-    if (homingState != HOMING_IDLE) {
+// --- Homing State Machine ---
+// Runs per drive, each drive uses its own batch (HOMING_BATCH + drive)
+void serviceHoming(uint8_t drive) {
+    DriveState &d = drives[drive];
+    const uint8_t batch = HOMING_BATCH + drive;
+    if (d.homingState == HOMING_IDLE) return;
+
+    // Sensorless homing requires data from the servo. If Modbus fails, stop homing.
+    if (!d.modbusOk) {
+        logToBrowser("Drive %d: Homing FAILED: Modbus connection lost.", drive + 1);
+        d.homingState = HOMING_IDLE;
+        sendHomingStatus(drive, "failed", "Homing FAILED: Modbus lost.");
+    }
 
-        // Sensorless homing requires data from the servo. If Modbus fails, stop homing.
-        if (!modbusOk) {
-            logToBrowser("Homing FAILED: Modbus connection lost.");
-            homingState = HOMING_IDLE;
-            wsJsonTx.clear(); wsJsonTx["type"] = "homingStatus"; wsJsonTx["status"] = "failed"; wsJsonTx["message"] = "Homing FAILED: Modbus lost.";
-            { String jsonString; serializeJson(wsJsonTx, jsonString); ws.textAll(jsonString); }
-        }
+    switch (d.homingState) {
+        case HOMING_START:
+            logToBrowser("Drive %d: Homing: Disabling Software Limits (C06.07 = 0), setting Speed Mode (1) and Target Speed (%d rpm), enabling servo...", drive + 1, HOMING_SPEED_RPM);
+            driveBatchBegin(batch);
+            runDriveMacro(drive, MACRO_HOMING_START, HOMING_SPEED_RPM, batch); // Ends once the servo is 'Running'
+            driveBatchEnd(batch);
+            d.homingState = HOMING_START_PENDING;
+            break;
 
-        switch (homingState) {
-            case HOMING_START:
-                logToBrowser("Homing: Disabling Software Limits (C06.07 = 0)...");
-                if (writeRegister(REG_SOFT_LIMIT_ENABLE, 0)) {
-                    delay(50);
-                    logToBrowser("Homing: Setting Speed Mode (1) and Target Speed (%d rpm)...", HOMING_SPEED_RPM);
-                    if (writeRegister(REG_CONTROL_MODE, 1) && writeRegister(REG_TARGET_SPEED, HOMING_SPEED_RPM)) {
-                        logToBrowser("Homing: Enabling servo...");
-                        if (enableServoModbus()) {
-                            logToBrowser("Homing: Servo enable command sent. Waiting for 'Running' status...");
-                            homingStartTime = millis(); 
-                            homingState = HOMING_WAIT_FOR_RUNNING; 
-                        } else {
-                            logToBrowser("Homing FAILED: Could not enable servo.");
-                            writeRegister(REG_CONTROL_MODE, 2); 
-                            writeRegister(REG_SOFT_LIMIT_ENABLE, 1); 
-                            homingState = HOMING_IDLE; 
-                        }
-                    } else {
-                        logToBrowser("Homing FAILED: Could not set speed mode/target.");
-                        writeRegister(REG_SOFT_LIMIT_ENABLE, 1); 
-                        homingState = HOMING_IDLE; 
-                    }
+        case HOMING_START_PENDING:
+            if (!driveBatchDone(batch)) break;
+            if (!driveBatches[batch].failed) {
+                logToBrowser("Drive %d: Homing: Servo is 'Running'. Now monitoring for stall.", drive + 1);
+                d.homingState = HOMING_MOVING_SLOW; 
+            } else {
+                if (d.actualServoStatus == 3) {
+                    logToBrowser("Drive %d: Homing FAILED: Servo faulted while trying to start.", drive + 1);
                 } else {
-                    logToBrowser("Homing FAILED: Could not disable software limits.");
-                    homingState = HOMING_IDLE;
+                    logToBrowser("Drive %d: Homing FAILED: Could not set speed mode, or servo did not enter 'Running' state.", drive + 1);
                 }
-                break;
+                d.currentTargetTorque = 0;
+                runDriveMacro(drive, MACRO_HOMING_ABORT);
+                d.homingState = HOMING_IDLE;
+            }
+            break;
 
-            case HOMING_WAIT_FOR_RUNNING:
-                if (servoIsEnabledActual) { 
-                    logToBrowser("Homing: Servo is 'Running'. Now monitoring for stall.");
-                    homingState = HOMING_MOVING_SLOW; 
-                } else if (actualServoStatus == 3) { 
-                    logToBrowser("Homing FAILED: Servo faulted while trying to start.");
-                    writeRegister(REG_SOFT_LIMIT_ENABLE, 1); 
-                    homingState = HOMING_IDLE;
-                } else if (millis() - homingStartTime > HOMING_START_TIMEOUT) { 
-                    logToBrowser("Homing FAILED: Servo did not enter 'Running' state (Timeout).");
-                    disableServoModbus(); 
-                    writeRegister(REG_CONTROL_MODE, 2); 
-                    writeRegister(REG_SOFT_LIMIT_ENABLE, 1); 
-                    homingState = HOMING_IDLE;
+        case HOMING_MOVING_SLOW:
+            if (d.servoIsEnabledActual) { 
+                if (abs(d.actualTorque) > HOMING_TORQUE_THRESHOLD) { 
+                    logToBrowser("Drive %d: Homing: Stall detected (Torque > %.1f%%) at position %d. Stopping.", drive + 1, HOMING_TORQUE_THRESHOLD/10.0, d.actualPosition);
+                    d.homingPosition = d.actualPosition; 
+                    d.homingState = HOMING_DONE;
                 }
-                break;
-
-            case HOMING_MOVING_SLOW:
-                if (servoIsEnabledActual) { 
-                    if (abs(actualTorque) > HOMING_TORQUE_THRESHOLD) { 
-                        logToBrowser("Homing: Stall detected (Torque > %.1f%%) at position %d. Stopping.", HOMING_TORQUE_THRESHOLD/10.0, actualPosition);
-                        homingPosition = actualPosition; 
-                        homingState = HOMING_DONE;
-                    }
+            } else {
+                if (d.actualServoStatus != 3) { 
+                    logToBrowser("Drive %d: Homing FAILED: Servo stopped unexpectedly before stall.", drive + 1);
                 } else {
-                    if (actualServoStatus != 3) { 
-                        logToBrowser("Homing FAILED: Servo stopped unexpectedly before stall.");
-                    } else {
-                        logToBrowser("Homing FAILED: Servo faulted during homing.");
-                    }
-                    writeRegister(REG_SOFT_LIMIT_ENABLE, 1); 
-                    homingState = HOMING_IDLE; 
+                    logToBrowser("Drive %d: Homing FAILED: Servo faulted during homing.", drive + 1);
                 }
-                break;
+                runDriveMacro(drive, MACRO_HOMING_ABORT);
+                d.homingState = HOMING_IDLE; 
+            }
+            break;
 
-            case HOMING_DONE:
-                logToBrowser("Homing: Disabling servo, restoring Torque Mode (2), and setting new software limit...");
-                disableServoModbus(); 
-                delay(50); 
-                writeRegister(REG_CONTROL_MODE, 2); 
-                writeRegister(REG_TARGET_TORQUE, 0); // Ensure torque is 0
-                writeRegister(REG_TARGET_SPEED, 0); 
-
-                logToBrowser("Setting Negative Software Limit (C06.08) to new position %d...", homingPosition);
-                if (writeRegister32bit(REG_SOFT_LIMIT_NEG, homingPosition)) {
-                     logToBrowser("New Negative Software Limit set.");
-                } else {
-                     logToBrowser("FAILED to write new Negative Software Limit!");
-                }
-                delay(50);
-                logToBrowser("Re-enabling Software Limits (C06.07 = 1)...");
-                 if (writeRegister(REG_SOFT_LIMIT_ENABLE, 1)) {
-                     logToBrowser("Software Limits re-enabled.");
-                 } else {
-                      logToBrowser("FAILED to re-enable Software Limits!");
-                 }
-                
-                logToBrowser("Homing Finished. Position set to %d.", homingPosition);
-                
-                preferences.begin("servo", false); // read-write
-                preferences.putLong("homingPos", homingPosition);
-                preferences.end();
-                logToBrowser("Homing position %d saved to flash.", homingPosition);
-                
-                wsJsonTx.clear(); wsJsonTx["type"] = "homingStatus"; wsJsonTx["status"] = "finished";
-                wsJsonTx["message"] = "Homing complete. Position: " + String(homingPosition);
-                { String jsonString; serializeJson(wsJsonTx, jsonString); ws.textAll(jsonString); }
-
-                homingState = HOMING_IDLE; 
-                break;
+        case HOMING_DONE:
+            logToBrowser("Drive %d: Homing: Disabling servo, restoring Torque Mode (2), and setting new software limit %d...", drive + 1, d.homingPosition);
+            d.currentTargetTorque = 0; // The servo off also writes a target torque of 0
+            driveBatchBegin(batch);
+            runDriveMacro(drive, MACRO_HOMING_FINISH, d.homingPosition, batch); // Verifies the new limit
+            driveBatchEnd(batch);
+            d.homingState = HOMING_FINISHING;
+            break;
+
+        case HOMING_FINISHING: {
+            if (!driveBatchDone(batch)) break;
+            if (driveBatches[batch].failed) {
+                logToBrowser("Drive %d: FAILED to write new Negative Software Limit or re-enable Software Limits!", drive + 1);
+            } else {
+                logToBrowser("Drive %d: New Negative Software Limit set, Software Limits re-enabled.", drive + 1);
+            }
             
-            default:
-                homingState = HOMING_IDLE;
-                break;
-        }
-    }
+            logToBrowser("Drive %d: Homing Finished. Position set to %d.", drive + 1, d.homingPosition);
+            
+            String key = drive ? "homingPos" + String(drive + 1) : String("homingPos"); // One key per drive
+            preferences.begin("servo", false); // read-write
+            preferences.putLong(key.c_str(), d.homingPosition);
+            preferences.end();
+            logToBrowser("Drive %d: Homing position %d saved to flash.", drive + 1, d.homingPosition);
+            
+            sendHomingStatus(drive, "finished", "Homing complete. Position: " + String(d.homingPosition));
 
+            d.homingState = HOMING_IDLE; 
+        } break;
+        
+        default:
+            d.homingState = HOMING_IDLE;
+            break;
+    }
+}
 
-    // 4. Servo Enable/Disable & Torque Sending (only if not homing)
-    if (homingState == HOMING_IDLE) {
-        if (modbusOk) {
-            
-            // --- 4a. Enable/Disable Command Logic ---
-            if (servoIsEnabledTarget && !servoIsEnabledActual) {
-                if (actualServoStatus == 1 && !enableCmdSent) {
-                     logToBrowser("Enable Condition Met: Target=ON, Actual=OFF, Status=1, CmdSent=FALSE -> Sending Enable Command...");
-                    if(enableServoModbus()) { 
-                       enableCmdSent = true; 
-                    }
-                }
-                else if (!enableCmdSent && (currentTime % 2000 < modbusReadInterval) ) { 
-                     // Log level reduced
-                     // logToBrowser("Enable Check: Target=ON, Actual=OFF, Status=%d, CmdSent=%s -> Conditions not met.",
-                     //              actualServoStatus, enableCmdSent ? "true" : "false");
-                }
-            } else if (!servoIsEnabledTarget && servoIsEnabledActual) {
-                if (disableServoModbus()) { 
-                    enableCmdSent = false; 
+// Servo Enable/Disable of one drive (only if not homing)
+void serviceServoEnable(uint8_t drive, unsigned long currentTime) {
+    DriveState &d = drives[drive];
+    if (d.homingState != HOMING_IDLE) return;
+    if (d.modbusOk) {
+        
+        // --- Enable/Disable Command Logic ---
+        if (d.servoIsEnabledTarget && !d.servoIsEnabledActual) {
+            if (d.actualServoStatus == 1 && !d.enableCmdSent) {
+                 logToBrowser("Drive %d: Enable Condition Met: Target=ON, Actual=OFF, Status=1, CmdSent=FALSE -> Sending Enable Command...", drive + 1);
+                if(enableServoModbus(drive)) { 
+                   d.enableCmdSent = true; 
                 }
-            } else {
-                 if (!servoIsEnabledTarget && !servoIsEnabledActual) {
-                      if (enableCmdSent) { enableCmdSent = false; }
-                 }
-                 else if (servoIsEnabledTarget && servoIsEnabledActual) {
-                     if (!enableCmdSent) { enableCmdSent = true; }
-                 }
             }
-
-            // --- 4b. Send Torque (if enabled) ---
-            if (servoIsEnabledActual) {
-                // Always send the torque value from the slider (converted from weight in JS)
-                // The servo itself handles the software limits
-                writeRegister(REG_TARGET_TORQUE, currentTargetTorque);
+            else if (!d.enableCmdSent && (currentTime % 2000 < wsSendInterval) ) { 
+                 // Log level reduced
+                 // logToBrowser("Enable Check: Target=ON, Actual=OFF, Status=%d, CmdSent=%s -> Conditions not met.",
+                 //              d.actualServoStatus, d.enableCmdSent ? "true" : "false");
             }
-            // (If servoIsEnabledActual == false, disableServoModbus() already set torque to 0)
-
-        } // end if(modbusOk)
-         else {
-            // Modbus not OK -> Ensure internal state reflects disabled
-            if (servoIsEnabledActual || servoIsEnabledTarget || enableCmdSent) { 
-                 servoIsEnabledActual = false;
-                 servoIsEnabledTarget = false;
-                 actualServoStatus = 0; 
-                 enableCmdSent = false; 
+        } else if (!d.servoIsEnabledTarget && d.servoIsEnabledActual) {
+            if (!d.disableCmdPending && disableServoModbus(drive)) { // One disable in flight at a time
+                d.enableCmdSent = false; 
             }
+        } else {
+             if (!d.servoIsEnabledTarget && !d.servoIsEnabledActual) {
+                  if (d.enableCmdSent) { d.enableCmdSent = false; }
+             }
+             else if (d.servoIsEnabledTarget && d.servoIsEnabledActual) {
+                 if (!d.enableCmdSent) { d.enableCmdSent = true; }
+             }
+        }
+
+    } // end if(modbusOk)
+     else {
+        // Modbus not OK -> Ensure internal state reflects disabled
+        if (d.servoIsEnabledActual || d.servoIsEnabledTarget || d.enableCmdSent) { 
+             d.servoIsEnabledActual = false;
+             d.servoIsEnabledTarget = false;
+             d.actualServoStatus = 0; 
+             d.enableCmdSent = false; 
+        }
+    }
+}
+
+// --- Main App Loop ---
+void appLoop() {
+    unsigned long currentTime = millis();
+
+    // 0. Take over samples and events from the drive task. They update the state used below.
+    serviceDriveQueues();
+    gatewayLoop(); // Answers for the Modbus TCP clients
+    serviceWsReplies(); // Connect, getStatus and rejected homing replies of the WebSocket handler
+
+    // Emergency stop from the WebSocket handler: the drive task drops everything queued, disables first
+    if (eStopRequested) {
+        eStopRequested = false;
+        eStopAllDrives();
+    }
+    serviceCapture();
+    serviceParams();
+    serviceMacros();
+    if (latencyResetRequested) {
+        latencyResetRequested = false;
+        if (sendDriveCommand(0, DRIVE_CMD_RESET_LATENCY)) logToBrowser("Modbus latency histograms cleared.");
+    }
+    if (busTargetRequested >= 0) {
+        int8_t target = busTargetRequested;
+        busTargetRequested = -1;
+        if (sendDriveCommand(0, DRIVE_CMD_BUS_TARGET, 0, target)) {
+            busTargetPct = target;
+            preferences.begin("modbus", false); // read-write
+            preferences.putUChar("busTarget", busTargetPct);
+            preferences.end();
+        }
+    }
+
+    // 1./2. Connection checks, reconnect and telemetry reads run in the drive task
+
+    for (uint8_t i = 0; i < DRIVE_COUNT; i++) {
+        DriveState &d = drives[i];
+        if (d.pendingDI5Func >= 0) {
+            writeRegister(i, REG_DI5_FUNCTION, d.pendingDI5Func);
+            d.pendingDI5Func = -1;
         }
-    } // end if(homingState == HOMING_IDLE)
+
+        // 3. Homing State Machine (has priority)
+        serviceHoming(i);
+
+        // 4. Servo Enable/Disable (only if not homing)
+        serviceServoEnable(i, currentTime);
+
+        // 4b. Torque setpoint. The drive task writes it while the servo runs:
+        // always the torque value from the slider (converted from weight in JS),
+        // the servo itself handles the software limits. Paused while homing runs in speed mode.
+        updateTorqueSetpoint(i, d.homingState == HOMING_IDLE ? d.currentTargetTorque : -1);
+        updatePollProfile(i, d.homingState != HOMING_IDLE);
+    }
 
 
     // 5. Send data to WebSocket clients
     if (currentTime - lastWsSendTime >= wsSendInterval) {
         lastWsSendTime = currentTime;
         if (ws.count() > 0) {
-            wsJsonTx.clear();
-            wsJsonTx["type"] = "status";
-            wsJsonTx["modbusOk"] = modbusOk;
-            wsJsonTx["servoEnabled"] = servoIsEnabledActual;
-            wsJsonTx["servoStatus"] = actualServoStatus;
-            wsJsonTx["diStatus"] = diStatus;
-            wsJsonTx["pos"] = actualPosition;
-            wsJsonTx["spd"] = actualSpeed;
-            wsJsonTx["trq"] = actualTorque;
-            wsJsonTx["cur"] = rmsCurrent;
-            wsJsonTx["vbus"] = busVoltage;
-            wsJsonTx["igbtTemp"] = igbtTemp;     
-            wsJsonTx["motorTemp"] = motorTemp;   
-            wsJsonTx["homingInProgress"] = (homingState != HOMING_IDLE); 
+            fillStatusJson();
             { String jsonString; serializeJson(wsJsonTx, jsonString); ws.textAll(jsonString); }
         }
     }
@@ -1135,6 +1796,17 @@ void loop() {
         if(wifiReconnectTimer == 0) {
             logToBrowser("WiFi connection lost. Attempting to reconnect...");
             wifiReconnectTimer = millis();
+
+            // Ensure the servos are off during disconnect. The drive task keeps running.
+            if (anyDriveOk() || anyServoEnabled()) {
+                eStopAllDrives(); // Drop queued writes, send disable commands
+                for (uint8_t i = 0; i < DRIVE_COUNT; i++) {
+                    drives[i].servoIsEnabledTarget = false;
+                    drives[i].enableCmdSent = false; // Reset flag on disconnect
+                    drives[i].homingState = HOMING_IDLE; // Abort homing on WiFi loss
+                }
+                logToBrowser("WiFi lost, servos disabled.");
+            }
         }
         if (millis() - wifiReconnectTimer > 10000) {
              Serial.print(".");
@@ -1142,17 +1814,7 @@ void loop() {
              WiFi.reconnect();
              wifiReconnectTimer = millis();
         }
-        // Ensure Modbus/Servo is off during disconnect
-        if (modbusOk || servoIsEnabledActual) {
-            disableServoModbus(); // Try to send disable command
-            modbusOk = false;
-            actualServoStatus = 0;
-            servoIsEnabledActual = false;
-            servoIsEnabledTarget = false;
-            enableCmdSent = false; // Reset flag on disconnect
-            homingState = HOMING_IDLE; // Abort homing on WiFi loss
-            logToBrowser("WiFi lost, Modbus communication stopped.");
-        }
+        serviceDriveQueues(); // appLoop() is not running, keep the drive queues drained
         delay(500); // Wait between checks
     }
 }
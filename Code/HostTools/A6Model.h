@@ -0,0 +1,227 @@
+/*
+ * Simulated A6-RS Servo Drive
+ *
+ * Register bank and behaviour of one drive, as far as the firmware uses it:
+ * servo status 0 -> 1 -> 2 (not ready, ready, running), torque and speed mode
+ * (C00.00 = 2 / 1), the negative software limit (C06.07 / C06.08), out of
+ * control protection (C06.20) and the U40 / U41 monitor registers.
+ *
+ * The mechanics are a motor with a cable spool, the handle against an end stop
+ * at the housing, and optionally a user pulling the handle out. Positive torque
+ * and speed retract the cable, which lowers the position. The end stop is at
+ * the lowest position, the negative software limit keeps the handle off it.
+ * The positive software limit is not modelled.
+ *
+ * Plain C++, host only.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <math.h>
+#include <map>
+#include "ModbusRtu.h"
+#include "ServoRegisterMap.h"
+
+#define A6_UNITS_PER_REV 10000     // Reference units per motor revolution
+#define A6_EXCEPTION_READ_DISABLED 0x20
+
+// Servo status (U41.0A)
+enum A6Status : uint16_t { A6_NOT_READY, A6_READY, A6_RUNNING, A6_FAULT };
+
+struct A6Mechanics {
+    double ratedTorqueNm = 1.27;   // 400 W motor, 1000 = 100.0 %
+    double ratedCurrentA = 2.8;
+    double inertia = 2.6e-4;       // Motor, spool and handle, kg m^2
+    double spoolRadius = 0.02;     // m
+    double viscous = 2e-4;         // Nm per rad/s
+    double coulomb = 0.02;         // Nm
+    double endStop = -2000;        // Position of the handle against the housing
+    double maxRpm = 3000;
+    double pullForceN = 0;         // User: peak pull on the handle, 0 = nobody pulls
+    double pullPeriodS = 3;        // One repetition
+    double maxPullSpeed = 1.5;     // m/s of the handle
+    uint32_t readyDelayMs = 1000;  // Power on to "ready"
+    uint32_t enableDelayMs = 20;   // Servo on to "running"
+};
+
+class A6Drive {
+public:
+    A6Drive(uint8_t slaveId, const A6Mechanics &mech) : _slaveId(slaveId), _mech(mech) { resetParams(); powerCycle(); }
+
+    uint8_t slaveId() const { return _slaveId; }
+    A6Status status() const { return _status; }
+    int32_t position() const { return (int32_t)lround(_pos); }
+    int16_t speedRpm() const { return (int16_t)lround(_omega * 60.0 / (2 * M_PI)); }
+    int16_t torquePermille() const { return (int16_t)lround(_torque / _mech.ratedTorqueNm * 1000.0); }
+    uint16_t param(uint16_t address) const {
+        auto it = _params.find(address);
+        return it == _params.end() ? 0 : it->second;
+    }
+
+    // Registers the drive refuses to read (exception 0x20), to exercise the read planner
+    void refuseReads(uint16_t first, uint16_t last) { _refused[first] = last; }
+
+    void resetParams() {
+        _params.clear();
+        _params[REG_CONTROL_MODE] = 0;        // Position mode
+        _params[REG_OUT_OF_CONTROL_PROT] = 1; // Enabled
+        _params[REG_MODBUS_BAUD] = 6;         // 57600
+    }
+
+    // Position, status and faults are lost. Parameters stay unless they were volatile.
+    void powerCycle() {
+        _status = A6_NOT_READY;
+        _ageMs = 0;
+        _enableAtMs = 0;
+        _pos = 0;
+        _omega = 0;
+        _torque = 0;
+        _speedInteg = 0;
+        _followingError = 0;
+        _oocMs = 0;
+        _params[REG_MODBUS_SERVO_ON] = 0;
+    }
+
+    // Advances the drive by 'dt' seconds, 't' is the simulation time
+    void step(double dt, double t) {
+        _ageMs += (uint32_t)lround(dt * 1000);
+        if (_status == A6_NOT_READY && _ageMs >= _mech.readyDelayMs) _status = A6_READY;
+        if (_status == A6_READY && _enableAtMs && _ageMs >= _enableAtMs) {
+            _status = A6_RUNNING;
+            _enableAtMs = 0;
+            _speedInteg = 0;
+        }
+
+        double rated = _mech.ratedTorqueNm;
+        double torque = 0;
+        if (_status == A6_RUNNING) {
+            if (param(REG_CONTROL_MODE) == 1) { // Speed mode, PI loop
+                double ref = (int16_t)param(REG_TARGET_SPEED) * 2 * M_PI / 60.0;
+                double err = ref - _omega;
+                _speedInteg += err * dt;
+                torque = 0.02 * err + 2.0 * _speedInteg;
+                _followingError += err * dt * A6_UNITS_PER_REV / (2 * M_PI);
+            } else if (param(REG_CONTROL_MODE) == 2) { // Torque mode
+                torque = (int16_t)param(REG_TARGET_TORQUE) / 1000.0 * rated;
+                if (fabs(_omega) * 60.0 / (2 * M_PI) > _mech.maxRpm) torque = 0; // Speed limit
+                _followingError = 0;
+            }
+            double limit = 3.0 * rated; // 300 % peak
+            if (torque > limit || torque < -limit) {
+                _speedInteg -= (torque - (torque > 0 ? limit : -limit)) / 2.0; // Anti windup
+                torque = torque > 0 ? limit : -limit;
+            }
+            // Software limit: no retracting torque below C06.08, brake towards it
+            int32_t negLimit = (int32_t)((uint32_t)param(REG_SOFT_LIMIT_NEG + 1) << 16 | param(REG_SOFT_LIMIT_NEG));
+            if (param(REG_SOFT_LIMIT_ENABLE) && _pos <= negLimit && torque > 0) torque = fmax(-limit, -0.05 * _omega);
+        }
+        _torque = torque;
+
+        // The user only pulls while the servo holds the cable, and can not pull faster than maxPullSpeed
+        double pull = 0;
+        if (_mech.pullForceN > 0 && _status == A6_RUNNING) {
+            double handleSpeed = -_omega * _mech.spoolRadius;
+            double force = _mech.pullForceN * 0.5 * (1 - cos(2 * M_PI * t / _mech.pullPeriodS));
+            pull = force * fmax(0.0, 1.0 - handleSpeed / _mech.maxPullSpeed) * _mech.spoolRadius;
+        }
+        double friction = _mech.viscous * _omega + (_omega > 0 ? _mech.coulomb : _omega < 0 ? -_mech.coulomb : 0);
+        _omega += (torque - pull - friction) / _mech.inertia * dt;
+        _pos -= _omega * dt * A6_UNITS_PER_REV / (2 * M_PI);
+        if (_pos <= _mech.endStop && _omega > 0) { // Handle against the housing
+            _pos = _mech.endStop;
+            _omega = 0;
+        }
+
+        // Out of control protection: the motor turns against its torque (someone pulls harder)
+        bool against = _status == A6_RUNNING && fabs(torque) > 0.05 * rated && torque * _omega < 0
+                       && fabs(_omega) * 60.0 / (2 * M_PI) > 300;
+        _oocMs = against ? _oocMs + (uint32_t)lround(dt * 1000) : 0;
+        if (param(REG_OUT_OF_CONTROL_PROT) && _oocMs > 200) {
+            _status = A6_FAULT;
+            _torque = 0;
+        }
+
+        double load = fabs(_torque) / rated;
+        _loadAvg += (load - _loadAvg) * dt / 1.0;
+        _motorTemp += ((30 + 40 * _loadAvg * _loadAvg) - _motorTemp) * dt / 300.0;
+    }
+
+    // Register reads, returns 0 or the exception code
+    uint8_t read(uint16_t address, uint16_t count, uint16_t *words) const {
+        if (count == 0 || count > MODBUS_MAX_READ_REGS) return MB_RESULT_ILLEGAL_DATA_VALUE;
+        for (uint16_t i = 0; i < count; i++) {
+            uint16_t reg = address + i;
+            if (!readable(reg)) return MB_RESULT_ILLEGAL_DATA_ADDRESS;
+            for (auto &r : _refused) {
+                if (reg >= r.first && reg <= r.second) return A6_EXCEPTION_READ_DISABLED;
+            }
+            words[i] = monitor(reg);
+        }
+        return 0;
+    }
+
+    // Register writes, returns 0 or the exception code
+    uint8_t write(uint16_t address, const uint16_t *values, uint16_t count) {
+        for (uint16_t i = 0; i < count; i++) {
+            if (!writable(address + i)) return MB_RESULT_ILLEGAL_DATA_ADDRESS;
+        }
+        for (uint16_t i = 0; i < count; i++) {
+            uint16_t reg = address + i;
+            _params[reg] = values[i];
+            if (reg == REG_MODBUS_SERVO_ON) {
+                if (values[i] && _status == A6_READY && !_enableAtMs) _enableAtMs = _ageMs + _mech.enableDelayMs;
+                if (!values[i]) {
+                    _enableAtMs = 0;
+                    if (_status == A6_RUNNING) _status = A6_READY;
+                }
+            }
+        }
+        return 0;
+    }
+
+private:
+    // Parameter groups C00..C0A, monitor groups U40 / U41
+    static bool isParam(uint16_t reg) { return (reg >> 8) <= 0x0A; }
+    static bool isMonitor(uint16_t reg) { return (reg >> 8) == 0x40 || (reg >> 8) == 0x41; }
+    static bool readable(uint16_t reg) { return isParam(reg) || isMonitor(reg); }
+    static bool writable(uint16_t reg) { return isParam(reg); }
+
+    uint16_t monitor(uint16_t reg) const {
+        double load = fabs(_torque) / _mech.ratedTorqueNm;
+        int32_t pos = position();
+        int32_t posErr = (int32_t)lround(_followingError);
+        switch (reg) {
+            case 0x0404: case 0x4004: return 0;                                         // DI status
+            case 0x4001: return (uint16_t)speedRpm();
+            case 0x4003: return (uint16_t)torquePermille();
+            case 0x4006: return (uint16_t)lround(3110 - 30 * load);                     // 0.1 V
+            case 0x4007: return (uint16_t)lround(_loadAvg * 1000);                     // 0.1 %
+            case 0x400C: return (uint16_t)lround(load * _mech.ratedCurrentA * 10);      // 0.1 A
+            case 0x4010: return (uint16_t)(posErr & 0xFFFF);
+            case 0x4011: return (uint16_t)((uint32_t)posErr >> 16);
+            case 0x4016: return (uint16_t)(pos & 0xFFFF);
+            case 0x4017: return (uint16_t)((uint32_t)pos >> 16);
+            case 0x4030: return (uint16_t)lround((35 + 15 * _loadAvg) * 10);            // 0.1 degC
+            case 0x4031: return (uint16_t)lround(_motorTemp * 10);
+            case 0x410A: return _status;
+        }
+        return isParam(reg) ? param(reg) : 0;
+    }
+
+    uint8_t _slaveId;
+    A6Mechanics _mech;
+    std::map<uint16_t, uint16_t> _params;
+    std::map<uint16_t, uint16_t> _refused; // First -> last register
+    A6Status _status = A6_NOT_READY;
+    uint32_t _ageMs = 0;       // Since power on
+    uint32_t _enableAtMs = 0;  // Servo on pending, 0 = none
+    double _pos = 0;           // Reference units
+    double _omega = 0;         // rad/s, positive = retract
+    double _torque = 0;        // Motor torque, Nm
+    double _speedInteg = 0;
+    double _followingError = 0;
+    uint32_t _oocMs = 0;
+    double _loadAvg = 0;
+    double _motorTemp = 30;
+};
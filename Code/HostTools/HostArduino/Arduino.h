@@ -0,0 +1,37 @@
+/*
+ * Arduino Shim for Host Builds
+ *
+ * Just enough of Arduino.h for the firmware's Modbus layer (ModbusRtuMaster,
+ * RtuPort) to build on a host. micros() and millis() run on a virtual clock
+ * that the host tool advances itself, so a replay is deterministic and runs
+ * as fast as the CPU allows.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <algorithm>
+
+using std::min;
+using std::max;
+
+inline uint64_t &hostClockUs() {
+    static uint64_t us = 0;
+    return us;
+}
+
+// 32 bit like on the ESP32, so wrap-around behaves the same
+inline unsigned long micros() { return (uint32_t)hostClockUs(); }
+inline unsigned long millis() { return (uint32_t)(hostClockUs() / 1000); }
+inline void delay(unsigned long ms) { hostClockUs() += ms * 1000ULL; }
+
+// Only what SerialRtuPort uses, there is no serial port behind it on a host
+class HardwareSerial {
+public:
+    void updateBaudRate(unsigned long) {}
+    int available() { return 0; }
+    int read() { return -1; }
+    size_t write(const uint8_t *, size_t length) { return length; }
+};
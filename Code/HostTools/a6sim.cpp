@@ -0,0 +1,434 @@
+/*
+ * A6-RS Drive Simulator
+ *
+ * Modbus RTU slave for one or more simulated A6-RS drives (A6Model.h) behind
+ * a Linux pseudo-terminal, or on a real serial port (USB-RS485 / USB-TTL
+ * adapter wired to the ESP32). Lets cycle time, reconnect time and homing
+ * be measured without a servo on the desk.
+ *
+ * Answers 0x03, 0x06 and 0x10, and 0x17 with --fc17. Writes to slave 0 are
+ * broadcasts and not answered. A response goes out after the request and
+ * response times on the wire at the simulated baud rate, plus the drive
+ * turnaround and jitter, so a pty shows the timing of the real bus.
+ *
+ *   make && ./a6sim -n 2 -l /tmp/ttyA6 --pull 60,3
+ *
+ * Signals: SIGUSR1 unplugs / replugs the bus (no answers while unplugged),
+ * SIGUSR2 power cycles the drives (status, position and faults reset, a
+ * C0A.01 baud rate change takes effect).
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <random>
+#include <vector>
+#include "A6Model.h"
+
+#define SIM_STEP_US 1000         // Mechanics time step
+#define SIM_GARBAGE_US 5000      // Silence after which an incomplete frame is dropped
+#define SIM_STATUS_INTERVAL_US 1000000
+#define SIM_MAX_WRITE_REGS 123     // Modbus limit of 0x10
+
+struct SimConfig {
+    uint8_t driveCount = 1;
+    const char *link = nullptr;    // Symlink to the pty slave
+    const char *device = nullptr;  // Real serial port instead of a pty
+    uint32_t baud = 57600;         // Until a power cycle applies C0A.01
+    uint32_t turnaroundUs = 1000;  // C0A.03 = 1 ms
+    uint32_t jitterUs = 300;
+    bool fc17 = false;
+    bool volatileParams = false;   // Parameter writes are lost on a power cycle
+    bool quiet = false;
+};
+
+struct SimStats {
+    uint32_t frames = 0;      // Requests to one of our drives, or broadcasts
+    uint32_t exceptions = 0;
+    uint32_t crcErrors = 0;
+    uint32_t dropped = 0;     // Incomplete frames
+    uint32_t ignored = 0;     // Requests to other slave ids, or while unplugged
+    uint64_t busyUs = 0;      // Request and response time on the wire
+};
+
+static volatile sig_atomic_t unplugToggle = 0;
+static volatile sig_atomic_t powerCycleRequest = 0;
+static volatile sig_atomic_t stopRequest = 0;
+
+static uint64_t monoUs() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static speed_t termiosSpeed(uint32_t baud) {
+    switch (baud) {
+        case 2400: return B2400;
+        case 4800: return B4800;
+        case 9600: return B9600;
+        case 19200: return B19200;
+        case 38400: return B38400;
+        case 57600: return B57600;
+        default: return B115200;
+    }
+}
+
+static bool setRaw(int fd, uint32_t baud) {
+    termios tio;
+    if (tcgetattr(fd, &tio) != 0) return false;
+    cfmakeraw(&tio);
+    cfsetspeed(&tio, termiosSpeed(baud));
+    tio.c_cflag |= CLOCAL | CREAD;
+    return tcsetattr(fd, TCSANOW, &tio) == 0;
+}
+
+// Opens the pty pair. The slave stays open here too, so the master does not
+// see EIO while the client has it closed, and its raw mode persists.
+static int openPty(const SimConfig &cfg, int &slaveFd) {
+    int fd = posix_openpt(O_RDWR | O_NOCTTY);
+    if (fd < 0 || grantpt(fd) != 0 || unlockpt(fd) != 0) return -1;
+    const char *name = ptsname(fd);
+    slaveFd = open(name, O_RDWR | O_NOCTTY);
+    if (slaveFd < 0 || !setRaw(slaveFd, cfg.baud)) return -1;
+    printf("Simulated bus on %s\n", name);
+    if (cfg.link) {
+        unlink(cfg.link);
+        if (symlink(name, cfg.link) != 0) perror("symlink");
+        else printf("Linked as %s\n", cfg.link);
+    }
+    return fd;
+}
+
+// Length of the request at the start of 'buf', 0 if not known yet
+static size_t requestLength(const uint8_t *buf, size_t len) {
+    if (len < 2) return 0;
+    switch (buf[1]) {
+        case MB_FC_READ_HOLDING_REGISTERS:
+        case MB_FC_WRITE_SINGLE_REGISTER:
+            return 8;
+        case MB_FC_WRITE_MULTIPLE_REGISTERS:
+            return len >= 7 ? 9 + buf[6] : 0;
+        case MB_FC_READ_WRITE_MULTIPLE_REGISTERS:
+            return len >= 11 ? 13 + buf[10] : 0;
+    }
+    return 0; // Unknown function, ended by silence
+}
+
+static size_t exceptionResponse(uint8_t *out, uint8_t slaveId, uint8_t function, uint8_t code) {
+    out[0] = slaveId;
+    out[1] = function | 0x80;
+    out[2] = code;
+    return modbusAppendCrc(out, 3);
+}
+
+static size_t readResponse(uint8_t *out, uint8_t slaveId, uint8_t function, const uint16_t *words, uint16_t count) {
+    out[0] = slaveId;
+    out[1] = function;
+    out[2] = count * 2;
+    for (uint16_t i = 0; i < count; i++) {
+        out[3 + 2 * i] = words[i] >> 8;
+        out[4 + 2 * i] = words[i] & 0xFF;
+    }
+    return modbusAppendCrc(out, 3 + count * 2);
+}
+
+// Executes a request on 'drive', returns the response length (0 = no response)
+static size_t execute(A6Drive &drive, const uint8_t *req, size_t len, bool fc17, uint8_t *out) {
+    uint8_t slaveId = req[0];
+    uint8_t function = req[1];
+    uint16_t address = (req[2] << 8) | req[3];
+    uint16_t count = (req[4] << 8) | req[5];
+    uint16_t words[MODBUS_RTU_MAX_FRAME / 2];
+    uint8_t error = 0;
+    switch (function) {
+        case MB_FC_READ_HOLDING_REGISTERS:
+            error = drive.read(address, count, words);
+            if (!error) return readResponse(out, slaveId, function, words, count);
+            break;
+        case MB_FC_WRITE_SINGLE_REGISTER:
+            error = drive.write(address, &count, 1); // 'count' holds the value
+            if (!error) {
+                memcpy(out, req, 6);
+                return modbusAppendCrc(out, 6);
+            }
+            break;
+        case MB_FC_WRITE_MULTIPLE_REGISTERS:
+            if (count == 0 || count > SIM_MAX_WRITE_REGS || req[6] != count * 2) {
+                error = MB_RESULT_ILLEGAL_DATA_VALUE;
+                break;
+            }
+            for (uint16_t i = 0; i < count; i++) words[i] = (req[7 + 2 * i] << 8) | req[8 + 2 * i];
+            error = drive.write(address, words, count);
+            if (!error) {
+                memcpy(out, req, 6);
+                return modbusAppendCrc(out, 6);
+            }
+            break;
+        case MB_FC_READ_WRITE_MULTIPLE_REGISTERS: {
+            if (!fc17) {
+                error = MB_RESULT_ILLEGAL_FUNCTION;
+                break;
+            }
+            uint16_t writeAddress = (req[6] << 8) | req[7];
+            uint16_t writeCount = (req[8] << 8) | req[9];
+            if (writeCount == 0 || req[10] != writeCount * 2) {
+                error = MB_RESULT_ILLEGAL_DATA_VALUE;
+                break;
+            }
+            for (uint16_t i = 0; i < writeCount; i++) words[i] = (req[11 + 2 * i] << 8) | req[12 + 2 * i];
+            error = drive.write(writeAddress, words, writeCount);
+            if (!error) error = drive.read(address, count, words);
+            if (!error) return readResponse(out, slaveId, function, words, count);
+        } break;
+        default:
+            error = MB_RESULT_ILLEGAL_FUNCTION;
+    }
+    if (slaveId == 0) return 0;
+    return exceptionResponse(out, slaveId, function, error);
+}
+
+static uint32_t charUs(uint32_t baud) { return (11UL * 1000000UL + baud - 1) / baud; }
+
+static const char *statusName(A6Status status) {
+    static const char *const names[] = { "NR", "RD", "RUN", "FLT" };
+    return names[status];
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -n N            drives with slave ids 1..N (default 1)\n"
+            "  -l PATH         symlink to the pty, e.g. /tmp/ttyA6\n"
+            "  -d DEVICE       serve a serial port instead of a pty\n"
+            "  -b BAUD         bus timing until a power cycle applies C0A.01 (default 57600)\n"
+            "  -t US           drive turnaround (default 1000)\n"
+            "  -j US           turnaround jitter (default 300)\n"
+            "  --fc17          accept 0x17 read/write\n"
+            "  --refuse A-B    refuse reads of registers A..B with 0x20 (hex, repeatable)\n"
+            "  --pull N[,S]    user pulls the handles with up to N newton, one rep every S seconds\n"
+            "  --end-stop POS  position of the housing end stop (default -2000)\n"
+            "  --volatile      parameter writes are lost on a power cycle\n"
+            "  -q              no status line\n"
+            "SIGUSR1 unplugs / replugs the bus, SIGUSR2 power cycles the drives.\n",
+            argv0);
+}
+
+int main(int argc, char **argv) {
+    SimConfig cfg;
+    A6Mechanics mech;
+    std::vector<std::pair<uint16_t, uint16_t>> refused;
+
+    static const option longOptions[] = {
+        { "fc17", no_argument, nullptr, 'F' },
+        { "refuse", required_argument, nullptr, 'R' },
+        { "pull", required_argument, nullptr, 'P' },
+        { "end-stop", required_argument, nullptr, 'E' },
+        { "volatile", no_argument, nullptr, 'V' },
+        { "help", no_argument, nullptr, 'h' },
+        { nullptr, 0, nullptr, 0 },
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "n:l:d:b:t:j:qh", longOptions, nullptr)) != -1) {
+        switch (opt) {
+            case 'n': cfg.driveCount = atoi(optarg); break;
+            case 'l': cfg.link = optarg; break;
+            case 'd': cfg.device = optarg; break;
+            case 'b': cfg.baud = strtoul(optarg, nullptr, 10); break;
+            case 't': cfg.turnaroundUs = strtoul(optarg, nullptr, 10); break;
+            case 'j': cfg.jitterUs = strtoul(optarg, nullptr, 10); break;
+            case 'q': cfg.quiet = true; break;
+            case 'F': cfg.fc17 = true; break;
+            case 'V': cfg.volatileParams = true; break;
+            case 'E': mech.endStop = atof(optarg); break;
+            case 'P': {
+                mech.pullForceN = atof(optarg);
+                const char *comma = strchr(optarg, ',');
+                if (comma) mech.pullPeriodS = atof(comma + 1);
+            } break;
+            case 'R': {
+                unsigned first, last;
+                if (sscanf(optarg, "%x-%x", &first, &last) != 2) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                refused.push_back({ (uint16_t)first, (uint16_t)last });
+            } break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (cfg.driveCount < 1 || cfg.driveCount > 247 || a6BaudCode(cfg.baud) == 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    std::vector<A6Drive> drives;
+    for (uint8_t i = 0; i < cfg.driveCount; i++) {
+        uint16_t baudCode = a6BaudCode(cfg.baud);
+        drives.emplace_back(i + 1, mech);
+        drives.back().write(REG_MODBUS_BAUD, &baudCode, 1);
+        for (auto &r : refused) drives.back().refuseReads(r.first, r.second);
+    }
+
+    int slaveFd = -1;
+    int fd;
+    if (cfg.device) {
+        fd = open(cfg.device, O_RDWR | O_NOCTTY);
+        if (fd < 0 || !setRaw(fd, cfg.baud)) {
+            perror(cfg.device);
+            return 1;
+        }
+        printf("Simulated drives on %s at %u baud\n", cfg.device, cfg.baud);
+    } else {
+        fd = openPty(cfg, slaveFd);
+        if (fd < 0) {
+            perror("pty");
+            return 1;
+        }
+    }
+    printf("%d drive(s), slave ids 1..%d, turnaround %u +- %u us%s\n", cfg.driveCount, cfg.driveCount,
+           cfg.turnaroundUs, cfg.jitterUs, cfg.fc17 ? ", 0x17 accepted" : "");
+    fflush(stdout);
+
+    signal(SIGUSR1, [](int) { unplugToggle = 1; });
+    signal(SIGUSR2, [](int) { powerCycleRequest = 1; });
+    signal(SIGINT, [](int) { stopRequest = 1; });
+    signal(SIGTERM, [](int) { stopRequest = 1; });
+
+    std::mt19937 rng(1);
+    SimStats stats, window;
+    bool unplugged = false;
+    uint8_t rx[MODBUS_RTU_MAX_FRAME];
+    size_t rxLen = 0;
+    uint8_t tx[MODBUS_RTU_MAX_FRAME];
+    size_t txLen = 0;
+    uint64_t txDueUs = 0;
+    uint64_t start = monoUs();
+    uint64_t simUs = start;
+    uint64_t lastRxUs = start;
+    uint64_t lastStatusUs = start;
+
+    while (!stopRequest) {
+        uint64_t now = monoUs();
+        while (simUs + SIM_STEP_US <= now) {
+            simUs += SIM_STEP_US;
+            for (auto &d : drives) d.step(SIM_STEP_US / 1e6, (simUs - start) / 1e6);
+        }
+
+        if (unplugToggle) {
+            unplugToggle = 0;
+            unplugged = !unplugged;
+            printf("Bus %s\n", unplugged ? "unplugged" : "plugged in");
+        }
+        if (powerCycleRequest) {
+            powerCycleRequest = 0;
+            for (auto &d : drives) {
+                if (cfg.volatileParams) {
+                    uint16_t baudCode = d.param(REG_MODBUS_BAUD);
+                    d.resetParams();
+                    d.write(REG_MODBUS_BAUD, &baudCode, 1); // Kept in EEPROM
+                }
+                d.powerCycle();
+            }
+            static const uint32_t rates[] = { 2400, 4800, 9600, 19200, 38400, 57600, 115200 };
+            uint16_t code = drives[0].param(REG_MODBUS_BAUD);
+            if (code >= 1 && code <= 7) cfg.baud = rates[code - 1];
+            if (cfg.device) setRaw(fd, cfg.baud);
+            printf("Power cycle, bus at %u baud\n", cfg.baud);
+        }
+
+        if (txLen && now >= txDueUs) {
+            if (write(fd, tx, txLen) < 0 && errno != EAGAIN) perror("write");
+            txLen = 0;
+        }
+
+        if (now - lastStatusUs >= SIM_STATUS_INTERVAL_US) {
+            if (!cfg.quiet) {
+                printf("%6.1fs %4u frames/s %3u%% busy, %u exc, %u crc |", (now - start) / 1e6, window.frames,
+                       (unsigned)(window.busyUs * 100 / (now - lastStatusUs)), window.exceptions, window.crcErrors);
+                for (auto &d : drives) {
+                    printf(" %d: %s pos %d spd %d trq %.1f%%", d.slaveId(), statusName(d.status()), d.position(),
+                           d.speedRpm(), d.torquePermille() / 10.0);
+                }
+                printf("%s\n", unplugged ? " (unplugged)" : "");
+                fflush(stdout);
+            }
+            window = SimStats();
+            lastStatusUs = now;
+        }
+
+        pollfd pfd = { fd, POLLIN, 0 };
+        int timeoutMs = 1;
+        if (txLen) timeoutMs = txDueUs > now + 1000 ? 1 : 0;
+        if (poll(&pfd, 1, timeoutMs) > 0 && (pfd.revents & POLLIN)) {
+            ssize_t n = read(fd, rx + rxLen, sizeof(rx) - rxLen);
+            if (n > 0) {
+                rxLen += n;
+                lastRxUs = monoUs();
+            }
+        }
+
+        size_t frameLen = requestLength(rx, rxLen);
+        if (frameLen == 0 || frameLen > sizeof(rx)) {
+            if (rxLen > 0 && (monoUs() - lastRxUs > SIM_GARBAGE_US || rxLen == sizeof(rx))) {
+                stats.dropped++;
+                rxLen = 0;
+            }
+            continue;
+        }
+        if (rxLen < frameLen) continue;
+
+        uint32_t ch = charUs(cfg.baud);
+        uint64_t requestUs = frameLen * ch;
+        if (!modbusCrcValid(rx, frameLen)) {
+            stats.crcErrors++;
+            window.crcErrors++;
+        } else if (unplugged) {
+            stats.ignored++;
+        } else {
+            uint8_t slaveId = rx[0];
+            A6Drive *drive = nullptr;
+            for (auto &d : drives) {
+                if (d.slaveId() == slaveId) drive = &d;
+            }
+            if (slaveId == 0) { // Broadcast: every drive executes it, nobody answers
+                for (auto &d : drives) execute(d, rx, frameLen, cfg.fc17, tx);
+                stats.frames++;
+                window.frames++;
+                window.busyUs += requestUs;
+            } else if (drive) {
+                txLen = execute(*drive, rx, frameLen, cfg.fc17, tx);
+                if (tx[1] & 0x80) {
+                    stats.exceptions++;
+                    window.exceptions++;
+                }
+                uint32_t jitter = cfg.jitterUs ? rng() % (cfg.jitterUs + 1) : 0;
+                txDueUs = lastRxUs + requestUs + cfg.turnaroundUs + jitter + txLen * ch;
+                stats.frames++;
+                window.frames++;
+                window.busyUs += requestUs + txLen * ch;
+                stats.busyUs += requestUs + txLen * ch;
+            } else {
+                stats.ignored++;
+            }
+        }
+        rxLen -= frameLen;
+        memmove(rx, rx + frameLen, rxLen);
+    }
+
+    printf("\n%u frames, %u exceptions, %u CRC errors, %u incomplete, %u ignored, %.1f s on the wire\n", stats.frames,
+           stats.exceptions, stats.crcErrors, stats.dropped, stats.ignored, stats.busyUs / 1e6);
+    if (cfg.link) unlink(cfg.link);
+    if (slaveFd >= 0) close(slaveFd);
+    close(fd);
+    return 0;
+}
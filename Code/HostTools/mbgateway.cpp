@@ -0,0 +1,423 @@
+/*
+ * Modbus TCP Gateway on the Host
+ *
+ * The gateway of the firmware (ModbusGateway / serviceGateway() in the drive
+ * task) on a PC: a Modbus TCP server framed with ModbusTcp.h, forwarding each
+ * request through the firmware's ModbusRtuMaster to a serial port, e.g. the
+ * pty of a6sim. Requests are taken one at a time in arrival order at the
+ * gateway priority, and answered like on the ESP32: drive exceptions passed
+ * through, 0x0A for an unknown unit id, 0x0B when the drive does not answer,
+ * 0x06 when the bus queue is full. Unit id 0 or 255 addresses the first slave.
+ * Lets PC tools (mbpoll, pymodbus) and the gateway be tried without an ESP32.
+ *
+ * There is no control loop on this bus, so the gateway gets all of it. The
+ * master runs on the wall clock instead of the virtual one of mbreplay.
+ *
+ *   make mbgateway a6sim
+ *   ./a6sim -n 2 -l /tmp/ttyA6 -q &
+ *   ./mbgateway -d /tmp/ttyA6 -u 1,2 -v
+ *   mbpoll -m tcp -p 1502 -a 1 -t 4 -r 1544 -c 2 -1 localhost   (C06.07, C06.08)
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <deque>
+#include <vector>
+#include "ModbusRtuMaster.h"
+#include "ModbusTcp.h"
+
+#define GATEWAY_MAX_CLIENTS 4        // Like the firmware
+#define GATEWAY_QUEUE_FRAMES 8       // Depth of gatewayRequests in the firmware, more are dropped
+#define GATEWAY_DEFAULT_PORT 1502    // 502 needs root
+#define MB_EX_SLAVE_DEVICE_BUSY 0x06 // Bus queue full, the tool may retry
+
+struct GatewayConfig {
+    const char *device = nullptr;
+    uint32_t baud = 57600;
+    uint16_t port = GATEWAY_DEFAULT_PORT;
+    std::vector<uint8_t> slaveIds = { 1 };
+    bool verbose = false;
+};
+
+struct Client {
+    int fd = -1;
+    uint8_t connection = 0;
+    uint8_t rx[MODBUS_TCP_MAX_ADU]; // Partial frame
+    uint16_t rxLen = 0;
+    uint32_t requests = 0;
+    uint32_t exceptions = 0;
+    uint32_t dropped = 0;
+};
+
+// A request waiting for the bus, like DriveGatewayFrame
+struct Request {
+    uint8_t client;
+    uint8_t connection;
+    uint16_t length;
+    uint8_t adu[MODBUS_TCP_MAX_ADU];
+};
+
+static volatile sig_atomic_t stopRequest = 0;
+
+static uint64_t monoUs() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static speed_t termiosSpeed(uint32_t baud) {
+    switch (baud) {
+        case 2400: return B2400;
+        case 4800: return B4800;
+        case 9600: return B9600;
+        case 19200: return B19200;
+        case 38400: return B38400;
+        case 57600: return B57600;
+        default: return B115200;
+    }
+}
+
+// --- Serial Side ---
+
+class FdRtuPort : public RtuPort {
+public:
+    bool open(const char *device, uint32_t baud) {
+        _fd = ::open(device, O_RDWR | O_NOCTTY | O_NONBLOCK);
+        if (_fd < 0) return false;
+        setBaud(baud);
+        return true;
+    }
+    int fd() const { return _fd; }
+
+    void setBaud(uint32_t baud) override {
+        termios tio;
+        if (tcgetattr(_fd, &tio) != 0) return;
+        cfmakeraw(&tio);
+        cfsetspeed(&tio, termiosSpeed(baud));
+        tio.c_cflag |= CLOCAL | CREAD;
+        tcsetattr(_fd, TCSANOW, &tio);
+    }
+    int available() override {
+        fill();
+        return _rx.size();
+    }
+    size_t read(uint8_t *buffer, size_t length) override {
+        fill();
+        size_t n = std::min(length, _rx.size());
+        std::copy(_rx.begin(), _rx.begin() + n, buffer);
+        _rx.erase(_rx.begin(), _rx.begin() + n);
+        return n;
+    }
+    void write(const uint8_t *frame, size_t length) override {
+        while (length > 0) {
+            ssize_t n = ::write(_fd, frame, length);
+            if (n < 0 && errno != EAGAIN && errno != EINTR) return;
+            if (n > 0) {
+                frame += n;
+                length -= n;
+            }
+        }
+    }
+    void flushInput() override {
+        fill();
+        _rx.clear();
+    }
+    void waitForData(uint32_t ms) override {
+        pollfd p = { _fd, POLLIN, 0 };
+        poll(&p, 1, ms);
+    }
+    const char *name() const override { return "host serial"; }
+
+private:
+    void fill() {
+        uint8_t buf[256];
+        ssize_t n;
+        while ((n = ::read(_fd, buf, sizeof(buf))) > 0) _rx.insert(_rx.end(), buf, buf + n);
+    }
+
+    int _fd = -1;
+    std::deque<uint8_t> _rx;
+};
+
+static GatewayConfig cfg;
+static FdRtuPort port;
+static ModbusRtuMaster master;
+static uint64_t startUs = 0;
+static Client clients[GATEWAY_MAX_CLIENTS];
+static std::deque<Request> requests;
+
+// The master's micros() / millis() follow the wall clock
+static void syncClock() {
+    hostClockUs() = monoUs() - startUs;
+}
+
+// --- Forwarding, as serviceGateway() ---
+
+static Request gatewayFrame; // Request in flight, the answer is built in its place
+static ModbusTcpHeader gatewayHeader;
+static ModbusPduRequest gatewayRequest;
+static bool gatewayPending = false;
+
+static void gatewayAnswer(size_t pduLen, uint32_t busUs) {
+    gatewayPending = false;
+    Client &c = clients[gatewayFrame.client];
+    if (c.fd < 0 || c.connection != gatewayFrame.connection) return; // Closed meanwhile
+    size_t len = modbusTcpBuildHeader(gatewayFrame.adu, gatewayHeader.transactionId, gatewayHeader.unitId, pduLen)
+               + pduLen;
+    bool exception = gatewayFrame.adu[MODBUS_TCP_MBAP_LENGTH] & 0x80;
+    c.requests++;
+    if (exception) c.exceptions++;
+    if (send(c.fd, gatewayFrame.adu, len, MSG_NOSIGNAL) != (ssize_t)len) perror("send");
+    if (cfg.verbose) {
+        printf("client %d: tid %u unit %u fc %02X %s, bus %u us\n", gatewayFrame.client, gatewayHeader.transactionId,
+               gatewayHeader.unitId, gatewayRequest.function, exception ? "exception" : "ok", busUs);
+    }
+}
+
+static void gatewayException(uint8_t code, uint32_t busUs = 0) {
+    gatewayAnswer(modbusBuildExceptionPdu(gatewayFrame.adu + MODBUS_TCP_MBAP_LENGTH, gatewayRequest.function, code),
+                  busUs);
+}
+
+// The slave id a unit id addresses, 0 if none. 0 and 255 address the first one.
+static uint8_t gatewaySlave(uint8_t unitId) {
+    if (unitId == 0 || unitId == 0xFF) return cfg.slaveIds[0];
+    for (uint8_t id : cfg.slaveIds) {
+        if (id == unitId) return id;
+    }
+    return 0;
+}
+
+static void onGatewayDone(const ModbusTransaction &txn, uint8_t result, const uint16_t *words) {
+    uint32_t busUs = (result == master.ku8MBAborted) ? 0 : master.exchangeUs;
+    if (result == master.ku8MBSuccess) {
+        gatewayAnswer(modbusBuildResponsePdu(gatewayFrame.adu + MODBUS_TCP_MBAP_LENGTH, gatewayRequest, words), busUs);
+    } else if (result <= 0x7F) {
+        gatewayException(result, busUs); // Exception from the drive, passed through
+    } else {
+        gatewayException(result == master.ku8MBAborted ? MB_EX_GATEWAY_PATH_UNAVAILABLE : MB_EX_GATEWAY_TARGET_FAILED,
+                         busUs);
+    }
+}
+
+// Takes the next request once the previous one is answered
+static void serviceGateway() {
+    if (gatewayPending || requests.empty()) return;
+    gatewayFrame = requests.front();
+    requests.pop_front();
+    gatewayPending = true;
+    modbusTcpParseHeader(gatewayFrame.adu, gatewayHeader);
+    ModbusPduRequest &r = gatewayRequest;
+    uint8_t error = modbusParseRequestPdu(gatewayFrame.adu + MODBUS_TCP_MBAP_LENGTH,
+                                          gatewayFrame.length - MODBUS_TCP_MBAP_LENGTH,
+                                          MODBUS_MAX_READ_REGS_PER_FRAME, MODBUS_MAX_WRITE_REGS, r);
+    if (error) {
+        gatewayException(error);
+        return;
+    }
+    uint8_t slaveId = gatewaySlave(gatewayHeader.unitId);
+    if (!slaveId) {
+        gatewayException(MB_EX_GATEWAY_PATH_UNAVAILABLE);
+        return;
+    }
+
+    master.selectSlave(slaveId);
+    bool queued = false;
+    switch (r.function) {
+        case MB_FC_READ_HOLDING_REGISTERS:
+            queued = master.readHoldingRegisters(r.address, r.count, onGatewayDone, nullptr, 0, MB_PRIO_GATEWAY);
+            break;
+        case MB_FC_WRITE_SINGLE_REGISTER:
+            queued = master.writeSingleRegister(r.address, r.values[0], onGatewayDone, nullptr, 0, MB_PRIO_GATEWAY);
+            break;
+        case MB_FC_WRITE_MULTIPLE_REGISTERS:
+            queued = master.writeMultipleRegisters(r.address, r.values, r.count, onGatewayDone, nullptr, 0,
+                                                   MB_PRIO_GATEWAY);
+            break;
+        case MB_FC_READ_WRITE_MULTIPLE_REGISTERS:
+            queued = master.readWriteMultipleRegisters(r.address, r.count, r.writeAddress, r.values, r.writeCount,
+                                                       onGatewayDone, nullptr, 0, MB_PRIO_GATEWAY);
+            break;
+    }
+    if (!queued) gatewayException(MB_EX_SLAVE_DEVICE_BUSY);
+}
+
+// --- TCP Side ---
+
+static int listenOn(uint16_t tcpPort) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(tcpPort);
+    if (bind(fd, (sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, GATEWAY_MAX_CLIENTS) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void acceptClient(int listenFd) {
+    int fd = accept(listenFd, nullptr, nullptr);
+    if (fd < 0) return;
+    for (uint8_t i = 0; i < GATEWAY_MAX_CLIENTS; i++) {
+        Client &c = clients[i];
+        if (c.fd >= 0) continue;
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        c.fd = fd;
+        c.connection++;
+        c.rxLen = 0;
+        c.requests = c.exceptions = c.dropped = 0;
+        printf("client %d connected\n", i);
+        return;
+    }
+    close(fd); // All slots taken
+}
+
+static void closeClient(uint8_t index) {
+    Client &c = clients[index];
+    printf("client %d closed: %u requests, %u exceptions, %u dropped\n", index, c.requests, c.exceptions, c.dropped);
+    close(c.fd);
+    c.fd = -1;
+}
+
+// Splits the TCP stream into Modbus TCP frames, like onGatewayData()
+static void readClient(uint8_t index) {
+    Client &c = clients[index];
+    ssize_t n = recv(c.fd, c.rx + c.rxLen, sizeof(c.rx) - c.rxLen, 0);
+    if (n <= 0) {
+        closeClient(index);
+        return;
+    }
+    c.rxLen += n;
+    for (;;) {
+        int frameLen = modbusTcpFrameLength(c.rx, c.rxLen);
+        if (frameLen < 0) { // Not Modbus TCP
+            closeClient(index);
+            return;
+        }
+        if (frameLen == 0) break;
+        if (requests.size() < GATEWAY_QUEUE_FRAMES) {
+            Request r;
+            r.client = index;
+            r.connection = c.connection;
+            r.length = frameLen;
+            memcpy(r.adu, c.rx, frameLen);
+            requests.push_back(r);
+        } else {
+            c.dropped++; // The tool times out, like on the ESP32
+        }
+        c.rxLen -= frameLen;
+        memmove(c.rx, c.rx + frameLen, c.rxLen);
+    }
+}
+
+static bool parseSlaveIds(const char *text) {
+    cfg.slaveIds.clear();
+    for (const char *p = text; *p; ) {
+        char *end;
+        long id = strtol(p, &end, 10);
+        if (end == p || id < 1 || id > 247) return false;
+        cfg.slaveIds.push_back(id);
+        p = (*end == ',') ? end + 1 : end;
+        if (*end && *end != ',') return false;
+    }
+    return !cfg.slaveIds.empty();
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr,
+            "Usage: %s -d DEVICE [options]\n"
+            "  -d DEVICE   serial port or pty of the drives, e.g. /tmp/ttyA6 of a6sim\n"
+            "  -b BAUD     bus baud rate (default 57600)\n"
+            "  -p PORT     Modbus TCP port (default %d)\n"
+            "  -u IDS      slave ids on the bus, comma separated (default 1)\n"
+            "  -v          one line per request\n",
+            argv0, GATEWAY_DEFAULT_PORT);
+}
+
+int main(int argc, char **argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "d:b:p:u:vh")) != -1) {
+        switch (opt) {
+            case 'd': cfg.device = optarg; break;
+            case 'b': cfg.baud = strtoul(optarg, nullptr, 10); break;
+            case 'p': cfg.port = atoi(optarg); break;
+            case 'u':
+                if (!parseSlaveIds(optarg)) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'v': cfg.verbose = true; break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (!cfg.device) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (!port.open(cfg.device, cfg.baud)) {
+        perror(cfg.device);
+        return 1;
+    }
+    int listenFd = listenOn(cfg.port);
+    if (listenFd < 0) {
+        perror("listen");
+        return 1;
+    }
+    signal(SIGINT, [](int) { stopRequest = 1; });
+    signal(SIGTERM, [](int) { stopRequest = 1; });
+
+    startUs = monoUs();
+    syncClock();
+    master.begin(port, cfg.slaveIds[0], cfg.baud);
+    printf("Modbus TCP on port %u, forwarding to %s at %u baud\n", cfg.port, cfg.device, cfg.baud);
+
+    while (!stopRequest) {
+        pollfd fds[2 + GATEWAY_MAX_CLIENTS];
+        nfds_t n = 0;
+        fds[n++] = { listenFd, POLLIN, 0 };
+        fds[n++] = { port.fd(), POLLIN, 0 };
+        for (uint8_t i = 0; i < GATEWAY_MAX_CLIENTS; i++) {
+            if (clients[i].fd >= 0) fds[n++] = { clients[i].fd, POLLIN, 0 };
+        }
+        // The master times its gaps and timeouts itself, so wake up every ms while it is busy
+        poll(fds, n, master.idle() && requests.empty() ? 100 : 1);
+
+        if (fds[0].revents & POLLIN) acceptClient(listenFd);
+        for (nfds_t k = 2; k < n; k++) {
+            if (!(fds[k].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+            for (uint8_t i = 0; i < GATEWAY_MAX_CLIENTS; i++) {
+                if (clients[i].fd == fds[k].fd) readClient(i);
+            }
+        }
+
+        syncClock();
+        serviceGateway();
+        master.poll();
+    }
+
+    printf("%u transactions, %u failures (%u exceptions, %u timeouts)\n", master.transactions, master.failures,
+           master.exceptions, master.timeouts);
+    return 0;
+}
@@ -0,0 +1,427 @@
+/*
+ * Modbus Capture Replay
+ *
+ * Replays a traffic capture of the firmware (ModbusCapture.h, downloaded from
+ * http://<esp32>/capture) through the firmware's own ModbusRtuMaster, built
+ * for the host against a virtual clock (HostArduino/Arduino.h). Every
+ * recorded request is queued again, and the recorded response bytes show up
+ * at the recorded delay after the request went out. Timeouts, CRC errors,
+ * truncated responses and the adaptive gap are decided by the current
+ * master code, so a change to it can be checked against a capture from the
+ * field: the error cascades it produces, and the exchange times and total
+ * bus time it needs.
+ *
+ * The replay runs as fast as the CPU allows, --speed paces it instead.
+ *
+ *   make && ./mbreplay modbus.cap
+ *   ./mbreplay -v --tick 2000 modbus.cap
+ */
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <deque>
+#include <vector>
+#include "ModbusCapture.h"
+#include "ModbusRtuMaster.h"
+
+#define REPLAY_LINK_DOWN_ERRORS 5 // MAX_MODBUS_ERRORS of the drive task
+
+struct ReplayConfig {
+    bool verbose = false;
+    uint32_t tickUs = 1000;     // Drive task wakeups while no response bytes arrive (one FreeRTOS tick)
+    double speed = 0;           // 0 = as fast as possible
+    uint32_t cascadeMin = 2;    // Shortest run of consecutive failures that is reported
+};
+
+// A record with its time unwrapped to 64 bit
+struct Record {
+    ModbusCaptureRecord rec;
+    uint64_t timeUs;
+};
+
+// Recorded response bytes of the transaction on the bus
+struct PendingRx {
+    uint64_t dueUs;
+    const uint8_t *data;
+    uint8_t length;
+};
+
+class ReplayPort : public RtuPort {
+public:
+    // Called before the transaction of 'tx' is queued, 'end' is the next TX record
+    void expect(const Record *tx, const Record *end) {
+        _tx = tx;
+        _end = end;
+        _written = false;
+    }
+    bool written() const { return _written; }
+    uint64_t writeUs() const { return _writeUs; }
+    uint64_t nextDueUs() const { return _rx.empty() ? UINT64_MAX : _rx.front().dueUs; }
+
+    void setBaud(uint32_t baud) override {}
+    int available() override {
+        int n = 0;
+        for (auto &p : _rx) {
+            if (p.dueUs > hostClockUs()) break;
+            n += p.length;
+        }
+        return n;
+    }
+    size_t read(uint8_t *buffer, size_t length) override {
+        size_t n = 0;
+        while (n < length && !_rx.empty() && _rx.front().dueUs <= hostClockUs()) {
+            PendingRx &p = _rx.front();
+            size_t take = std::min(length - n, (size_t)p.length);
+            memcpy(buffer + n, p.data, take);
+            n += take;
+            p.data += take;
+            p.length -= take;
+            if (p.length == 0) _rx.pop_front();
+        }
+        return n;
+    }
+    // The response bytes of the recorded request are due at their recorded delay after this one
+    void write(const uint8_t *frame, size_t length) override {
+        _written = true;
+        _writeUs = hostClockUs();
+        if (!_tx) return;
+        if (length != _tx->rec.length || memcmp(frame, _tx->rec.data, length) != 0) mismatches++;
+        for (const Record *r = _tx + 1; r != _end; r++) {
+            if (r->rec.type == CAPTURE_RX) _rx.push_back({ _writeUs + (r->timeUs - _tx->timeUs), r->rec.data, r->rec.length });
+            if (r->rec.type == CAPTURE_COLLISION) _collision = true;
+        }
+        _tx = nullptr;
+    }
+    void flushInput() override {
+        while (!_rx.empty() && _rx.front().dueUs <= hostClockUs()) _rx.pop_front();
+    }
+    void waitForData(uint32_t ms) override {}
+    bool takeCollision() override {
+        bool collision = _collision;
+        _collision = false;
+        return collision;
+    }
+    const char *name() const override { return "capture replay"; }
+
+    uint32_t mismatches = 0; // Requests the master built differently from the recorded ones
+
+private:
+    const Record *_tx = nullptr;
+    const Record *_end = nullptr;
+    bool _written = false;
+    uint64_t _writeUs = 0;
+    bool _collision = false;
+    std::deque<PendingRx> _rx;
+};
+
+// --- Results ---
+
+struct Outcome {
+    bool done;
+    uint8_t result;
+};
+
+struct Cascade {
+    uint32_t length = 0;
+    uint64_t startUs = 0;
+    uint32_t timeouts = 0;
+    uint32_t crc = 0;
+    uint32_t exceptions = 0;
+};
+
+struct ReplayStats {
+    uint32_t transactions = 0;
+    uint32_t ok = 0;
+    uint32_t exceptions = 0;
+    uint32_t timeouts = 0;
+    uint32_t crc = 0;
+    uint32_t broadcasts = 0;
+    uint32_t unknownFrames = 0;  // Recorded requests the master can not queue
+    uint32_t orphanRx = 0;       // Bytes before the first request
+    uint32_t cascades = 0;
+    uint32_t linkLosses = 0;     // Cascades long enough to take a link down
+    std::vector<uint32_t> exchangeUs;
+    std::vector<uint32_t> turnaroundUs;
+};
+
+static ModbusRtuMaster master;
+static ReplayPort port;
+static Outcome outcome;
+static ReplayConfig cfg;
+static ReplayStats stats;
+static Cascade cascades[256]; // Per slave id
+static uint64_t virtualStartUs = 0;
+
+static void onReplayDone(const ModbusTransaction &txn, uint8_t result, const uint16_t *words) {
+    outcome.done = true;
+    outcome.result = result;
+}
+
+static const char *resultName(uint8_t result) {
+    static char text[16];
+    switch (result) {
+        case MB_RESULT_SUCCESS: return "ok";
+        case MB_RESULT_TIMEOUT: return "timeout";
+        case MB_RESULT_INVALID_CRC: return "crc";
+        case MB_RESULT_ABORTED: return "aborted";
+    }
+    snprintf(text, sizeof(text), "exc %02X", result);
+    return text;
+}
+
+static double seconds(uint64_t us) { return (us - virtualStartUs) / 1e6; }
+
+static void endCascade(uint8_t slaveId) {
+    Cascade &c = cascades[slaveId];
+    if (c.length >= cfg.cascadeMin) {
+        bool linkDown = c.length >= REPLAY_LINK_DOWN_ERRORS;
+        printf("%12.6f  slave %d: %u consecutive failures over %.1f ms (timeout %u, crc %u, exception %u)%s\n",
+               seconds(c.startUs), slaveId, c.length, (hostClockUs() - c.startUs) / 1e3, c.timeouts, c.crc,
+               c.exceptions, linkDown ? ", link down" : "");
+        stats.cascades++;
+        if (linkDown) stats.linkLosses++;
+    }
+    c = Cascade();
+}
+
+static void countOutcome(uint8_t slaveId, uint8_t result) {
+    Cascade &c = cascades[slaveId];
+    if (result == MB_RESULT_SUCCESS) {
+        endCascade(slaveId);
+        return;
+    }
+    if (c.length == 0) c.startUs = hostClockUs();
+    c.length++;
+    if (result == MB_RESULT_TIMEOUT) c.timeouts++;
+    else if (result == MB_RESULT_INVALID_CRC) c.crc++;
+    else c.exceptions++;
+}
+
+// Queues the recorded request 'frame' on the master, false if it can not be rebuilt
+static bool queueRecorded(const uint8_t *frame, size_t len) {
+    if (len < 8 || !modbusCrcValid(frame, len)) return false;
+    uint16_t address = (frame[2] << 8) | frame[3];
+    uint16_t count = (frame[4] << 8) | frame[5];
+    uint16_t values[MODBUS_MAX_WRITE_REGS];
+    master.selectSlave(frame[0]);
+    switch (frame[1]) {
+        case MB_FC_READ_HOLDING_REGISTERS:
+            return master.readHoldingRegisters(address, count, onReplayDone);
+        case MB_FC_WRITE_SINGLE_REGISTER:
+            return master.writeSingleRegister(address, count, onReplayDone);
+        case MB_FC_WRITE_MULTIPLE_REGISTERS:
+            if (count > MODBUS_MAX_WRITE_REGS || len != 9u + count * 2) return false;
+            for (uint16_t i = 0; i < count; i++) values[i] = (frame[7 + 2 * i] << 8) | frame[8 + 2 * i];
+            return master.writeMultipleRegisters(address, values, count, onReplayDone);
+        case MB_FC_READ_WRITE_MULTIPLE_REGISTERS: {
+            if (len < 13) return false;
+            uint16_t writeAddress = (frame[6] << 8) | frame[7];
+            uint16_t writeCount = (frame[8] << 8) | frame[9];
+            if (writeCount > MODBUS_MAX_WRITE_REGS || len != 13u + writeCount * 2) return false;
+            for (uint16_t i = 0; i < writeCount; i++) values[i] = (frame[11 + 2 * i] << 8) | frame[12 + 2 * i];
+            return master.readWriteMultipleRegisters(address, count, writeAddress, values, writeCount, onReplayDone);
+        }
+    }
+    return false;
+}
+
+static uint64_t wallUs() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// --speed: waits until the wall clock caught up with the virtual one
+static void pace(uint64_t wallStartUs) {
+    if (cfg.speed <= 0) return;
+    uint64_t due = wallStartUs + (uint64_t)((hostClockUs() - virtualStartUs) / cfg.speed);
+    uint64_t now = wallUs();
+    if (due > now) usleep(due - now);
+}
+
+// Runs the master until the queued request completed
+static void runTransaction() {
+    outcome.done = false;
+    master.poll();
+    while (!outcome.done) {
+        uint64_t next = std::min(hostClockUs() + cfg.tickUs, port.nextDueUs());
+        if (next <= hostClockUs()) next = hostClockUs() + 1;
+        hostClockUs() = next;
+        master.poll();
+    }
+}
+
+static uint32_t percentile(std::vector<uint32_t> &v, double p) {
+    if (v.empty()) return 0;
+    size_t i = std::min(v.size() - 1, (size_t)(p * v.size()));
+    std::nth_element(v.begin(), v.begin() + i, v.end());
+    return v[i];
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr,
+            "Usage: %s [options] capture.bin\n"
+            "  -v             print every transaction\n"
+            "  -t, --tick US  drive task wakeup period while waiting for a response (default 1000)\n"
+            "  -s, --speed X  replay at X times real time (default: as fast as possible)\n"
+            "  -c N           report runs of at least N consecutive failures (default 2)\n",
+            argv0);
+}
+
+int main(int argc, char **argv) {
+    static const option longOptions[] = {
+        { "tick", required_argument, nullptr, 't' },
+        { "speed", required_argument, nullptr, 's' },
+        { "help", no_argument, nullptr, 'h' },
+        { nullptr, 0, nullptr, 0 },
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "vt:s:c:h", longOptions, nullptr)) != -1) {
+        switch (opt) {
+            case 'v': cfg.verbose = true; break;
+            case 't': cfg.tickUs = std::max(1L, atol(optarg)); break;
+            case 's': cfg.speed = atof(optarg); break;
+            case 'c': cfg.cascadeMin = std::max(1, atoi(optarg)); break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (optind != argc - 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    FILE *f = fopen(argv[optind], "rb");
+    if (!f) {
+        perror(argv[optind]);
+        return 1;
+    }
+    std::vector<uint8_t> log;
+    uint8_t chunk[4096];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0) log.insert(log.end(), chunk, chunk + n);
+    fclose(f);
+
+    uint32_t baud, dropped;
+    if (!modbusCaptureParseHeader(log.data(), log.size(), baud, dropped)) {
+        fprintf(stderr, "%s: not a Modbus capture\n", argv[optind]);
+        return 1;
+    }
+    std::vector<Record> records;
+    uint64_t base = 0;
+    uint32_t last = 0;
+    for (size_t offset = MODBUS_CAPTURE_HEADER_LENGTH;;) {
+        Record r;
+        size_t size = modbusCaptureParseRecord(log.data(), log.size(), offset, r.rec);
+        if (size == 0) break;
+        if (!records.empty() && r.rec.timeUs < last && last - r.rec.timeUs > 0x80000000UL) base += 0x100000000ULL;
+        last = r.rec.timeUs;
+        r.timeUs = base + r.rec.timeUs;
+        records.push_back(r);
+        offset += size;
+    }
+    if (records.empty()) {
+        fprintf(stderr, "%s: no records\n", argv[optind]);
+        return 1;
+    }
+    printf("%zu records, %.3f s at %u baud%s\n", records.size(), (records.back().timeUs - records.front().timeUs) / 1e6,
+           baud, dropped ? " (older records were dropped from the ring)" : "");
+
+    hostClockUs() = 1000000;
+    virtualStartUs = hostClockUs();
+    master.begin(port, 1, baud ? baud : 57600);
+    int64_t shift = (int64_t)hostClockUs() - (int64_t)records.front().timeUs; // Recorded -> virtual time
+    uint64_t wallStart = wallUs();
+    bool seenTx = false;
+
+    for (size_t i = 0; i < records.size(); i++) {
+        const Record &r = records[i];
+        uint64_t due = r.timeUs + shift;
+        switch (r.rec.type) {
+            case CAPTURE_BAUD: {
+                uint32_t rate = r.rec.data[0] | (r.rec.data[1] << 8) | (r.rec.data[2] << 16) | ((uint32_t)r.rec.data[3] << 24);
+                hostClockUs() = std::max(hostClockUs(), due);
+                master.setBaud(rate);
+                printf("%12.6f  baud rate %u\n", seconds(hostClockUs()), rate);
+            } break;
+            case CAPTURE_MARK:
+                printf("%12.6f  # %.*s\n", seconds(std::max(hostClockUs(), due)), r.rec.length, (const char *)r.rec.data);
+                break;
+            case CAPTURE_RX:
+                if (!seenTx) stats.orphanRx += r.rec.length;
+                break; // Replayed with its request
+            case CAPTURE_TX: {
+                seenTx = true;
+                size_t end = i + 1;
+                while (end < records.size() && records[end].rec.type != CAPTURE_TX) end++;
+                hostClockUs() = std::max(hostClockUs(), due);
+                master.poll();
+                port.expect(&records[i], records.data() + end);
+                const uint8_t *frame = r.rec.data;
+                if (!queueRecorded(frame, r.rec.length)) {
+                    stats.unknownFrames++;
+                    break;
+                }
+                runTransaction();
+                if (port.written()) shift = (int64_t)port.writeUs() - (int64_t)r.timeUs;
+                pace(wallStart);
+
+                if (frame[0] == MODBUS_BROADCAST_ID) {
+                    stats.broadcasts++;
+                    if (cfg.verbose) printf("%12.6f  broadcast %02X %04X\n", seconds(port.writeUs()), frame[1], (frame[2] << 8) | frame[3]);
+                    break;
+                }
+                stats.transactions++;
+                if (outcome.result == MB_RESULT_SUCCESS) {
+                    stats.ok++;
+                    stats.exchangeUs.push_back(master.exchangeUs);
+                    stats.turnaroundUs.push_back(master.turnaroundUs);
+                } else if (outcome.result == MB_RESULT_TIMEOUT) {
+                    stats.timeouts++;
+                } else if (outcome.result == MB_RESULT_INVALID_CRC) {
+                    stats.crc++;
+                } else {
+                    stats.exceptions++;
+                }
+                if (cfg.verbose) {
+                    printf("%12.6f  slave %d  %02X %04X%c%-5d %-8s exchange %5u us  turnaround %5u us  gap %u us\n",
+                           seconds(port.writeUs()), frame[0], frame[1], (frame[2] << 8) | frame[3],
+                           frame[1] == MB_FC_WRITE_SINGLE_REGISTER ? '=' : '+', (frame[4] << 8) | frame[5],
+                           resultName(outcome.result), master.exchangeUs, master.turnaroundUs, master.gapUs());
+                }
+                countOutcome(frame[0], outcome.result);
+            } break;
+        }
+    }
+    for (int id = 0; id < 256; id++) endCascade(id);
+
+    uint64_t wall = wallUs() - wallStart;
+    uint64_t replayed = hostClockUs() - virtualStartUs;
+    uint64_t recorded = records.back().timeUs - records.front().timeUs;
+    printf("\n%u transactions: %u ok, %u exceptions, %u timeouts, %u CRC errors (%u truncated), %u broadcasts\n",
+           stats.transactions, stats.ok, stats.exceptions, stats.timeouts, stats.crc, master.truncated, stats.broadcasts);
+    printf("%u failure cascades, %u long enough to take the link down\n", stats.cascades, stats.linkLosses);
+    if (!stats.exchangeUs.empty()) {
+        uint64_t sum = 0;
+        for (uint32_t v : stats.exchangeUs) sum += v;
+        printf("Exchange us: avg %llu, p50 %u, p90 %u, p99 %u, max %u\n", (unsigned long long)(sum / stats.exchangeUs.size()),
+               percentile(stats.exchangeUs, 0.5), percentile(stats.exchangeUs, 0.9), percentile(stats.exchangeUs, 0.99),
+               percentile(stats.exchangeUs, 1.0));
+        printf("Turnaround us: p50 %u, p99 %u, max %u\n", percentile(stats.turnaroundUs, 0.5),
+               percentile(stats.turnaroundUs, 0.99), percentile(stats.turnaroundUs, 1.0));
+    }
+    if (port.mismatches || stats.unknownFrames || stats.orphanRx) {
+        printf("%u requests rebuilt differently, %u requests not replayable, %u bytes before the first request\n",
+               port.mismatches, stats.unknownFrames, stats.orphanRx);
+    }
+    printf("Recorded %.3f s, replayed %.3f s (%+.3f s) in %.3f s wall time, %.0fx real time\n", recorded / 1e6,
+           replayed / 1e6, ((double)replayed - (double)recorded) / 1e6, wall / 1e6,
+           wall ? (double)replayed / wall : 0.0);
+    return 0;
+}
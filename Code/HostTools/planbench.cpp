@@ -0,0 +1,307 @@
+/*
+ * Read Planner Checks and Benchmark
+ *
+ * Runs planReads() (ServoRegisterMap.h) on the host. The checks cover the
+ * constraints of a plan: registers the drive refuses to read, the gap and
+ * frame limits, isolated fields and 32-bit fields, on small made-up tables
+ * and on the real telemetry table. The benchmark replays the poll periods of
+ * each profile on the telemetry tick of the drive task and reports the spans
+ * per cycle and the transactions per second, with block reads and with the
+ * separate transactions a drive without them gets, and the time planReads()
+ * takes per cycle.
+ *
+ *   make planbench && ./planbench
+ *   ./planbench -n 1000000    (planReads() calls timed)
+ *
+ * Exits with 1 if a check fails.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "ServoRegisterMap.h"
+
+#define BENCH_TICK_MS 10      // POLL_TICK_MS of the drive task
+#define BENCH_WINDOW_MS 1000  // Simulated time per profile
+
+static int failures = 0;
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+static ReadPlannerConfig blockConfig(const RegRange *forbidden = nullptr, uint8_t forbiddenCount = 0,
+                                     uint32_t isolatedMask = 0) {
+    ReadPlannerConfig cfg;
+    cfg.maxRegsPerFrame = MODBUS_MAX_READ_REGS;
+    cfg.maxGapRegs = READ_PLANNER_DEFAULT_GAP_REGS;
+    cfg.forbidden = forbidden;
+    cfg.forbiddenCount = forbiddenCount;
+    cfg.isolatedMask = isolatedMask;
+    return cfg;
+}
+
+// What the drive task uses without block reads (MODBUS_BLOCK_READ 0)
+static ReadPlannerConfig separateConfig() {
+    ReadPlannerConfig cfg = blockConfig();
+    cfg.maxRegsPerFrame = 2;
+    cfg.maxGapRegs = 0;
+    cfg.isolatedMask = 0xFFFFFFFFUL;
+    return cfg;
+}
+
+static RegField field(uint16_t address, uint8_t words) {
+    return { "f", address, words, false, 1.0f, POLL_FAST, { 10, 10, 10 } };
+}
+
+// Span of the plan that reads field 'id', -1 if none does
+static int spanOf(const ReadPlan &plan, uint8_t id) {
+    for (uint8_t s = 0; s < plan.spanCount; s++) {
+        if (plan.spans[s].fieldMask & FIELD_BIT(id)) return s;
+    }
+    return -1;
+}
+
+// Invariants of every plan: each readable wanted field in exactly one span that
+// covers all its words, no span over the frame limit or a refused register,
+// totalRegs the sum of the spans
+static void checkPlan(const RegField *fields, uint8_t count, uint32_t wanted, const ReadPlannerConfig &cfg,
+                      const ReadPlan &plan) {
+    uint32_t seen = 0;
+    uint16_t total = 0;
+    for (uint8_t s = 0; s < plan.spanCount; s++) {
+        const ReadSpan &span = plan.spans[s];
+        uint16_t last = span.start + span.count - 1;
+        CHECK(span.count >= 1 && span.count <= cfg.maxRegsPerFrame);
+        CHECK(!regRangeIsForbidden(cfg, span.start, last));
+        CHECK((seen & span.fieldMask) == 0);
+        CHECK((span.fieldMask & ~wanted) == 0);
+        seen |= span.fieldMask;
+        total += span.count;
+        for (uint8_t i = 0; i < count; i++) {
+            if (!(span.fieldMask & FIELD_BIT(i))) continue;
+            CHECK(fields[i].address >= span.start && fields[i].address + fields[i].words - 1 <= last);
+            if (cfg.isolatedMask & FIELD_BIT(i)) CHECK(span.fieldMask == FIELD_BIT(i));
+        }
+    }
+    CHECK(total == plan.totalRegs);
+    for (uint8_t i = 0; i < count; i++) {
+        if (!(wanted & FIELD_BIT(i))) continue;
+        bool readable = fields[i].words <= cfg.maxRegsPerFrame
+            && !regRangeIsForbidden(cfg, fields[i].address, fields[i].address + fields[i].words - 1);
+        CHECK(((seen & FIELD_BIT(i)) != 0) == readable);
+    }
+}
+
+static bool plan(const RegField *fields, uint8_t count, uint32_t wanted, const ReadPlannerConfig &cfg, ReadPlan &p) {
+    bool ok = planReads(fields, count, wanted, cfg, p);
+    checkPlan(fields, count, wanted, cfg, p);
+    return ok;
+}
+
+static void checkGapLimit() {
+    ReadPlannerConfig cfg = blockConfig();
+    ReadPlan p;
+    RegField merged[] = { field(0x100, 1), field(0x101 + READ_PLANNER_DEFAULT_GAP_REGS, 1) };
+    CHECK(plan(merged, 2, 3, cfg, p) && p.spanCount == 1 && p.totalRegs == READ_PLANNER_DEFAULT_GAP_REGS + 2);
+    RegField split[] = { field(0x100, 1), field(0x102 + READ_PLANNER_DEFAULT_GAP_REGS, 1) };
+    CHECK(plan(split, 2, 3, cfg, p) && p.spanCount == 2 && p.totalRegs == 2);
+    cfg.maxGapRegs = 0; // Adjacent fields still share a span
+    RegField adjacent[] = { field(0x100, 1), field(0x101, 2), field(0x104, 1) };
+    CHECK(plan(adjacent, 3, 7, cfg, p) && p.spanCount == 2 && spanOf(p, 0) == spanOf(p, 1));
+}
+
+static void checkFrameLimit() {
+    ReadPlannerConfig cfg = blockConfig();
+    cfg.maxGapRegs = 0xFFFF;
+    ReadPlan p;
+    RegField fits[] = { field(0x100, 1), field(0x100 + MODBUS_MAX_READ_REGS - 1, 1) };
+    CHECK(plan(fits, 2, 3, cfg, p) && p.spanCount == 1 && p.spans[0].count == MODBUS_MAX_READ_REGS);
+    RegField over[] = { field(0x100, 1), field(0x100 + MODBUS_MAX_READ_REGS, 1) };
+    CHECK(plan(over, 2, 3, cfg, p) && p.spanCount == 2);
+    // The high word of a 32-bit field would be the 65th register
+    RegField wide[] = { field(0x100, 1), field(0x100 + MODBUS_MAX_READ_REGS - 1, 2) };
+    CHECK(plan(wide, 2, 3, cfg, p) && p.spanCount == 2 && p.spans[1].count == 2);
+    // Many fields in a row, 191 registers: the fewest spans of at most 64 registers
+    RegField row[20];
+    for (uint8_t i = 0; i < 20; i++) row[i] = field(0x100 + i * 10, 1);
+    CHECK(plan(row, 20, (1UL << 20) - 1, cfg, p) && p.spanCount == 3);
+}
+
+static void checkForbidden() {
+    ReadPlan p;
+    // Refused registers in the gap split the span even though the gap is small
+    static const RegRange hole[] = { { 0x4008, 0x400B } };
+    ReadPlannerConfig cfg = blockConfig(hole, 1);
+    uint32_t all = (1UL << FIELD_COUNT) - 1;
+    CHECK(plan(regFields, FIELD_COUNT, all, cfg, p));
+    CHECK(spanOf(p, FIELD_LOAD_RATIO) != spanOf(p, FIELD_RMS_CURRENT));
+    CHECK(spanOf(p, FIELD_SPEED) == spanOf(p, FIELD_LOAD_RATIO));
+    // A refused field is left out and reported, the others are still planned
+    static const RegRange speed[] = { { 0x4001, 0x4001 } };
+    cfg = blockConfig(speed, 1);
+    CHECK(!plan(regFields, FIELD_COUNT, all, cfg, p));
+    CHECK(spanOf(p, FIELD_SPEED) < 0 && spanOf(p, FIELD_TORQUE) >= 0);
+    // Only the high word of a 32-bit field refused
+    static const RegRange high[] = { { 0x4017, 0x4017 } };
+    cfg = blockConfig(high, 1);
+    CHECK(!plan(regFields, FIELD_COUNT, all, cfg, p) && spanOf(p, FIELD_POSITION) < 0);
+    // Several ranges, unsorted
+    static const RegRange two[] = { { 0x4030, 0x40FF }, { 0x4002, 0x4002 } };
+    cfg = blockConfig(two, 2);
+    CHECK(!plan(regFields, FIELD_COUNT, all, cfg, p));
+    CHECK(spanOf(p, FIELD_TEMP_IGBT) < 0 && spanOf(p, FIELD_SPEED) != spanOf(p, FIELD_TORQUE));
+}
+
+static void checkIsolated() {
+    ReadPlan p;
+    uint32_t all = (1UL << FIELD_COUNT) - 1;
+    ReadPlannerConfig cfg = blockConfig(nullptr, 0, FIELD_BIT(FIELD_TORQUE));
+    CHECK(plan(regFields, FIELD_COUNT, all, cfg, p));
+    int trq = spanOf(p, FIELD_TORQUE);
+    CHECK(trq >= 0 && p.spans[trq].fieldMask == FIELD_BIT(FIELD_TORQUE) && p.spans[trq].count == 1);
+    // The fields on both sides do not join it, but still join each other behind it
+    CHECK(spanOf(p, FIELD_SPEED) != spanOf(p, FIELD_BUS_VOLTAGE));
+    CHECK(spanOf(p, FIELD_BUS_VOLTAGE) == spanOf(p, FIELD_POSITION));
+    // Separate transactions: one span per field
+    cfg = separateConfig();
+    CHECK(plan(regFields, FIELD_COUNT, all, cfg, p) && p.spanCount == FIELD_COUNT);
+}
+
+static void checkWords32() {
+    ReadPlan p;
+    ReadPlannerConfig cfg = blockConfig();
+    // Low word first, the span covers both words even if the next field starts inside it
+    RegField overlap[] = { field(0x200, 2), field(0x201, 1) };
+    CHECK(plan(overlap, 2, 3, cfg, p) && p.spanCount == 1 && p.spans[0].count == 2);
+    // The gap counts from the high word
+    RegField gap[] = { field(0x200, 2), field(0x202 + READ_PLANNER_DEFAULT_GAP_REGS, 1) };
+    CHECK(plan(gap, 2, 3, cfg, p) && p.spanCount == 1);
+    // A frame too small for a 32-bit field
+    cfg.maxRegsPerFrame = 1;
+    CHECK(!plan(overlap, 2, 1, cfg, p) && p.spanCount == 0);
+    // Unsorted table, out of order addresses
+    RegField unsorted[] = { field(0x210, 2), field(0x200, 2), field(0x205, 1) };
+    cfg = blockConfig();
+    CHECK(plan(unsorted, 3, 7, cfg, p) && p.spanCount == 1 && p.spans[0].start == 0x200 && p.spans[0].count == 18);
+}
+
+static void checkTelemetryTable() {
+    ReadPlan p;
+    uint32_t all = (1UL << FIELD_COUNT) - 1;
+    ReadPlannerConfig cfg = blockConfig();
+    // C04.04 | U40.01..U40.17 | U40.30..31 | U41.0A
+    CHECK(plan(regFields, FIELD_COUNT, all, cfg, p) && p.spanCount == 4 && p.totalRegs == 27);
+    CHECK(plan(regFields, FIELD_COUNT, 0, cfg, p) && p.spanCount == 0 && p.totalRegs == 0);
+    // The combined setpoint transaction needs the motion feedback in one span
+    uint32_t feedback = FIELD_BIT(FIELD_SPEED) | FIELD_BIT(FIELD_TORQUE) | FIELD_BIT(FIELD_FOLLOWING_ERROR)
+                      | FIELD_BIT(FIELD_POSITION);
+    CHECK(plan(regFields, FIELD_COUNT, feedback, cfg, p) && p.spanCount == 1);
+}
+
+struct ProfileStats {
+    unsigned cycles;
+    unsigned spans;
+    unsigned maxSpans;
+    unsigned regs;
+};
+
+// Replays BENCH_WINDOW_MS of telemetry ticks: the fields whose period elapsed
+// (with the half tick of slack of dueFields()) are planned together
+static ProfileStats runProfile(PollProfile profile, const ReadPlannerConfig &cfg) {
+    ProfileStats stats = {};
+    uint32_t lastPoll[FIELD_COUNT] = {};
+    for (uint32_t now = BENCH_TICK_MS; now <= BENCH_WINDOW_MS; now += BENCH_TICK_MS) {
+        uint32_t due = 0;
+        for (uint8_t id = 0; id < FIELD_COUNT; id++) {
+            uint32_t period = regFields[id].periodMs[profile] < BENCH_TICK_MS ? BENCH_TICK_MS : regFields[id].periodMs[profile];
+            if (now - lastPoll[id] + BENCH_TICK_MS / 2 >= period) {
+                due |= FIELD_BIT(id);
+                lastPoll[id] = now;
+            }
+        }
+        if (!due) continue;
+        ReadPlan p;
+        CHECK(plan(regFields, FIELD_COUNT, due, cfg, p));
+        stats.cycles++;
+        stats.spans += p.spanCount;
+        stats.regs += p.totalRegs;
+        if (p.spanCount > stats.maxSpans) stats.maxSpans = p.spanCount;
+    }
+    return stats;
+}
+
+static void benchProfiles() {
+    static const char *const names[POLL_PROFILE_COUNT] = { "idle", "running", "homing" };
+    printf("\n%-8s %-9s %7s %10s %9s %9s %8s\n", "profile", "reads", "cycles", "spans/cyc", "max/cyc", "frames/s",
+           "regs/s");
+    for (uint8_t profile = 0; profile < POLL_PROFILE_COUNT; profile++) {
+        for (uint8_t mode = 0; mode < 2; mode++) {
+            ProfileStats s = runProfile((PollProfile)profile, mode == 0 ? blockConfig() : separateConfig());
+            printf("%-8s %-9s %7u %10.2f %9u %9u %8u\n", names[profile], mode == 0 ? "block" : "separate", s.cycles,
+                   s.cycles ? (double)s.spans / s.cycles : 0.0, s.maxSpans, s.spans * 1000 / BENCH_WINDOW_MS,
+                   s.regs * 1000 / BENCH_WINDOW_MS);
+        }
+    }
+}
+
+static double nowSeconds() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void benchPlanner(long iterations) {
+    static const RegRange refused[] = { { 0x4008, 0x400B }, { 0x4020, 0x402F } };
+    ReadPlannerConfig cfg = blockConfig(refused, 2);
+    ReadPlan p;
+    volatile unsigned sink = 0;
+    double start = nowSeconds();
+    for (long i = 0; i < iterations; i++) {
+        uint32_t due = (uint32_t)(i * 2654435761UL) & ((1UL << FIELD_COUNT) - 1); // Varying due sets
+        planReads(regFields, FIELD_COUNT, due, cfg, p);
+        sink = sink + p.spanCount;
+    }
+    double elapsed = nowSeconds() - start;
+    printf("\nplanReads(): %ld calls, %.1f ns per call (host)\n", iterations, elapsed * 1e9 / iterations);
+}
+
+static void usage(const char *argv0) {
+    printf("Usage: %s [-n calls]\n"
+           "Checks planReads() and reports its frames per poll profile and its run time.\n"
+           "  -n calls  planReads() calls timed (default 200000)\n", argv0);
+}
+
+int main(int argc, char **argv) {
+    long iterations = 200000;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:h")) != -1) {
+        switch (opt) {
+            case 'n': iterations = atol(optarg) > 0 ? atol(optarg) : 1; break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    checkGapLimit();
+    checkFrameLimit();
+    checkForbidden();
+    checkIsolated();
+    checkWords32();
+    checkTelemetryTable();
+    benchProfiles();
+    benchPlanner(iterations);
+
+    if (failures) {
+        printf("\n%d checks failed\n", failures);
+        return 1;
+    }
+    printf("\nAll checks passed\n");
+    return 0;
+}
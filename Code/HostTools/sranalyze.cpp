@@ -0,0 +1,688 @@
+/*
+ * Sigrok Capture Analyzer for the Modbus Link
+ *
+ * Reads a sigrok session file (.sr, as saved by PulseView), decodes the UART
+ * bytes on the RX and TX lines into Modbus RTU frames and reports the bus
+ * timing: drive turnaround, exchange times, inter-frame gaps, utilisation,
+ * and the busy and dead time of every poll cycle. Logic and analog captures
+ * are supported, analog channels are cut at a threshold halfway between
+ * their low and high level.
+ *
+ *   make && ./sranalyze ../../Debug/Sigrok/1.sr
+ *   ./sranalyze -v --csv transactions.csv capture.sr
+ *   ./sranalyze old.sr new.sr           (adds a table to compare firmware versions)
+ *
+ * A cycle is a burst of transactions, it ends at an idle gap longer than
+ * --cycle-gap. Its dead time is the part of the cycle period the bus is idle.
+ */
+
+#include <getopt.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+#include "ModbusRtu.h"
+
+// --- Session File ---
+
+// Entries of a zip archive, inflated
+static bool readZip(const char *path, std::map<std::string, std::vector<uint8_t>> &files) {
+    FILE *f = fopen(path, "rb");
+    if (!f) return false;
+    std::vector<uint8_t> zip;
+    uint8_t chunk[65536];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0) zip.insert(zip.end(), chunk, chunk + n);
+    fclose(f);
+
+    auto u16 = [&](size_t o) { return (uint32_t)zip[o] | (zip[o + 1] << 8); };
+    auto u32 = [&](size_t o) { return u16(o) | (u16(o + 2) << 16); };
+
+    // End of central directory, followed by a comment of up to 64 KB
+    if (zip.size() < 22) return false;
+    size_t eocd = zip.size() - 22;
+    while (eocd > 0 && u32(eocd) != 0x06054b50) eocd--;
+    if (u32(eocd) != 0x06054b50) return false;
+    uint32_t entries = u16(eocd + 10);
+    size_t dir = u32(eocd + 16);
+
+    for (uint32_t i = 0; i < entries; i++) {
+        if (dir + 46 > zip.size() || u32(dir) != 0x02014b50) return false;
+        uint16_t method = u16(dir + 10);
+        uint32_t packedSize = u32(dir + 20);
+        uint32_t size = u32(dir + 24);
+        uint16_t nameLen = u16(dir + 28);
+        size_t local = u32(dir + 42);
+        std::string name((const char *)&zip[dir + 46], nameLen);
+        dir += 46 + nameLen + u16(dir + 30) + u16(dir + 32);
+
+        if (local + 30 > zip.size() || u32(local) != 0x04034b50) return false;
+        size_t data = local + 30 + u16(local + 26) + u16(local + 28);
+        if (data + packedSize > zip.size()) return false;
+        std::vector<uint8_t> &out = files[name];
+        out.resize(size);
+        if (method == 0) {
+            memcpy(out.data(), &zip[data], size);
+        } else if (method == 8) {
+            z_stream zs = {};
+            if (inflateInit2(&zs, -MAX_WBITS) != Z_OK) return false;
+            zs.next_in = &zip[data];
+            zs.avail_in = packedSize;
+            zs.next_out = out.data();
+            zs.avail_out = size;
+            int rc = inflate(&zs, Z_FINISH);
+            inflateEnd(&zs);
+            if (rc != Z_STREAM_END) return false;
+        } else {
+            fprintf(stderr, "%s: unsupported zip method %u\n", name.c_str(), method);
+            return false;
+        }
+    }
+    return true;
+}
+
+// "8 MHz" -> 8000000
+static double parseRate(const std::string &text) {
+    char unit[8] = "";
+    double value = 0;
+    if (sscanf(text.c_str(), "%lf %7s", &value, unit) < 1) return 0;
+    if (unit[0] == 'k') value *= 1e3;
+    else if (unit[0] == 'M') value *= 1e6;
+    else if (unit[0] == 'G') value *= 1e9;
+    return value;
+}
+
+// Chunk files of a channel ("analog-1-2-" or "logic-1-") in order
+static std::vector<const std::vector<uint8_t> *> chunks(const std::map<std::string, std::vector<uint8_t>> &files,
+                                                        const std::string &prefix) {
+    std::map<int, const std::vector<uint8_t> *> ordered;
+    for (auto &f : files) {
+        if (f.first.compare(0, prefix.size(), prefix) == 0) ordered[atoi(f.first.c_str() + prefix.size())] = &f.second;
+    }
+    std::vector<const std::vector<uint8_t> *> list;
+    for (auto &c : ordered) list.push_back(c.second);
+    return list;
+}
+
+// --- Digital Signal ---
+
+// A line as the sample numbers where it changes level
+struct Signal {
+    bool initial = true;
+    std::vector<uint64_t> edges;
+    uint64_t samples = 0;
+
+    bool levelAt(uint64_t sample) const {
+        size_t changes = std::upper_bound(edges.begin(), edges.end(), sample) - edges.begin();
+        return initial ^ (changes & 1);
+    }
+    // First falling edge at or after 'sample', UINT64_MAX if none
+    uint64_t nextFall(uint64_t sample) const {
+        size_t i = std::lower_bound(edges.begin(), edges.end(), sample) - edges.begin();
+        for (; i < edges.size(); i++) {
+            if (!(initial ^ ((i + 1) & 1))) return edges[i];
+        }
+        return UINT64_MAX;
+    }
+};
+
+static Signal digitizeAnalog(const std::vector<const std::vector<uint8_t> *> &parts, double threshold) {
+    std::vector<float> v;
+    for (auto *p : parts) {
+        size_t n = p->size() / 4;
+        size_t at = v.size();
+        v.resize(at + n);
+        memcpy(&v[at], p->data(), n * 4);
+    }
+    Signal s;
+    s.samples = v.size();
+    if (v.empty()) return s;
+
+    float lo = 0, hi = 0;
+    if (std::isnan(threshold)) {
+        std::vector<float> sub;
+        for (size_t i = 0; i < v.size(); i += 97) sub.push_back(v[i]);
+        std::sort(sub.begin(), sub.end());
+        lo = sub[sub.size() / 100];
+        hi = sub[sub.size() - 1 - sub.size() / 100];
+        threshold = (lo + hi) / 2;
+    }
+    float hyst = std::max(0.05 * fabs(hi - lo), 1e-6); // Noise must not toggle the line
+    bool level = v[0] > threshold;
+    s.initial = level;
+    for (size_t i = 1; i < v.size(); i++) {
+        if (level && v[i] < threshold - hyst) {
+            level = false;
+            s.edges.push_back(i);
+        } else if (!level && v[i] > threshold + hyst) {
+            level = true;
+            s.edges.push_back(i);
+        }
+    }
+    return s;
+}
+
+static Signal digitizeLogic(const std::vector<const std::vector<uint8_t> *> &parts, int unitSize, int bit) {
+    Signal s;
+    bool level = true;
+    uint64_t sample = 0;
+    for (auto *p : parts) {
+        for (size_t o = (bit / 8); o < p->size(); o += unitSize, sample++) {
+            bool b = ((*p)[o] >> (bit % 8)) & 1;
+            if (sample == 0) s.initial = level = b;
+            else if (b != level) {
+                level = b;
+                s.edges.push_back(sample);
+            }
+        }
+    }
+    s.samples = sample;
+    return s;
+}
+
+// --- UART ---
+
+struct UartFormat {
+    double bitSamples;
+    int dataBits = 8;
+    char parity = 'N';
+    int bits() const { return 1 + dataBits + (parity == 'N' ? 0 : 1) + 1; } // Start, data, parity, stop
+};
+
+struct UartByte {
+    uint64_t start;
+    uint64_t end; // End of the stop bit
+    uint8_t value;
+    bool error;   // Framing or parity
+};
+
+// Slowest baud rate whose bit length fits the pulse widths. Faster rates fit
+// as well when they divide the bit, so a rate only wins by fitting clearly better.
+static double detectBaud(const Signal &a, const Signal &b, double sampleRate) {
+    static const double rates[] = { 2400, 4800, 9600, 19200, 38400, 57600, 115200, 230400 };
+    double best = 0, bestErr = 1e30;
+    for (double rate : rates) {
+        double bit = sampleRate / rate;
+        double err = 0;
+        int used = 0;
+        for (const Signal *s : { &a, &b }) {
+            for (size_t i = 1; i < s->edges.size() && used < 20000; i++) {
+                double bits = (s->edges[i] - s->edges[i - 1]) / bit;
+                if (bits > 10.5) continue;
+                if (bits < 0.5) {
+                    err += 1; // Shorter than a bit: wrong rate
+                } else {
+                    err += fabs(bits - round(bits));
+                }
+                used++;
+            }
+        }
+        if (used == 0) continue;
+        err /= used;
+        if (err < bestErr - 0.05) {
+            bestErr = err;
+            best = rate;
+        }
+    }
+    return best;
+}
+
+static std::vector<UartByte> decodeUart(const Signal &s, const UartFormat &fmt) {
+    std::vector<UartByte> bytes;
+    uint64_t pos = 0;
+    for (;;) {
+        uint64_t start = s.nextFall(pos);
+        if (start == UINT64_MAX || start + fmt.bits() * fmt.bitSamples > s.samples) break;
+        auto bitAt = [&](int i) { return s.levelAt(start + (uint64_t)((i + 0.5) * fmt.bitSamples)); };
+        UartByte b = { start, start + (uint64_t)(fmt.bits() * fmt.bitSamples), 0, false };
+        if (bitAt(0)) { // Glitch, not a start bit
+            pos = start + 1;
+            continue;
+        }
+        int ones = 0;
+        for (int i = 0; i < fmt.dataBits; i++) {
+            if (bitAt(1 + i)) {
+                b.value |= 1 << i;
+                ones++;
+            }
+        }
+        int next = 1 + fmt.dataBits;
+        if (fmt.parity != 'N') {
+            bool parity = bitAt(next++);
+            if (((ones + parity) & 1) != (fmt.parity == 'O')) b.error = true;
+        }
+        if (!bitAt(next)) b.error = true; // Stop bit
+        bytes.push_back(b);
+        pos = start + (uint64_t)((next + 0.5) * fmt.bitSamples);
+    }
+    return bytes;
+}
+
+// --- Modbus RTU ---
+
+struct Frame {
+    bool request;      // TX line
+    uint64_t start;
+    uint64_t end;
+    std::vector<uint8_t> data;
+    bool crcOk;
+    bool uartError;
+    bool t15Violation; // A gap inside the frame longer than t1.5
+};
+
+// Bytes separated by less than t3.5 belong to the same frame
+static std::vector<Frame> splitFrames(const std::vector<UartByte> &bytes, bool request, double t15, double t35) {
+    std::vector<Frame> frames;
+    for (size_t i = 0; i < bytes.size(); i++) {
+        double gap = frames.empty() ? 1e30 : (double)bytes[i].start - (double)frames.back().end;
+        if (gap >= t35) frames.push_back({ request, bytes[i].start, bytes[i].end, {}, false, false, false });
+        Frame &f = frames.back();
+        if (gap > t15 && gap < t35) f.t15Violation = true;
+        f.end = bytes[i].end;
+        f.data.push_back(bytes[i].value);
+        if (bytes[i].error) f.uartError = true;
+    }
+    for (auto &f : frames) f.crcOk = f.data.size() >= 4 && modbusCrcValid(f.data.data(), f.data.size());
+    return frames;
+}
+
+static std::string describe(const Frame &f) {
+    char text[96];
+    const std::vector<uint8_t> &d = f.data;
+    if (d.size() < 2) return "(runt)";
+    auto word = [&](size_t i) { return (d[i] << 8) | d[i + 1]; };
+    if (d[1] & 0x80) {
+        snprintf(text, sizeof(text), "slave %d fc %02X exception %02X", d[0], d[1] & 0x7F, d.size() > 2 ? d[2] : 0);
+    } else if (f.request && d.size() >= 6) {
+        switch (d[1]) {
+            case MB_FC_READ_HOLDING_REGISTERS: snprintf(text, sizeof(text), "slave %d read %04X x%d", d[0], word(2), word(4)); break;
+            case MB_FC_WRITE_SINGLE_REGISTER: snprintf(text, sizeof(text), "slave %d write %04X = %d", d[0], word(2), (int16_t)word(4)); break;
+            case MB_FC_WRITE_MULTIPLE_REGISTERS: snprintf(text, sizeof(text), "slave %d write %04X x%d", d[0], word(2), word(4)); break;
+            case MB_FC_READ_WRITE_MULTIPLE_REGISTERS: snprintf(text, sizeof(text), "slave %d read %04X x%d, write %04X", d[0], word(2), word(4), word(6)); break;
+            default: snprintf(text, sizeof(text), "slave %d fc %02X", d[0], d[1]);
+        }
+    } else {
+        snprintf(text, sizeof(text), "slave %d fc %02X, %zu bytes", d[0], d[1], d.size());
+    }
+    std::string s = text;
+    if (!f.crcOk) s += " CRC ERROR";
+    if (f.uartError) s += " UART ERROR";
+    return s;
+}
+
+// --- Statistics ---
+
+struct Series {
+    std::vector<double> v;
+    void add(double x) { v.push_back(x); }
+    double avg() const {
+        double sum = 0;
+        for (double x : v) sum += x;
+        return v.empty() ? NAN : sum / v.size();
+    }
+    void print(const char *name) {
+        if (v.empty()) {
+            printf("  %-42s -\n", name);
+            return;
+        }
+        std::sort(v.begin(), v.end());
+        double sum = 0;
+        for (double x : v) sum += x;
+        auto pct = [&](double p) { return v[std::min(v.size() - 1, (size_t)(p * v.size()))]; };
+        printf("  %-42s %5zu x  min %8.0f  avg %8.0f  p50 %8.0f  p90 %8.0f  max %8.0f\n", name, v.size(), v.front(),
+               sum / v.size(), pct(0.5), pct(0.9), v.back());
+    }
+};
+
+struct Transaction {
+    const Frame *request;
+    const Frame *response; // Null if unanswered
+};
+
+struct Cycle {
+    uint64_t start;
+    uint64_t end;       // End of its last frame
+    uint64_t busy;      // Samples with a frame on the bus
+    int transactions;
+};
+
+struct Options {
+    std::string rxName = "CH1", txName = "CH2";
+    double baud = 0, threshold = NAN, cycleGapMs = 10;
+    char parity = 'N';
+    bool verbose = false;
+    FILE *csv = nullptr;
+};
+
+// One line per capture when comparing firmware versions
+struct Summary {
+    double seconds, baud;
+    size_t requests;
+    int failed; // Unanswered, CRC or UART errors
+    double turnaroundUs, exchangeUs, busyPercent, periodUs, deadPercent;
+};
+
+static bool analyze(const char *path, const Options &o, Summary &sum) {
+    const std::string &rxName = o.rxName, &txName = o.txName;
+    double baud = o.baud, cycleGapMs = o.cycleGapMs;
+    char parity = o.parity;
+    bool verbose = o.verbose;
+
+
+    std::map<std::string, std::vector<uint8_t>> files;
+    if (!readZip(path, files) || !files.count("metadata")) {
+        fprintf(stderr, "%s: not a sigrok session file\n", path);
+        return false;
+    }
+
+    // metadata: [device 1] samplerate, probeN / analogN = channel name, unitsize
+    std::map<std::string, std::string> meta;
+    {
+        std::string text(files["metadata"].begin(), files["metadata"].end());
+        size_t pos = 0;
+        while (pos < text.size()) {
+            size_t eol = text.find('\n', pos);
+            if (eol == std::string::npos) eol = text.size();
+            std::string line = text.substr(pos, eol - pos);
+            size_t eq = line.find('=');
+            if (eq != std::string::npos) meta[line.substr(0, eq)] = line.substr(eq + 1);
+            pos = eol + 1;
+        }
+    }
+    double sampleRate = parseRate(meta["samplerate"]);
+    if (sampleRate <= 0) {
+        fprintf(stderr, "%s: no sample rate\n", path);
+        return false;
+    }
+
+    Signal lines[2]; // RX, TX
+    const std::string names[2] = { rxName, txName };
+    for (int k = 0; k < 2; k++) {
+        bool found = false;
+        for (auto &m : meta) {
+            if (m.second != names[k]) continue;
+            if (m.first.compare(0, 6, "analog") == 0) {
+                int index = atoi(m.first.c_str() + 6);
+                lines[k] = digitizeAnalog(chunks(files, "analog-1-" + std::to_string(index) + "-"), o.threshold);
+                found = true;
+            } else if (m.first.compare(0, 5, "probe") == 0) {
+                int index = atoi(m.first.c_str() + 5);
+                int unitSize = meta.count("unitsize") ? atoi(meta["unitsize"].c_str()) : 1;
+                auto parts = chunks(files, "logic-1-");
+                if (parts.empty() && files.count("logic-1")) parts.push_back(&files["logic-1"]);
+                lines[k] = digitizeLogic(parts, unitSize, index - 1);
+                found = true;
+            }
+        }
+        if (!found) {
+            fprintf(stderr, "%s: no channel named %s\n", path, names[k].c_str());
+            return false;
+        }
+    }
+
+    if (baud <= 0) baud = detectBaud(lines[0], lines[1], sampleRate);
+    if (baud <= 0) {
+        fprintf(stderr, "%s: no UART traffic found\n", path);
+        return false;
+    }
+    UartFormat fmt;
+    fmt.bitSamples = sampleRate / baud;
+    fmt.parity = parity;
+    double charSamples = fmt.bits() * fmt.bitSamples;
+    double t15 = baud > 19200 ? 750e-6 * sampleRate : 1.5 * charSamples;
+    double t35 = baud > 19200 ? 1750e-6 * sampleRate : 3.5 * charSamples;
+    auto us = [&](double samples) { return samples / sampleRate * 1e6; };
+
+    std::vector<Frame> requests = splitFrames(decodeUart(lines[1], fmt), true, t15, t35);
+
+    // Half-duplex adapters echo the requests on RX. Drop those bytes before
+    // framing, a fast response would merge with the echo otherwise.
+    int echoes = 0;
+    std::vector<UartByte> rxBytes;
+    {
+        size_t q = 0;
+        for (auto &b : decodeUart(lines[0], fmt)) {
+            while (q < requests.size() && requests[q].end < b.start) q++;
+            if (q < requests.size() && b.start + fmt.bitSamples >= requests[q].start) {
+                echoes++;
+            } else {
+                rxBytes.push_back(b);
+            }
+        }
+    }
+    std::vector<Frame> responses = splitFrames(rxBytes, false, t15, t35);
+    uint64_t samples = std::max(lines[0].samples, lines[1].samples);
+
+    printf("%s: %.3f s at %.0f MHz, RX = %s, TX = %s, %.0f baud 8%c1\n", path, samples / sampleRate, sampleRate / 1e6,
+           rxName.c_str(), txName.c_str(), baud, parity);
+
+    // Pair every request with the first response that starts before the next request
+    std::vector<Transaction> txns;
+    size_t r = 0;
+    int crcErrors = 0, uartErrors = 0, t15Violations = 0, strayResponses = 0;
+    for (size_t i = 0; i < requests.size(); i++) {
+        uint64_t nextRequest = i + 1 < requests.size() ? requests[i + 1].start : UINT64_MAX;
+        while (r < responses.size() && responses[r].start < requests[i].end) {
+            strayResponses++;
+            r++;
+        }
+        Transaction t = { &requests[i], nullptr };
+        bool broadcast = !requests[i].data.empty() && requests[i].data[0] == MODBUS_BROADCAST_ID;
+        if (!broadcast && r < responses.size() && responses[r].start < nextRequest) t.response = &responses[r++];
+        txns.push_back(t);
+    }
+    strayResponses += responses.size() - r;
+    for (auto *list : { &requests, &responses }) {
+        for (auto &f : *list) {
+            if (!f.crcOk) crcErrors++;
+            if (f.uartError) uartErrors++;
+            if (f.t15Violation) t15Violations++;
+        }
+    }
+
+    Series turnaround, exchange, responseGap, requestPeriod, requestLength, responseLength;
+    int unanswered = 0, exceptions = 0;
+    uint64_t busySamples = 0;
+    for (auto &f : requests) busySamples += f.end - f.start;
+    for (auto &f : responses) busySamples += f.end - f.start;
+    for (size_t i = 0; i < txns.size(); i++) {
+        const Transaction &t = txns[i];
+        requestLength.add(us(t.request->end - t.request->start));
+        if (i + 1 < txns.size()) {
+            requestPeriod.add(us(txns[i + 1].request->start - t.request->start));
+            uint64_t lastEnd = t.response ? t.response->end : t.request->end;
+            responseGap.add(us((double)txns[i + 1].request->start - (double)lastEnd));
+        }
+        if (!t.response) {
+            if (t.request->data.empty() || t.request->data[0] != MODBUS_BROADCAST_ID) unanswered++;
+            continue;
+        }
+        if (t.response->data.size() > 1 && (t.response->data[1] & 0x80)) exceptions++;
+        turnaround.add(us(t.response->start - t.request->end));
+        exchange.add(us(t.response->end - t.request->start));
+        responseLength.add(us(t.response->end - t.response->start));
+    }
+
+    // Poll cycles: bursts of transactions separated by more than --cycle-gap of idle bus
+    std::vector<Cycle> cycles;
+    double cycleGap = cycleGapMs * 1e-3 * sampleRate;
+    for (auto &t : txns) {
+        uint64_t end = t.response ? t.response->end : t.request->end;
+        uint64_t busy = (t.request->end - t.request->start) + (t.response ? t.response->end - t.response->start : 0);
+        if (cycles.empty() || t.request->start - cycles.back().end > cycleGap) {
+            cycles.push_back({ t.request->start, end, busy, 1 });
+        } else {
+            cycles.back().end = end;
+            cycles.back().busy += busy;
+            cycles.back().transactions++;
+        }
+    }
+    Series period, cycleBusy, cycleActive, cycleDead;
+    double deadTotal = 0, periodTotal = 0;
+    for (size_t i = 0; i + 1 < cycles.size(); i++) { // The last cycle has no period
+        const Cycle &c = cycles[i];
+        double p = us(cycles[i + 1].start - c.start);
+        period.add(p);
+        cycleBusy.add(us(c.busy));
+        cycleActive.add(us(c.end - c.start));
+        cycleDead.add(p - us(c.busy));
+        deadTotal += p - us(c.busy);
+        periodTotal += p;
+    }
+
+    if (verbose) {
+        printf("\nFrames (ms from the start of the capture):\n");
+        size_t ri = 0, qi = 0;
+        while (ri < responses.size() || qi < requests.size()) {
+            bool takeRequest = ri >= responses.size() || (qi < requests.size() && requests[qi].start <= responses[ri].start);
+            const Frame &f = takeRequest ? requests[qi++] : responses[ri++];
+            printf("  %10.3f  %s %6.2f ms  %-40s", us(f.start) / 1e3, f.request ? "TX" : "  RX", us(f.end - f.start) / 1e3,
+                   describe(f).c_str());
+            for (uint8_t b : f.data) printf(" %02X", b);
+            printf("\n");
+        }
+        printf("\nCycles:\n");
+        for (size_t i = 0; i < cycles.size(); i++) {
+            const Cycle &c = cycles[i];
+            printf("  %10.3f  %2d transactions, active %6.2f ms, busy %6.2f ms", us(c.start) / 1e3, c.transactions,
+                   us(c.end - c.start) / 1e3, us(c.busy) / 1e3);
+            if (i + 1 < cycles.size()) printf(", period %6.2f ms", us(cycles[i + 1].start - c.start) / 1e3);
+            printf("\n");
+        }
+    }
+
+    printf("\n%zu requests, %zu responses, %d unanswered, %d exceptions, %d CRC errors, %d UART errors, "
+           "%d frames with gaps > t1.5, %d responses without a request",
+           requests.size(), responses.size(), unanswered, exceptions, crcErrors, uartErrors, t15Violations,
+           strayResponses);
+    if (echoes) printf(", %d echoed request bytes on RX", echoes);
+    printf("\n");
+    printf("\nTiming in us:\n");
+    requestLength.print("Request on the wire");
+    responseLength.print("Response on the wire");
+    turnaround.print("Turnaround (request end -> response)");
+    exchange.print("Exchange (request start -> response end)");
+    responseGap.print("Idle after a transaction");
+    requestPeriod.print("Request to request");
+    printf("\nBus: %.1f ms of %.1f ms busy (%.1f %%)\n", us(busySamples) / 1e3, us(samples) / 1e3,
+           samples ? 100.0 * busySamples / samples : 0.0);
+    printf("\nPoll cycles (split at %.1f ms idle): %zu\n", cycleGapMs, cycles.size());
+    period.print("Period");
+    cycleActive.print("First request to last response");
+    cycleBusy.print("Busy");
+    cycleDead.print("Dead time");
+    if (periodTotal > 0) printf("  Dead time is %.1f %% of the cycle period\n", 100.0 * deadTotal / periodTotal);
+
+    if (o.csv) {
+        for (auto &t : txns) {
+            const std::vector<uint8_t> &d = t.request->data;
+            if (d.size() < 6) continue;
+            fprintf(o.csv, "%s,%.1f,%d,%d,%d,%d,%.1f,", path, us(t.request->start), d[0], d[1], (d[2] << 8) | d[3],
+                    (d[4] << 8) | d[5], us(t.request->end - t.request->start));
+            if (!t.response) {
+                fprintf(o.csv, ",,,%s\n", d[0] == MODBUS_BROADCAST_ID ? "broadcast" : "timeout");
+                continue;
+            }
+            const char *result = !t.response->crcOk ? "crc" : (t.response->data[1] & 0x80) ? "exception" : "ok";
+            fprintf(o.csv, "%.1f,%.1f,%.1f,%s\n", us(t.response->start - t.request->end),
+                    us(t.response->end - t.response->start), us(t.response->end - t.request->start), result);
+        }
+    }
+
+    sum.seconds = samples / sampleRate;
+    sum.baud = baud;
+    sum.requests = requests.size();
+    sum.failed = unanswered + crcErrors + uartErrors;
+    sum.turnaroundUs = turnaround.avg();
+    sum.exchangeUs = exchange.avg();
+    sum.busyPercent = samples ? 100.0 * busySamples / samples : 0.0;
+    sum.periodUs = period.avg();
+    sum.deadPercent = periodTotal > 0 ? 100.0 * deadTotal / periodTotal : NAN;
+    return true;
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr,
+            "Usage: %s [options] capture.sr [capture.sr ...]\n"
+            "  --rx NAME         channel of the drive responses (default CH1)\n"
+            "  --tx NAME         channel of the requests (default CH2)\n"
+            "  -b, --baud RATE   baud rate (default: detected)\n"
+            "  -p, --parity N|E|O  (default N)\n"
+            "  --threshold V     analog threshold in V (default: halfway between low and high level)\n"
+            "  --cycle-gap MS    idle time that ends a poll cycle (default 10)\n"
+            "  --csv FILE        one line per transaction\n"
+            "  -v                list every frame and cycle\n"
+            "With several captures, a comparison table follows the reports.\n",
+            argv0);
+}
+
+int main(int argc, char **argv) {
+    Options o;
+    const char *csvPath = nullptr;
+
+    static const option longOptions[] = {
+        { "rx", required_argument, nullptr, 'R' },
+        { "tx", required_argument, nullptr, 'T' },
+        { "baud", required_argument, nullptr, 'b' },
+        { "parity", required_argument, nullptr, 'p' },
+        { "threshold", required_argument, nullptr, 'H' },
+        { "cycle-gap", required_argument, nullptr, 'G' },
+        { "csv", required_argument, nullptr, 'C' },
+        { "help", no_argument, nullptr, 'h' },
+        { nullptr, 0, nullptr, 0 },
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "b:p:vh", longOptions, nullptr)) != -1) {
+        switch (opt) {
+            case 'R': o.rxName = optarg; break;
+            case 'T': o.txName = optarg; break;
+            case 'b': o.baud = atof(optarg); break;
+            case 'p': o.parity = toupper(optarg[0]); break;
+            case 'H': o.threshold = atof(optarg); break;
+            case 'G': o.cycleGapMs = atof(optarg); break;
+            case 'C': csvPath = optarg; break;
+            case 'v': o.verbose = true; break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (optind >= argc || (o.parity != 'N' && o.parity != 'E' && o.parity != 'O')) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (csvPath) {
+        o.csv = fopen(csvPath, "w");
+        if (!o.csv) {
+            perror(csvPath);
+            return 1;
+        }
+        fprintf(o.csv, "file,start_us,slave,function,address,count,request_us,turnaround_us,response_us,exchange_us,result\n");
+    }
+
+    std::vector<std::pair<const char *, Summary>> results;
+    bool ok = true;
+    for (int i = optind; i < argc; i++) {
+        Summary sum;
+        if (i > optind) printf("\n");
+        if (analyze(argv[i], o, sum)) results.push_back({ argv[i], sum });
+        else ok = false;
+    }
+    if (o.csv) fclose(o.csv);
+
+    if (results.size() > 1) {
+        printf("\n%-24s %8s %6s %6s %6s %11s %11s %6s %10s %6s\n", "Capture", "Seconds", "Baud", "Reqs", "Failed",
+               "Turnaround", "Exchange", "Busy", "Period", "Dead");
+        for (auto &r : results) {
+            const Summary &s = r.second;
+            printf("%-24s %8.3f %6.0f %6zu %6d %8.0f us %8.0f us %5.1f%% %7.1f ms %5.1f%%\n", r.first, s.seconds, s.baud,
+                   s.requests, s.failed, s.turnaroundUs, s.exchangeUs, s.busyPercent, s.periodUs / 1e3, s.deadPercent);
+        }
+    }
+    return ok ? 0 : 1;
+}